@@ -0,0 +1,307 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* AES-CTR used by fsbld --encrypt.  See aesctr.h for a description of the
+   API.
+*/
+#include <string.h>
+#include "aesctr.h"
+
+/* On x86 the AES-NI code is compiled with a target attribute and chosen at
+   run time with __builtin_cpu_supports(), so fsbld needs no special flags to
+   use the instructions. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define AES_CTR_AES_NI  1
+#include <immintrin.h>
+#endif
+
+
+static const unsigned char g_AesSbox[256] =
+{
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+
+/* Multiplies by x in GF(2^8). */
+static unsigned char _AesTimes2(unsigned char Value)
+{
+    return (unsigned char)((Value << 1) ^ ((Value & 0x80) ? 0x1B : 0x00));
+}
+
+
+/* Expands a 128 or 256-bit key into the round keys.
+
+   Parameters:
+    pAes is the context to be filled in.
+    pKey points to the key.
+    KeyBits is 128 or 256.
+
+   Returns:
+    Nothing.
+*/
+void AesExpandKey(SAesContext* pAes, const unsigned char* pKey, unsigned int KeyBits)
+{
+    unsigned int    KeyWords = KeyBits / 32;
+    unsigned int    TotalWords;
+    unsigned char   RoundConstant = 0x01;
+    unsigned int    i;
+
+    pAes->KeyBits = KeyBits;
+    pAes->Rounds = KeyWords + 6;
+    TotalWords = 4 * (pAes->Rounds + 1);
+    memcpy(pAes->RoundKeys, pKey, KeyWords * 4);
+    for (i = KeyWords ; i < TotalWords ; i++)
+    {
+        unsigned char Word[4];
+
+        memcpy(Word, pAes->RoundKeys + 4 * (i - 1), 4);
+        if (i % KeyWords == 0)
+        {
+            unsigned char First = Word[0];
+
+            Word[0] = g_AesSbox[Word[1]] ^ RoundConstant;
+            Word[1] = g_AesSbox[Word[2]];
+            Word[2] = g_AesSbox[Word[3]];
+            Word[3] = g_AesSbox[First];
+            RoundConstant = _AesTimes2(RoundConstant);
+        }
+        else if (KeyWords > 6 && i % KeyWords == 4)
+        {
+            Word[0] = g_AesSbox[Word[0]];
+            Word[1] = g_AesSbox[Word[1]];
+            Word[2] = g_AesSbox[Word[2]];
+            Word[3] = g_AesSbox[Word[3]];
+        }
+        pAes->RoundKeys[4 * i + 0] = pAes->RoundKeys[4 * (i - KeyWords) + 0] ^ Word[0];
+        pAes->RoundKeys[4 * i + 1] = pAes->RoundKeys[4 * (i - KeyWords) + 1] ^ Word[1];
+        pAes->RoundKeys[4 * i + 2] = pAes->RoundKeys[4 * (i - KeyWords) + 2] ^ Word[2];
+        pAes->RoundKeys[4 * i + 3] = pAes->RoundKeys[4 * (i - KeyWords) + 3] ^ Word[3];
+    }
+}
+
+
+#if defined(AES_CTR_AES_NI)
+/* Encrypts 16 byte blocks in place with the AES-NI instructions.
+
+   Parameters:
+    pAes is the expanded key.
+    pBlocks points to the blocks.
+    BlockCount is the number of blocks, at most AES_CTR_BATCH.
+
+   Returns:
+    Nothing.
+*/
+__attribute__((target("aes")))
+static void _AesEncryptBlocksAesNi(const SAesContext* pAes, unsigned char* pBlocks, unsigned int BlockCount)
+{
+    __m128i         Blocks[AES_CTR_BATCH];
+    __m128i         RoundKey;
+    unsigned int    Round;
+    unsigned int    i;
+
+    RoundKey = _mm_loadu_si128((const __m128i*)pAes->RoundKeys);
+    for (i = 0 ; i < BlockCount ; i++)
+    {
+        Blocks[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(pBlocks + 16 * i)), RoundKey);
+    }
+    for (Round = 1 ; Round < pAes->Rounds ; Round++)
+    {
+        RoundKey = _mm_loadu_si128((const __m128i*)(pAes->RoundKeys + 16 * Round));
+        for (i = 0 ; i < BlockCount ; i++)
+        {
+            Blocks[i] = _mm_aesenc_si128(Blocks[i], RoundKey);
+        }
+    }
+    RoundKey = _mm_loadu_si128((const __m128i*)(pAes->RoundKeys + 16 * pAes->Rounds));
+    for (i = 0 ; i < BlockCount ; i++)
+    {
+        _mm_storeu_si128((__m128i*)(pBlocks + 16 * i), _mm_aesenclast_si128(Blocks[i], RoundKey));
+    }
+}
+#endif
+
+
+/* Encrypts 16 byte blocks in place in portable code.
+
+   Parameters:
+    pAes is the expanded key.
+    pBlocks points to the blocks.
+    BlockCount is the number of blocks, at most AES_CTR_BATCH.
+
+   Returns:
+    Nothing.
+*/
+static void _AesEncryptBlocksPortable(const SAesContext* pAes, unsigned char* pBlocks, unsigned int BlockCount)
+{
+    unsigned int    i;
+
+    for (i = 0 ; i < BlockCount ; i++)
+    {
+        unsigned char*  pState = pBlocks + 16 * i;
+        unsigned char   Shifted[16];
+        unsigned int    Round;
+        unsigned int    j;
+
+        for (j = 0 ; j < 16 ; j++)
+        {
+            pState[j] ^= pAes->RoundKeys[j];
+        }
+        for (Round = 1 ; Round <= pAes->Rounds ; Round++)
+        {
+            const unsigned char* pRoundKey = pAes->RoundKeys + 16 * Round;
+
+            /* SubBytes and ShiftRows.  The state is stored a column at a
+               time and row r is rotated left by r columns. */
+            for (j = 0 ; j < 16 ; j++)
+            {
+                Shifted[j] = g_AesSbox[pState[(j + 4 * (j & 3)) & 15]];
+            }
+            if (Round == pAes->Rounds)
+            {
+                for (j = 0 ; j < 16 ; j++)
+                {
+                    pState[j] = Shifted[j] ^ pRoundKey[j];
+                }
+                break;
+            }
+            /* MixColumns and AddRoundKey. */
+            for (j = 0 ; j < 16 ; j += 4)
+            {
+                unsigned char A0 = Shifted[j];
+                unsigned char A1 = Shifted[j + 1];
+                unsigned char A2 = Shifted[j + 2];
+                unsigned char A3 = Shifted[j + 3];
+                unsigned char All = A0 ^ A1 ^ A2 ^ A3;
+
+                pState[j] = A0 ^ All ^ _AesTimes2(A0 ^ A1) ^ pRoundKey[j];
+                pState[j + 1] = A1 ^ All ^ _AesTimes2(A1 ^ A2) ^ pRoundKey[j + 1];
+                pState[j + 2] = A2 ^ All ^ _AesTimes2(A2 ^ A3) ^ pRoundKey[j + 2];
+                pState[j + 3] = A3 ^ All ^ _AesTimes2(A3 ^ A0) ^ pRoundKey[j + 3];
+            }
+        }
+    }
+}
+
+
+/* Encrypts 16 byte blocks in place, with the AES-NI instructions when the
+   processor has them.
+
+   Parameters:
+    pAes is the expanded key.
+    pBlocks points to the blocks.
+    BlockCount is the number of blocks, at most AES_CTR_BATCH.
+
+   Returns:
+    Nothing.
+*/
+void AesEncryptBlocks(const SAesContext* pAes, unsigned char* pBlocks, unsigned int BlockCount)
+{
+#if defined(AES_CTR_AES_NI)
+    if (__builtin_cpu_supports("aes"))
+    {
+        _AesEncryptBlocksAesNi(pAes, pBlocks, BlockCount);
+        return;
+    }
+#endif
+    _AesEncryptBlocksPortable(pAes, pBlocks, BlockCount);
+}
+
+
+/* Encrypts, or decrypts, part of a region of the image in place with the
+   AES-CTR keystream described for SFileSystemEncryption.
+
+   Parameters:
+    pAes is the expanded key and nonce.
+    Index is the counter block index of the region, such as the entry index.
+    Offset is the position of pData from the start of the region.
+    pData points to the bytes to be encrypted.
+    Size is the number of bytes.
+
+   Returns:
+    Nothing.
+*/
+void AesCtrXor(const SAesContext* pAes, uint32_t Index, uint64_t Offset, unsigned char* pData, size_t Size)
+{
+    unsigned char Keystream[AES_CTR_BATCH * 16];
+
+    while (Size > 0)
+    {
+        unsigned int    Skip = (unsigned int)(Offset & 15);
+        uint64_t        Counter = Offset / 16;
+        size_t          Length;
+        unsigned int    BlockCount;
+        unsigned int    i;
+
+        BlockCount = (unsigned int)((Skip + Size + 15) / 16);
+        if (BlockCount > AES_CTR_BATCH)
+        {
+            BlockCount = AES_CTR_BATCH;
+        }
+        for (i = 0 ; i < BlockCount ; i++)
+        {
+            unsigned char* pCounter = Keystream + 16 * i;
+
+            memcpy(pCounter, pAes->Nonce, sizeof(pAes->Nonce));
+            pCounter[8] = (unsigned char)(Index >> 24);
+            pCounter[9] = (unsigned char)(Index >> 16);
+            pCounter[10] = (unsigned char)(Index >> 8);
+            pCounter[11] = (unsigned char)Index;
+            pCounter[12] = (unsigned char)((Counter + i) >> 24);
+            pCounter[13] = (unsigned char)((Counter + i) >> 16);
+            pCounter[14] = (unsigned char)((Counter + i) >> 8);
+            pCounter[15] = (unsigned char)(Counter + i);
+        }
+        AesEncryptBlocks(pAes, Keystream, BlockCount);
+
+        Length = BlockCount * 16 - Skip;
+        if (Length > Size)
+        {
+            Length = Size;
+        }
+        for (i = 0 ; i < Length ; i++)
+        {
+            pData[i] ^= Keystream[Skip + i];
+        }
+        pData += Length;
+        Offset += Length;
+        Size -= Length;
+    }
+}
+
+
+const char* AesImplementation(void)
+{
+#if defined(AES_CTR_AES_NI)
+    if (__builtin_cpu_supports("aes"))
+    {
+        return "AES-NI";
+    }
+#endif
+    return "portable";
+}
@@ -0,0 +1,59 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* AES-128 and AES-256 in counter mode, used by fsbld --encrypt to encrypt
+   the file data of an image as described for SFileSystemEncryption in
+   ffsformat.h.  The AES-NI instructions are used when the processor has
+   them and portable code otherwise.
+*/
+#ifndef _AESCTR_H_
+#define _AESCTR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Expanded AES key and the per-image nonce of the counter blocks. */
+typedef struct _SAesContext
+{
+    unsigned char       RoundKeys[15 * 16];
+    unsigned int        Rounds;
+    unsigned int        KeyBits;
+    unsigned char       Nonce[8];
+} SAesContext;
+
+/* Number of AES-CTR counter blocks encrypted at a time so that the AES-NI
+   rounds of several blocks can be in flight at once. */
+#define AES_CTR_BATCH   8
+
+/* Expands a 128 or 256-bit key into the round keys of pAes.  The nonce is
+   left for the caller to fill in. */
+void    AesExpandKey(SAesContext* pAes, const unsigned char* pKey, unsigned int KeyBits);
+/* Encrypts BlockCount 16 byte blocks in place, at most AES_CTR_BATCH. */
+void    AesEncryptBlocks(const SAesContext* pAes, unsigned char* pBlocks, unsigned int BlockCount);
+/* Encrypts, or decrypts, Size bytes at pData in place.  Index is the counter
+   block index of the region, such as the entry index, and Offset is the
+   position of pData from the start of the region. */
+void    AesCtrXor(const SAesContext* pAes, uint32_t Index, uint64_t Offset, unsigned char* pData, size_t Size);
+/* Returns "AES-NI" or "portable", whichever is used on this processor. */
+const char* AesImplementation(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _AESCTR_H_ */
@@ -0,0 +1,176 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* CRC32C (Castagnoli) used by fsbld --integrity.  See crc32c.h for a
+   description of the API.
+*/
+#include <string.h>
+#include "crc32c.h"
+
+/* On x86 the SSE4.2 code is compiled with a target attribute and chosen at
+   run time with __builtin_cpu_supports(), so fsbld needs no special flags to
+   use the instructions.  A build which can assume them (e.g. with -msse4.2)
+   skips the check and the slice-by-8 tables. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_SSE42    1
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t _Crc32cSse42(uint32_t Crc, const unsigned char* pData, size_t Size)
+{
+#if defined(__x86_64__)
+    for ( ; Size >= 8 ; Size -= 8, pData += 8)
+    {
+        uint64_t Word;
+
+        memcpy(&Word, pData, sizeof(Word));
+        Crc = (uint32_t)_mm_crc32_u64(Crc, Word);
+    }
+#else
+    for ( ; Size >= 4 ; Size -= 4, pData += 4)
+    {
+        uint32_t Word;
+
+        memcpy(&Word, pData, sizeof(Word));
+        Crc = _mm_crc32_u32(Crc, Word);
+    }
+#endif
+    while (Size--)
+    {
+        Crc = _mm_crc32_u8(Crc, *pData++);
+    }
+
+    return Crc;
+}
+#endif
+
+
+#if defined(__ARM_FEATURE_CRC32)
+static uint32_t _Crc32cArm(uint32_t Crc, const unsigned char* pData, size_t Size)
+{
+    for ( ; Size >= 8 ; Size -= 8, pData += 8)
+    {
+        uint64_t Word;
+
+        memcpy(&Word, pData, sizeof(Word));
+        Crc = __crc32cd(Crc, Word);
+    }
+    while (Size--)
+    {
+        Crc = __crc32cb(Crc, *pData++);
+    }
+
+    return Crc;
+}
+#endif
+
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+/* Slice-by-8 tables for the CRC32C used by --integrity when the processor's
+   CRC32C instructions aren't available, built by _InitCrc32cTable(). */
+static uint32_t g_Crc32cTable[8][256];
+
+static void _InitCrc32cTable(void)
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0 ; i < 256 ; i++)
+    {
+        uint32_t Crc = i;
+
+        for (j = 0 ; j < 8 ; j++)
+        {
+            Crc = (Crc >> 1) ^ (0x82F63B78U & (0U - (Crc & 1)));
+        }
+        g_Crc32cTable[0][i] = Crc;
+    }
+    for (i = 0 ; i < 256 ; i++)
+    {
+        for (j = 1 ; j < 8 ; j++)
+        {
+            g_Crc32cTable[j][i] = (g_Crc32cTable[j - 1][i] >> 8) ^ g_Crc32cTable[0][g_Crc32cTable[j - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t _Crc32cTables(uint32_t Crc, const unsigned char* pData, size_t Size)
+{
+    if (!g_Crc32cTable[0][1])
+    {
+        _InitCrc32cTable();
+    }
+    /* The bytes are combined explicitly so that this works on hosts of
+       either byte order. */
+    for ( ; Size >= 8 ; Size -= 8, pData += 8)
+    {
+        uint32_t Low = Crc ^ ((uint32_t)pData[0] | (uint32_t)pData[1] << 8 |
+                              (uint32_t)pData[2] << 16 | (uint32_t)pData[3] << 24);
+        uint32_t High = (uint32_t)pData[4] | (uint32_t)pData[5] << 8 |
+                        (uint32_t)pData[6] << 16 | (uint32_t)pData[7] << 24;
+
+        Crc = g_Crc32cTable[7][Low & 0xFF] ^ g_Crc32cTable[6][(Low >> 8) & 0xFF] ^
+              g_Crc32cTable[5][(Low >> 16) & 0xFF] ^ g_Crc32cTable[4][Low >> 24] ^
+              g_Crc32cTable[3][High & 0xFF] ^ g_Crc32cTable[2][(High >> 8) & 0xFF] ^
+              g_Crc32cTable[1][(High >> 16) & 0xFF] ^ g_Crc32cTable[0][High >> 24];
+    }
+    while (Size--)
+    {
+        Crc = g_Crc32cTable[0][(Crc ^ *pData++) & 0xFF] ^ (Crc >> 8);
+    }
+
+    return Crc;
+}
+#endif
+
+
+uint32_t Crc32cUpdate(uint32_t Crc, const unsigned char* pData, size_t Size)
+{
+#if defined(__ARM_FEATURE_CRC32)
+    return ~_Crc32cArm(~Crc, pData, Size);
+#elif defined(__SSE4_2__)
+    return ~_Crc32cSse42(~Crc, pData, Size);
+#else
+#if defined(CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~_Crc32cSse42(~Crc, pData, Size);
+    }
+#endif
+    return ~_Crc32cTables(~Crc, pData, Size);
+#endif
+}
+
+
+const char* Crc32cImplementation(void)
+{
+#if defined(__ARM_FEATURE_CRC32)
+    return "ARMv8 CRC32";
+#elif defined(__SSE4_2__)
+    return "SSE4.2";
+#else
+#if defined(CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return "SSE4.2";
+    }
+#endif
+    return "slice-by-8";
+#endif
+}
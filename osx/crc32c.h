@@ -0,0 +1,52 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* CRC32C (Castagnoli) of file data, as stored in the
+   FILE_SYSTEM_SECTION_INTEGRITY table of an image.  The SSE4.2 CRC32C
+   instructions are used when the processor has them, the ARMv8 ones when
+   fsbld is built for them and slice-by-8 tables otherwise.
+*/
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Updates the CRC32C of a file's contents with the next chunk.
+
+   Parameters:
+    Crc is the CRC32C of the contents which precede this chunk, 0 for the
+        first chunk.
+    pData points to the chunk.
+    Size is the length of the chunk in bytes.
+
+   Returns:
+    The updated CRC32C.
+*/
+uint32_t    Crc32cUpdate(uint32_t Crc, const unsigned char* pData, size_t Size);
+
+/* Returns the name of the code used by Crc32cUpdate() on this processor,
+   e.g. "SSE4.2" or "slice-by-8", for fsbld's progress output.
+*/
+const char* Crc32cImplementation(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CRC32C_H_ */
@@ -19,6 +19,7 @@
 #ifndef _FFSFORMAT_H_
 #define _FFSFORMAT_H_
 
+#include <stdint.h>
 
 /* The signature to be placed in SFileSystemHeader::FileSystemSignature.
    Only the first 8 bytes are used and the NULL terminator discarded. */
@@ -52,4 +53,328 @@ typedef struct _SFileSystemEntry
 } SFileSystemEntry;
 
 
+
+/* Signature to be placed in SFileSystemHeaderV2::FileSystemSignature.  It
+   differs from FILE_SYSTEM_SIGNATURE so that runtimes which only understand
+   the original layout don't attempt to mount a versioned image. */
+#define FILE_SYSTEM_SIGNATURE_V2 "FFileSy2"
+
+/* The format version written to SFileSystemHeaderV2::FormatVersion. */
+#define FILE_SYSTEM_FORMAT_VERSION 2
+
+/* Bits used in SFileSystemHeaderV2::FeatureFlags.  A reader should refuse
+   to mount an image which has flags set that it doesn't understand. */
+/* The entry table contains SFileSystemEntry64 rather than SFileSystemEntry
+   elements. */
+#define FILE_SYSTEM_FEATURE_64BIT_OFFSETS   0x00000001
+/* The entry table is packed with the field widths given in
+   SFileSystemHeaderV2::EntryOffsetBytes and EntrySizeBytes.  Each compact
+   entry is the FilenameOffset and FileBinaryOffset fields, each
+   EntryOffsetBytes long, followed by the EntrySizeBytes long FileBinarySize
+   field.  Fields are stored in the byte order of the image and entries are
+   not padded so they must be read a byte at a time. */
+#define FILE_SYSTEM_FEATURE_COMPACT_ENTRIES 0x00000002
+/* All multi-byte fields in the image are stored most significant byte first.
+   Since this flag is itself stored in the image's byte order, a reader should
+   first determine the order from SFileSystemHeaderV2::FormatVersion. */
+#define FILE_SYSTEM_FEATURE_BIG_ENDIAN      0x00000004
+/* File data is spread across the FLASH regions listed in the
+   FILE_SYSTEM_SECTION_REGIONS section.  The FileBinaryOffset of each entry
+   is relative to the start of the region given for it in the
+   FILE_SYSTEM_SECTION_ENTRY_REGIONS section rather than to the start of the
+   image. */
+#define FILE_SYSTEM_FEATURE_REGIONS         0x00000008
+/* The image ends with a FILE_SYSTEM_SECTION_MERKLE hash tree and an
+   SFileSystemDigest, holding the root of the tree, follows the header.
+   HeaderSize includes the SFileSystemDigest. */
+#define FILE_SYSTEM_FEATURE_MERKLE          0x00000010
+/* The data of each entry and precompressed variant is encrypted with
+   AES-CTR as described for SFileSystemEncryption, which follows the header
+   and any SFileSystemDigest.  HeaderSize includes it. */
+#define FILE_SYSTEM_FEATURE_ENCRYPTED       0x00000020
+/* The FILE_SYSTEM_SECTION_ENTRIES and FILE_SYSTEM_SECTION_FILENAMES sections
+   are encrypted as well. */
+#define FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES 0x00000040
+
+/* Values used in SFileSystemSection::Type. */
+#define FILE_SYSTEM_SECTION_ENTRIES     1
+#define FILE_SYSTEM_SECTION_FILENAMES   2
+#define FILE_SYSTEM_SECTION_DATA        3
+/* Optional sidecar holding the first SFileSystemSection::Flags bytes of each
+   filename, NULL padded, in the same sorted order as the entries.  A binary
+   search probe can compare its key against the prefix with memcmp() and only
+   needs to read the full filename when the prefixes match.  If the key is
+   shorter than the prefix length then matching prefixes are a match of the
+   whole filename. */
+#define FILE_SYSTEM_SECTION_NAME_PREFIXES 4
+/* Optional Bloom filter over all filenames which allows lookups of files that
+   aren't in the image to be rejected with a single 32-bit read.  The section
+   is an array of 32-bit words in the byte order of the image and
+   SFileSystemSection::Flags holds the number of bits, K, set per filename.
+   To test a filename:
+     Hash = FNV-1a hash of the filename, without its NULL terminator, using
+            FILE_SYSTEM_FNV_OFFSET_BASIS and FILE_SYSTEM_FNV_PRIME.
+     Word = Words[Hash % WordCount]
+     Mix = MurmurHash3 32-bit finalizer of Hash:
+             Mix = Hash ^ (Hash >> 16);
+             Mix *= FILE_SYSTEM_FILTER_MIX1;
+             Mix ^= Mix >> 13;
+             Mix *= FILE_SYSTEM_FILTER_MIX2;
+             Mix ^= Mix >> 16;
+     The file may be present only if bit ((Mix >> (5 * i)) & 31) of Word is
+     set for every i from 0 to K - 1. */
+#define FILE_SYSTEM_SECTION_NAME_FILTER 5
+
+/* Optional array of SFileSystemMetadata records, one per entry in the same
+   sorted order, aligned to 8 bytes. */
+#define FILE_SYSTEM_SECTION_METADATA    6
+/* Table of the MIME types referenced by SFileSystemMetadata::MimeType.  It
+   starts with SFileSystemSection::Flags 32-bit offsets, relative to the start
+   of the image, of the NULL terminated MIME type strings which follow. */
+#define FILE_SYSTEM_SECTION_MIME_TYPES  7
+/* Optional array of SFileSystemVariant records describing precompressed
+   copies of entries, sorted by EntryIndex and then Encoding and aligned to 8
+   bytes.  The compressed bytes are stored in the data section after the
+   file data. */
+#define FILE_SYSTEM_SECTION_VARIANTS    8
+/* Optional array of 32-bit sizes of the ready to send HTTP response headers
+   placed immediately before the data of each entry, in entry order, followed
+   by those in front of each SFileSystemVariant.  The header of an entry
+   starts at FileBinaryOffset minus its size so that the header and body can
+   be sent with a single write. */
+#define FILE_SYSTEM_SECTION_HTTP_HEADERS 9
+/* Array of SFileSystemRegion records, aligned to 8 bytes.  Region 0 is the
+   one which starts with this header. */
+#define FILE_SYSTEM_SECTION_REGIONS     10
+/* Array of 8-bit indices into the FILE_SYSTEM_SECTION_REGIONS table giving
+   the region which holds the data of each entry, in entry order. */
+#define FILE_SYSTEM_SECTION_ENTRY_REGIONS 11
+/* Optional array of 32-bit CRC32C values of the data of each entry, as
+   stored in the image and so after any encryption, in entry order, followed
+   by those of each SFileSystemVariant.  Uses the Castagnoli
+   polynomial, reflected as 0x82F63B78, with an initial value and final XOR of
+   0xFFFFFFFF, as computed by the SSE4.2 and ARMv8 CRC32C instructions.  A
+   file can be verified the first time it is opened to detect a corrupted
+   FLASH write. */
+#define FILE_SYSTEM_SECTION_INTEGRITY   12
+/* Optional SHA-256 Merkle tree over the image, which always comes last.  The
+   image is split into SFileSystemDigest::BlockSize byte blocks from its start
+   up to CoveredSize, the start of this section, with a shorter final block.
+   The section holds every level of the tree, 32 bytes per node, starting with
+   one leaf hash per block and ending with the root.  SFileSystemSection::Flags
+   holds the number of levels.
+     Leaf = SHA-256(FILE_SYSTEM_MERKLE_LEAF_PREFIX || Block)
+     Node = SHA-256(FILE_SYSTEM_MERKLE_NODE_PREFIX || Left || Right)
+   When a level has an odd number of nodes its last node is carried up to
+   the next level unchanged.  SFileSystemDigest::RootHash is treated as
+   zero while hashing the first block.  A bootloader can verify just the
+   blocks which hold a file by hashing them and walking up the stored tree
+   to RootHash. */
+#define FILE_SYSTEM_SECTION_MERKLE      13
+
+/* Byte hashed in front of the contents of a Merkle tree leaf, and of the
+   child hashes of a node, so that one can't be passed off as the other. */
+#define FILE_SYSTEM_MERKLE_LEAF_PREFIX  0x00
+#define FILE_SYSTEM_MERKLE_NODE_PREFIX  0x01
+
+/* Values of SFileSystemEncryption's counter block Index for the encrypted
+   tables.  The data of entry i uses i and that of variant i uses FileCount
+   plus i. */
+#define FILE_SYSTEM_ENCRYPTION_ENTRIES_INDEX    0xFFFFFFFFU
+#define FILE_SYSTEM_ENCRYPTION_FILENAMES_INDEX  0xFFFFFFFEU
+
+/* Values used in SFileSystemVariant::Encoding, matching the HTTP
+   Content-Encoding which the bytes can be served with. */
+#define FILE_SYSTEM_ENCODING_GZIP       1
+#define FILE_SYSTEM_ENCODING_BROTLI     2
+
+/* 32-bit FNV-1a parameters used to hash filenames. */
+#define FILE_SYSTEM_FNV_OFFSET_BASIS    0x811C9DC5U
+#define FILE_SYSTEM_FNV_PRIME           0x01000193U
+
+/* 64-bit FNV-1a parameters used to hash file contents for
+   SFileSystemMetadata::ContentHash. */
+#define FILE_SYSTEM_FNV64_OFFSET_BASIS  0xCBF29CE484222325ULL
+#define FILE_SYSTEM_FNV64_PRIME         0x00000100000001B3ULL
+
+/* Multipliers used to scramble a filename hash when selecting the bits
+   within a filter word. */
+#define FILE_SYSTEM_FILTER_MIX1         0x85EBCA6BU
+#define FILE_SYSTEM_FILTER_MIX2         0xC2B2AE35U
+
+
+/* Header stored at the beginning of a versioned file system image.  All
+   offsets in a versioned image are relative to the beginning of this
+   header.  The structures of a versioned image contain no padding and are
+   written field by field in the byte order of the target device. */
+typedef struct _SFileSystemHeaderV2
+{
+    /* Signature should be set to FILE_SYSTEM_SIGNATURE_V2. */
+    char            FileSystemSignature[8];
+    /* Should be set to FILE_SYSTEM_FORMAT_VERSION. */
+    uint16_t        FormatVersion;
+    /* Size of this header.  The section table starts at this offset so that
+       fields can be added to the end of the header in later versions. */
+    uint16_t        HeaderSize;
+    /* Combination of FILE_SYSTEM_FEATURE_* bits. */
+    uint32_t        FeatureFlags;
+    /* Number of entries in this file system image. */
+    uint32_t        FileCount;
+    /* Number of SFileSystemSection elements in the section table. */
+    uint32_t        SectionCount;
+    /* Total size of the image in bytes. */
+    uint64_t        ImageSize;
+    /* Size in bytes of each element in the entry table. */
+    uint16_t        EntrySize;
+    /* Number of bytes used by the offset fields and by the size field of each
+       entry.  4 for SFileSystemEntry and 8 for SFileSystemEntry64. */
+    uint8_t         EntryOffsetBytes;
+    uint8_t         EntrySizeBytes;
+    uint32_t        Reserved;
+    /* The SFileSystemSection[SFileSystemHeaderV2::SectionCount] array will
+       start at SFileSystemHeaderV2::HeaderSize. */
+} SFileSystemHeaderV2;
+
+/* Follows SFileSystemHeaderV2 when FILE_SYSTEM_FEATURE_MERKLE is set. */
+typedef struct _SFileSystemDigest
+{
+    /* Size of each block hashed into a leaf of the Merkle tree. */
+    uint32_t        BlockSize;
+    uint32_t        Reserved;
+    /* Number of bytes from the start of the image covered by the tree. */
+    uint64_t        CoveredSize;
+    /* SHA-256 root of the FILE_SYSTEM_SECTION_MERKLE tree. */
+    uint8_t         RootHash[32];
+} SFileSystemDigest;
+
+/* Follows SFileSystemHeaderV2, and any SFileSystemDigest, when
+   FILE_SYSTEM_FEATURE_ENCRYPTED is set.  Each encrypted region is XORed with
+   an AES-CTR keystream so that any byte can be decrypted on its own.  The
+   keystream for the byte at Offset from the start of a region is byte
+   Offset % 16 of AES(Key, Counter) where the 16 byte Counter is:
+     Nonce (8 bytes) || Index (32-bit) || Offset / 16 (32-bit)
+   with both 32-bit values stored most significant byte first whatever the
+   byte order of the image.  Index is the entry index, FileCount plus the
+   variant index or one of the FILE_SYSTEM_ENCRYPTION_*_INDEX values.  HTTP
+   response headers and the other tables are left in plaintext. */
+typedef struct _SFileSystemEncryption
+{
+    /* 128 or 256 for AES-128 or AES-256. */
+    uint32_t        KeyBits;
+    uint32_t        Reserved;
+    /* Random value chosen for each image so that images built with the same
+       key never reuse a keystream. */
+    uint8_t         Nonce[8];
+    /* First 8 bytes of AES(Key, 16 zero bytes) which lets the device detect
+       that it has been given the wrong key. */
+    uint8_t         KeyCheck[8];
+} SFileSystemEncryption;
+
+/* Describes the location of each section within a versioned image.  The
+   FILE_SYSTEM_SECTION_ENTRIES section holds FileCount entries sorted so that
+   a binary search can be performed at file open time. */
+typedef struct _SFileSystemSection
+{
+    /* One of the FILE_SYSTEM_SECTION_* values. */
+    uint32_t        Type;
+    /* Section specific value: the prefix length of NAME_PREFIXES, the K of
+       NAME_FILTER, the MIME type count of MIME_TYPES and the level count of
+       MERKLE.  0 for the other sections. */
+    uint32_t        Flags;
+    uint64_t        Offset;
+    uint64_t        Size;
+} SFileSystemSection;
+
+/* Metadata captured from each source file when the image was built so that
+   the device can serve typed responses and answer conditional requests
+   without computing anything at runtime. */
+typedef struct _SFileSystemMetadata
+{
+    /* Last modification time of the source file in seconds since 1970. */
+    uint64_t        ModificationTime;
+    /* 64-bit FNV-1a hash of the file contents, suitable for use as an ETag. */
+    uint64_t        ContentHash;
+    /* Permission bits of the source file (st_mode & 07777). */
+    uint32_t        Mode;
+    /* Index into the FILE_SYSTEM_SECTION_MIME_TYPES table. */
+    uint16_t        MimeType;
+    uint16_t        Reserved;
+} SFileSystemMetadata;
+
+/* Precompressed copy of an entry which is only stored when it is smaller
+   than the original. */
+typedef struct _SFileSystemVariant
+{
+    /* Index of the original entry in the sorted entry table. */
+    uint32_t        EntryIndex;
+    /* One of the FILE_SYSTEM_ENCODING_* values. */
+    uint16_t        Encoding;
+    uint16_t        Reserved;
+    /* Location of the compressed bytes relative to the start of the image. */
+    uint64_t        Offset;
+    uint64_t        Size;
+} SFileSystemVariant;
+
+/* FLASH region, such as an internal bank or external QSPI FLASH, which holds
+   part of the file data when FILE_SYSTEM_FEATURE_REGIONS is set. */
+typedef struct _SFileSystemRegion
+{
+    /* Device address at which the contents of the region are programmed. */
+    uint64_t        Address;
+    /* Number of bytes available in the region. */
+    uint64_t        Capacity;
+    /* Number of bytes of the region used by the image. */
+    uint64_t        Size;
+} SFileSystemRegion;
+
+/* Entry used in a versioned image when FILE_SYSTEM_FEATURE_64BIT_OFFSETS is
+   set. */
+typedef struct _SFileSystemEntry64
+{
+    uint64_t        FilenameOffset;
+    uint64_t        FileBinaryOffset;
+    uint64_t        FileBinarySize;
+} SFileSystemEntry64;
+
+
+
+/* Signature at the start of an over the air update delta created by
+   fsbld --diff.  A delta rebuilds a new image from the previous image which
+   is already on the device. */
+#define FILE_SYSTEM_DELTA_SIGNATURE "FFSDelta"
+
+/* The version written to SFileSystemDeltaHeader::Version. */
+#define FILE_SYSTEM_DELTA_VERSION 1
+
+/* Operations which follow SFileSystemDeltaHeader.  Each is a single opcode
+   byte followed by its operands, which are unsigned LEB128 values (7 bits per
+   byte, least significant group first, high bit set on all but the last
+   byte).  The operations produce the new image from start to end. */
+/* Ends the delta.  No operands. */
+#define FILE_SYSTEM_DELTA_END   0
+/* Copies Length bytes from Offset in the previous image.  Operands: Offset,
+   Length. */
+#define FILE_SYSTEM_DELTA_COPY  1
+/* Adds Length new bytes which immediately follow the operand.  Operand:
+   Length. */
+#define FILE_SYSTEM_DELTA_ADD   2
+
+/* Header stored at the beginning of a delta.  Its fields are always stored
+   least significant byte first.  The hashes are 64-bit FNV-1a hashes of the
+   whole image, calculated with FILE_SYSTEM_FNV64_OFFSET_BASIS and
+   FILE_SYSTEM_FNV64_PRIME, so that a delta is only applied to the image it
+   was created from. */
+typedef struct _SFileSystemDeltaHeader
+{
+    /* Signature should be set to FILE_SYSTEM_DELTA_SIGNATURE. */
+    char            Signature[8];
+    /* Should be set to FILE_SYSTEM_DELTA_VERSION. */
+    uint32_t        Version;
+    uint32_t        Reserved;
+    uint64_t        OldImageSize;
+    uint64_t        OldImageHash;
+    uint64_t        NewImageSize;
+    uint64_t        NewImageHash;
+} SFileSystemDeltaHeader;
+
 #endif /* _FFSFORMAT_H_ */
@@ -20,44 +20,687 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <strings.h>
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "ffsformat.h"
+#include "fsreader.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include "aesctr.h"
+#include "fsdelta.h"
+
+
+/* The d_namlen field of struct dirent is only provided by OS X and the BSDs. */
+#if defined(_DIRENT_HAVE_D_NAMLEN) || defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__NetBSD__) || defined(__OpenBSD__)
+#define DIRENT_NAME_LENGTH(pDirEntry) ((pDirEntry)->d_namlen)
+#else
+#define DIRENT_NAME_LENGTH(pDirEntry) ((unsigned int)strlen((pDirEntry)->d_name))
+#endif
 
 
 /* Displays the command line usage to the user. */
 static void _DisplayUsage(void)
 {
-    printf("Usage:   fsbld RootSourceDirectory OutputBinaryFilename\n"
+    printf("Usage:   fsbld [Options] RootSourceDirectory OutputBinaryFilename\n"
            "  Where: RootSourceDirectory is the name of the directory which\n"
            "           contains the files to be encoded in the output binary\n"
            "           image.\n"
            "         OutputBinaryFilename is the name of the binary file to\n"
            "           contain the resulting file system image.\n"
-           "         A C-style header file (.h) is created from the OutputBinaryFilename\n\n"
+           "         A C-style header file (.h) is created from the OutputBinaryFilename\n"
+           "           along with a C++20 index header (.hpp) which allows files to\n"
+           "           be looked up at compile time.\n\n"
            "         The binary file can be appended to the end of an existing FLASH\n"
            "           image before being deployed to the mbed device.\n\n"
            "                               - OR -\n\n"
            "           can be appended to the end of an existing FLASH image\n"
-           "         Import the .h file into the compiler and include it in the main file.\n");
+           "         Import the .h file into the compiler and include it in the main file.\n\n"
+           "         fsbld --diff OldImage NewImage DeltaFile\n"
+           "           Creates an over the air update delta which rebuilds NewImage\n"
+           "           from OldImage.\n"
+           "         fsbld --apply-delta OldImage DeltaFile NewImage\n"
+           "           Rebuilds NewImage by applying DeltaFile to OldImage.\n"
+           "         fsbld --update [--remove Pattern] [--compact] Image [ChangesDirectory]\n"
+           "           Adds or replaces the files found in ChangesDirectory and\n"
+           "           removes the files matching each --remove Pattern in an\n"
+           "           existing legacy Image.  New data is appended and only the\n"
+           "           entry and filename tables are rewritten unless --compact is\n"
+           "           given, which also reclaims the space left by old data.\n"
+           "         fsbld --verify Image [Filename]\n"
+           "           Checks Image against its --merkle tree, or with Filename\n"
+           "           checks just the blocks holding that file against the root.\n"
+           "         fsbld --benchmark-reader Image [LookupCount]\n"
+           "           Opens Image with libfsbld-reader, checks that every file can\n"
+           "           be found and times LookupCount random lookups.\n"
+           "         fsbld --inspect [--depth Depth] [--top Count] Image\n"
+           "           Checks that the entries of Image are sorted and lie within\n"
+           "           it, and that its filenames and file data don't overlap, then\n"
+           "           lists the size of each directory, down to Depth levels, the\n"
+           "           Count largest files and where the bytes of the image go.\n"
+           "           Exits with an error if any check fails.\n"
+           "         fsbld --extract [--compare SourceDirectory] Image OutputDirectory\n"
+           "           Writes the files of Image into OutputDirectory, in parallel,\n"
+           "           and optionally checks that they match the files of\n"
+           "           SourceDirectory by comparing their SHA-256 hashes.\n\n"
+           "Options: --overlay Layer\n"
+           "           Adds the files of another directory or existing image on\n"
+           "           top of RootSourceDirectory, replacing files with the same\n"
+           "           name.  Can be given more than once with later layers\n"
+           "           taking precedence.  RootSourceDirectory can also be an\n"
+           "           existing image.\n"
+           "         --format legacy|v2\n"
+           "           Selects the layout of the image.  legacy (the default) is the\n"
+           "           original header understood by all FlashFileSystem versions.\n"
+           "           v2 adds a format version, feature flags and a section table\n"
+           "           and switches to 64-bit offsets when the image exceeds 4GB.\n"
+           "         --compact-entries\n"
+           "           Packs the entry table of a v2 image using 2, 3 or 4 byte\n"
+           "           offsets and sizes, selected from the size of the image.\n"
+           "         --target-endian little|big\n"
+           "           Byte order of the device which will read the image.  Defaults\n"
+           "           to little, which is correct for all ARM based mbed boards.\n"
+           "         --name-prefixes 4|8|16\n"
+           "           Adds a sidecar of fixed length filename prefixes next to the\n"
+           "           entries of a v2 image so that most binary search probes can be\n"
+           "           resolved without reading the filename.\n"
+           "         --name-filter BitsPerFile\n"
+           "           Adds a Bloom filter over the filenames of a v2 image so that\n"
+           "           lookups of missing files can be rejected with one FLASH read.\n"
+           "         --metadata\n"
+           "           Adds the modification time, permissions, MIME type and a\n"
+           "           content hash ETag of each file to a v2 image.\n"
+           "         --integrity\n"
+           "           Adds the CRC32C of each file in a v2 image so that the\n"
+           "           device can detect corrupted FLASH when a file is opened.\n"
+           "         --merkle BlockSize\n"
+           "           Appends a SHA-256 Merkle tree over BlockSize blocks of a v2\n"
+           "           image, with its root in the header, so that a bootloader\n"
+           "           can verify just the blocks which hold a file.\n"
+           "         --encrypt KeyFile\n"
+           "           Encrypts the file data and the entry and filename tables of\n"
+           "           a v2 image with AES-CTR.  KeyFile holds a 128 or 256-bit key\n"
+           "           as raw bytes or hex digits.\n"
+           "         --plaintext-tables\n"
+           "           Leaves the entry and filename tables of an --encrypt image\n"
+           "           unencrypted.\n"
+           "         --precompress gzip|brotli|gzip,brotli\n"
+           "           Stores precompressed copies of the compressible files in a\n"
+           "           v2 image, keeping each one only if it is smaller, so that\n"
+           "           they can be served with a Content-Encoding header.\n"
+           "         --http-headers RulesFile\n"
+           "           Places a ready to send HTTP response header in front of the\n"
+           "           data of each file in a v2 image.  Each line of RulesFile is\n"
+           "           a filename pattern followed by the Cache-Control value for\n"
+           "           matching files.\n"
+           "         --benchmark-http Count\n"
+           "           Replays Count random requests against the finished image,\n"
+           "           formatting the headers at runtime and using the\n"
+           "           precomputed ones, and reports the time taken.\n"
+           "         --access-profile ProfileFile\n"
+           "           Orders the file data so that frequently accessed files come\n"
+           "           first and files accessed one after the other are adjacent.\n"
+           "           ProfileFile lists the filename of each access, in order,\n"
+           "           one per line, with blank lines between sessions.\n"
+           "         --flash-geometry SectorSize[xCount][,...]\n"
+           "           Erase sector sizes of the device FLASH, from address 0, such\n"
+           "           as 4Kx16,32Kx14 for the LPC1768.  A final size without a\n"
+           "           count repeats.  Small files are kept within one sector.\n"
+           "         --flash-offset Address\n"
+           "           FLASH address at which the image will be placed.\n"
+           "         --volatile Pattern\n"
+           "           Places the data of files matching Pattern in sectors of\n"
+           "           their own so they can be updated without erasing the\n"
+           "           other files.  Can be given more than once.\n"
+           "         --region Name:Address:Capacity\n"
+           "           Spreads the file data of a v2 image across FLASH regions,\n"
+           "           such as internal banks and QSPI FLASH, with best fit\n"
+           "           decreasing packing.  Can be given more than once.  The\n"
+           "           first region also holds the header and tables and the data\n"
+           "           of each other region is written to Output.Name.bin.\n"
+           "         --pin Pattern=Region\n"
+           "           Places the files matching Pattern in the named region.\n"
+           "           Can be given more than once and the first match wins.\n"
+           "         --target Name\n"
+           "           Tunes the image for a device such as LPC1768, KL25Z, KL46Z,\n"
+           "           K64F, LPC11U24, NUCLEO_F401RE or NRF51822.  Sets the byte\n"
+           "           order, file data alignment, FLASH geometry, budget and the\n"
+           "           section and alignment of the exported header.  Options\n"
+           "           given explicitly take precedence.\n"
+           "         --target-file TargetFile\n"
+           "           Adds to or replaces the built-in targets.  Each line is\n"
+           "           Name FlashSize Alignment little|big SectionName [Geometry]\n"
+           "         --firmware FirmwareFile [--out CombinedFile]\n"
+           "           Writes CombinedFile with the contents of FirmwareFile\n"
+           "           followed by the image, padded with 0xFF so that the image\n"
+           "           starts on a multiple of --image-align, which defaults to 4\n"
+           "           or the --target alignment, or at --image-address.  The\n"
+           "           image is written there in place of OutputBinaryFilename.\n"
+           "           The sector aware layout and --budget use the image address.\n"
+           "         --firmware-base Address\n"
+           "           Device address of the start of FirmwareFile, 0 by default.\n"
+           "         --symbols LinkerScript\n"
+           "           Writes roFlashDrive, roFlashDrive_size and roFlashDrive_end\n"
+           "           symbol assignments for the combined image.\n"
+           "         --hex HexFile\n"
+           "         --srec SrecFile\n"
+           "           Writes the image, or with --firmware the firmware and the\n"
+           "           image at their device addresses, as Intel HEX or\n"
+           "           S-records.\n"
+           "         --record-base Address\n"
+           "           Device address of the image in the --hex and --srec files\n"
+           "           when there is no --firmware, 0 by default.\n"
+           "         --budget Size|flash\n"
+           "           Largest allowed image size, or the FLASH size of the\n"
+           "           --target for flash, less any --firmware.  The image is\n"
+           "           planned from the scanned file sizes and optional files\n"
+           "           are dropped until it fits, failing before any file data\n"
+           "           is read if it can't.\n"
+           "         --priorities PrioritiesFile\n"
+           "           Each line is a filename pattern followed by a priority\n"
+           "           number or required.  Files with the lowest priority are\n"
+           "           dropped first to meet the --budget.  The first match wins\n"
+           "           and files matching no pattern are required.\n"
+           "         --dry-run\n"
+           "           Plans the image and prints where its bytes go without\n"
+           "           writing anything.\n"
+           "         --changed-files ListFile\n"
+           "           Reports the FLASH sectors which would need to be erased to\n"
+           "           update the files listed in ListFile, one per line.\n"
+           "         --benchmark-lookups Count\n"
+           "           Replays Count random lookups against the finished image with\n"
+           "           and without name prefixes and reports the time taken.\n");
 }
 
 
 
+/* Value used in SFileSystemBuild::FormatVersion for the original image layout
+   which starts with SFileSystemHeader. */
+#define FILE_SYSTEM_FORMAT_LEGACY   1
+
+/* Maximum number of sections which can be placed in a versioned image. */
+#define FILE_SYSTEM_MAX_SECTIONS    16
+
+/* Size of the buffer used to copy file data into the image. */
+#define COPY_BUFFER_SIZE            (64 * 1024)
+
+/* Maximum number of differently sized groups of FLASH sectors which can be
+   described with --flash-geometry. */
+#define FLASH_MAX_REGIONS           8
+
+/* Maximum number of FLASH regions which can be given with --region. */
+#define IMAGE_MAX_REGIONS           8
+
+/* Value of erased FLASH, used to fill the gaps left between files. */
+#define FLASH_ERASED_BYTE           0xFF
+
+/* Size of each node of the --merkle tree and the smallest block size,
+   which keeps the root hash in the header within the first block. */
+#define MERKLE_HASH_SIZE            SHA256_DIGEST_SIZE
+#define MERKLE_MIN_BLOCK_SIZE       256
+
+/* Largest HTTP response header which --http-headers will render. */
+#define HTTP_HEADER_MAX_SIZE        1024
+
+/* Formats written by --hex and --srec. */
+#define RECORD_FORMAT_INTEL_HEX     0
+#define RECORD_FORMAT_SREC          1
+#define RECORD_FORMAT_COUNT         2
+
+/* Data bytes per Intel HEX or S-record line, the longest line including the
+   S0 header and the size of the buffer lines are encoded into. */
+#define RECORD_LINE_SIZE            16
+#define RECORD_MAX_LINE_SIZE        (2 * RECORD_LINE_SIZE + 32)
+#define RECORD_BUFFER_SIZE          (64 * 1024)
+
+/* Intel HEX record types. */
+#define INTEL_HEX_DATA                      0
+#define INTEL_HEX_END_OF_FILE               1
+#define INTEL_HEX_EXTENDED_LINEAR_ADDRESS   4
+
+
+/* Maps filename extensions to the MIME types recorded by --metadata.  Files
+   with extensions not found here are application/octet-stream, which must
+   remain the first element.  Compressible is non-zero for the types which
+   --precompress should attempt to shrink; formats which are already
+   compressed are left alone. */
+typedef struct _SMimeTypeMapping
+{
+    const char*         pExtension;
+    const char*         pMimeType;
+    int                 Compressible;
+} SMimeTypeMapping;
+
+static const SMimeTypeMapping g_MimeTypes[] =
+{
+    { "",               "application/octet-stream",           0 },
+    { "htm",            "text/html",                          1 },
+    { "html",           "text/html",                          1 },
+    { "css",            "text/css",                           1 },
+    { "csv",            "text/csv",                           1 },
+    { "txt",            "text/plain",                         1 },
+    { "js",             "text/javascript",                    1 },
+    { "mjs",            "text/javascript",                    1 },
+    { "json",           "application/json",                   1 },
+    { "map",            "application/json",                   1 },
+    { "webmanifest",    "application/manifest+json",          1 },
+    { "xml",            "application/xml",                    1 },
+    { "pdf",            "application/pdf",                    0 },
+    { "wasm",           "application/wasm",                   1 },
+    { "gz",             "application/gzip",                   0 },
+    { "zip",            "application/zip",                    0 },
+    { "svg",            "image/svg+xml",                      1 },
+    { "png",            "image/png",                          0 },
+    { "jpg",            "image/jpeg",                         0 },
+    { "jpeg",           "image/jpeg",                         0 },
+    { "gif",            "image/gif",                          0 },
+    { "bmp",            "image/bmp",                          1 },
+    { "ico",            "image/x-icon",                       1 },
+    { "webp",           "image/webp",                         0 },
+    { "woff",           "font/woff",                          0 },
+    { "woff2",          "font/woff2",                         0 },
+    { "ttf",            "font/ttf",                           1 },
+    { "otf",            "font/otf",                           1 },
+    { "mp3",            "audio/mpeg",                         0 },
+    { "wav",            "audio/wav",                          0 },
+    { "mp4",            "video/mp4",                          0 }
+};
+
+#define MIME_TYPE_COUNT (sizeof(g_MimeTypes) / sizeof(g_MimeTypes[0]))
+
+
+/* Device parameters selected with --target.  Geometry is a --flash-geometry
+   list used for sector aware layouts and Alignment is the alignment of the
+   data of each file, which must be a power of 2.  SectionName is the linker
+   section which the exported roFlashDrive array is placed in. */
+typedef struct _STargetProfile
+{
+    char                Name[32];
+    uint64_t            FlashSize;
+    char                Geometry[64];
+    unsigned int        Alignment;
+    int                 BigEndian;
+    char                SectionName[32];
+} STargetProfile;
+
+/* Built-in targets.  More can be added, or these replaced, with
+   --target-file. */
+static const STargetProfile g_TargetProfiles[] =
+{
+    { "LPC1768",        512 * 1024,     "4Kx16,32Kx14",                 4,  0,  "FlashDrive" },
+    { "LPC11U24",       32 * 1024,      "4K",                           4,  0,  "FlashDrive" },
+    { "KL25Z",          128 * 1024,     "1K",                           4,  0,  "FlashDrive" },
+    { "KL46Z",          256 * 1024,     "1K",                           4,  0,  "FlashDrive" },
+    { "K64F",           1024 * 1024,    "4K",                           8,  0,  "FlashDrive" },
+    { "NUCLEO_F401RE",  512 * 1024,     "16Kx4,64Kx1,128K",             4,  0,  "FlashDrive" },
+    { "NRF51822",       256 * 1024,     "1K",                           4,  0,  "FlashDrive" }
+};
+
+#define TARGET_PROFILE_COUNT (sizeof(g_TargetProfiles) / sizeof(g_TargetProfiles[0]))
+
+
+/* Build time description of each file to be placed in the image.  Offsets
+   and sizes are tracked with 64 bits so that overflow of the on-disk entry
+   encoding can be detected before any of the image is written. */
+typedef struct _SFileSystemBuildEntry
+{
+    /* Offset of the filename relative to the start of pFilenameBuffer.  The
+       offset within the image is only known once the layout is planned. */
+    unsigned int        FilenameOffset;
+    /* Location of the file data relative to the start of the image, assigned
+       by _PlanFileSystemImage(). */
+    uint64_t            FileBinaryOffset;
+    /* Size of the file as found while scanning the source directory. */
+    uint64_t            FileBinarySize;
+    /* Metadata found while scanning the source directory.  MimeType is an
+       index into g_MimeTypes. */
+    uint64_t            ModificationTime;
+    uint32_t            Mode;
+    unsigned int        MimeType;
+    /* Hash of the file contents, calculated as the data is copied into the
+       image. */
+    uint64_t            ContentHash;
+    /* CRC32C of the file contents for --integrity, also calculated as the
+       data is copied. */
+    uint32_t            Crc32c;
+    /* Size of the HTTP response header placed just before the file data by
+       --http-headers. */
+    unsigned int        HttpHeaderSize;
+    /* Non-zero if the file matched a --volatile pattern. */
+    int                 Volatile;
+    /* Index of the layer which supplies the file and, for an image layer,
+       the location of the data within that image. */
+    unsigned int        Layer;
+    uint64_t            SourceOffset;
+    /* Index of the --region which holds the file data. */
+    unsigned int        Region;
+} SFileSystemBuildEntry;
+
+/* Location of each portion of the image as determined by
+   _PlanFileSystemImage(). */
+typedef struct _SFileSystemLayout
+{
+    /* Size of the header, including the section table for versioned
+       images. */
+    uint64_t            HeaderSize;
+    uint64_t            EntriesOffset;
+    uint64_t            NameFilterOffset;
+    uint64_t            NamePrefixesOffset;
+    uint64_t            MetadataOffset;
+    uint64_t            MimeTypesOffset;
+    uint64_t            MimeTypesSize;
+    uint64_t            VariantsOffset;
+    uint64_t            HttpHeadersOffset;
+    uint64_t            IntegrityOffset;
+    uint64_t            RegionsOffset;
+    uint64_t            EntryRegionsOffset;
+    uint64_t            FilenamesOffset;
+    uint64_t            DataOffset;
+    /* Start of the --merkle tree, which is also the number of bytes that it
+       covers, and the number of levels in the tree. */
+    uint64_t            MerkleOffset;
+    unsigned int        MerkleLevelCount;
+    uint64_t            ImageSize;
+    /* Size of each on-disk entry along with the width of its offset and size
+       fields.  SFileSystemEntry, SFileSystemEntry64 or a compact entry. */
+    unsigned int        EntrySize;
+    unsigned int        EntryOffsetBytes;
+    unsigned int        EntrySizeBytes;
+    /* FILE_SYSTEM_FEATURE_* bits to be recorded in a versioned header. */
+    uint32_t            FeatureFlags;
+    /* Section table to be written to a versioned header. */
+    unsigned int        SectionCount;
+    SFileSystemSection  Sections[FILE_SYSTEM_MAX_SECTIONS];
+} SFileSystemLayout;
+
+/* Precompressed copy of a file created by --precompress. */
+typedef struct _SFileSystemBuildVariant
+{
+    /* Index of the original file in the sorted pFileEntries array. */
+    unsigned int        EntryIndex;
+    /* FILE_SYSTEM_ENCODING_* value. */
+    unsigned int        Encoding;
+    /* Compressed bytes, or NULL if the compressed copy wasn't smaller. */
+    unsigned char*      pData;
+    size_t              Size;
+    /* Location of the compressed bytes, assigned by _PlanFileSystemImage(). */
+    uint64_t            Offset;
+    /* Size of the HTTP response header placed just before the compressed
+       bytes by --http-headers. */
+    unsigned int        HttpHeaderSize;
+    /* CRC32C of the compressed bytes for --integrity. */
+    uint32_t            Crc32c;
+} SFileSystemBuildVariant;
+
+/* Group of equally sized FLASH erase sectors from --flash-geometry. */
+typedef struct _SFlashRegion
+{
+    uint64_t            SectorSize;
+    /* Number of sectors in the region or 0 if the last region repeats to
+       the end of FLASH. */
+    uint64_t            SectorCount;
+} SFlashRegion;
+
+/* Location of a single FLASH erase sector. */
+typedef struct _SFlashSector
+{
+    /* Index of the sector from the start of FLASH. */
+    uint64_t            Index;
+    uint64_t            Start;
+    uint64_t            Size;
+} SFlashSector;
+
+/* FLASH region from --region which receives part of the file data. */
+typedef struct _SImageRegion
+{
+    char                Name[32];
+    uint64_t            Address;
+    uint64_t            Capacity;
+    /* Bytes of the region used, assigned by _PlanFileSystemImage(). */
+    uint64_t            Size;
+} SImageRegion;
+
+/* Cache policy read from the --http-headers rules file. */
+typedef struct _SHttpRule
+{
+    /* fnmatch() pattern which is compared against the filename. */
+    const char*         pPattern;
+    /* Value of the Cache-Control header for matching files. */
+    const char*         pCacheControl;
+} SHttpRule;
+
+/* Filename or file data found in an image by fsbld --inspect. */
+typedef struct _SInspectExtent
+{
+    uint64_t            Offset;
+    uint64_t            Size;
+    uint32_t            Index;
+    uint32_t            Region;
+} SInspectExtent;
+
+/* Directory in the size tree listed by fsbld --inspect.  pName points to the
+   last component of its path within the filename of its first file. */
+typedef struct _SInspectDirectory
+{
+    const char*         pName;
+    size_t              NameLength;
+    size_t              PathLength;
+    unsigned int        Depth;
+    unsigned int        FileCount;
+    uint64_t            Size;
+} SInspectDirectory;
+
+/* An existing image opened with libfsbld-reader along with all of its
+   entries. */
+typedef struct _SImageFile
+{
+    const char*             pFilename;
+    SFsReaderImage          Reader;
+    /* Every byte of the image file, including anything after the end of a
+       v2 image, so that a delta rebuilds the file exactly. */
+    const unsigned char*    pImage;
+    uint64_t                ImageSize;
+    /* Every entry in sorted order, as described by FsReaderStatIndex(). */
+    SFsReaderStat*          pEntries;
+    unsigned int            FileCount;
+} SImageFile;
+
+/* State of an Intel HEX or S-record file being written by --hex or --srec. */
+typedef struct _SRecordWriter
+{
+    FILE*               pFile;
+    const char*         pFilename;
+    /* RECORD_FORMAT_INTEL_HEX or RECORD_FORMAT_SREC. */
+    unsigned int        Format;
+    /* Width of the address in S-record data records: 2, 3 or 4 bytes. */
+    unsigned int        AddressBytes;
+    /* Upper 16 bits of the address from the last Intel HEX extended linear
+       address record. */
+    uint32_t            UpperAddress;
+    /* Data collected for the next data record. */
+    uint64_t            LineAddress;
+    unsigned int        LineSize;
+    unsigned char       Line[RECORD_LINE_SIZE];
+    /* Encoded lines waiting to be written. */
+    char*               pBuffer;
+    size_t              BufferUsed;
+    /* Statistics reported once the file is written. */
+    uint64_t            RecordCount;
+    uint64_t            DataRecordCount;
+    uint64_t            DataSize;
+    uint64_t            EncodeTime;
+} SRecordWriter;
+
+/* Source of files given by the root directory or an --overlay option.  Each
+   layer is either a directory, which is scanned, or an existing image whose
+   entries and data are used directly. */
+typedef struct _SFileSystemLayer
+{
+    const char*             pPath;
+    /* The decoded image or an empty SImageFile for a directory. */
+    SImageFile              Image;
+    /* Sorted entries of the layer.  For an image the filenames are read from
+       the image itself. */
+    const char*             pFilenameBuffer;
+    SFileSystemBuildEntry*  pFileEntries;
+    unsigned int            FileCount;
+    /* Next entry to be merged. */
+    unsigned int            Position;
+} SFileSystemLayer;
+
+/* Operations which can be selected on the command line. */
+#define FSBLD_MODE_BUILD        0
+#define FSBLD_MODE_DIFF         1
+#define FSBLD_MODE_APPLY_DELTA  2
+#define FSBLD_MODE_UPDATE       3
+#define FSBLD_MODE_VERIFY       4
+#define FSBLD_MODE_BENCHMARK_READER 5
+#define FSBLD_MODE_INSPECT      6
+#define FSBLD_MODE_EXTRACT      7
+
+/* Number of problems of each kind listed by fsbld --inspect before it just
+   counts them. */
+#define INSPECT_MAX_REPORTED    10
+
+/* Size of the reads made from a source file while hashing it for
+   fsbld --extract --compare. */
+#define EXTRACT_READ_SIZE       (64 * 1024)
+
 /* Structure used to hold context for the file system building process. */
 typedef struct _SFileSystemBuild
 {
     /* Command line parameters */
     const char*         pRootSourceDirectory;
     const char*         pOutputBinaryFilename;
+    /* One of the FSBLD_MODE_* values. */
+    unsigned int        Mode;
+    /* Positional parameters of the command line. */
+    const char*         pParameters[3];
+    /* FILE_SYSTEM_FORMAT_LEGACY or FILE_SYSTEM_FORMAT_VERSION. */
+    unsigned int        FormatVersion;
+    /* Non-zero if --compact-entries was specified. */
+    int                 CompactEntries;
+    /* Non-zero if --target-endian big was specified. */
+    int                 TargetBigEndian;
+    /* Length of each name prefix in the FILE_SYSTEM_SECTION_NAME_PREFIXES
+       sidecar or 0 if it isn't to be created. */
+    unsigned int        NamePrefixLength;
+    /* Number of random lookups to time with --benchmark-lookups. */
+    unsigned int        BenchmarkLookups;
+    /* Deepest level of the --inspect directory tree to be listed and the
+       number of largest files to be listed. */
+    unsigned int        InspectDepth;
+    unsigned int        InspectTopCount;
+    /* Source tree which the files written by --extract are compared with or
+       NULL if they aren't to be compared. */
+    const char*         pCompareDirectory;
+    /* Size of the FILE_SYSTEM_SECTION_NAME_FILTER Bloom filter in bits per
+       file or 0 if it isn't to be created. */
+    unsigned int        NameFilterBitsPerFile;
+    /* The Bloom filter words, in host byte order, and the number of bits set
+       per filename. */
+    uint32_t*           pNameFilter;
+    unsigned int        NameFilterWordCount;
+    unsigned int        NameFilterHashCount;
+    /* Non-zero if --metadata was specified. */
+    int                 Metadata;
+    /* Non-zero if --integrity was specified. */
+    int                 Integrity;
+    /* Size of the blocks hashed into the --merkle tree or 0 if the image
+       isn't to have one. */
+    uint64_t            MerkleBlockSize;
+    /* Key file given with --encrypt, or NULL if the image isn't encrypted,
+       the key and nonce loaded from it, and non-zero if --plaintext-tables
+       was specified. */
+    const char*         pKeyFilename;
+    SAesContext         Aes;
+    int                 PlaintextTables;
+    /* Index of each g_MimeTypes element in the image's MIME type table or -1
+       if no file uses it.  MimeTypeCount is the size of the table. */
+    int                 MimeTypeIds[MIME_TYPE_COUNT];
+    unsigned int        MimeTypeCount;
+    /* Combination of (1 << FILE_SYSTEM_ENCODING_*) bits selected with
+       --precompress. */
+    unsigned int        PrecompressEncodings;
+    /* Precompressed variants which turned out to be smaller than the
+       original, sorted by EntryIndex and then Encoding. */
+    SFileSystemBuildVariant* pVariants;
+    unsigned int        VariantCount;
+    /* Name of the --http-headers rules file or NULL if HTTP response headers
+       aren't to be placed in the image.  The rules point into
+       pHttpRulesBuffer, which holds the contents of the file. */
+    const char*         pHttpRulesFilename;
+    char*               pHttpRulesBuffer;
+    SHttpRule*          pHttpRules;
+    unsigned int        HttpRuleCount;
+    /* Number of random requests to time with --benchmark-http. */
+    unsigned int        BenchmarkHttpRequests;
+    /* Name of the --access-profile file or NULL to place file data in the
+       same order as the entries. */
+    const char*         pAccessProfileFilename;
+    /* Indices into pFileEntries in the order that their data is to be placed
+       in the image or NULL for the same order as the entries. */
+    unsigned int*       pDataOrder;
+    /* FLASH erase sectors from --flash-geometry, FlashRegionCount is 0 if the
+       layout isn't to be sector aware. */
+    SFlashRegion        FlashRegions[FLASH_MAX_REGIONS];
+    unsigned int        FlashRegionCount;
+    /* FLASH address of the start of the image from --flash-offset. */
+    uint64_t            FlashOffset;
+    /* Patterns from each --volatile option. */
+    const char**        ppVolatilePatterns;
+    unsigned int        VolatilePatternCount;
+    /* Name of the --changed-files list or NULL. */
+    const char*         pChangedFilesFilename;
+    /* FLASH regions from --region, the first of which holds the header and
+       tables, and the Pattern=Region rules from each --pin option. */
+    SImageRegion        Regions[IMAGE_MAX_REGIONS];
+    unsigned int        RegionCount;
+    const char**        ppPins;
+    unsigned int        PinCount;
+    /* Patterns from each --remove option used by --update. */
+    const char**        ppRemovePatterns;
+    unsigned int        RemovePatternCount;
+    /* Non-zero if --compact was specified. */
+    int                 Compact;
+    /* Paths from each --overlay option. */
+    const char**        ppOverlays;
+    unsigned int        OverlayCount;
+    /* The root directory followed by each overlay when the files come from
+       more than one source or from an existing image, otherwise NULL. */
+    SFileSystemLayer*   pLayers;
+    unsigned int        LayerCount;
     /* The buffer used to store all of the filenames to be dumped into the
        file system image. */
     char*               pFilenameBuffer;
     /* The array of entries used to describe the files to be placed in the
        file system image. */
-    SFileSystemEntry*   pFileEntries;
+    SFileSystemBuildEntry* pFileEntries;
     /* The size of the pFilenameBuffer */
     unsigned int        FilenameBufferSize;
     /* The number of files to be placed in the file system image. The 
@@ -65,931 +708,10528 @@ typedef struct _SFileSystemBuild
     unsigned int        FileCount;
     /* State tracked as the pFileEntries and pFilenameBuffer is recursiviely
        filled in. */
-    SFileSystemEntry*   pCurrEntry;
+    SFileSystemBuildEntry* pCurrEntry;
     char*               pCurrFilename;
     unsigned int        FilesLeft;
     unsigned int        CurrFilenameOffset;
-    unsigned int        FilenameStartOffset;
+    /* Largest allowed image size from --budget or 0 if there is no limit. */
+    uint64_t            Budget;
+    /* Name of the --priorities file or NULL if every file is required. */
+    const char*         pPrioritiesFilename;
+    /* Non-zero if --dry-run was specified. */
+    int                 DryRun;
+    /* Device selected with --target, valid if HaveTarget is non-zero, and the
+       --target-file which can add to the built-in profiles. */
+    STargetProfile      Target;
+    int                 HaveTarget;
+    const char*         pTargetFilename;
+    /* Firmware given with --firmware which the image is appended to in the
+       --out file, and the optional --symbols linker script.  ImageAddress is
+       the device address of the image, FirmwareBase that of the firmware. */
+    const char*         pFirmwareFilename;
+    const char*         pCombinedFilename;
+    const char*         pSymbolsFilename;
+    uint64_t            FirmwareBase;
+    uint64_t            FirmwareSize;
+    uint64_t            ImageAlignment;
+    uint64_t            ImageAddress;
+    /* File the image is written to and the offset of the image within it:
+       the --out file after the firmware and padding, or OutputBinaryFilename
+       at offset 0.  Everything which reads the finished image back uses
+       these. */
+    const char*         pImageFilename;
+    uint64_t            ImageFileOffset;
+    /* Intel HEX and S-record files from --hex and --srec, and the address of
+       the image in them when there is no --firmware. */
+    const char*         pHexFilename;
+    const char*         pSrecFilename;
+    uint64_t            RecordBase;
+    /* Where each portion of the image will be written. */
+    SFileSystemLayout   Layout;
 } SFileSystemBuild;
 
 
 
-/* Parses the user supplied command line.
+/* Parses a size or address which may be followed by a K or M suffix.
 
-    Parameters:
-    argc is the number of command line parameters passed on the command line
-         including the name of the program itself.
-    argv is a pointer to the array of command line parameter strings.
-    pFileSystemBuild is a pointer to the structure to be filled in with the
-        user specified command line parameters.
-    
-    Returns:
-        0 on success and a negative error code otherwise.
+   Parameters:
+    pString is the string to be parsed.
+    ppEnd is a pointer to be filled in with the first character after the
+        size.
+
+   Returns:
+    The parsed value.
 */
-static int _ParseCommandLine(int argc, const char** argv, SFileSystemBuild* pFileSystemBuild)
+static uint64_t _ParseSize(const char* pString, char** ppEnd)
 {
-    assert ( argv && pFileSystemBuild );
-    
-    if (argc < 3)
+    uint64_t Value = strtoull(pString, ppEnd, 0);
+
+    if (**ppEnd == 'K' || **ppEnd == 'k')
     {
-        fprintf(stderr, "error: Must specify both RootSourceDirectory and OutputBinaryFilename on command line.\n");
-        return -1;
+        Value *= 1024;
+        (*ppEnd)++;
     }
-    
-    pFileSystemBuild->pRootSourceDirectory = argv[1];
-    pFileSystemBuild->pOutputBinaryFilename = argv[2];
-    
-    return 0;
+    else if (**ppEnd == 'M' || **ppEnd == 'm')
+    {
+        Value *= 1024 * 1024;
+        (*ppEnd)++;
+    }
+
+    return Value;
 }
 
-/* Global used to record the base address of the file system image so that
-   the relative filenames can be found in _CompareFileEntries() */
-static const char* g_pFLASHBase;
 
-static int _CompareFileEntries(const void* pvEntry1, const void* pvEntry2)
+/* Parses a --region Name:Address:Capacity value and adds it to the list of
+   regions.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _ParseRegion(SFileSystemBuild* pFileSystemBuild, const char* pRegion)
 {
-    const SFileSystemEntry*     pEntry1 = (const SFileSystemEntry*)pvEntry1;
-    const SFileSystemEntry*     pEntry2 = (const SFileSystemEntry*)pvEntry2;
-    const char*                 pEntryName1 = g_pFLASHBase + pEntry1->FilenameOffset;
-    const char*                 pEntryName2 = g_pFLASHBase + pEntry2->FilenameOffset;
-    
-    return strcmp(pEntryName1, pEntryName2);
+    SImageRegion*   pNewRegion = &pFileSystemBuild->Regions[pFileSystemBuild->RegionCount];
+    const char*     pColon = strchr(pRegion, ':');
+    char*           pEnd = NULL;
+    unsigned int    i;
+
+    if (pFileSystemBuild->RegionCount >= IMAGE_MAX_REGIONS)
+    {
+        fprintf(stderr, "error: No more than %u regions can be given.\n", IMAGE_MAX_REGIONS);
+        return 1;
+    }
+    if (!pColon || pColon == pRegion || (size_t)(pColon - pRegion) >= sizeof(pNewRegion->Name))
+    {
+        return 1;
+    }
+    memset(pNewRegion, 0, sizeof(*pNewRegion));
+    memcpy(pNewRegion->Name, pRegion, pColon - pRegion);
+    pNewRegion->Address = _ParseSize(pColon + 1, &pEnd);
+    if (pEnd == pColon + 1 || *pEnd != ':')
+    {
+        return 1;
+    }
+    pNewRegion->Capacity = _ParseSize(pEnd + 1, &pEnd);
+    if (*pEnd != '\0' || pNewRegion->Capacity == 0)
+    {
+        return 1;
+    }
+    for (i = 0 ; i < pFileSystemBuild->RegionCount ; i++)
+    {
+        if (0 == strcmp(pFileSystemBuild->Regions[i].Name, pNewRegion->Name))
+        {
+            fprintf(stderr, "error: Region %s is given more than once.\n", pNewRegion->Name);
+            return 1;
+        }
+    }
+    pFileSystemBuild->RegionCount++;
+
+    return 0;
 }
 
 
-/* Iterates over the files in a directory, counting the number of files each
-   contains.  This is a recursive function that it able to find and count
-   all files in a directory hierarchy.
-   
+/* Reads a text file, such as a rules file or access profile, into memory.
+
    Parameters:
-    pDirectoryName is the name of the directory on the PC to iterate through.
-    ImageDirectoryNameSize is the length of the corresponding directory in the
-        destination file system image.
-    pFileCount is a pointer to be filled in with the number of files found in
-        this directory tree.
-    pFilenameSize is a pointer to be filled in with the number of bytes that
-        will be needed to contain all of the filenames found in this tree.
-        
+    pFilename is the name of the file to be read.
+    pLineCount is a pointer to be filled in with the largest number of lines
+        which the file could contain.
+
    Returns:
-    0 on success and a positive error code otherwise 
+    Pointer to the NULL terminated contents which the caller must free() or
+    NULL on failure.
 */
-static int _CountFilesInDirectoryTree(const char*   pDirectoryName,
-                                      unsigned int  ImageDirectoryNameSize,
-                                      unsigned int* pFileCount,
-                                      unsigned int* pFilenameSize)
+static char* _LoadTextFile(const char* pFilename, unsigned int* pLineCount)
 {
-    int                 Return = 1;
-    unsigned int        DirectoryNameSize = 0;
-    unsigned int        TotalFileCount = 0;
-    unsigned int        TotalFilenameSize = 0;
-    DIR*                pDir = NULL;
-    struct dirent*      pDirEntry = NULL;
-    
-    assert ( pDirectoryName && pFileCount && pFilenameSize );
-    
-    /* Attempt to open the specified input root directory */
-    pDir = opendir(pDirectoryName);
-    if (!pDir)
+    FILE*   pFile = NULL;
+    char*   pBuffer = NULL;
+    char*   pCurr;
+    long    FileSize;
+
+    pFile = fopen(pFilename, "r");
+    if (!pFile || fseek(pFile, 0, SEEK_END) || (FileSize = ftell(pFile)) < 0 || fseek(pFile, 0, SEEK_SET))
     {
-        fprintf(stderr, 
-                "error: Failed to open directory %s\n", 
-                pDirectoryName);
+        fprintf(stderr, "error: Failed to open %s for read.\n", pFilename);
         goto Error;
     }
+    pBuffer = malloc(FileSize + 1);
+    if (!pBuffer)
+    {
+        fprintf(stderr, "error: Failed to allocate %ld bytes for %s.\n", FileSize, pFilename);
+        goto Error;
+    }
+    if (FileSize > 0 && 1 != fread(pBuffer, FileSize, 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to read %s.\n", pFilename);
+        free(pBuffer);
+        pBuffer = NULL;
+        goto Error;
+    }
+    pBuffer[FileSize] = '\0';
 
-    /* Determine the length of this directory name with trailing slash
-       separator. */
-    DirectoryNameSize = strlen(pDirectoryName);
-    
-    /* Iterate through the files in the directory and determine size of
-       data to be allocated to track these files. */
-    while(NULL != (pDirEntry = readdir(pDir)))
+    *pLineCount = 1;
+    for (pCurr = pBuffer ; *pCurr ; pCurr++)
     {
-        if (DT_DIR == pDirEntry->d_type)
+        *pLineCount += (*pCurr == '\n');
+    }
+
+Error:
+    if (pFile)
+    {
+        fclose(pFile);
+    }
+    return pBuffer;
+}
+
+
+/* Finds a --target profile.  Lines of the --target-file take precedence over
+   the built-in profiles and each one holds:
+     Name FlashSize Alignment little|big SectionName [Geometry]
+   Blank lines and lines starting with # are ignored.
+
+   Parameters:
+    pName is the name of the target.
+    pTargetFilename is the name of the --target-file or NULL.
+    pProfile is filled in with the matching profile.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _FindTargetProfile(const char* pName, const char* pTargetFilename, STargetProfile* pProfile)
+{
+    char*           pBuffer = NULL;
+    char*           pLine;
+    unsigned int    LineCount = 0;
+    unsigned int    LineNumber = 0;
+    unsigned int    i;
+    int             Return = 1;
+
+    if (pTargetFilename)
+    {
+        pBuffer = _LoadTextFile(pTargetFilename, &LineCount);
+        if (!pBuffer)
         {
-            /* Skip . and .. directories */
-            if (0 != strcmp(pDirEntry->d_name, ".") &&
-                0 != strcmp(pDirEntry->d_name, ".."))
+            return 1;
+        }
+        for (pLine = pBuffer ; *pLine ; )
+        {
+            char*           pNext = pLine + strcspn(pLine, "\n");
+            char            FlashSize[32] = "";
+            char            Endian[8] = "";
+            char*           pEnd = NULL;
+            STargetProfile  Profile;
+            int             Fields;
+
+            LineNumber++;
+            if (*pNext)
             {
-                /* Recurse into subdirectories. */
-                int          Result = 1;
-                unsigned int FileCount = 0;
-                unsigned int FilenameSize = 0;
-                char         SubdirectoryName[512];
-            
-                /* Make sure that the complete pathname for this subdirectory will
-                   fit in the SubdirectoryName buffer. */
-                if (DirectoryNameSize + 1 + pDirEntry->d_namlen > 
-                    (sizeof(SubdirectoryName) - 1))
-                {
-                    fprintf(stderr,
-                            "error: %s/%s pathname is too long.\n",
-                            pDirectoryName,
-                            pDirEntry->d_name);
-                    goto Error;
-                }
-            
-                /* Create complete pathname. */
-                snprintf(SubdirectoryName, sizeof(SubdirectoryName), 
-                         "%s/%s",
-                         pDirectoryName,
-                         pDirEntry->d_name);
-            
-                /* Recurse into this directory and gets its counts. */
-                Result = _CountFilesInDirectoryTree(SubdirectoryName,
-                                                    ImageDirectoryNameSize + 
-                                                      pDirEntry->d_namlen + 1,
-                                                    &FileCount,
-                                                    &FilenameSize);
-                if (Result)
-                {
-                    Return = Result;
-                    goto Error;
-                }
-                TotalFileCount += FileCount;
-                TotalFilenameSize += FilenameSize;
+                *pNext++ = '\0';
+            }
+            pLine += strspn(pLine, " \t\r");
+            if (*pLine == '\0' || *pLine == '#')
+            {
+                pLine = pNext;
+                continue;
+            }
+
+            memset(&Profile, 0, sizeof(Profile));
+            Fields = sscanf(pLine, "%31s %31s %u %7s %31s %63s", 
+                            Profile.Name, FlashSize, &Profile.Alignment, Endian, 
+                            Profile.SectionName, Profile.Geometry);
+            Profile.FlashSize = _ParseSize(FlashSize, &pEnd);
+            Profile.BigEndian = (0 == strcmp(Endian, "big"));
+            if (Fields < 5 || *pEnd != '\0' || Profile.FlashSize == 0 ||
+                Profile.Alignment == 0 || (Profile.Alignment & (Profile.Alignment - 1)) ||
+                (!Profile.BigEndian && 0 != strcmp(Endian, "little")))
+            {
+                fprintf(stderr, "error: %s:%u: Expected Name FlashSize Alignment little|big SectionName [Geometry].\n",
+                        pTargetFilename, LineNumber);
+                goto Error;
+            }
+            if (0 == strcasecmp(Profile.Name, pName))
+            {
+                *pProfile = Profile;
+                Return = 0;
+                goto Error;
             }
+            pLine = pNext;
         }
-        else
+    }
+
+    for (i = 0 ; i < TARGET_PROFILE_COUNT ; i++)
+    {
+        if (0 == strcasecmp(g_TargetProfiles[i].Name, pName))
         {
-            /* Update size statistics based on data for this file. */
-            TotalFileCount++;
-            TotalFilenameSize += ImageDirectoryNameSize + pDirEntry->d_namlen + 1;
+            *pProfile = g_TargetProfiles[i];
+            Return = 0;
+            goto Error;
         }
     }
-    
-    /* Update counters. */
-    *pFileCount = TotalFileCount;
-    *pFilenameSize = TotalFilenameSize;
 
-    Return = 0;
-Error:
-    if(pDir)
+    fprintf(stderr, "error: %s isn't a known --target.  Built-in targets are:", pName);
+    for (i = 0 ; i < TARGET_PROFILE_COUNT ; i++)
     {
-        closedir(pDir);
-        pDir = NULL;
+        fprintf(stderr, " %s", g_TargetProfiles[i].Name);
     }
-
+    fprintf(stderr, "\n");
+Error:
+    free(pBuffer);
     return Return;
 }
 
 
-/* Recursively iterates over the files in a directory, populating the file 
-   entries.
-   
+/* Rounds an image offset up to the next multiple of Alignment, which must be
+   a power of 2. */
+static uint64_t _AlignOffset(uint64_t Offset, uint64_t Alignment)
+{
+    return (Offset + Alignment - 1) & ~(Alignment - 1);
+}
+
+
+/* Finds where the image goes after the --firmware.  It is placed at the
+   --image-address, if given, or the first address after the firmware which
+   is a multiple of the image alignment.
+
    Parameters:
-    pFileSystemBuild is a pointer to the structure used both for input and
-        output data to/from this procedure.
-    pDirectoryName is the name of the directory on the PC to iterate through.
-    pImageDirectoryName is the name of the directory in the destination file 
-        system image.
-        
+    pFileSystemBuild is a pointer to the file system build.
+    ImageAddressGiven is non-zero if --image-address was specified.
+
    Returns:
-    0 on success and a positive error code otherwise 
-*/
-static int _PopulateEntriesFromDirectoryTree(SFileSystemBuild* pFileSystemBuild,
-                                             const char*       pDirectoryName,
+    0 on success and a positive error code otherwise */
+static int _PlaceFirmwareImage(SFileSystemBuild* pFileSystemBuild, int ImageAddressGiven)
+{
+    struct stat     FileStats;
+    uint64_t        FirmwareEnd;
+
+    if (stat(pFileSystemBuild->pFirmwareFilename, &FileStats) || !S_ISREG(FileStats.st_mode))
+    {
+        fprintf(stderr, "error: Failed to find firmware %s.\n", pFileSystemBuild->pFirmwareFilename);
+        return 1;
+    }
+    pFileSystemBuild->FirmwareSize = FileStats.st_size;
+    FirmwareEnd = pFileSystemBuild->FirmwareBase + pFileSystemBuild->FirmwareSize;
+    if (!ImageAddressGiven)
+    {
+        pFileSystemBuild->ImageAddress = _AlignOffset(FirmwareEnd, pFileSystemBuild->ImageAlignment);
+    }
+    else if (pFileSystemBuild->ImageAddress < FirmwareEnd)
+    {
+        fprintf(stderr, "error: The %llu byte firmware ends at 0x%llx, past the image address of 0x%llx.\n",
+                (unsigned long long)pFileSystemBuild->FirmwareSize,
+                (unsigned long long)FirmwareEnd,
+                (unsigned long long)pFileSystemBuild->ImageAddress);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Parses the --flash-geometry list of SectorSize[xCount] values.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _ParseFlashGeometry(SFileSystemBuild* pFileSystemBuild, const char* pGeometry)
+{
+    char* pCurr = (char*)pGeometry;
+
+    pFileSystemBuild->FlashRegionCount = 0;
+    for (;;)
+    {
+        SFlashRegion* pRegion;
+
+        if (pFileSystemBuild->FlashRegionCount >= FLASH_MAX_REGIONS)
+        {
+            return 1;
+        }
+        pRegion = &pFileSystemBuild->FlashRegions[pFileSystemBuild->FlashRegionCount++];
+        pRegion->SectorSize = _ParseSize(pCurr, &pCurr);
+        pRegion->SectorCount = 0;
+        if (*pCurr == 'x' || *pCurr == 'X')
+        {
+            pRegion->SectorCount = strtoull(pCurr + 1, &pCurr, 0);
+            if (pRegion->SectorCount == 0)
+            {
+                return 1;
+            }
+        }
+        if (pRegion->SectorSize == 0)
+        {
+            return 1;
+        }
+        if (*pCurr == '\0')
+        {
+            return 0;
+        }
+        /* Only the last region can repeat. */
+        if (*pCurr != ',' || pRegion->SectorCount == 0)
+        {
+            return 1;
+        }
+        pCurr++;
+    }
+}
+
+
+/* Parses the user supplied command line.
+
+    Parameters:
+    argc is the number of command line parameters passed on the command line
+         including the name of the program itself.
+    argv is a pointer to the array of command line parameter strings.
+    pFileSystemBuild is a pointer to the structure to be filled in with the
+        user specified command line parameters.
+    
+    Returns:
+        0 on success and a negative error code otherwise.
+*/
+static int _ParseCommandLine(int argc, const char** argv, SFileSystemBuild* pFileSystemBuild)
+{
+    int             i;
+    unsigned int    ParameterCount = 0;
+    const char*     pTargetName = NULL;
+    int             TargetEndian = -1;
+    int             FlashOffsetGiven = 0;
+    int             BudgetIsFlashSize = 0;
+    int             ImageAddressGiven = 0;
+    int             RecordBaseGiven = 0;
+    
+    assert ( argv && pFileSystemBuild );
+    
+    pFileSystemBuild->FormatVersion = FILE_SYSTEM_FORMAT_LEGACY;
+    pFileSystemBuild->InspectDepth = ~0U;
+    pFileSystemBuild->InspectTopCount = 10;
+    pFileSystemBuild->ppVolatilePatterns = calloc(argc, sizeof(*pFileSystemBuild->ppVolatilePatterns));
+    pFileSystemBuild->ppRemovePatterns = calloc(argc, sizeof(*pFileSystemBuild->ppRemovePatterns));
+    pFileSystemBuild->ppOverlays = calloc(argc, sizeof(*pFileSystemBuild->ppOverlays));
+    pFileSystemBuild->ppPins = calloc(argc, sizeof(*pFileSystemBuild->ppPins));
+    if (!pFileSystemBuild->ppVolatilePatterns || 
+        !pFileSystemBuild->ppRemovePatterns || 
+        !pFileSystemBuild->ppOverlays ||
+        !pFileSystemBuild->ppPins)
+    {
+        fprintf(stderr, "error: Failed to allocate command line patterns.\n");
+        return -1;
+    }
+    
+    for (i = 1 ; i < argc ; i++)
+    {
+        const char* pArg = argv[i];
+        
+        if (0 == strcmp(pArg, "--format"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --format requires legacy or v2.\n");
+                return -1;
+            }
+            if (0 == strcmp(argv[i], "legacy"))
+            {
+                pFileSystemBuild->FormatVersion = FILE_SYSTEM_FORMAT_LEGACY;
+            }
+            else if (0 == strcmp(argv[i], "v2"))
+            {
+                pFileSystemBuild->FormatVersion = FILE_SYSTEM_FORMAT_VERSION;
+            }
+            else
+            {
+                fprintf(stderr, "error: %s isn't a supported --format.\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--target-endian"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --target-endian requires little or big.\n");
+                return -1;
+            }
+            if (0 == strcmp(argv[i], "little"))
+            {
+                TargetEndian = 0;
+            }
+            else if (0 == strcmp(argv[i], "big"))
+            {
+                TargetEndian = 1;
+            }
+            else
+            {
+                fprintf(stderr, "error: %s isn't a supported --target-endian.\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--name-prefixes"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --name-prefixes requires a prefix length.\n");
+                return -1;
+            }
+            pFileSystemBuild->NamePrefixLength = strtoul(argv[i], NULL, 0);
+            if (pFileSystemBuild->NamePrefixLength != 4 &&
+                pFileSystemBuild->NamePrefixLength != 8 &&
+                pFileSystemBuild->NamePrefixLength != 16)
+            {
+                fprintf(stderr, "error: --name-prefixes must be 4, 8 or 16.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--name-filter"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --name-filter requires the number of bits per file.\n");
+                return -1;
+            }
+            pFileSystemBuild->NameFilterBitsPerFile = strtoul(argv[i], NULL, 0);
+            if (pFileSystemBuild->NameFilterBitsPerFile < 1 ||
+                pFileSystemBuild->NameFilterBitsPerFile > 64)
+            {
+                fprintf(stderr, "error: --name-filter must be between 1 and 64 bits per file.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--metadata"))
+        {
+            pFileSystemBuild->Metadata = 1;
+        }
+        else if (0 == strcmp(pArg, "--integrity"))
+        {
+            pFileSystemBuild->Integrity = 1;
+        }
+        else if (0 == strcmp(pArg, "--merkle"))
+        {
+            char* pEnd;
+
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --merkle requires a block size.\n");
+                return -1;
+            }
+            pFileSystemBuild->MerkleBlockSize = _ParseSize(argv[i], &pEnd);
+            if (*pEnd != '\0' || pFileSystemBuild->MerkleBlockSize < MERKLE_MIN_BLOCK_SIZE || 
+                pFileSystemBuild->MerkleBlockSize > 0x80000000 ||
+                (pFileSystemBuild->MerkleBlockSize & (pFileSystemBuild->MerkleBlockSize - 1)))
+            {
+                fprintf(stderr, "error: --merkle block size must be a power of 2 from 256 bytes to 2GB.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--encrypt"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --encrypt requires a key file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pKeyFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--plaintext-tables"))
+        {
+            pFileSystemBuild->PlaintextTables = 1;
+        }
+        else if (0 == strcmp(pArg, "--verify"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_VERIFY;
+        }
+        else if (0 == strcmp(pArg, "--benchmark-reader"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_BENCHMARK_READER;
+        }
+        else if (0 == strcmp(pArg, "--inspect"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_INSPECT;
+        }
+        else if (0 == strcmp(pArg, "--extract"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_EXTRACT;
+        }
+        else if (0 == strcmp(pArg, "--compare"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --compare requires a source directory.\n");
+                return -1;
+            }
+            pFileSystemBuild->pCompareDirectory = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--depth"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --depth requires a directory depth.\n");
+                return -1;
+            }
+            pFileSystemBuild->InspectDepth = strtoul(argv[i], NULL, 0);
+        }
+        else if (0 == strcmp(pArg, "--top"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --top requires a file count.\n");
+                return -1;
+            }
+            pFileSystemBuild->InspectTopCount = strtoul(argv[i], NULL, 0);
+        }
+        else if (0 == strcmp(pArg, "--precompress"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --precompress requires gzip, brotli or gzip,brotli.\n");
+                return -1;
+            }
+            if (0 == strcmp(argv[i], "gzip"))
+            {
+                pFileSystemBuild->PrecompressEncodings = 1 << FILE_SYSTEM_ENCODING_GZIP;
+            }
+            else if (0 == strcmp(argv[i], "brotli"))
+            {
+                pFileSystemBuild->PrecompressEncodings = 1 << FILE_SYSTEM_ENCODING_BROTLI;
+            }
+            else if (0 == strcmp(argv[i], "gzip,brotli") || 0 == strcmp(argv[i], "brotli,gzip"))
+            {
+                pFileSystemBuild->PrecompressEncodings = (1 << FILE_SYSTEM_ENCODING_GZIP) | 
+                                                         (1 << FILE_SYSTEM_ENCODING_BROTLI);
+            }
+            else
+            {
+                fprintf(stderr, "error: %s isn't a supported --precompress encoding.\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--http-headers"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --http-headers requires the name of a rules file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pHttpRulesFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--benchmark-http"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --benchmark-http requires a request count.\n");
+                return -1;
+            }
+            pFileSystemBuild->BenchmarkHttpRequests = strtoul(argv[i], NULL, 0);
+        }
+        else if (0 == strcmp(pArg, "--access-profile"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --access-profile requires the name of a profile file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pAccessProfileFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--flash-geometry"))
+        {
+            if (++i >= argc || _ParseFlashGeometry(pFileSystemBuild, argv[i]))
+            {
+                fprintf(stderr, "error: --flash-geometry requires a list of SectorSize[xCount] values.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--region"))
+        {
+            if (++i >= argc || _ParseRegion(pFileSystemBuild, argv[i]))
+            {
+                fprintf(stderr, "error: --region requires a Name:Address:Capacity value.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--pin"))
+        {
+            if (++i >= argc || !strchr(argv[i], '='))
+            {
+                fprintf(stderr, "error: --pin requires a Pattern=Region value.\n");
+                return -1;
+            }
+            pFileSystemBuild->ppPins[pFileSystemBuild->PinCount++] = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--flash-offset"))
+        {
+            char* pEnd = NULL;
+            
+            if (++i >= argc || 
+                (pFileSystemBuild->FlashOffset = _ParseSize(argv[i], &pEnd), *pEnd != '\0'))
+            {
+                fprintf(stderr, "error: --flash-offset requires a FLASH address.\n");
+                return -1;
+            }
+            FlashOffsetGiven = 1;
+        }
+        else if (0 == strcmp(pArg, "--volatile"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --volatile requires a filename pattern.\n");
+                return -1;
+            }
+            pFileSystemBuild->ppVolatilePatterns[pFileSystemBuild->VolatilePatternCount++] = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--changed-files"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --changed-files requires the name of a list file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pChangedFilesFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--budget"))
+        {
+            char* pEnd = NULL;
+
+            if (++i < argc && 0 == strcmp(argv[i], "flash"))
+            {
+                BudgetIsFlashSize = 1;
+            }
+            else if (i >= argc ||
+                     (pFileSystemBuild->Budget = _ParseSize(argv[i], &pEnd), *pEnd != '\0') ||
+                     !pFileSystemBuild->Budget)
+            {
+                fprintf(stderr, "error: --budget requires an image size or flash.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--target"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --target requires the name of a target.\n");
+                return -1;
+            }
+            pTargetName = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--target-file"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --target-file requires the name of a target profile file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pTargetFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--firmware"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --firmware requires the name of a firmware binary.\n");
+                return -1;
+            }
+            pFileSystemBuild->pFirmwareFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--out"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --out requires the name of the combined binary.\n");
+                return -1;
+            }
+            pFileSystemBuild->pCombinedFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--symbols"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --symbols requires the name of a linker script.\n");
+                return -1;
+            }
+            pFileSystemBuild->pSymbolsFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--image-align"))
+        {
+            char* pEnd = NULL;
+
+            if (++i >= argc ||
+                (pFileSystemBuild->ImageAlignment = _ParseSize(argv[i], &pEnd), *pEnd != '\0') ||
+                pFileSystemBuild->ImageAlignment == 0 ||
+                (pFileSystemBuild->ImageAlignment & (pFileSystemBuild->ImageAlignment - 1)))
+            {
+                fprintf(stderr, "error: --image-align requires a power of 2.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--image-address"))
+        {
+            char* pEnd = NULL;
+
+            if (++i >= argc ||
+                (pFileSystemBuild->ImageAddress = _ParseSize(argv[i], &pEnd), *pEnd != '\0'))
+            {
+                fprintf(stderr, "error: --image-address requires a FLASH address.\n");
+                return -1;
+            }
+            ImageAddressGiven = 1;
+        }
+        else if (0 == strcmp(pArg, "--firmware-base"))
+        {
+            char* pEnd = NULL;
+
+            if (++i >= argc ||
+                (pFileSystemBuild->FirmwareBase = _ParseSize(argv[i], &pEnd), *pEnd != '\0'))
+            {
+                fprintf(stderr, "error: --firmware-base requires a FLASH address.\n");
+                return -1;
+            }
+        }
+        else if (0 == strcmp(pArg, "--hex"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --hex requires the name of an Intel HEX file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pHexFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--srec"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --srec requires the name of an S-record file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pSrecFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--record-base"))
+        {
+            char* pEnd = NULL;
+
+            if (++i >= argc ||
+                (pFileSystemBuild->RecordBase = _ParseSize(argv[i], &pEnd), *pEnd != '\0'))
+            {
+                fprintf(stderr, "error: --record-base requires a device address.\n");
+                return -1;
+            }
+            RecordBaseGiven = 1;
+        }
+        else if (0 == strcmp(pArg, "--priorities"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --priorities requires the name of a priorities file.\n");
+                return -1;
+            }
+            pFileSystemBuild->pPrioritiesFilename = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--dry-run"))
+        {
+            pFileSystemBuild->DryRun = 1;
+        }
+        else if (0 == strcmp(pArg, "--benchmark-lookups"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --benchmark-lookups requires a lookup count.\n");
+                return -1;
+            }
+            pFileSystemBuild->BenchmarkLookups = strtoul(argv[i], NULL, 0);
+        }
+        else if (0 == strcmp(pArg, "--diff"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_DIFF;
+        }
+        else if (0 == strcmp(pArg, "--apply-delta"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_APPLY_DELTA;
+        }
+        else if (0 == strcmp(pArg, "--overlay"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --overlay requires a directory or image.\n");
+                return -1;
+            }
+            pFileSystemBuild->ppOverlays[pFileSystemBuild->OverlayCount++] = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--update"))
+        {
+            pFileSystemBuild->Mode = FSBLD_MODE_UPDATE;
+        }
+        else if (0 == strcmp(pArg, "--remove"))
+        {
+            if (++i >= argc)
+            {
+                fprintf(stderr, "error: --remove requires a filename pattern.\n");
+                return -1;
+            }
+            pFileSystemBuild->ppRemovePatterns[pFileSystemBuild->RemovePatternCount++] = argv[i];
+        }
+        else if (0 == strcmp(pArg, "--compact"))
+        {
+            pFileSystemBuild->Compact = 1;
+        }
+        else if (0 == strcmp(pArg, "--compact-entries"))
+        {
+            pFileSystemBuild->CompactEntries = 1;
+        }
+        else if (pArg[0] == '-' && pArg[1] != '\0')
+        {
+            fprintf(stderr, "error: %s isn't a recognized option.\n", pArg);
+            return -1;
+        }
+        else if (ParameterCount < 3)
+        {
+            pFileSystemBuild->pParameters[ParameterCount++] = pArg;
+        }
+        else
+        {
+            fprintf(stderr, "error: Unexpected %s parameter on command line.\n", pArg);
+            return -1;
+        }
+    }
+    
+    if ((pFileSystemBuild->RemovePatternCount || pFileSystemBuild->Compact) &&
+        pFileSystemBuild->Mode != FSBLD_MODE_UPDATE)
+    {
+        fprintf(stderr, "error: --remove and --compact require --update.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->Mode == FSBLD_MODE_UPDATE)
+    {
+        if (ParameterCount < 1 || ParameterCount > 2)
+        {
+            fprintf(stderr, "error: --update requires an image and an optional changes directory.\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (pFileSystemBuild->Mode == FSBLD_MODE_VERIFY)
+    {
+        if (ParameterCount < 1 || ParameterCount > 2)
+        {
+            fprintf(stderr, "error: --verify requires an image and an optional filename.\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (pFileSystemBuild->pCompareDirectory && pFileSystemBuild->Mode != FSBLD_MODE_EXTRACT)
+    {
+        fprintf(stderr, "error: --compare requires --extract.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->Mode == FSBLD_MODE_EXTRACT)
+    {
+        if (ParameterCount != 2)
+        {
+            fprintf(stderr, "error: --extract requires an image and an output directory.\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (pFileSystemBuild->Mode == FSBLD_MODE_INSPECT)
+    {
+        if (ParameterCount != 1)
+        {
+            fprintf(stderr, "error: --inspect requires an image.\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (pFileSystemBuild->Mode == FSBLD_MODE_BENCHMARK_READER)
+    {
+        if (ParameterCount < 1 || ParameterCount > 2)
+        {
+            fprintf(stderr, "error: --benchmark-reader requires an image and an optional lookup count.\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (pFileSystemBuild->Mode != FSBLD_MODE_BUILD)
+    {
+        if (ParameterCount != 3)
+        {
+            fprintf(stderr, "error: --diff and --apply-delta require three image filenames.\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (ParameterCount > 2)
+    {
+        fprintf(stderr, "error: Unexpected %s parameter on command line.\n", pFileSystemBuild->pParameters[2]);
+        return -1;
+    }
+    pFileSystemBuild->pRootSourceDirectory = pFileSystemBuild->pParameters[0];
+    pFileSystemBuild->pOutputBinaryFilename = pFileSystemBuild->pParameters[1];
+    pFileSystemBuild->pImageFilename = pFileSystemBuild->pOutputBinaryFilename;
+    if (ParameterCount < 2)
+    {
+        fprintf(stderr, "error: Must specify both RootSourceDirectory and OutputBinaryFilename on command line.\n");
+        return -1;
+    }
+    /* Options given explicitly take precedence over the --target profile. */
+    if (pFileSystemBuild->pTargetFilename && !pTargetName)
+    {
+        fprintf(stderr, "error: --target-file requires --target.\n");
+        return -1;
+    }
+    if (pTargetName)
+    {
+        if (_FindTargetProfile(pTargetName, pFileSystemBuild->pTargetFilename, &pFileSystemBuild->Target))
+        {
+            return -1;
+        }
+        pFileSystemBuild->HaveTarget = 1;
+        if (TargetEndian < 0)
+        {
+            TargetEndian = pFileSystemBuild->Target.BigEndian;
+        }
+    }
+    pFileSystemBuild->TargetBigEndian = TargetEndian > 0;
+
+    /* The image follows the --firmware so its FLASH address is known. */
+    if (pFileSystemBuild->pFirmwareFilename && 
+        !pFileSystemBuild->pCombinedFilename && !pFileSystemBuild->pHexFilename && !pFileSystemBuild->pSrecFilename)
+    {
+        fprintf(stderr, "error: --firmware requires --out, --hex or --srec.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pCombinedFilename && !pFileSystemBuild->pFirmwareFilename)
+    {
+        fprintf(stderr, "error: --out requires --firmware.\n");
+        return -1;
+    }
+    if (!pFileSystemBuild->pFirmwareFilename && 
+        (pFileSystemBuild->pSymbolsFilename || pFileSystemBuild->ImageAlignment || 
+         ImageAddressGiven || pFileSystemBuild->FirmwareBase))
+    {
+        fprintf(stderr, "error: --image-align, --image-address, --firmware-base and --symbols require --firmware.\n");
+        return -1;
+    }
+    if (RecordBaseGiven && 
+        (pFileSystemBuild->pFirmwareFilename || (!pFileSystemBuild->pHexFilename && !pFileSystemBuild->pSrecFilename)))
+    {
+        fprintf(stderr, "error: --record-base requires --hex or --srec and can't be used with --firmware.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pFirmwareFilename)
+    {
+        if (!pFileSystemBuild->ImageAlignment)
+        {
+            pFileSystemBuild->ImageAlignment = pFileSystemBuild->HaveTarget && pFileSystemBuild->Target.Alignment > 4 ?
+                                               pFileSystemBuild->Target.Alignment : 4;
+        }
+        if (_PlaceFirmwareImage(pFileSystemBuild, ImageAddressGiven))
+        {
+            return -1;
+        }
+        if (!FlashOffsetGiven)
+        {
+            pFileSystemBuild->FlashOffset = pFileSystemBuild->ImageAddress - pFileSystemBuild->FirmwareBase;
+            FlashOffsetGiven = 1;
+        }
+        if (pFileSystemBuild->pCombinedFilename)
+        {
+            pFileSystemBuild->pImageFilename = pFileSystemBuild->pCombinedFilename;
+            pFileSystemBuild->ImageFileOffset = pFileSystemBuild->ImageAddress - pFileSystemBuild->FirmwareBase;
+        }
+    }
+
+    if (pFileSystemBuild->HaveTarget)
+    {
+        /* The image only needs to avoid sector boundaries when its address
+           in FLASH is known or files are to be updated in place. */
+        if (!pFileSystemBuild->FlashRegionCount && 
+            !pFileSystemBuild->RegionCount &&
+            pFileSystemBuild->Target.Geometry[0] &&
+            (FlashOffsetGiven || pFileSystemBuild->VolatilePatternCount || pFileSystemBuild->pChangedFilesFilename) &&
+            _ParseFlashGeometry(pFileSystemBuild, pFileSystemBuild->Target.Geometry))
+        {
+            fprintf(stderr, "error: %s has an invalid FLASH geometry.\n", pFileSystemBuild->Target.Name);
+            return -1;
+        }
+        if (!pFileSystemBuild->Budget && !pFileSystemBuild->RegionCount)
+        {
+            BudgetIsFlashSize = 1;
+        }
+    }
+    if (BudgetIsFlashSize)
+    {
+        /* Only the FLASH left after the firmware is available to the image. */
+        uint64_t FlashSize = pFileSystemBuild->HaveTarget ? pFileSystemBuild->Target.FlashSize : FILE_SYSTEM_FLASH_SIZE;
+        uint64_t Used = pFileSystemBuild->pFirmwareFilename ? pFileSystemBuild->FlashOffset : 0;
+
+        if (Used >= FlashSize)
+        {
+            fprintf(stderr, "error: There is no FLASH left for the image after the firmware.\n");
+            return -1;
+        }
+        pFileSystemBuild->Budget = FlashSize - Used;
+    }
+    if (pFileSystemBuild->CompactEntries && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --compact-entries requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->NamePrefixLength && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --name-prefixes requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->NameFilterBitsPerFile && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --name-filter requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->Metadata && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --metadata requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->Integrity && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --integrity requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->MerkleBlockSize && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --merkle requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->PrecompressEncodings && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --precompress requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pHttpRulesFilename && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --http-headers requires --format v2.\n");
+        return -1;
+    }
+    if ((pFileSystemBuild->VolatilePatternCount || pFileSystemBuild->pChangedFilesFilename) && 
+        !pFileSystemBuild->FlashRegionCount)
+    {
+        fprintf(stderr, "error: --volatile and --changed-files require --flash-geometry.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->RegionCount && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --region requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->RegionCount && 
+        (pFileSystemBuild->FlashRegionCount || 
+         pFileSystemBuild->PrecompressEncodings || 
+         pFileSystemBuild->pHttpRulesFilename))
+    {
+        fprintf(stderr, "error: --region can't be used with --flash-geometry, --precompress or --http-headers.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->PinCount && !pFileSystemBuild->RegionCount)
+    {
+        fprintf(stderr, "error: --pin requires --region.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pPrioritiesFilename && !pFileSystemBuild->Budget)
+    {
+        fprintf(stderr, "error: --priorities requires --budget.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->Budget && pFileSystemBuild->RegionCount)
+    {
+        fprintf(stderr, "error: --budget can't be used with --region, which checks the capacity of each region.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->MerkleBlockSize && pFileSystemBuild->RegionCount)
+    {
+        fprintf(stderr, "error: --merkle can't be used with --region since it only covers the first region.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pKeyFilename && 
+        pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --encrypt requires --format v2.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->PlaintextTables && !pFileSystemBuild->pKeyFilename)
+    {
+        fprintf(stderr, "error: --plaintext-tables requires --encrypt.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pKeyFilename && pFileSystemBuild->NamePrefixLength && 
+        !pFileSystemBuild->PlaintextTables)
+    {
+        fprintf(stderr, "error: --name-prefixes would reveal the encrypted filenames.  Add --plaintext-tables.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pKeyFilename && pFileSystemBuild->NameFilterBitsPerFile && 
+        !pFileSystemBuild->PlaintextTables)
+    {
+        fprintf(stderr, "error: --name-filter would reveal the encrypted filenames.  Add --plaintext-tables.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pKeyFilename && pFileSystemBuild->Metadata && 
+        !pFileSystemBuild->PlaintextTables)
+    {
+        fprintf(stderr, "error: --metadata would reveal the types and content hashes of the encrypted files.  "
+                        "Add --plaintext-tables.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pKeyFilename && pFileSystemBuild->pHttpRulesFilename && 
+        !pFileSystemBuild->PlaintextTables)
+    {
+        fprintf(stderr, "error: --http-headers would reveal the types, sizes and content hashes of the encrypted "
+                        "files.  Add --plaintext-tables.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->pKeyFilename && 
+        (pFileSystemBuild->BenchmarkLookups || pFileSystemBuild->BenchmarkHttpRequests))
+    {
+        fprintf(stderr, "error: --benchmark-lookups and --benchmark-http can't be used with --encrypt.\n");
+        return -1;
+    }
+    if (pFileSystemBuild->BenchmarkHttpRequests && !pFileSystemBuild->pHttpRulesFilename)
+    {
+        fprintf(stderr, "error: --benchmark-http requires --http-headers.\n");
+        return -1;
+    }
+#if !defined(HAVE_ZLIB)
+    if (pFileSystemBuild->PrecompressEncodings & (1 << FILE_SYSTEM_ENCODING_GZIP))
+    {
+        fprintf(stderr, "error: This build of fsbld doesn't include gzip support.\n");
+        return -1;
+    }
+#endif
+#if !defined(HAVE_BROTLI)
+    if (pFileSystemBuild->PrecompressEncodings & (1 << FILE_SYSTEM_ENCODING_BROTLI))
+    {
+        fprintf(stderr, "error: This build of fsbld doesn't include brotli support.\n");
+        return -1;
+    }
+#endif
+    
+    return 0;
+}
+
+/* Global used to record the base address of the filename buffer so that
+   the relative filenames can be found in _CompareFileEntries() */
+static const char* g_pFilenameBase;
+
+static int _CompareFileEntries(const void* pvEntry1, const void* pvEntry2)
+{
+    const SFileSystemBuildEntry* pEntry1 = (const SFileSystemBuildEntry*)pvEntry1;
+    const SFileSystemBuildEntry* pEntry2 = (const SFileSystemBuildEntry*)pvEntry2;
+    const char*                  pEntryName1 = g_pFilenameBase + pEntry1->FilenameOffset;
+    const char*                  pEntryName2 = g_pFilenameBase + pEntry2->FilenameOffset;
+    
+    return strcmp(pEntryName1, pEntryName2);
+}
+
+
+/* Finds the MIME type of a file from its extension.
+
+   Parameters:
+    pFilename is the name of the file.
+
+   Returns:
+    Index of the matching element in g_MimeTypes.
+*/
+static unsigned int _FindMimeType(const char* pFilename)
+{
+    const char*     pExtension = strrchr(pFilename, '.');
+    unsigned int    i;
+
+    if (!pExtension || strchr(pExtension, '/'))
+    {
+        return 0;
+    }
+    pExtension++;
+    for (i = 1 ; i < MIME_TYPE_COUNT ; i++)
+    {
+        if (0 == strcasecmp(pExtension, g_MimeTypes[i].pExtension))
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Iterates over the files in a directory, counting the number of files each
+   contains.  This is a recursive function that it able to find and count
+   all files in a directory hierarchy.
+   
+   Parameters:
+    pDirectoryName is the name of the directory on the PC to iterate through.
+    ImageDirectoryNameSize is the length of the corresponding directory in the
+        destination file system image.
+    pFileCount is a pointer to be filled in with the number of files found in
+        this directory tree.
+    pFilenameSize is a pointer to be filled in with the number of bytes that
+        will be needed to contain all of the filenames found in this tree.
+        
+   Returns:
+    0 on success and a positive error code otherwise 
+*/
+static int _CountFilesInDirectoryTree(const char*   pDirectoryName,
+                                      unsigned int  ImageDirectoryNameSize,
+                                      unsigned int* pFileCount,
+                                      unsigned int* pFilenameSize)
+{
+    int                 Return = 1;
+    unsigned int        DirectoryNameSize = 0;
+    unsigned int        TotalFileCount = 0;
+    unsigned int        TotalFilenameSize = 0;
+    DIR*                pDir = NULL;
+    struct dirent*      pDirEntry = NULL;
+    
+    assert ( pDirectoryName && pFileCount && pFilenameSize );
+    
+    /* Attempt to open the specified input root directory */
+    pDir = opendir(pDirectoryName);
+    if (!pDir)
+    {
+        fprintf(stderr, 
+                "error: Failed to open directory %s\n", 
+                pDirectoryName);
+        goto Error;
+    }
+
+    /* Determine the length of this directory name with trailing slash
+       separator. */
+    DirectoryNameSize = strlen(pDirectoryName);
+    
+    /* Iterate through the files in the directory and determine size of
+       data to be allocated to track these files. */
+    while(NULL != (pDirEntry = readdir(pDir)))
+    {
+        if (DT_DIR == pDirEntry->d_type)
+        {
+            /* Skip . and .. directories */
+            if (0 != strcmp(pDirEntry->d_name, ".") &&
+                0 != strcmp(pDirEntry->d_name, ".."))
+            {
+                /* Recurse into subdirectories. */
+                int          Result = 1;
+                unsigned int FileCount = 0;
+                unsigned int FilenameSize = 0;
+                char         SubdirectoryName[512];
+            
+                /* Make sure that the complete pathname for this subdirectory will
+                   fit in the SubdirectoryName buffer. */
+                if (DirectoryNameSize + 1 + DIRENT_NAME_LENGTH(pDirEntry) > 
+                    (sizeof(SubdirectoryName) - 1))
+                {
+                    fprintf(stderr,
+                            "error: %s/%s pathname is too long.\n",
+                            pDirectoryName,
+                            pDirEntry->d_name);
+                    goto Error;
+                }
+            
+                /* Create complete pathname. */
+                snprintf(SubdirectoryName, sizeof(SubdirectoryName), 
+                         "%s/%s",
+                         pDirectoryName,
+                         pDirEntry->d_name);
+            
+                /* Recurse into this directory and gets its counts. */
+                Result = _CountFilesInDirectoryTree(SubdirectoryName,
+                                                    ImageDirectoryNameSize + 
+                                                      DIRENT_NAME_LENGTH(pDirEntry) + 1,
+                                                    &FileCount,
+                                                    &FilenameSize);
+                if (Result)
+                {
+                    Return = Result;
+                    goto Error;
+                }
+                TotalFileCount += FileCount;
+                TotalFilenameSize += FilenameSize;
+            }
+        }
+        else
+        {
+            /* Update size statistics based on data for this file. */
+            TotalFileCount++;
+            TotalFilenameSize += ImageDirectoryNameSize + DIRENT_NAME_LENGTH(pDirEntry) + 1;
+        }
+    }
+    
+    /* Update counters. */
+    *pFileCount = TotalFileCount;
+    *pFilenameSize = TotalFilenameSize;
+
+    Return = 0;
+Error:
+    if(pDir)
+    {
+        closedir(pDir);
+        pDir = NULL;
+    }
+
+    return Return;
+}
+
+
+/* Recursively iterates over the files in a directory, populating the file 
+   entries.
+   
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+    pDirectoryName is the name of the directory on the PC to iterate through.
+    pImageDirectoryName is the name of the directory in the destination file 
+        system image.
+        
+   Returns:
+    0 on success and a positive error code otherwise 
+*/
+static int _PopulateEntriesFromDirectoryTree(SFileSystemBuild* pFileSystemBuild,
+                                             const char*       pDirectoryName,
                                              const char*       pImageDirectoryName)
 {
-    int                 Return = 1;
-    unsigned int        DirectoryNameSize = 0;
-    unsigned int        ImageDirectoryNameSize = 0;
-    DIR*                pDir = NULL;
-    struct dirent*      pDirEntry = NULL;
-    
-    assert ( pFileSystemBuild && 
-             pDirectoryName && 
-             pImageDirectoryName );
-    
-    /* Attempt to open the specified input root directory */
-    pDir = opendir(pDirectoryName);
-    if (!pDir)
+    int                 Return = 1;
+    unsigned int        DirectoryNameSize = 0;
+    unsigned int        ImageDirectoryNameSize = 0;
+    DIR*                pDir = NULL;
+    struct dirent*      pDirEntry = NULL;
+    
+    assert ( pFileSystemBuild && 
+             pDirectoryName && 
+             pImageDirectoryName );
+    
+    /* Attempt to open the specified input root directory */
+    pDir = opendir(pDirectoryName);
+    if (!pDir)
+    {
+        fprintf(stderr, 
+                "error: Failed to open directory %s\n", 
+                pDirectoryName);
+        goto Error;
+    }
+
+    /* Determine the length of this directory name with trailing slash
+       separator. */
+    DirectoryNameSize = strlen(pDirectoryName);
+    ImageDirectoryNameSize = strlen(pImageDirectoryName);
+    
+    /* Iterate through the files in the directory and fill in the file system
+       entries. */
+    while(NULL != (pDirEntry = readdir(pDir)))
+    {
+        if (DT_DIR == pDirEntry->d_type)
+        {
+            /* Skip . and .. directories */
+            if (0 != strcmp(pDirEntry->d_name, ".") &&
+                0 != strcmp(pDirEntry->d_name, ".."))
+            {
+                /* Recurse into subdirectories. */
+                int          Result = 1;
+                char         SubdirectoryName[512];
+                char         ImageSubdirectoryName[512];
+            
+                /* Make sure that the complete pathname for this subdirectory will
+                   fit in the buffers. */
+                if (DirectoryNameSize + 1 + DIRENT_NAME_LENGTH(pDirEntry) > 
+                    (sizeof(SubdirectoryName) - 1))
+                {
+                    fprintf(stderr,
+                            "error: %s/%s pathname is too long.\n",
+                            pDirectoryName,
+                            pDirEntry->d_name);
+                    goto Error;
+                }
+                if (ImageDirectoryNameSize + DIRENT_NAME_LENGTH(pDirEntry) + 1 >
+                    sizeof(ImageSubdirectoryName) - 1)
+                {
+                    fprintf(stderr,
+                            "error: %s%s/ pathname is too long.\n",
+                            pImageDirectoryName,
+                            pDirEntry->d_name);
+                    goto Error;
+                }
+            
+                /* Create complete pathnames. */
+                snprintf(SubdirectoryName, sizeof(SubdirectoryName), 
+                         "%s/%s",
+                         pDirectoryName,
+                         pDirEntry->d_name);
+                snprintf(ImageSubdirectoryName, sizeof(ImageSubdirectoryName), 
+                         "%s%s/",
+                         pImageDirectoryName,
+                         pDirEntry->d_name);
+            
+                /* Recurse into this directory and gets its counts. */
+                Result = _PopulateEntriesFromDirectoryTree(pFileSystemBuild,
+                                                           SubdirectoryName,
+                                                           ImageSubdirectoryName);
+                if (Result)
+                {
+                    Return = Result;
+                    goto Error;
+                }
+            }
+        }
+        else
+        {
+            unsigned int FilenameLength;
+            char         SourceFilename[1024];
+            struct stat  SourceStat;
+        
+            /* Make sure that we didn't encounter more files during the second
+               iteration. */
+            if (0 == pFileSystemBuild->FilesLeft--)
+            {
+                fprintf(stderr, 
+                        "error: File contents of %s appear to have changed while creating file system image.\n", 
+                        pFileSystemBuild->pRootSourceDirectory);
+                goto Error;
+            }
+        
+            /* Determine the size of the file now so that the complete image
+               layout can be checked before any of it is written. */
+            if (DirectoryNameSize + 1 + DIRENT_NAME_LENGTH(pDirEntry) > 
+                (sizeof(SourceFilename) - 1))
+            {
+                fprintf(stderr,
+                        "error: %s/%s pathname is too long.\n",
+                        pDirectoryName,
+                        pDirEntry->d_name);
+                goto Error;
+            }
+            snprintf(SourceFilename, sizeof(SourceFilename), 
+                     "%s/%s",
+                     pDirectoryName,
+                     pDirEntry->d_name);
+            if (stat(SourceFilename, &SourceStat))
+            {
+                fprintf(stderr, "error: Failed to determine file size of %s\n",
+                        SourceFilename);
+                goto Error;
+            }
+        
+            /* Fill in the directory structure for this file.  Can only default 
+               the binary start offset since the layout hasn't been planned
+               yet. */
+            pFileSystemBuild->pCurrEntry->FilenameOffset = pFileSystemBuild->CurrFilenameOffset;
+            pFileSystemBuild->pCurrEntry->FileBinaryOffset = ~(uint64_t)0;
+            pFileSystemBuild->pCurrEntry->FileBinarySize = SourceStat.st_size;
+            pFileSystemBuild->pCurrEntry->ModificationTime = SourceStat.st_mtime;
+            pFileSystemBuild->pCurrEntry->Mode = SourceStat.st_mode & 07777;
+            pFileSystemBuild->pCurrEntry->MimeType = _FindMimeType(pDirEntry->d_name);
+            pFileSystemBuild->pCurrEntry->ContentHash = 0;
+            pFileSystemBuild->pCurrEntry->Crc32c = 0;
+            pFileSystemBuild->pCurrEntry->HttpHeaderSize = 0;
+            pFileSystemBuild->pCurrEntry->Volatile = 0;
+            pFileSystemBuild->pCurrEntry->Layer = 0;
+            pFileSystemBuild->pCurrEntry->SourceOffset = 0;
+            pFileSystemBuild->pCurrEntry->Region = 0;
+
+            /* Make sure that we aren't going to overflow the filename buffer */
+            FilenameLength = ImageDirectoryNameSize + DIRENT_NAME_LENGTH(pDirEntry) + 1; /* Copy NULL terminator as well. */
+            if ((pFileSystemBuild->CurrFilenameOffset + FilenameLength) > pFileSystemBuild->FilenameBufferSize)
+            {
+                fprintf(stderr, 
+                        "error: File contents of %s appear to have changed while creating file system image.\n", 
+                        pFileSystemBuild->pRootSourceDirectory);
+                goto Error;
+            }
+        
+            /* Copy the filename into the filename buffer. */
+            memcpy(pFileSystemBuild->pCurrFilename, pImageDirectoryName, ImageDirectoryNameSize);
+            memcpy(pFileSystemBuild->pCurrFilename + ImageDirectoryNameSize, pDirEntry->d_name, DIRENT_NAME_LENGTH(pDirEntry) + 1);
+
+            /* Update the pointers */
+            pFileSystemBuild->pCurrFilename += FilenameLength;
+            pFileSystemBuild->CurrFilenameOffset += FilenameLength;
+            pFileSystemBuild->pCurrEntry++;
+        }
+    }
+    
+    Return = 0;
+Error:
+    if(pDir)
+    {
+        closedir(pDir);
+        pDir = NULL;
+    }
+
+    return Return;
+}
+
+
+/* Creates a list of files to be placed in the file syste image based on the
+   contents of the user supplied root source directory.  Since this function
+   needs to allocate buffers to list out the source files, it needs to know
+   suitable sizes for the allocations before populating them, this function
+   runs two passes through the directory list: first to calculate the required
+   size of the buffers; second fill in the newly allocated buffers.
+   
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+        
+   Returns:
+    0 on success and a positive error code otherwise 
+*/
+static int _CreateFileList(SFileSystemBuild* pFileSystemBuild)
+{
+    int                 Return = 1;
+    int                 Result = 1;
+    unsigned int        TotalFilenameSize = 0;
+    unsigned int        TotalFileCount = 0;
+
+    assert ( pFileSystemBuild && pFileSystemBuild->pRootSourceDirectory);
+
+    /* Display information about the enumeration process to be conducted by
+       this procedure. */
+    printf("Enumerating the contents of the %s directory to be placed in "
+           "the file system image...\n",
+           pFileSystemBuild->pRootSourceDirectory);
+    
+    /* Iterate through the files in the directory and determine size of
+       data to be allocated to track these files. */
+    Result = _CountFilesInDirectoryTree(pFileSystemBuild->pRootSourceDirectory,
+                                        0,
+                                        &TotalFileCount,
+                                        &TotalFilenameSize);
+    if (Result)
+    {
+        Return = Result;
+        goto Error;
+    }
+    pFileSystemBuild->FileCount = TotalFileCount;
+    pFileSystemBuild->FilenameBufferSize = TotalFilenameSize;
+    
+    /* Allocate the buffers to record the file list information. */
+    pFileSystemBuild->pFilenameBuffer = malloc(TotalFilenameSize);
+    if (!pFileSystemBuild->pFilenameBuffer)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %u bytes for filename buffer.\n", 
+                TotalFilenameSize);
+        goto Error;
+    }
+    pFileSystemBuild->pFileEntries = malloc(sizeof(pFileSystemBuild->pFileEntries[0]) * 
+                                            TotalFileCount);
+    if (!pFileSystemBuild->pFileEntries)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %u file entry descriptors.\n", 
+                TotalFileCount);
+        goto Error;
+    }
+    
+    /* Initialize the state used while filling in the file system entries. */
+    pFileSystemBuild->CurrFilenameOffset = 0;
+    pFileSystemBuild->pCurrEntry = pFileSystemBuild->pFileEntries;
+    pFileSystemBuild->pCurrFilename = pFileSystemBuild->pFilenameBuffer;
+    pFileSystemBuild->FilesLeft = TotalFileCount;
+
+    /* Iterate through the files in the directory tree again and fill in the
+       structures that were just allocated. */
+    Result = _PopulateEntriesFromDirectoryTree(pFileSystemBuild,
+                                               pFileSystemBuild->pRootSourceDirectory,
+                                               "");
+    if (Result)
+    {
+        Return = Result;
+        goto Error;
+    }
+
+    /* Make sure that we didn't encounter fewer files during the second
+       iteration. */
+    if (0 != pFileSystemBuild->FilesLeft)
+    {
+        fprintf(stderr, 
+                "error: File contents of %s appear to have changed while creating file system image.\n", 
+                pFileSystemBuild->pRootSourceDirectory);
+        goto Error;
+    }
+                                                      
+    /* Sort the file entries in case sensitive order. */
+    g_pFilenameBase = pFileSystemBuild->pFilenameBuffer;
+    qsort(pFileSystemBuild->pFileEntries, 
+          pFileSystemBuild->FileCount,
+          sizeof(pFileSystemBuild->pFileEntries[0]),
+          _CompareFileEntries);
+          
+    Return = 0;
+Error:
+
+    return Return;
+}
+
+
+/* Determines the byte order of the machine running fsbld.
+
+   Returns:
+    Non-zero if the host stores multi-byte values most significant byte
+    first.
+*/
+static int _IsHostBigEndian(void)
+{
+    const uint16_t  Value = 0x0102;
+
+    return *(const unsigned char*)&Value == 0x01;
+}
+
+
+/* Simple xorshift generator so that benchmarks and filter measurements are
+   repeatable. */
+static uint32_t _NextRandom(uint32_t* pState)
+{
+    uint32_t State = *pState;
+
+    State ^= State << 13;
+    State ^= State >> 17;
+    State ^= State << 5;
+    *pState = State;
+
+    return State;
+}
+
+
+/* Finds a filename in the sorted file list.
+
+   Returns:
+    The index of the file in pFileSystemBuild->pFileEntries or -1 if it isn't
+    in the list.
+*/
+static int _FindFileInList(const SFileSystemBuild* pFileSystemBuild, const char* pFilename)
+{
+    unsigned int Low = 0;
+    unsigned int High = pFileSystemBuild->FileCount;
+
+    while (Low < High)
+    {
+        unsigned int Middle = Low + (High - Low) / 2;
+        int          Order = strcmp(pFilename, 
+                                    pFileSystemBuild->pFilenameBuffer + 
+                                    pFileSystemBuild->pFileEntries[Middle].FilenameOffset);
+
+        if (Order == 0)
+        {
+            return (int)Middle;
+        }
+        else if (Order < 0)
+        {
+            High = Middle;
+        }
+        else
+        {
+            Low = Middle + 1;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Determines whether a filename is in the sorted file list. */
+static int _IsFileInList(const SFileSystemBuild* pFileSystemBuild, const char* pFilename)
+{
+    return _FindFileInList(pFileSystemBuild, pFilename) >= 0;
+}
+
+
+/* Builds the Bloom filter over the sorted filenames for the
+   FILE_SYSTEM_SECTION_NAME_FILTER section and measures its false positive rate
+   with filenames which are known not to be in the image.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CreateNameFilter(SFileSystemBuild* pFileSystemBuild)
+{
+    const unsigned int      ProbeCount = 100000;
+    SFileSystemBuildEntry*  pEntry = NULL;
+    uint64_t                FilterBits;
+    unsigned int            HashCount;
+    unsigned int            FalsePositives = 0;
+    unsigned int            Misses = 0;
+    uint32_t                Random = 0x9E3779B9;
+    unsigned int            i;
+
+    if (!pFileSystemBuild->NameFilterBitsPerFile || !pFileSystemBuild->FileCount)
+    {
+        return 0;
+    }
+
+    /* Since all of a filename's bits land in one word, the best number of
+       hashes is lower than the usual 0.69 * bits per file.  2 + bits / 6 is
+       within a few percent of optimal and at most 6 fit in the 30 bits of a
+       mixed hash. */
+    HashCount = (unsigned int)(2 + pFileSystemBuild->NameFilterBitsPerFile / 6.0 + 0.5);
+    if (HashCount < 1)
+    {
+        HashCount = 1;
+    }
+    else if (HashCount > 6)
+    {
+        HashCount = 6;
+    }
+    FilterBits = (uint64_t)pFileSystemBuild->NameFilterBitsPerFile * pFileSystemBuild->FileCount;
+    pFileSystemBuild->NameFilterWordCount = (unsigned int)((FilterBits + 31) / 32);
+    pFileSystemBuild->NameFilterHashCount = HashCount;
+    pFileSystemBuild->pNameFilter = calloc(pFileSystemBuild->NameFilterWordCount, sizeof(uint32_t));
+    if (!pFileSystemBuild->pNameFilter)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %u words for filename filter.\n", 
+                pFileSystemBuild->NameFilterWordCount);
+        return 1;
+    }
+
+    pEntry = pFileSystemBuild->pFileEntries;
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        uint32_t Hash = FsReaderHashFilename(pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset);
+
+        pFileSystemBuild->pNameFilter[Hash % pFileSystemBuild->NameFilterWordCount] |= 
+            FsReaderGetFilterBits(Hash, HashCount);
+    }
+
+    /* Probe with variations of real filenames since misses in practice look
+       a lot like the files which are present. */
+    for (i = 0 ; i < ProbeCount ; i++)
+    {
+        char        Probe[1024];
+        const char* pFilename;
+
+        pEntry = &pFileSystemBuild->pFileEntries[_NextRandom(&Random) % pFileSystemBuild->FileCount];
+        pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+        snprintf(Probe, sizeof(Probe), "%s.%u", pFilename, (unsigned int)(_NextRandom(&Random) % 1000));
+        if (_IsFileInList(pFileSystemBuild, Probe))
+        {
+            continue;
+        }
+        Misses++;
+        if (FsReaderTestNameFilter((const unsigned char*)pFileSystemBuild->pNameFilter, 
+                                   pFileSystemBuild->NameFilterWordCount, HashCount, _IsHostBigEndian(), Probe))
+        {
+            FalsePositives++;
+        }
+    }
+
+    printf("Filename filter: %lu bytes (%u bits per file, %u hashes), %.3f%% false positive rate.\n",
+           (unsigned long)(pFileSystemBuild->NameFilterWordCount * sizeof(uint32_t)),
+           pFileSystemBuild->NameFilterBitsPerFile,
+           HashCount,
+           Misses ? 100.0 * FalsePositives / Misses : 0.0);
+
+    return 0;
+}
+
+
+/* Returns the current time in nanoseconds for benchmarking. */
+static uint64_t _GetTimeInNanoseconds(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return (uint64_t)Time.tv_sec * 1000000000 + Time.tv_nsec;
+}
+
+
+/* Hashes one block of the image into a leaf of the Merkle tree. */
+static void _HashMerkleLeaf(const unsigned char* pBlock, size_t Size, unsigned char* pHash)
+{
+    static const unsigned char  Prefix = FILE_SYSTEM_MERKLE_LEAF_PREFIX;
+    SSha256                     Sha;
+
+    Sha256Init(&Sha);
+    Sha256Update(&Sha, &Prefix, sizeof(Prefix));
+    Sha256Update(&Sha, pBlock, Size);
+    Sha256Final(&Sha, pHash);
+}
+
+
+/* Hashes two sibling nodes of the Merkle tree into their parent. */
+static void _HashMerkleNode(const unsigned char* pLeft, const unsigned char* pRight, unsigned char* pHash)
+{
+    static const unsigned char  Prefix = FILE_SYSTEM_MERKLE_NODE_PREFIX;
+    SSha256                     Sha;
+
+    Sha256Init(&Sha);
+    Sha256Update(&Sha, &Prefix, sizeof(Prefix));
+    Sha256Update(&Sha, pLeft, MERKLE_HASH_SIZE);
+    Sha256Update(&Sha, pRight, MERKLE_HASH_SIZE);
+    Sha256Final(&Sha, pHash);
+}
+
+
+/* Counts the nodes in all levels of a Merkle tree.
+
+   Parameters:
+    LeafCount is the number of blocks hashed into the tree.
+    pLevelCount is a pointer to be filled in with the number of levels.
+
+   Returns:
+    The number of nodes, including the leaves and the root.
+*/
+static uint64_t _CountMerkleNodes(uint64_t LeafCount, unsigned int* pLevelCount)
+{
+    uint64_t        NodeCount = LeafCount;
+    unsigned int    LevelCount = 1;
+
+    while (LeafCount > 1)
+    {
+        LeafCount = (LeafCount + 1) / 2;
+        NodeCount += LeafCount;
+        LevelCount++;
+    }
+    *pLevelCount = LevelCount;
+
+    return NodeCount;
+}
+
+
+/* Fills in the levels of a Merkle tree above its leaves, which are already
+   at the start of pTree.  The root ends up in the last node. */
+static void _BuildMerkleLevels(unsigned char* pTree, uint64_t LeafCount)
+{
+    unsigned char*  pLevel = pTree;
+    uint64_t        i;
+
+    while (LeafCount > 1)
+    {
+        unsigned char* pNext = pLevel + LeafCount * MERKLE_HASH_SIZE;
+
+        for (i = 0 ; i + 1 < LeafCount ; i += 2)
+        {
+            _HashMerkleNode(pLevel + i * MERKLE_HASH_SIZE, pLevel + (i + 1) * MERKLE_HASH_SIZE,
+                            pNext + (i / 2) * MERKLE_HASH_SIZE);
+        }
+        if (LeafCount & 1)
+        {
+            memcpy(pNext + (LeafCount / 2) * MERKLE_HASH_SIZE, pLevel + (LeafCount - 1) * MERKLE_HASH_SIZE,
+                   MERKLE_HASH_SIZE);
+        }
+        pLevel = pNext;
+        LeafCount = (LeafCount + 1) / 2;
+    }
+}
+
+
+/* Range of Merkle tree leaves hashed by one _MerkleLeafThread(). */
+typedef struct _SMerkleWork
+{
+    const unsigned char* pImage;
+    uint64_t            CoveredSize;
+    uint64_t            BlockSize;
+    unsigned char*      pLeaves;
+    uint64_t            FirstLeaf;
+    uint64_t            LeafCount;
+} SMerkleWork;
+
+
+static void* _MerkleLeafThread(void* pvWork)
+{
+    const SMerkleWork*  pWork = (const SMerkleWork*)pvWork;
+    uint64_t            i;
+
+    for (i = pWork->FirstLeaf ; i < pWork->FirstLeaf + pWork->LeafCount ; i++)
+    {
+        uint64_t Offset = i * pWork->BlockSize;
+        uint64_t Size = pWork->CoveredSize - Offset;
+
+        _HashMerkleLeaf(pWork->pImage + Offset, (size_t)(Size < pWork->BlockSize ? Size : pWork->BlockSize),
+                        pWork->pLeaves + i * MERKLE_HASH_SIZE);
+    }
+
+    return NULL;
+}
+
+
+/* Hashes every block of an image into the leaves of its Merkle tree, with
+   the blocks split evenly across one thread per processor.
+
+   Parameters:
+    pImage points to the image.
+    CoveredSize is the number of bytes of the image covered by the tree.
+    BlockSize is the size of each block.
+    pLeaves is filled in with the hash of each block.
+
+   Returns:
+    The number of threads used.
+*/
+static unsigned int _HashMerkleLeaves(const unsigned char* pImage, uint64_t CoveredSize, uint64_t BlockSize,
+                                      unsigned char* pLeaves)
+{
+    SMerkleWork     Work[64];
+    pthread_t       Threads[64];
+    uint64_t        LeafCount = (CoveredSize + BlockSize - 1) / BlockSize;
+    uint64_t        FirstLeaf = 0;
+    unsigned int    ThreadCount;
+    unsigned int    Started;
+    unsigned int    i;
+    long            ProcessorCount;
+
+    ProcessorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    ThreadCount = ProcessorCount > 0 ? (unsigned int)ProcessorCount : 1;
+    if (ThreadCount > sizeof(Threads) / sizeof(Threads[0]))
+    {
+        ThreadCount = sizeof(Threads) / sizeof(Threads[0]);
+    }
+    if (ThreadCount > LeafCount)
+    {
+        ThreadCount = LeafCount ? (unsigned int)LeafCount : 1;
+    }
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        Work[i].pImage = pImage;
+        Work[i].CoveredSize = CoveredSize;
+        Work[i].BlockSize = BlockSize;
+        Work[i].pLeaves = pLeaves;
+        Work[i].FirstLeaf = FirstLeaf;
+        Work[i].LeafCount = (LeafCount - FirstLeaf) / (ThreadCount - i);
+        FirstLeaf += Work[i].LeafCount;
+    }
+
+    /* The first range is hashed on this thread, along with those of any
+       threads which fail to start. */
+    for (Started = 1 ; Started < ThreadCount ; Started++)
+    {
+        if (pthread_create(&Threads[Started], NULL, _MerkleLeafThread, &Work[Started]))
+        {
+            break;
+        }
+    }
+    for (i = Started ; i < ThreadCount ; i++)
+    {
+        _MerkleLeafThread(&Work[i]);
+    }
+    _MerkleLeafThread(&Work[0]);
+    for (i = 1 ; i < Started ; i++)
+    {
+        pthread_join(Threads[i], NULL);
+    }
+
+    return ThreadCount;
+}
+
+
+/* Reads the --encrypt key file, which holds either the raw 16 or 32 byte key
+   or the same number of bytes as hex digits, and picks a random nonce for
+   the image.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _LoadEncryptionKey(SFileSystemBuild* pFileSystemBuild)
+{
+    int             Return = 1;
+    FILE*           pFile = NULL;
+    unsigned char   Contents[129];
+    unsigned char   Key[32];
+    size_t          ContentsSize;
+    size_t          KeySize = 0;
+    size_t          i;
+
+    if (!pFileSystemBuild->pKeyFilename)
+    {
+        return 0;
+    }
+
+    pFile = fopen(pFileSystemBuild->pKeyFilename, "rb");
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to open key file %s.\n", pFileSystemBuild->pKeyFilename);
+        goto Error;
+    }
+    ContentsSize = fread(Contents, 1, sizeof(Contents), pFile);
+    fclose(pFile);
+    pFile = NULL;
+
+    /* Hex digits with any whitespace between them are preferred since a raw
+       key is very unlikely to be made only of them. */
+    if (ContentsSize < sizeof(Contents))
+    {
+        unsigned int Digits = 0;
+
+        for (i = 0 ; i < ContentsSize ; i++)
+        {
+            int Value;
+
+            if (isspace(Contents[i]))
+            {
+                continue;
+            }
+            if (!isxdigit(Contents[i]) || Digits >= 2 * sizeof(Key))
+            {
+                break;
+            }
+            Value = isdigit(Contents[i]) ? Contents[i] - '0' : (tolower(Contents[i]) - 'a' + 10);
+            Key[Digits / 2] = (unsigned char)((Digits & 1) ? (Key[Digits / 2] << 4) | Value : Value);
+            Digits++;
+        }
+        if (i == ContentsSize && (Digits == 32 || Digits == 64))
+        {
+            KeySize = Digits / 2;
+        }
+    }
+    if (!KeySize && (ContentsSize == 16 || ContentsSize == 32))
+    {
+        memcpy(Key, Contents, ContentsSize);
+        KeySize = ContentsSize;
+    }
+    if (!KeySize)
+    {
+        fprintf(stderr, 
+                "error: %s should hold a 128 or 256-bit key as raw bytes or hex digits.\n", 
+                pFileSystemBuild->pKeyFilename);
+        goto Error;
+    }
+    AesExpandKey(&pFileSystemBuild->Aes, Key, (unsigned int)KeySize * 8);
+
+    /* A fresh nonce for every build keeps two builds with the same key from
+       ever sharing keystream. */
+    pFile = fopen("/dev/urandom", "rb");
+    if (!pFile || 
+        1 != fread(pFileSystemBuild->Aes.Nonce, sizeof(pFileSystemBuild->Aes.Nonce), 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to read a random nonce from /dev/urandom.\n");
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    memset(Key, 0, sizeof(Key));
+    memset(Contents, 0, sizeof(Contents));
+    if (pFile)
+    {
+        fclose(pFile);
+        pFile = NULL;
+    }
+    return Return;
+}
+
+
+/* Reads the --http-headers rules file.  Each line holds an fnmatch() pattern
+   followed by the Cache-Control value to be used for files which match it.
+   The first matching rule wins.  Blank lines and lines starting with # are
+   ignored.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _LoadHttpRules(SFileSystemBuild* pFileSystemBuild)
+{
+    char*           pLine;
+    unsigned int    MaxRules = 0;
+    unsigned int    LineNumber = 0;
+
+    if (!pFileSystemBuild->pHttpRulesFilename)
+    {
+        return 0;
+    }
+
+    /* There can't be more rules than lines. */
+    pFileSystemBuild->pHttpRulesBuffer = _LoadTextFile(pFileSystemBuild->pHttpRulesFilename, &MaxRules);
+    if (!pFileSystemBuild->pHttpRulesBuffer)
+    {
+        return 1;
+    }
+    pFileSystemBuild->pHttpRules = calloc(MaxRules, sizeof(*pFileSystemBuild->pHttpRules));
+    if (!pFileSystemBuild->pHttpRules)
+    {
+        fprintf(stderr, "error: Failed to allocate %u HTTP rules.\n", MaxRules);
+        return 1;
+    }
+
+    /* Split each line into its pattern and value in place. */
+    pLine = pFileSystemBuild->pHttpRulesBuffer;
+    while (*pLine)
+    {
+        char*   pNext = pLine + strcspn(pLine, "\n");
+        char*   pEnd;
+        char*   pValue;
+
+        LineNumber++;
+        if (*pNext)
+        {
+            *pNext++ = '\0';
+        }
+        pEnd = pLine + strlen(pLine);
+        while (pEnd > pLine && (pEnd[-1] == ' ' || pEnd[-1] == '\t' || pEnd[-1] == '\r'))
+        {
+            *--pEnd = '\0';
+        }
+        pLine += strspn(pLine, " \t");
+        if (*pLine && *pLine != '#')
+        {
+            SHttpRule* pRule = &pFileSystemBuild->pHttpRules[pFileSystemBuild->HttpRuleCount++];
+
+            pValue = pLine + strcspn(pLine, " \t");
+            if (*pValue)
+            {
+                *pValue++ = '\0';
+                pValue += strspn(pValue, " \t");
+            }
+            if (!*pValue || strlen(pValue) > HTTP_HEADER_MAX_SIZE / 2)
+            {
+                fprintf(stderr, "error: %s:%u: Expected a pattern followed by a Cache-Control value.\n",
+                        pFileSystemBuild->pHttpRulesFilename, LineNumber);
+                return 1;
+            }
+            pRule->pPattern = pLine;
+            pRule->pCacheControl = pValue;
+        }
+        pLine = pNext;
+    }
+
+    return 0;
+}
+
+
+/* Finds the Cache-Control value of the first rule which matches a filename.
+
+   Returns:
+    The Cache-Control value or NULL if no rule matches, in which case the
+    header is left out.
+*/
+static const char* _FindCacheControl(const SFileSystemBuild* pFileSystemBuild, const char* pFilename)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < pFileSystemBuild->HttpRuleCount ; i++)
+    {
+        if (0 == fnmatch(pFileSystemBuild->pHttpRules[i].pPattern, pFilename, 0))
+        {
+            return pFileSystemBuild->pHttpRules[i].pCacheControl;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Formats the HTTP response header which is sent in front of a file.  This is
+   used both to render the headers into the image and, by --benchmark-http, to
+   time what the device would otherwise do for every request.  The ETag is
+   always 16 hex digits so the size of the header doesn't depend on the
+   hash.
+
+   Parameters:
+    pBuffer is the buffer to be filled in with the header.
+    BufferSize is the size of pBuffer in bytes.
+    pMimeType is the value of the Content-Type header.
+    ContentLength is the number of bytes which follow the header.
+    ContentHash is the hash of those bytes, used for the ETag.
+    pCacheControl is the value of the Cache-Control header or NULL.
+    Encoding is the FILE_SYSTEM_ENCODING_* value of the bytes or 0 if they
+        aren't compressed.
+    Vary is non-zero if the file has precompressed variants, so that caches
+        are told that the response depends on Accept-Encoding.
+
+   Returns:
+    The length of the header or 0 if it doesn't fit in pBuffer.
+*/
+static unsigned int _RenderHttpHeader(char*       pBuffer,
+                                      size_t      BufferSize,
+                                      const char* pMimeType,
+                                      uint64_t    ContentLength,
+                                      uint64_t    ContentHash,
+                                      const char* pCacheControl,
+                                      unsigned int Encoding,
+                                      int         Vary)
+{
+    int Length;
+
+    Length = snprintf(pBuffer, BufferSize,
+                      "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Length: %llu\r\n"
+                      "ETag: \"%016llx\"\r\n"
+                      "%s%s%s"
+                      "%s%s"
+                      "\r\n",
+                      pMimeType,
+                      (unsigned long long)ContentLength,
+                      (unsigned long long)ContentHash,
+                      pCacheControl ? "Cache-Control: " : "",
+                      pCacheControl ? pCacheControl : "",
+                      pCacheControl ? "\r\n" : "",
+                      Encoding == FILE_SYSTEM_ENCODING_GZIP ? "Content-Encoding: gzip\r\n" :
+                      Encoding == FILE_SYSTEM_ENCODING_BROTLI ? "Content-Encoding: br\r\n" : "",
+                      Vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (Length < 0 || (size_t)Length >= BufferSize)
+    {
+        return 0;
+    }
+
+    return (unsigned int)Length;
+}
+
+
+/* Determines whether an entry has any precompressed variants, which are
+   sorted by EntryIndex.
+
+   Returns:
+    Non-zero if at least one variant was kept for the entry.
+*/
+static int _EntryHasVariants(const SFileSystemBuild* pFileSystemBuild, unsigned int EntryIndex)
+{
+    unsigned int Low = 0;
+    unsigned int High = pFileSystemBuild->VariantCount;
+
+    while (Low < High)
+    {
+        unsigned int Middle = Low + (High - Low) / 2;
+
+        if (pFileSystemBuild->pVariants[Middle].EntryIndex < EntryIndex)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    return Low < pFileSystemBuild->VariantCount && pFileSystemBuild->pVariants[Low].EntryIndex == EntryIndex;
+}
+
+
+/* Renders the HTTP response header of an entry, or of one of its
+   precompressed variants if pVariant isn't NULL.  The identity response of
+   an entry with variants carries Vary: Accept-Encoding as well.
+
+   Returns:
+    The length of the header.
+*/
+static unsigned int _RenderEntryHttpHeader(const SFileSystemBuild*        pFileSystemBuild,
+                                           const SFileSystemBuildEntry*   pEntry,
+                                           const SFileSystemBuildVariant* pVariant,
+                                           char*                          pBuffer)
+{
+    const char* pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+
+    return _RenderHttpHeader(pBuffer, HTTP_HEADER_MAX_SIZE,
+                             g_MimeTypes[pEntry->MimeType].pMimeType,
+                             pVariant ? pVariant->Size : pEntry->FileBinarySize,
+                             pVariant ? FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS,
+                                                             pVariant->pData, pVariant->Size)
+                                      : pEntry->ContentHash,
+                             _FindCacheControl(pFileSystemBuild, pFilename),
+                             pVariant ? pVariant->Encoding : 0,
+                             pVariant ||
+                                _EntryHasVariants(pFileSystemBuild,
+                                                  (unsigned int)(pEntry - pFileSystemBuild->pFileEntries)));
+}
+
+
+/* Determines the size of the HTTP response header of each entry and variant
+   so that room can be left for them in front of the data.  The content
+   lengths and variants are already known and the hashes don't change the
+   size. */
+static void _SizeHttpHeaders(SFileSystemBuild* pFileSystemBuild)
+{
+    char            Header[HTTP_HEADER_MAX_SIZE];
+    unsigned int    i;
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[i];
+
+        pEntry->HttpHeaderSize = _RenderEntryHttpHeader(pFileSystemBuild, pEntry, NULL, Header);
+    }
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+    {
+        SFileSystemBuildVariant* pVariant = &pFileSystemBuild->pVariants[i];
+
+        pVariant->HttpHeaderSize = _RenderEntryHttpHeader(pFileSystemBuild,
+                                                          &pFileSystemBuild->pFileEntries[pVariant->EntryIndex],
+                                                          pVariant, Header);
+    }
+}
+
+
+/* Finds the layer which supplies the data of an entry.
+
+   Returns:
+    Pointer to the layer or NULL when the files all come from
+    pRootSourceDirectory.
+*/
+static const SFileSystemLayer* _GetSourceLayer(const SFileSystemBuild*      pFileSystemBuild,
+                                               const SFileSystemBuildEntry* pEntry)
+{
+    return pFileSystemBuild->pLayers ? &pFileSystemBuild->pLayers[pEntry->Layer] : NULL;
+}
+
+
+/* Reads the entire contents of a source file into memory.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    pEntry is the entry of the file to be read.
+
+   Returns:
+    Pointer to the file contents which the caller must free() or NULL on
+    failure.
+*/
+static unsigned char* _ReadSourceFile(const SFileSystemBuild*      pFileSystemBuild,
+                                      const SFileSystemBuildEntry* pEntry)
+{
+    const SFileSystemLayer* pLayer = _GetSourceLayer(pFileSystemBuild, pEntry);
+    char                    FilenameBuffer[1024];
+    FILE*                   pSourceFile = NULL;
+    unsigned char*          pData = NULL;
+
+    snprintf(FilenameBuffer, sizeof(FilenameBuffer), 
+             "%s/%s", 
+             pLayer ? pLayer->pPath : pFileSystemBuild->pRootSourceDirectory, 
+             pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset);
+
+    /* Files from an existing image are copied straight out of it. */
+    if (pLayer && pLayer->Image.pImage)
+    {
+        pData = malloc((size_t)pEntry->FileBinarySize + 1);
+        if (!pData)
+        {
+            fprintf(stderr, "error: Failed to allocate %llu bytes for %s.\n", 
+                    (unsigned long long)pEntry->FileBinarySize, FilenameBuffer);
+            return NULL;
+        }
+        memcpy(pData, pLayer->Image.pImage + pEntry->SourceOffset, (size_t)pEntry->FileBinarySize);
+        return pData;
+    }
+
+    pSourceFile = fopen(FilenameBuffer, "r");
+    if (!pSourceFile)
+    {
+        fprintf(stderr, "error: Failed to open %s for read.\n", FilenameBuffer);
+        return NULL;
+    }
+    /* Allocate at least one byte so that an empty file doesn't look like a
+       failed allocation. */
+    pData = malloc((size_t)pEntry->FileBinarySize + 1);
+    if (!pData)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes for %s.\n", 
+                (unsigned long long)pEntry->FileBinarySize, FilenameBuffer);
+    }
+    else if (pEntry->FileBinarySize > 0 &&
+             1 != fread(pData, (size_t)pEntry->FileBinarySize, 1, pSourceFile))
+    {
+        fprintf(stderr, "error: Failed to read %llu bytes from %s.\n",
+                (unsigned long long)pEntry->FileBinarySize, FilenameBuffer);
+        free(pData);
+        pData = NULL;
+    }
+    fclose(pSourceFile);
+
+    return pData;
+}
+
+
+/* Compresses a buffer with the requested HTTP content encoding.
+
+   Parameters:
+    Encoding is the FILE_SYSTEM_ENCODING_* value to compress with.
+    pData points to the data to be compressed.
+    Size is the length of the data in bytes.
+    ppCompressed is a pointer to be filled in with the compressed data, which
+        the caller must free(), or NULL if it wasn't smaller than Size.
+    pCompressedSize is a pointer to be filled in with the size of the
+        compressed data.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CompressData(unsigned int         Encoding,
+                         const unsigned char* pData,
+                         size_t               Size,
+                         unsigned char**      ppCompressed,
+                         size_t*              pCompressedSize)
+{
+    unsigned char*  pCompressed = NULL;
+    size_t          CompressedSize = 0;
+    int             Result = 1;
+
+    *ppCompressed = NULL;
+    *pCompressedSize = 0;
+#if !defined(HAVE_ZLIB) && !defined(HAVE_BROTLI)
+    /* No encoders were available when fsbld was built. */
+    (void)Encoding;
+    (void)pData;
+#endif
+#if defined(HAVE_ZLIB)
+    if (Encoding == FILE_SYSTEM_ENCODING_GZIP)
+    {
+        z_stream    Stream;
+
+        /* 16 added to the window bits selects a gzip rather than zlib
+           wrapper.  The header's timestamp is left as 0 so that the image is
+           reproducible. */
+        memset(&Stream, 0, sizeof(Stream));
+        if (Z_OK != deflateInit2(&Stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY))
+        {
+            return 1;
+        }
+        CompressedSize = deflateBound(&Stream, Size);
+        pCompressed = malloc(CompressedSize);
+        if (pCompressed)
+        {
+            Stream.next_in = (Bytef*)pData;
+            Stream.avail_in = Size;
+            Stream.next_out = pCompressed;
+            Stream.avail_out = CompressedSize;
+            if (Z_STREAM_END == deflate(&Stream, Z_FINISH))
+            {
+                CompressedSize = Stream.total_out;
+                Result = 0;
+            }
+        }
+        deflateEnd(&Stream);
+    }
+#endif
+#if defined(HAVE_BROTLI)
+    if (Encoding == FILE_SYSTEM_ENCODING_BROTLI)
+    {
+        CompressedSize = BrotliEncoderMaxCompressedSize(Size);
+        pCompressed = CompressedSize ? malloc(CompressedSize) : NULL;
+        if (pCompressed &&
+            BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                  Size, pData, &CompressedSize, pCompressed))
+        {
+            Result = 0;
+        }
+    }
+#endif
+    if (Result || CompressedSize >= Size)
+    {
+        free(pCompressed);
+        return Result;
+    }
+
+    *ppCompressed = pCompressed;
+    *pCompressedSize = CompressedSize;
+    return 0;
+}
+
+
+/* Work shared between the threads which create the precompressed variants. */
+typedef struct _SPrecompressWork
+{
+    SFileSystemBuild*   pFileSystemBuild;
+    pthread_mutex_t     Lock;
+    /* Index of the next element of pFileSystemBuild->pVariants to be
+       compressed. */
+    unsigned int        NextVariant;
+    /* Non-zero once any of the threads has failed. */
+    int                 Failed;
+} SPrecompressWork;
+
+
+/* Thread which repeatedly takes the next variant to be created from the
+   shared SPrecompressWork and compresses the contents of its file. */
+static void* _PrecompressThread(void* pvWork)
+{
+    SPrecompressWork*   pWork = (SPrecompressWork*)pvWork;
+    SFileSystemBuild*   pFileSystemBuild = pWork->pFileSystemBuild;
+
+    for (;;)
+    {
+        SFileSystemBuildVariant*     pVariant;
+        const SFileSystemBuildEntry* pEntry;
+        unsigned char*               pData;
+        int                          Result;
+
+        pthread_mutex_lock(&pWork->Lock);
+        if (pWork->Failed || pWork->NextVariant >= pFileSystemBuild->VariantCount)
+        {
+            pthread_mutex_unlock(&pWork->Lock);
+            break;
+        }
+        pVariant = &pFileSystemBuild->pVariants[pWork->NextVariant++];
+        pthread_mutex_unlock(&pWork->Lock);
+
+        pEntry = &pFileSystemBuild->pFileEntries[pVariant->EntryIndex];
+        pData = _ReadSourceFile(pFileSystemBuild, pEntry);
+        Result = pData ? _CompressData(pVariant->Encoding, pData, (size_t)pEntry->FileBinarySize,
+                                       &pVariant->pData, &pVariant->Size) : 1;
+        free(pData);
+        if (Result)
+        {
+            fprintf(stderr, "error: Failed to compress %s.\n", 
+                    pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset);
+            pthread_mutex_lock(&pWork->Lock);
+            pWork->Failed = 1;
+            pthread_mutex_unlock(&pWork->Lock);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Creates the precompressed variants requested with --precompress.  Each
+   compressible file is compressed with every requested encoding on a pool of
+   threads, one per processor, and only the variants which are smaller than
+   the original file are kept.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build with sorted
+        entries.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CreatePrecompressedVariants(SFileSystemBuild* pFileSystemBuild)
+{
+    static const char* const EncodingNames[] = { "", "gzip", "brotli" };
+    SPrecompressWork         Work;
+    pthread_t                Threads[64];
+    unsigned int             ThreadCount;
+    unsigned int             MaxVariants;
+    unsigned int             Kept = 0;
+    unsigned int             Encoding;
+    unsigned int             i;
+    uint64_t                 OriginalTotal = 0;
+    uint64_t                 CompressedTotal = 0;
+    long                     ProcessorCount;
+
+    if (!pFileSystemBuild->PrecompressEncodings)
+    {
+        return 0;
+    }
+
+    /* Queue up a variant for every requested encoding of each compressible
+       file, already in the order they are to be stored in the image. */
+    MaxVariants = pFileSystemBuild->FileCount * 2;
+    pFileSystemBuild->pVariants = calloc(MaxVariants + 1, sizeof(*pFileSystemBuild->pVariants));
+    if (!pFileSystemBuild->pVariants)
+    {
+        fprintf(stderr, "error: Failed to allocate precompressed variants.\n");
+        return 1;
+    }
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        if (!g_MimeTypes[pFileSystemBuild->pFileEntries[i].MimeType].Compressible)
+        {
+            continue;
+        }
+        for (Encoding = FILE_SYSTEM_ENCODING_GZIP ; Encoding <= FILE_SYSTEM_ENCODING_BROTLI ; Encoding++)
+        {
+            if (pFileSystemBuild->PrecompressEncodings & (1 << Encoding))
+            {
+                SFileSystemBuildVariant* pVariant = &pFileSystemBuild->pVariants[pFileSystemBuild->VariantCount++];
+
+                pVariant->EntryIndex = i;
+                pVariant->Encoding = Encoding;
+            }
+        }
+    }
+
+    /* Compress them in parallel. */
+    memset(&Work, 0, sizeof(Work));
+    Work.pFileSystemBuild = pFileSystemBuild;
+    pthread_mutex_init(&Work.Lock, NULL);
+    ProcessorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    ThreadCount = ProcessorCount > 0 ? (unsigned int)ProcessorCount : 1;
+    if (ThreadCount > sizeof(Threads) / sizeof(Threads[0]))
+    {
+        ThreadCount = sizeof(Threads) / sizeof(Threads[0]);
+    }
+    if (ThreadCount > pFileSystemBuild->VariantCount)
+    {
+        ThreadCount = pFileSystemBuild->VariantCount;
+    }
+    printf("Precompressing %u variants using %u threads...\n", 
+           pFileSystemBuild->VariantCount, ThreadCount);
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        if (pthread_create(&Threads[i], NULL, _PrecompressThread, &Work))
+        {
+            /* Carry on with the threads which did start, or on this one if
+               none did. */
+            break;
+        }
+    }
+    ThreadCount = i;
+    if (ThreadCount == 0)
+    {
+        _PrecompressThread(&Work);
+    }
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        pthread_join(Threads[i], NULL);
+    }
+    pthread_mutex_destroy(&Work.Lock);
+    if (Work.Failed)
+    {
+        return 1;
+    }
+
+    /* Drop the variants which didn't shrink their file and report the
+       savings of the rest. */
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+    {
+        SFileSystemBuildVariant*     pVariant = &pFileSystemBuild->pVariants[i];
+        const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[pVariant->EntryIndex];
+        const char*                  pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+
+        if (!pVariant->pData)
+        {
+            printf("    %s: %s not smaller, skipped\n", pFilename, EncodingNames[pVariant->Encoding]);
+            continue;
+        }
+        printf("    %s: %s %llu -> %lu bytes (%.1f%% saved)\n",
+               pFilename,
+               EncodingNames[pVariant->Encoding],
+               (unsigned long long)pEntry->FileBinarySize,
+               (unsigned long)pVariant->Size,
+               100.0 * (pEntry->FileBinarySize - pVariant->Size) / pEntry->FileBinarySize);
+        OriginalTotal += pEntry->FileBinarySize;
+        CompressedTotal += pVariant->Size;
+        pFileSystemBuild->pVariants[Kept++] = *pVariant;
+    }
+    pFileSystemBuild->VariantCount = Kept;
+    printf("Precompressed %u variants: %llu -> %llu bytes (%.1f%% saved when served compressed).\n",
+           Kept,
+           (unsigned long long)OriginalTotal,
+           (unsigned long long)CompressedTotal,
+           OriginalTotal ? 100.0 * (OriginalTotal - CompressedTotal) / OriginalTotal : 0.0);
+
+    return 0;
+}
+
+
+/* Number of times that one file was accessed right after another in the
+   access profile. */
+typedef struct _SAccessPair
+{
+    unsigned int        From;
+    unsigned int        To;
+    unsigned int        Count;
+} SAccessPair;
+
+/* Sorts access pairs by From and To so that duplicates can be merged. */
+static int _CompareAccessPairs(const void* pv1, const void* pv2)
+{
+    const SAccessPair* pPair1 = (const SAccessPair*)pv1;
+    const SAccessPair* pPair2 = (const SAccessPair*)pv2;
+
+    if (pPair1->From != pPair2->From)
+    {
+        return pPair1->From < pPair2->From ? -1 : 1;
+    }
+    if (pPair1->To != pPair2->To)
+    {
+        return pPair1->To < pPair2->To ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Sorts merged access pairs with the most frequent first, and then by From
+   and To so that the order is reproducible. */
+static int _CompareAccessPairCounts(const void* pv1, const void* pv2)
+{
+    const SAccessPair* pPair1 = (const SAccessPair*)pv1;
+    const SAccessPair* pPair2 = (const SAccessPair*)pv2;
+
+    if (pPair1->Count != pPair2->Count)
+    {
+        return pPair1->Count > pPair2->Count ? -1 : 1;
+    }
+    return _CompareAccessPairs(pv1, pv2);
+}
+
+/* Access counts used by _CompareAccessCounts(). */
+static const unsigned int* g_pAccessCounts;
+
+/* Sorts file indices with the highest count first, keeping the sorted order
+   for files with the same count. */
+static int _CompareAccessCounts(const void* pv1, const void* pv2)
+{
+    unsigned int Index1 = *(const unsigned int*)pv1;
+    unsigned int Index2 = *(const unsigned int*)pv2;
+
+    if (g_pAccessCounts[Index1] != g_pAccessCounts[Index2])
+    {
+        return g_pAccessCounts[Index1] > g_pAccessCounts[Index2] ? -1 : 1;
+    }
+    return Index1 < Index2 ? -1 : (Index1 > Index2);
+}
+
+
+/* Measures how well a data order serves the access profile: the percentage of
+   consecutive accesses whose data directly follows the previous file and the
+   average distance, in bytes, between the end of one file's data and the
+   start of the next.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    pOrder is the order of the file data or NULL for the order of the
+        entries.
+    pPairs is the array of merged access pairs.
+    PairCount is the number of elements in pPairs.
+    pAdjacent is a pointer to be filled in with the adjacency percentage.
+    pDistance is a pointer to be filled in with the average distance.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _MeasureDataOrder(const SFileSystemBuild* pFileSystemBuild,
+                             const unsigned int*     pOrder,
+                             const SAccessPair*      pPairs,
+                             unsigned int            PairCount,
+                             double*                 pAdjacent,
+                             double*                 pDistance)
+{
+    uint64_t*       pOffsets = NULL;
+    uint64_t        Offset = 0;
+    uint64_t        Transitions = 0;
+    uint64_t        Adjacent = 0;
+    double          Distance = 0.0;
+    unsigned int    i;
+
+    pOffsets = malloc((pFileSystemBuild->FileCount + 1) * sizeof(*pOffsets));
+    if (!pOffsets)
+    {
+        fprintf(stderr, "error: Failed to allocate access profile offsets.\n");
+        return 1;
+    }
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        unsigned int Index = pOrder ? pOrder[i] : i;
+
+        pOffsets[Index] = Offset;
+        Offset += pFileSystemBuild->pFileEntries[Index].FileBinarySize;
+    }
+    for (i = 0 ; i < PairCount ; i++)
+    {
+        uint64_t End = pOffsets[pPairs[i].From] + pFileSystemBuild->pFileEntries[pPairs[i].From].FileBinarySize;
+        uint64_t Start = pOffsets[pPairs[i].To];
+
+        Transitions += pPairs[i].Count;
+        if (Start == End)
+        {
+            Adjacent += pPairs[i].Count;
+        }
+        Distance += (double)pPairs[i].Count * (Start > End ? Start - End : End - Start);
+    }
+    free(pOffsets);
+
+    *pAdjacent = Transitions ? 100.0 * Adjacent / Transitions : 0.0;
+    *pDistance = Transitions ? Distance / Transitions : 0.0;
+    return 0;
+}
+
+
+/* Orders the file data from the --access-profile so that the device reads
+   the image as sequentially as possible.  The entries themselves stay sorted
+   by name for the binary search; only the placement of the data changes.
+
+   The profile lists the filename of each access in the order it happened,
+   one per line, with a blank line between sessions.  Files are joined into
+   chains by taking the pairs of consecutive accesses, most frequent first,
+   and appending the second file's chain to the first's whenever the first
+   file ends its chain and the second starts another.  A file is therefore
+   placed after the file it is most often reached from, so an entry page
+   comes before the assets it loads.  The chains are then placed with the
+   one holding the most frequently accessed file first.  Files which were
+   never accessed are placed last, in sorted order.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CreateDataOrder(SFileSystemBuild* pFileSystemBuild)
+{
+    int             Return = 1;
+    unsigned int    FileCount = pFileSystemBuild->FileCount;
+    char*           pProfile = NULL;
+    char*           pLine = NULL;
+    unsigned int    MaxAccesses = 0;
+    unsigned int*   pAccessCounts = NULL;
+    unsigned int*   pChainCounts = NULL;
+    unsigned int*   pChains = NULL;
+    int*            pNext = NULL;
+    int*            pPrev = NULL;
+    unsigned int*   pHead = NULL;
+    unsigned int*   pTail = NULL;
+    SAccessPair*    pPairs = NULL;
+    unsigned int    PairCount = 0;
+    unsigned int    ChainCount = 0;
+    unsigned int    Accessed = 0;
+    unsigned int    Accesses = 0;
+    unsigned int    Unknown = 0;
+    unsigned int    Placed = 0;
+    int             Previous = -1;
+    double          SortedAdjacent;
+    double          SortedDistance;
+    double          ProfileAdjacent;
+    double          ProfileDistance;
+    unsigned int    i;
+
+    if (!pFileSystemBuild->pAccessProfileFilename)
+    {
+        return 0;
+    }
+
+    pProfile = _LoadTextFile(pFileSystemBuild->pAccessProfileFilename, &MaxAccesses);
+    if (!pProfile)
+    {
+        goto Error;
+    }
+    pAccessCounts = calloc(FileCount + 1, sizeof(*pAccessCounts));
+    pChainCounts = calloc(FileCount + 1, sizeof(*pChainCounts));
+    pChains = calloc(FileCount + 1, sizeof(*pChains));
+    pNext = calloc(FileCount + 1, sizeof(*pNext));
+    pPrev = calloc(FileCount + 1, sizeof(*pPrev));
+    pHead = calloc(FileCount + 1, sizeof(*pHead));
+    pTail = calloc(FileCount + 1, sizeof(*pTail));
+    pPairs = calloc(MaxAccesses, sizeof(*pPairs));
+    pFileSystemBuild->pDataOrder = calloc(FileCount + 1, sizeof(*pFileSystemBuild->pDataOrder));
+    if (!pAccessCounts || !pChainCounts || !pChains || !pNext || !pPrev || !pHead || !pTail || !pPairs ||
+        !pFileSystemBuild->pDataOrder)
+    {
+        fprintf(stderr, "error: Failed to allocate access profile.\n");
+        goto Error;
+    }
+
+    /* Count the accesses to each file and to each pair of files accessed one
+       after the other. */
+    pLine = pProfile;
+    while (*pLine)
+    {
+        char*   pNext = pLine + strcspn(pLine, "\n");
+        char*   pEnd;
+        int     Index;
+
+        if (*pNext)
+        {
+            *pNext++ = '\0';
+        }
+        pEnd = pLine + strlen(pLine);
+        while (pEnd > pLine && (pEnd[-1] == ' ' || pEnd[-1] == '\t' || pEnd[-1] == '\r'))
+        {
+            *--pEnd = '\0';
+        }
+        pLine += strspn(pLine, " \t");
+        /* Accept URL paths from a web server log as well as filenames. */
+        while (*pLine == '/')
+        {
+            pLine++;
+        }
+
+        if (*pLine == '\0')
+        {
+            Previous = -1;
+        }
+        else if ((Index = _FindFileInList(pFileSystemBuild, pLine)) < 0)
+        {
+            Unknown++;
+        }
+        else
+        {
+            Accesses++;
+            pAccessCounts[Index]++;
+            if (Previous >= 0 && Previous != Index)
+            {
+                pPairs[PairCount].From = Previous;
+                pPairs[PairCount].To = Index;
+                pPairs[PairCount].Count = 1;
+                PairCount++;
+            }
+            Previous = Index;
+        }
+        pLine = pNext;
+    }
+
+    /* Merge the duplicate pairs and then order them with the most frequent
+       first. */
+    if (PairCount)
+    {
+        unsigned int Merged = 0;
+
+        qsort(pPairs, PairCount, sizeof(*pPairs), _CompareAccessPairs);
+        for (i = 1 ; i < PairCount ; i++)
+        {
+            if (pPairs[i].From == pPairs[Merged].From && pPairs[i].To == pPairs[Merged].To)
+            {
+                pPairs[Merged].Count++;
+            }
+            else
+            {
+                pPairs[++Merged] = pPairs[i];
+            }
+        }
+        PairCount = Merged + 1;
+        qsort(pPairs, PairCount, sizeof(*pPairs), _CompareAccessPairCounts);
+    }
+
+    /* Every file starts as a chain of its own.  pHead is only kept up to
+       date for the last file of each chain and pTail for the first. */
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        pNext[i] = -1;
+        pPrev[i] = -1;
+        pHead[i] = i;
+        pTail[i] = i;
+    }
+
+    /* Join the chains along the heaviest pairs first.  A pair is skipped if
+       its From file is already followed by another file, its To file is
+       already preceded by one, or both are in the same chain. */
+    for (i = 0 ; i < PairCount ; i++)
+    {
+        unsigned int From = pPairs[i].From;
+        unsigned int To = pPairs[i].To;
+        unsigned int Head;
+        unsigned int Tail;
+
+        if (pNext[From] >= 0 || pPrev[To] >= 0 || pHead[From] == To)
+        {
+            continue;
+        }
+        Head = pHead[From];
+        Tail = pTail[To];
+        pNext[From] = To;
+        pPrev[To] = From;
+        pTail[Head] = Tail;
+        pHead[Tail] = Head;
+    }
+
+    /* Order the chains by their most frequently accessed file. */
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        int Current;
+
+        if (pAccessCounts[i])
+        {
+            Accessed++;
+        }
+        if (pPrev[i] >= 0)
+        {
+            continue;
+        }
+        pChains[ChainCount++] = i;
+        for (Current = i ; Current >= 0 ; Current = pNext[Current])
+        {
+            if (pAccessCounts[Current] > pChainCounts[i])
+            {
+                pChainCounts[i] = pAccessCounts[Current];
+            }
+        }
+    }
+    g_pAccessCounts = pChainCounts;
+    qsort(pChains, ChainCount, sizeof(*pChains), _CompareAccessCounts);
+
+    for (i = 0 ; i < ChainCount ; i++)
+    {
+        int Current;
+
+        for (Current = pChains[i] ; Current >= 0 ; Current = pNext[Current])
+        {
+            pFileSystemBuild->pDataOrder[Placed++] = Current;
+        }
+    }
+    assert ( Placed == FileCount );
+
+    if (_MeasureDataOrder(pFileSystemBuild, NULL, pPairs, PairCount, &SortedAdjacent, &SortedDistance) ||
+        _MeasureDataOrder(pFileSystemBuild, pFileSystemBuild->pDataOrder, pPairs, PairCount, 
+                          &ProfileAdjacent, &ProfileDistance))
+    {
+        goto Error;
+    }
+    printf("Access profile: %u accesses to %u of %u files (%u unknown filenames ignored).\n",
+           Accesses, Accessed, FileCount, Unknown);
+    printf("    Sorted layout:  %5.1f%% of transitions adjacent, %12.1f bytes average distance\n",
+           SortedAdjacent, SortedDistance);
+    printf("    Profile layout: %5.1f%% of transitions adjacent, %12.1f bytes average distance\n",
+           ProfileAdjacent, ProfileDistance);
+
+    Return = 0;
+Error:
+    g_pAccessCounts = NULL;
+    free(pProfile);
+    free(pAccessCounts);
+    free(pChainCounts);
+    free(pChains);
+    free(pNext);
+    free(pPrev);
+    free(pHead);
+    free(pTail);
+    free(pPairs);
+    return Return;
+}
+
+
+/* Marks the files which match a --volatile pattern and moves their data after
+   that of the stable files, keeping the existing order within each group.
+   The data order is always created for a --flash-geometry since the layout
+   may reorder files to fill the gaps at the end of sectors.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _GroupVolatileFiles(SFileSystemBuild* pFileSystemBuild)
+{
+    unsigned int    FileCount = pFileSystemBuild->FileCount;
+    unsigned int*   pOrder = NULL;
+    unsigned int    Count = 0;
+    unsigned int    VolatileCount = 0;
+    unsigned int    Group;
+    unsigned int    i;
+    unsigned int    j;
+
+    if (!pFileSystemBuild->FlashRegionCount)
+    {
+        return 0;
+    }
+
+    for (i = 0 ; i < FileCount && pFileSystemBuild->VolatilePatternCount ; i++)
+    {
+        SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[i];
+        const char*            pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+
+        for (j = 0 ; j < pFileSystemBuild->VolatilePatternCount ; j++)
+        {
+            if (0 == fnmatch(pFileSystemBuild->ppVolatilePatterns[j], pFilename, 0))
+            {
+                pEntry->Volatile = 1;
+                VolatileCount++;
+                break;
+            }
+        }
+    }
+
+    pOrder = malloc((FileCount + 1) * sizeof(*pOrder));
+    if (!pOrder)
+    {
+        fprintf(stderr, "error: Failed to allocate data order.\n");
+        return 1;
+    }
+    for (Group = 0 ; Group < 2 ; Group++)
+    {
+        for (i = 0 ; i < FileCount ; i++)
+        {
+            unsigned int Index = pFileSystemBuild->pDataOrder ? pFileSystemBuild->pDataOrder[i] : i;
+
+            if (pFileSystemBuild->pFileEntries[Index].Volatile == (int)Group)
+            {
+                pOrder[Count++] = Index;
+            }
+        }
+    }
+    free(pFileSystemBuild->pDataOrder);
+    pFileSystemBuild->pDataOrder = pOrder;
+    if (VolatileCount)
+    {
+        printf("Placing %u volatile files in separate FLASH sectors.\n", VolatileCount);
+    }
+
+    return 0;
+}
+
+
+/* Frees up memory allocated in the pointers maintained by the SFileSystemBuild
+   structure.
+   
+   Parameters:
+    pFileSystemBuild is a pointer to the structure to be freed.
+    
+   Returns:
+    Nothing.
+*/
+static void _FreeFileSystemBuild(SFileSystemBuild* pFileSystemBuild)
+{
+    /* If the pointer is NULL then there is nothing to do */
+    if (!pFileSystemBuild)
+    {
+        return;
+    }
+    
+    if (pFileSystemBuild->pFilenameBuffer)
+    {
+        free(pFileSystemBuild->pFilenameBuffer);
+        pFileSystemBuild->pFilenameBuffer = NULL;
+    }
+    if (pFileSystemBuild->pFileEntries)
+    {
+        free(pFileSystemBuild->pFileEntries);
+        pFileSystemBuild->pFileEntries = NULL;
+    }
+    free(pFileSystemBuild->pNameFilter);
+    pFileSystemBuild->pNameFilter = NULL;
+    if (pFileSystemBuild->pVariants)
+    {
+        unsigned int i;
+
+        for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+        {
+            free(pFileSystemBuild->pVariants[i].pData);
+        }
+        free(pFileSystemBuild->pVariants);
+        pFileSystemBuild->pVariants = NULL;
+    }
+    free(pFileSystemBuild->pHttpRules);
+    pFileSystemBuild->pHttpRules = NULL;
+    free(pFileSystemBuild->pHttpRulesBuffer);
+    pFileSystemBuild->pHttpRulesBuffer = NULL;
+    free(pFileSystemBuild->pDataOrder);
+    pFileSystemBuild->pDataOrder = NULL;
+    free(pFileSystemBuild->ppVolatilePatterns);
+    pFileSystemBuild->ppVolatilePatterns = NULL;
+    free(pFileSystemBuild->ppRemovePatterns);
+    pFileSystemBuild->ppRemovePatterns = NULL;
+    free(pFileSystemBuild->ppOverlays);
+    pFileSystemBuild->ppOverlays = NULL;
+    free(pFileSystemBuild->ppPins);
+    pFileSystemBuild->ppPins = NULL;
+    if (pFileSystemBuild->pLayers)
+    {
+        unsigned int i;
+
+        for (i = 0 ; i < pFileSystemBuild->LayerCount ; i++)
+        {
+            SFileSystemLayer* pLayer = &pFileSystemBuild->pLayers[i];
+
+            if (!pLayer->Image.pImage)
+            {
+                free((char*)pLayer->pFilenameBuffer);
+            }
+            free(pLayer->pFileEntries);
+            FsReaderCloseImage(&pLayer->Image.Reader);
+            free(pLayer->Image.pEntries);
+        }
+        free(pFileSystemBuild->pLayers);
+        pFileSystemBuild->pLayers = NULL;
+    }
+}
+
+
+/* Appends a section to the section table of the layout.  The table is only
+   written to versioned images but is kept for both layouts.
+
+   Parameters:
+    pLayout is the layout being planned.
+    Type is one of the FILE_SYSTEM_SECTION_* values.
+    Flags is the section specific SFileSystemSection::Flags value.
+    Offset is the location of the section relative to the start of the image.
+    Size is the size of the section in bytes.
+
+   Returns:
+    Nothing.
+*/
+static void _AddSection(SFileSystemLayout* pLayout, 
+                        uint32_t           Type, 
+                        uint32_t           Flags, 
+                        uint64_t           Offset, 
+                        uint64_t           Size)
+{
+    SFileSystemSection* pSection;
+
+    assert ( pLayout && pLayout->SectionCount < FILE_SYSTEM_MAX_SECTIONS );
+
+    pSection = &pLayout->Sections[pLayout->SectionCount++];
+    pSection->Type = Type;
+    pSection->Flags = Flags;
+    pSection->Offset = Offset;
+    pSection->Size = Size;
+}
+
+
+/* Finds the FLASH erase sector which contains an address.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build with the
+        --flash-geometry.
+    Address is the FLASH address.
+    pSector is a pointer to be filled in with the sector.
+
+   Returns:
+    0 on success or 1 if Address is beyond the end of the FLASH.
+*/
+static int _FindFlashSector(const SFileSystemBuild* pFileSystemBuild, uint64_t Address, SFlashSector* pSector)
+{
+    uint64_t        RegionStart = 0;
+    uint64_t        RegionIndex = 0;
+    unsigned int    i;
+
+    for (i = 0 ; i < pFileSystemBuild->FlashRegionCount ; i++)
+    {
+        const SFlashRegion* pRegion = &pFileSystemBuild->FlashRegions[i];
+        uint64_t            RegionSize = pRegion->SectorSize * pRegion->SectorCount;
+
+        if (pRegion->SectorCount == 0 || Address < RegionStart + RegionSize)
+        {
+            uint64_t Sector = (Address - RegionStart) / pRegion->SectorSize;
+
+            pSector->Index = RegionIndex + Sector;
+            pSector->Start = RegionStart + Sector * pRegion->SectorSize;
+            pSector->Size = pRegion->SectorSize;
+            return 0;
+        }
+        RegionStart += RegionSize;
+        RegionIndex += pRegion->SectorCount;
+    }
+
+    return 1;
+}
+
+
+/* Moves the planned image offset of a file's data to the start of the next
+   FLASH sector if the file would otherwise straddle a sector boundary that
+   it doesn't need to.  Files which are larger than the next sector are left
+   where they are.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    Offset is the image offset at which the data would be placed.
+    Size is the size of the data.
+
+   Returns:
+    The image offset at which the data should be placed.
+*/
+static uint64_t _AvoidSectorSplit(const SFileSystemBuild* pFileSystemBuild, uint64_t Offset, uint64_t Size)
+{
+    SFlashSector    Sector;
+    SFlashSector    NextSector;
+    uint64_t        Address = pFileSystemBuild->FlashOffset + Offset;
+
+    if (!pFileSystemBuild->FlashRegionCount || Size == 0 ||
+        _FindFlashSector(pFileSystemBuild, Address, &Sector) ||
+        Address + Size <= Sector.Start + Sector.Size ||
+        _FindFlashSector(pFileSystemBuild, Sector.Start + Sector.Size, &NextSector) ||
+        Size > NextSector.Size)
+    {
+        return Offset;
+    }
+
+    return NextSector.Start - pFileSystemBuild->FlashOffset;
+}
+
+
+/* Moves the data of a file up to the --target alignment.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    Offset is the image offset at which the file, including any HTTP response
+        header in front of its data, would be placed.
+    HeaderSize is the size of the HTTP response header.
+
+   Returns:
+    The image offset at which the file should be placed so that its data is
+    aligned.
+*/
+static uint64_t _AlignFileData(const SFileSystemBuild* pFileSystemBuild, uint64_t Offset, uint64_t HeaderSize)
+{
+    if (!pFileSystemBuild->HaveTarget)
+    {
+        return Offset;
+    }
+    return _AlignOffset(Offset + HeaderSize, pFileSystemBuild->Target.Alignment) - HeaderSize;
+}
+
+
+/* Fills the gap which would be left at the end of a FLASH sector when the
+   file at Position in the data order has to be moved to the next sector.  The
+   first later file, of the same volatility, which fits in the gap is moved
+   up to Position instead, keeping the order of the files in between.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    Position is the index into pDataOrder of the next file to be placed.
+    Offset is the image offset at which the next file would be placed.
+
+   Returns:
+    Nothing.
+*/
+static void _FillSectorGap(SFileSystemBuild* pFileSystemBuild, unsigned int Position, uint64_t Offset)
+{
+    unsigned int*                pOrder = pFileSystemBuild->pDataOrder;
+    const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[pOrder[Position]];
+    SFlashSector                 Sector;
+    uint64_t                     Address = pFileSystemBuild->FlashOffset + Offset;
+    unsigned int                 i;
+
+    if (_AvoidSectorSplit(pFileSystemBuild, Offset, pEntry->HttpHeaderSize + pEntry->FileBinarySize) == Offset ||
+        _FindFlashSector(pFileSystemBuild, Address, &Sector))
+    {
+        return;
+    }
+    for (i = Position + 1 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        const SFileSystemBuildEntry* pCandidate = &pFileSystemBuild->pFileEntries[pOrder[i]];
+        uint64_t                     Size = pCandidate->HttpHeaderSize + pCandidate->FileBinarySize;
+
+        if (pCandidate->Volatile == pEntry->Volatile && Size > 0 &&
+            Address + Size <= Sector.Start + Sector.Size)
+        {
+            unsigned int Index = pOrder[i];
+
+            memmove(&pOrder[Position + 1], &pOrder[Position], (i - Position) * sizeof(*pOrder));
+            pOrder[Position] = Index;
+            return;
+        }
+    }
+}
+
+
+/* Rounds an image offset up to the start of the next FLASH sector, if it
+   isn't already at the start of one. */
+static uint64_t _AlignToSector(const SFileSystemBuild* pFileSystemBuild, uint64_t Offset)
+{
+    SFlashSector    Sector;
+    uint64_t        Address = pFileSystemBuild->FlashOffset + Offset;
+
+    if (!pFileSystemBuild->FlashRegionCount ||
+        _FindFlashSector(pFileSystemBuild, Address, &Sector) ||
+        Address == Sector.Start)
+    {
+        return Offset;
+    }
+
+    return Sector.Start + Sector.Size - pFileSystemBuild->FlashOffset;
+}
+
+
+/* Adds the FLASH sectors touched by a range of the image to a list of
+   sectors.
+
+   Returns:
+    The new number of sectors in pSectors.
+*/
+static unsigned int _AddTouchedSectors(const SFileSystemBuild* pFileSystemBuild,
+                                       uint64_t                Offset,
+                                       uint64_t                Size,
+                                       uint64_t*               pSectors,
+                                       unsigned int            SectorCount,
+                                       unsigned int            MaxSectors)
+{
+    uint64_t Address = pFileSystemBuild->FlashOffset + Offset;
+    uint64_t End = Address + (Size ? Size : 1);
+
+    while (Address < End && SectorCount < MaxSectors)
+    {
+        SFlashSector Sector;
+
+        if (_FindFlashSector(pFileSystemBuild, Address, &Sector))
+        {
+            break;
+        }
+        pSectors[SectorCount++] = Sector.Index;
+        Address = Sector.Start + Sector.Size;
+    }
+
+    return SectorCount;
+}
+
+
+/* Sorts FLASH sector indices so that duplicates can be removed. */
+static int _CompareSectors(const void* pv1, const void* pv2)
+{
+    uint64_t Sector1 = *(const uint64_t*)pv1;
+    uint64_t Sector2 = *(const uint64_t*)pv2;
+
+    return Sector1 < Sector2 ? -1 : (Sector1 > Sector2);
+}
+
+
+/* Counts the distinct FLASH sectors in a list. */
+static unsigned int _CountDistinctSectors(uint64_t* pSectors, unsigned int SectorCount)
+{
+    unsigned int Distinct = 0;
+    unsigned int i;
+
+    qsort(pSectors, SectorCount, sizeof(*pSectors), _CompareSectors);
+    for (i = 0 ; i < SectorCount ; i++)
+    {
+        Distinct += (i == 0 || pSectors[i] != pSectors[i - 1]);
+    }
+
+    return Distinct;
+}
+
+
+/* Checks that the planned image fits within the --flash-geometry and reports
+   the sectors it occupies.  If --changed-files was given, also reports the
+   sectors which would have to be erased to update those files, both for the
+   planned layout and for the same data packed without regard to sectors.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _ReportFlashSectors(const SFileSystemBuild* pFileSystemBuild)
+{
+    const SFileSystemLayout* pLayout = &pFileSystemBuild->Layout;
+    SFlashSector             FirstSector;
+    SFlashSector             LastSector;
+    char*                    pList = NULL;
+    char*                    pLine;
+    unsigned int             MaxChanges = 0;
+    uint64_t*                pSectors = NULL;
+    uint64_t*                pPackedSectors = NULL;
+    uint64_t*                pPackedOffsets = NULL;
+    unsigned int             MaxSectors;
+    unsigned int             SectorCount = 0;
+    unsigned int             PackedSectorCount = 0;
+    unsigned int             Changed = 0;
+    uint64_t                 Offset;
+    uint64_t                 DataSize = 0;
+    unsigned int             i;
+    int                      Return = 1;
+
+    if (!pFileSystemBuild->FlashRegionCount)
+    {
+        return 0;
+    }
+
+    if (_FindFlashSector(pFileSystemBuild, pFileSystemBuild->FlashOffset, &FirstSector) ||
+        _FindFlashSector(pFileSystemBuild, pFileSystemBuild->FlashOffset + pLayout->ImageSize - 1, &LastSector))
+    {
+        fprintf(stderr, "error: Image of %llu bytes at 0x%llx doesn't fit in the FLASH described by --flash-geometry.\n",
+                (unsigned long long)pLayout->ImageSize,
+                (unsigned long long)pFileSystemBuild->FlashOffset);
+        return 1;
+    }
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        DataSize += pFileSystemBuild->pFileEntries[i].HttpHeaderSize + 
+                    pFileSystemBuild->pFileEntries[i].FileBinarySize;
+    }
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+    {
+        DataSize += pFileSystemBuild->pVariants[i].HttpHeaderSize + pFileSystemBuild->pVariants[i].Size;
+    }
+    printf("FLASH layout: image occupies sectors %llu to %llu (0x%llx - 0x%llx), %llu bytes of padding between files.\n",
+           (unsigned long long)FirstSector.Index,
+           (unsigned long long)LastSector.Index,
+           (unsigned long long)pFileSystemBuild->FlashOffset,
+           (unsigned long long)(pFileSystemBuild->FlashOffset + pLayout->ImageSize - 1),
+           (unsigned long long)(pLayout->ImageSize - pLayout->DataOffset - DataSize));
+
+    if (!pFileSystemBuild->pChangedFilesFilename)
+    {
+        return 0;
+    }
+    pList = _LoadTextFile(pFileSystemBuild->pChangedFilesFilename, &MaxChanges);
+    if (!pList)
+    {
+        goto Error;
+    }
+
+    /* Work out where each file would be if the data was packed in the same
+       order without any sector alignment. */
+    pPackedOffsets = malloc((pFileSystemBuild->FileCount + 1) * sizeof(*pPackedOffsets));
+    MaxSectors = (unsigned int)(LastSector.Index - FirstSector.Index + 1) * MaxChanges;
+    pSectors = malloc(MaxSectors * sizeof(*pSectors));
+    pPackedSectors = malloc(MaxSectors * sizeof(*pPackedSectors));
+    if (!pPackedOffsets || !pSectors || !pPackedSectors)
+    {
+        fprintf(stderr, "error: Failed to allocate FLASH sector report.\n");
+        goto Error;
+    }
+    Offset = pLayout->DataOffset;
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        unsigned int                 Index = pFileSystemBuild->pDataOrder ? pFileSystemBuild->pDataOrder[i] : i;
+        const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[Index];
+
+        pPackedOffsets[Index] = Offset;
+        Offset += pEntry->HttpHeaderSize + pEntry->FileBinarySize;
+    }
+
+    for (pLine = strtok(pList, "\r\n") ; pLine ; pLine = strtok(NULL, "\r\n"))
+    {
+        const SFileSystemBuildEntry* pEntry;
+        int                          Index;
+
+        pLine += strspn(pLine, " \t/");
+        if (*pLine == '\0' || *pLine == '#')
+        {
+            continue;
+        }
+        Index = _FindFileInList(pFileSystemBuild, pLine);
+        if (Index < 0)
+        {
+            fprintf(stderr, "error: Changed file %s isn't in the image.\n", pLine);
+            goto Error;
+        }
+        pEntry = &pFileSystemBuild->pFileEntries[Index];
+        Changed++;
+        SectorCount = _AddTouchedSectors(pFileSystemBuild, 
+                                         pEntry->FileBinaryOffset - pEntry->HttpHeaderSize,
+                                         pEntry->HttpHeaderSize + pEntry->FileBinarySize,
+                                         pSectors, SectorCount, MaxSectors);
+        PackedSectorCount = _AddTouchedSectors(pFileSystemBuild, 
+                                               pPackedOffsets[Index],
+                                               pEntry->HttpHeaderSize + pEntry->FileBinarySize,
+                                               pPackedSectors, PackedSectorCount, MaxSectors);
+    }
+    printf("    Updating %u changed files in place touches %u sectors (%u if packed without sector alignment).\n",
+           Changed,
+           _CountDistinctSectors(pSectors, SectorCount),
+           _CountDistinctSectors(pPackedSectors, PackedSectorCount));
+
+    Return = 0;
+Error:
+    free(pList);
+    free(pPackedOffsets);
+    free(pSectors);
+    free(pPackedSectors);
+    return Return;
+}
+
+
+/* Counts the sections which will be placed in the image: the entries,
+   filenames and data along with any optional sections requested on the
+   command line. */
+static unsigned int _CountImageSections(const SFileSystemBuild* pFileSystemBuild)
+{
+    unsigned int SectionCount = 3;
+
+    if (pFileSystemBuild->NamePrefixLength)
+    {
+        SectionCount++;
+    }
+    if (pFileSystemBuild->pNameFilter)
+    {
+        SectionCount++;
+    }
+    if (pFileSystemBuild->Metadata)
+    {
+        /* Metadata records and MIME type table. */
+        SectionCount += 2;
+    }
+    if (pFileSystemBuild->VariantCount)
+    {
+        SectionCount++;
+    }
+    if (pFileSystemBuild->pHttpRulesFilename)
+    {
+        SectionCount++;
+    }
+    if (pFileSystemBuild->Integrity)
+    {
+        SectionCount++;
+    }
+    if (pFileSystemBuild->MerkleBlockSize)
+    {
+        SectionCount++;
+    }
+    if (pFileSystemBuild->RegionCount)
+    {
+        /* Region table and the region of each entry. */
+        SectionCount += 2;
+    }
+
+    return SectionCount;
+}
+
+
+/* Assigns image offsets to each portion of the image and to the data of each
+   file based on the entry encoding already selected in
+   pFileSystemBuild->Layout.EntrySize.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    Nothing.
+*/
+static void _AssignImageOffsets(SFileSystemBuild* pFileSystemBuild)
+{
+    SFileSystemLayout*      pLayout = &pFileSystemBuild->Layout;
+    SFileSystemBuildEntry*  pEntry = NULL;
+    uint64_t                Offset;
+    unsigned int            Region = 0;
+    unsigned int            i;
+
+    pLayout->SectionCount = 0;
+    if (pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        pLayout->HeaderSize = sizeof(SFileSystemHeader);
+    }
+    else
+    {
+        pLayout->HeaderSize = sizeof(SFileSystemHeaderV2) + 
+                              _CountImageSections(pFileSystemBuild) * sizeof(SFileSystemSection);
+        if (pFileSystemBuild->MerkleBlockSize)
+        {
+            pLayout->HeaderSize += sizeof(SFileSystemDigest);
+        }
+        if (pFileSystemBuild->pKeyFilename)
+        {
+            pLayout->HeaderSize += sizeof(SFileSystemEncryption);
+        }
+    }
+    Offset = pLayout->HeaderSize;
+
+    /* The filename filter is consulted before anything else so it goes first,
+       where it is also naturally aligned for 32-bit reads. */
+    if (pFileSystemBuild->pNameFilter)
+    {
+        pLayout->NameFilterOffset = Offset;
+        Offset += (uint64_t)pFileSystemBuild->NameFilterWordCount * sizeof(uint32_t);
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_NAME_FILTER, pFileSystemBuild->NameFilterHashCount,
+                    pLayout->NameFilterOffset, Offset - pLayout->NameFilterOffset);
+    }
+
+    pLayout->EntriesOffset = Offset;
+    Offset += (uint64_t)pLayout->EntrySize * pFileSystemBuild->FileCount;
+    _AddSection(pLayout, FILE_SYSTEM_SECTION_ENTRIES, 0,
+                pLayout->EntriesOffset, Offset - pLayout->EntriesOffset);
+
+    /* The name prefixes sit right after the entries since they are read
+       together during each binary search probe. */
+    if (pFileSystemBuild->NamePrefixLength)
+    {
+        pLayout->NamePrefixesOffset = Offset;
+        Offset += (uint64_t)pFileSystemBuild->NamePrefixLength * pFileSystemBuild->FileCount;
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_NAME_PREFIXES, pFileSystemBuild->NamePrefixLength,
+                    pLayout->NamePrefixesOffset, Offset - pLayout->NamePrefixesOffset);
+    }
+
+    /* The metadata records are aligned so that the device can access them
+       in place. */
+    if (pFileSystemBuild->Metadata)
+    {
+        pLayout->MetadataOffset = _AlignOffset(Offset, 8);
+        Offset = pLayout->MetadataOffset + 
+                 (uint64_t)sizeof(SFileSystemMetadata) * pFileSystemBuild->FileCount;
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_METADATA, 0,
+                    pLayout->MetadataOffset, Offset - pLayout->MetadataOffset);
+
+        pLayout->MimeTypesOffset = Offset;
+        Offset += pLayout->MimeTypesSize;
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_MIME_TYPES, pFileSystemBuild->MimeTypeCount,
+                    pLayout->MimeTypesOffset, Offset - pLayout->MimeTypesOffset);
+    }
+
+    if (pFileSystemBuild->VariantCount)
+    {
+        pLayout->VariantsOffset = _AlignOffset(Offset, 8);
+        Offset = pLayout->VariantsOffset + 
+                 (uint64_t)sizeof(SFileSystemVariant) * pFileSystemBuild->VariantCount;
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_VARIANTS, 0,
+                    pLayout->VariantsOffset, Offset - pLayout->VariantsOffset);
+    }
+
+    if (pFileSystemBuild->pHttpRulesFilename)
+    {
+        pLayout->HttpHeadersOffset = _AlignOffset(Offset, 4);
+        Offset = pLayout->HttpHeadersOffset + 
+                 sizeof(uint32_t) * ((uint64_t)pFileSystemBuild->FileCount + pFileSystemBuild->VariantCount);
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_HTTP_HEADERS, 0,
+                    pLayout->HttpHeadersOffset, Offset - pLayout->HttpHeadersOffset);
+    }
+
+    if (pFileSystemBuild->Integrity)
+    {
+        pLayout->IntegrityOffset = _AlignOffset(Offset, 4);
+        Offset = pLayout->IntegrityOffset + 
+                 sizeof(uint32_t) * ((uint64_t)pFileSystemBuild->FileCount + pFileSystemBuild->VariantCount);
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_INTEGRITY, 0,
+                    pLayout->IntegrityOffset, Offset - pLayout->IntegrityOffset);
+    }
+
+    if (pFileSystemBuild->RegionCount)
+    {
+        pLayout->RegionsOffset = _AlignOffset(Offset, 8);
+        Offset = pLayout->RegionsOffset + 
+                 (uint64_t)sizeof(SFileSystemRegion) * pFileSystemBuild->RegionCount;
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_REGIONS, 0,
+                    pLayout->RegionsOffset, Offset - pLayout->RegionsOffset);
+
+        pLayout->EntryRegionsOffset = Offset;
+        Offset += pFileSystemBuild->FileCount;
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_ENTRY_REGIONS, 0,
+                    pLayout->EntryRegionsOffset, Offset - pLayout->EntryRegionsOffset);
+    }
+
+    pLayout->FilenamesOffset = Offset;
+    Offset += pFileSystemBuild->FilenameBufferSize;
+    _AddSection(pLayout, FILE_SYSTEM_SECTION_FILENAMES, 0,
+                pLayout->FilenamesOffset, Offset - pLayout->FilenamesOffset);
+
+    /* File data is placed in the same sorted order as the entries, unless
+       reordered by an access profile or --volatile, followed by any
+       precompressed variants.  Each one is preceded by its HTTP response
+       header, if any, so that both can be sent with one write.  Gaps are
+       left where needed to keep files within FLASH sectors.  With --region
+       the data order is grouped by region and each region after the first
+       is laid out from its own start. */
+    pLayout->DataOffset = Offset;
+    for (i = 0 ; i < pFileSystemBuild->RegionCount ; i++)
+    {
+        pFileSystemBuild->Regions[i].Size = 0;
+    }
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        int PreviousVolatile = pEntry ? pEntry->Volatile : 0;
+
+        pEntry = &pFileSystemBuild->pFileEntries[pFileSystemBuild->pDataOrder ? 
+                                                 pFileSystemBuild->pDataOrder[i] : i];
+        if (pEntry->Region != Region)
+        {
+            pFileSystemBuild->Regions[Region].Size = Offset;
+            Region = pEntry->Region;
+            Offset = 0;
+        }
+        if (pEntry->Volatile && !PreviousVolatile)
+        {
+            /* The volatile files come last, starting in a sector of their
+               own. */
+            Offset = _AlignToSector(pFileSystemBuild, Offset);
+        }
+        if (pFileSystemBuild->FlashRegionCount)
+        {
+            _FillSectorGap(pFileSystemBuild, i, Offset);
+            pEntry = &pFileSystemBuild->pFileEntries[pFileSystemBuild->pDataOrder[i]];
+        }
+        Offset = _AlignFileData(pFileSystemBuild, Offset, pEntry->HttpHeaderSize);
+        Offset = _AvoidSectorSplit(pFileSystemBuild, Offset, pEntry->HttpHeaderSize + pEntry->FileBinarySize);
+        Offset = _AlignFileData(pFileSystemBuild, Offset, pEntry->HttpHeaderSize);
+        Offset += pEntry->HttpHeaderSize;
+        pEntry->FileBinaryOffset = Offset;
+        Offset += pEntry->FileBinarySize;
+    }
+    if (pFileSystemBuild->RegionCount)
+    {
+        /* The image itself is the contents of the first region. */
+        pFileSystemBuild->Regions[Region].Size = Offset;
+        Offset = pFileSystemBuild->Regions[0].Size;
+    }
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+    {
+        Offset = _AlignFileData(pFileSystemBuild, Offset, pFileSystemBuild->pVariants[i].HttpHeaderSize);
+        Offset = _AvoidSectorSplit(pFileSystemBuild, Offset, 
+                                   pFileSystemBuild->pVariants[i].HttpHeaderSize + pFileSystemBuild->pVariants[i].Size);
+        Offset = _AlignFileData(pFileSystemBuild, Offset, pFileSystemBuild->pVariants[i].HttpHeaderSize);
+        Offset += pFileSystemBuild->pVariants[i].HttpHeaderSize;
+        pFileSystemBuild->pVariants[i].Offset = Offset;
+        Offset += pFileSystemBuild->pVariants[i].Size;
+    }
+    pLayout->ImageSize = Offset;
+    _AddSection(pLayout, FILE_SYSTEM_SECTION_DATA, 0,
+                pLayout->DataOffset, pLayout->ImageSize - pLayout->DataOffset);
+
+    /* The Merkle tree covers everything before it so it has to come last. */
+    if (pFileSystemBuild->MerkleBlockSize)
+    {
+        uint64_t LeafCount;
+
+        pLayout->MerkleOffset = _AlignOffset(Offset, 4);
+        LeafCount = (pLayout->MerkleOffset + pFileSystemBuild->MerkleBlockSize - 1) / pFileSystemBuild->MerkleBlockSize;
+        pLayout->ImageSize = pLayout->MerkleOffset + 
+                             MERKLE_HASH_SIZE * _CountMerkleNodes(LeafCount, &pLayout->MerkleLevelCount);
+        _AddSection(pLayout, FILE_SYSTEM_SECTION_MERKLE, pLayout->MerkleLevelCount,
+                    pLayout->MerkleOffset, pLayout->ImageSize - pLayout->MerkleOffset);
+    }
+
+    assert ( pLayout->SectionCount == _CountImageSections(pFileSystemBuild) );
+}
+
+
+/* Finds the largest offset and size which will need to be stored in the
+   entry table of the planned layout.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pMaxOffset is a pointer to be filled in with the largest offset.
+    pMaxSize is a pointer to be filled in with the largest file size.
+
+   Returns:
+    Nothing.
+*/
+static void _FindLargestEntryFields(const SFileSystemBuild* pFileSystemBuild,
+                                    uint64_t*               pMaxOffset,
+                                    uint64_t*               pMaxSize)
+{
+    const SFileSystemBuildEntry* pEntry = pFileSystemBuild->pFileEntries;
+    uint64_t                     MaxOffset;
+    uint64_t                     MaxSize = 0;
+    unsigned int                 i;
+
+    /* All filenames are found before the start of the data. */
+    MaxOffset = pFileSystemBuild->Layout.DataOffset;
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        if (pEntry->FileBinaryOffset > MaxOffset)
+        {
+            MaxOffset = pEntry->FileBinaryOffset;
+        }
+        if (pEntry->FileBinarySize > MaxSize)
+        {
+            MaxSize = pEntry->FileBinarySize;
+        }
+    }
+
+    *pMaxOffset = MaxOffset;
+    *pMaxSize = MaxSize;
+}
+
+
+/* Returns the number of bytes, 2 to 4, needed to store a compact entry field
+   which must be able to hold Value.  Values which need more than 4 bytes
+   return 5. */
+static unsigned int _CompactFieldBytes(uint64_t Value)
+{
+    if (Value <= 0xFFFF)
+    {
+        return 2;
+    }
+    else if (Value <= 0xFFFFFF)
+    {
+        return 3;
+    }
+    else if (Value <= UINT32_MAX)
+    {
+        return 4;
+    }
+    return 5;
+}
+
+
+/* Selects the field widths for a compact entry table.  Narrower entries move
+   the filenames and data closer to the start of the image, so the widths are
+   grown from the smallest until they hold every offset and size.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.  The 32-bit layout must already
+        have been assigned.
+
+   Returns:
+    Nothing.
+*/
+static void _PlanCompactEntries(SFileSystemBuild* pFileSystemBuild)
+{
+    SFileSystemLayout*  pLayout = &pFileSystemBuild->Layout;
+    unsigned int        OffsetBytes = 2;
+    unsigned int        SizeBytes = 2;
+    uint64_t            MaxOffset = 0;
+    uint64_t            MaxSize = 0;
+
+    for (;;)
+    {
+        unsigned int RequiredOffsetBytes;
+        unsigned int RequiredSizeBytes;
+
+        pLayout->EntryOffsetBytes = OffsetBytes;
+        pLayout->EntrySizeBytes = SizeBytes;
+        pLayout->EntrySize = 2 * OffsetBytes + SizeBytes;
+        _AssignImageOffsets(pFileSystemBuild);
+
+        _FindLargestEntryFields(pFileSystemBuild, &MaxOffset, &MaxSize);
+        RequiredOffsetBytes = _CompactFieldBytes(MaxOffset);
+        RequiredSizeBytes = _CompactFieldBytes(MaxSize);
+        if (RequiredOffsetBytes <= OffsetBytes && RequiredSizeBytes <= SizeBytes)
+        {
+            break;
+        }
+        if (RequiredOffsetBytes > OffsetBytes)
+        {
+            OffsetBytes = RequiredOffsetBytes;
+        }
+        if (RequiredSizeBytes > SizeBytes)
+        {
+            SizeBytes = RequiredSizeBytes;
+        }
+    }
+
+    /* The caller has already made sure that the image fits in 32-bit fields
+       so the widths can't grow past 4 bytes.  If that is what it took then
+       the regular SFileSystemEntry is just as small. */
+    assert ( OffsetBytes <= 4 && SizeBytes <= 4 );
+    if (OffsetBytes == 4 && SizeBytes == 4)
+    {
+        printf("Compact entries would be no smaller for this image so using 12 byte entries.\n");
+        return;
+    }
+
+    pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_COMPACT_ENTRIES;
+    printf("Using compact entries with %u byte offsets and %u byte sizes (%u bytes per entry).\n",
+           OffsetBytes,
+           SizeBytes,
+           pLayout->EntrySize);
+}
+
+
+/* Assigns an index in the image's MIME type table to each MIME type used by
+   at least one file and determines the size of the table.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    Nothing.
+*/
+static void _AssignMimeTypeIds(SFileSystemBuild* pFileSystemBuild)
+{
+    const SFileSystemBuildEntry* pEntry = pFileSystemBuild->pFileEntries;
+    uint64_t                     TableSize = 0;
+    unsigned int                 i;
+    unsigned int                 j;
+
+    for (i = 0 ; i < MIME_TYPE_COUNT ; i++)
+    {
+        pFileSystemBuild->MimeTypeIds[i] = -1;
+    }
+    pFileSystemBuild->MimeTypeCount = 0;
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        unsigned int MimeType = pEntry->MimeType;
+
+        if (pFileSystemBuild->MimeTypeIds[MimeType] >= 0)
+        {
+            continue;
+        }
+
+        /* Several extensions map to the same MIME type string so they share
+           an id as well. */
+        for (j = 0 ; j < MIME_TYPE_COUNT ; j++)
+        {
+            if (pFileSystemBuild->MimeTypeIds[j] >= 0 &&
+                0 == strcmp(g_MimeTypes[j].pMimeType, g_MimeTypes[MimeType].pMimeType))
+            {
+                pFileSystemBuild->MimeTypeIds[MimeType] = pFileSystemBuild->MimeTypeIds[j];
+                break;
+            }
+        }
+        if (j == MIME_TYPE_COUNT)
+        {
+            pFileSystemBuild->MimeTypeIds[MimeType] = pFileSystemBuild->MimeTypeCount++;
+            TableSize += sizeof(uint32_t) + strlen(g_MimeTypes[MimeType].pMimeType) + 1;
+        }
+    }
+    pFileSystemBuild->Layout.MimeTypesSize = TableSize;
+}
+
+
+/* Entries and pin of each entry used by _ComparePackOrder(). */
+static const SFileSystemBuildEntry* g_pPackEntries;
+static const int*                   g_pPackPins;
+
+/* Orders the files to be packed into regions: pinned files first, since they
+   have no choice of region, and then largest first for best-fit decreasing
+   packing. */
+static int _ComparePackOrder(const void* pv1, const void* pv2)
+{
+    unsigned int Index1 = *(const unsigned int*)pv1;
+    unsigned int Index2 = *(const unsigned int*)pv2;
+    uint64_t     Size1 = g_pPackEntries[Index1].FileBinarySize;
+    uint64_t     Size2 = g_pPackEntries[Index2].FileBinarySize;
+
+    if ((g_pPackPins[Index1] >= 0) != (g_pPackPins[Index2] >= 0))
+    {
+        return g_pPackPins[Index1] >= 0 ? -1 : 1;
+    }
+    if (Size1 != Size2)
+    {
+        return Size1 > Size2 ? -1 : 1;
+    }
+    return Index1 < Index2 ? -1 : (Index1 > Index2);
+}
+
+
+/* Finds the region selected by each --pin rule for every file.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    pPins is filled in with the index of the region each file is pinned to
+        or -1 if it isn't pinned.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _ResolveRegionPins(const SFileSystemBuild* pFileSystemBuild, int* pPins)
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        pPins[i] = -1;
+    }
+    /* The first matching rule wins so apply them in reverse. */
+    for (j = pFileSystemBuild->PinCount ; j-- > 0 ; )
+    {
+        const char*     pPin = pFileSystemBuild->ppPins[j];
+        const char*     pEquals = strrchr(pPin, '=');
+        char            Pattern[512];
+        int             Region = -1;
+        unsigned int    r;
+
+        for (r = 0 ; r < pFileSystemBuild->RegionCount ; r++)
+        {
+            if (0 == strcmp(pFileSystemBuild->Regions[r].Name, pEquals + 1))
+            {
+                Region = r;
+            }
+        }
+        if (Region < 0 || (size_t)(pEquals - pPin) >= sizeof(Pattern))
+        {
+            fprintf(stderr, "error: --pin %s doesn't name one of the regions.\n", pPin);
+            return 1;
+        }
+        memcpy(Pattern, pPin, pEquals - pPin);
+        Pattern[pEquals - pPin] = '\0';
+        for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+        {
+            const char* pFilename = pFileSystemBuild->pFilenameBuffer + 
+                                    pFileSystemBuild->pFileEntries[i].FilenameOffset;
+
+            if (0 == fnmatch(Pattern, pFilename, 0))
+            {
+                pPins[i] = Region;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Prints the address, capacity and use of each region to pStream. */
+static void _PrintRegionTable(FILE* pStream, const SFileSystemBuild* pFileSystemBuild, const uint64_t* pFree)
+{
+    unsigned int i;
+
+    fprintf(pStream, "    Region            Address    Capacity        Used        Free\n");
+    for (i = 0 ; i < pFileSystemBuild->RegionCount ; i++)
+    {
+        const SImageRegion* pRegion = &pFileSystemBuild->Regions[i];
+
+        fprintf(pStream, "    %-12s 0x%08llx %11llu %11llu %11llu\n",
+               pRegion->Name,
+               (unsigned long long)pRegion->Address,
+               (unsigned long long)pRegion->Capacity,
+               (unsigned long long)(pRegion->Capacity - pFree[i]),
+               (unsigned long long)pFree[i]);
+    }
+}
+
+
+/* Spreads the file data across the --region list with best-fit decreasing
+   bin packing.  Files matching a --pin rule are placed first in their
+   region, then the remaining files, largest first, each go in the region
+   with the least free space which can still hold them.  The first region
+   also holds the header and tables so its space is reduced by the planned
+   data offset.  Sizes are rounded up to the --target alignment.  The data
+   order is then grouped by region, keeping the existing order within each
+   one.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build whose layout has
+        already been assigned once to size the tables.
+
+   Returns:
+    0 on success and a positive error code otherwise.  When the files don't
+    fit, a report of every region and each file which couldn't be placed is
+    printed before returning.
+*/
+static int _PackRegions(SFileSystemBuild* pFileSystemBuild)
+{
+    SFileSystemBuildEntry*  pEntries = pFileSystemBuild->pFileEntries;
+    unsigned int            FileCount = pFileSystemBuild->FileCount;
+    uint64_t                Free[IMAGE_MAX_REGIONS];
+    uint64_t                TotalFree = 0;
+    uint64_t                UnplacedSize = 0;
+    unsigned int*           pOrder = NULL;
+    unsigned int*           pDataOrder = NULL;
+    unsigned int*           pUnplaced = NULL;
+    unsigned int            UnplacedCount = 0;
+    unsigned int            Count = 0;
+    int*                    pPins = NULL;
+    unsigned int            i;
+    unsigned int            r;
+    int                     Return = 1;
+    uint64_t                Alignment = pFileSystemBuild->HaveTarget ? pFileSystemBuild->Target.Alignment : 1;
+    uint64_t                DataOffset = _AlignOffset(pFileSystemBuild->Layout.DataOffset, Alignment);
+
+    pOrder = malloc((FileCount + 1) * sizeof(*pOrder));
+    pDataOrder = malloc((FileCount + 1) * sizeof(*pDataOrder));
+    pUnplaced = malloc((FileCount + 1) * sizeof(*pUnplaced));
+    pPins = malloc((FileCount + 1) * sizeof(*pPins));
+    if (!pOrder || !pDataOrder || !pUnplaced || !pPins)
+    {
+        fprintf(stderr, "error: Failed to allocate region packing order.\n");
+        goto Error;
+    }
+    if (_ResolveRegionPins(pFileSystemBuild, pPins))
+    {
+        goto Error;
+    }
+
+    for (r = 0 ; r < pFileSystemBuild->RegionCount ; r++)
+    {
+        Free[r] = pFileSystemBuild->Regions[r].Capacity;
+    }
+    if (Free[0] < DataOffset)
+    {
+        fprintf(stderr, "error: The %llu bytes of header and tables don't fit in the %llu byte %s region.\n",
+                (unsigned long long)DataOffset,
+                (unsigned long long)Free[0],
+                pFileSystemBuild->Regions[0].Name);
+        goto Error;
+    }
+    Free[0] -= DataOffset;
+
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        pOrder[i] = i;
+    }
+    g_pPackEntries = pEntries;
+    g_pPackPins = pPins;
+    qsort(pOrder, FileCount, sizeof(*pOrder), _ComparePackOrder);
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        SFileSystemBuildEntry*  pEntry = &pEntries[pOrder[i]];
+        int                     Best = pPins[pOrder[i]];
+        uint64_t                Size = _AlignOffset(pEntry->FileBinarySize, Alignment);
+
+        if (Best < 0)
+        {
+            for (r = 0 ; r < pFileSystemBuild->RegionCount ; r++)
+            {
+                if (Free[r] >= Size && (Best < 0 || Free[r] < Free[Best]))
+                {
+                    Best = r;
+                }
+            }
+        }
+        if (Best < 0 || Free[Best] < Size)
+        {
+            pUnplaced[UnplacedCount++] = pOrder[i];
+            UnplacedSize += pEntry->FileBinarySize;
+            continue;
+        }
+        pEntry->Region = Best;
+        Free[Best] -= Size;
+    }
+
+    if (UnplacedCount)
+    {
+        fprintf(stderr, "error: The file data doesn't fit in the FLASH regions.\n");
+        _PrintRegionTable(stderr, pFileSystemBuild, Free);
+        fprintf(stderr, "    %u files (%llu bytes) couldn't be placed:\n", UnplacedCount, (unsigned long long)UnplacedSize);
+        for (i = 0 ; i < UnplacedCount ; i++)
+        {
+            const SFileSystemBuildEntry* pEntry = &pEntries[pUnplaced[i]];
+
+            fprintf(stderr, "        %s (%llu bytes", 
+                   pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset,
+                   (unsigned long long)pEntry->FileBinarySize);
+            if (pPins[pUnplaced[i]] >= 0)
+            {
+                fprintf(stderr, ", pinned to %s", pFileSystemBuild->Regions[pPins[pUnplaced[i]]].Name);
+            }
+            fprintf(stderr, ")\n");
+        }
+        for (r = 0 ; r < pFileSystemBuild->RegionCount ; r++)
+        {
+            TotalFree += Free[r];
+        }
+        if (UnplacedSize > TotalFree)
+        {
+            fprintf(stderr, "    The regions are %llu bytes short.\n", (unsigned long long)(UnplacedSize - TotalFree));
+        }
+        else
+        {
+            fprintf(stderr, "    There are %llu bytes free in total but no region can hold the files above.\n",
+                   (unsigned long long)TotalFree);
+        }
+        goto Error;
+    }
+
+    /* Group the data by region, keeping any order already chosen. */
+    for (r = 0 ; r < pFileSystemBuild->RegionCount ; r++)
+    {
+        for (i = 0 ; i < FileCount ; i++)
+        {
+            unsigned int Index = pFileSystemBuild->pDataOrder ? pFileSystemBuild->pDataOrder[i] : i;
+
+            if (pEntries[Index].Region == r)
+            {
+                pDataOrder[Count++] = Index;
+            }
+        }
+    }
+    free(pFileSystemBuild->pDataOrder);
+    pFileSystemBuild->pDataOrder = pDataOrder;
+    pDataOrder = NULL;
+
+    printf("Packed %u files into %u FLASH regions.\n", FileCount, pFileSystemBuild->RegionCount);
+    _PrintRegionTable(stdout, pFileSystemBuild, Free);
+
+    Return = 0;
+Error:
+    free(pOrder);
+    free(pDataOrder);
+    free(pUnplaced);
+    free(pPins);
+    return Return;
+}
+
+
+/* Plans the location of every portion of the image, including the data of
+   each file, from the sizes found while scanning the source directory.  This
+   allows offset overflow to be detected before the output file is even
+   opened.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _PlanFileSystemImage(SFileSystemBuild* pFileSystemBuild)
+{
+    SFileSystemLayout*  pLayout = NULL;
+    uint64_t            MaxOffset = 0;
+    uint64_t            MaxSize = 0;
+
+    assert ( pFileSystemBuild && 
+             pFileSystemBuild->pFilenameBuffer &&
+             pFileSystemBuild->pFileEntries );
+
+    pLayout = &pFileSystemBuild->Layout;
+    memset(pLayout, 0, sizeof(*pLayout));
+    if (pFileSystemBuild->Metadata)
+    {
+        _AssignMimeTypeIds(pFileSystemBuild);
+    }
+    if (pFileSystemBuild->pHttpRulesFilename)
+    {
+        _SizeHttpHeaders(pFileSystemBuild);
+    }
+    if (pFileSystemBuild->TargetBigEndian)
+    {
+        pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_BIG_ENDIAN;
+    }
+    if (pFileSystemBuild->MerkleBlockSize)
+    {
+        pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_MERKLE;
+    }
+    if (pFileSystemBuild->pKeyFilename)
+    {
+        unsigned int i;
+
+        pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_ENCRYPTED;
+        if (!pFileSystemBuild->PlaintextTables)
+        {
+            pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES;
+        }
+        /* The 32-bit block counter limits how large an encrypted file can
+           be. */
+        for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+        {
+            if (pFileSystemBuild->pFileEntries[i].FileBinarySize > ((uint64_t)16 << 32))
+            {
+                fprintf(stderr, "error: %s is too large to be encrypted.\n",
+                        pFileSystemBuild->pFilenameBuffer + pFileSystemBuild->pFileEntries[i].FilenameOffset);
+                return 1;
+            }
+        }
+    }
+
+    /* Start with 32-bit entries and only widen them if necessary. */
+    pLayout->EntrySize = sizeof(SFileSystemEntry);
+    pLayout->EntryOffsetBytes = sizeof(uint32_t);
+    pLayout->EntrySizeBytes = sizeof(uint32_t);
+    _AssignImageOffsets(pFileSystemBuild);
+    if (pFileSystemBuild->RegionCount)
+    {
+        /* The tables are the same size wherever the data goes so the space
+           left for data in the first region is now known. */
+        pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_REGIONS;
+        if (_PackRegions(pFileSystemBuild))
+        {
+            return 1;
+        }
+        _AssignImageOffsets(pFileSystemBuild);
+    }
+    _FindLargestEntryFields(pFileSystemBuild, &MaxOffset, &MaxSize);
+    if (MaxOffset <= UINT32_MAX && MaxSize <= UINT32_MAX)
+    {
+        if (pFileSystemBuild->CompactEntries)
+        {
+            _PlanCompactEntries(pFileSystemBuild);
+        }
+        return 0;
+    }
+
+    if (pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr,
+                "error: Image would be %llu bytes which can't be addressed by the 32-bit\n"
+                "       offsets of the legacy format.  Use --format v2 instead.\n",
+                (unsigned long long)pLayout->ImageSize);
+        return 1;
+    }
+
+    pLayout->EntrySize = sizeof(SFileSystemEntry64);
+    pLayout->EntryOffsetBytes = sizeof(uint64_t);
+    pLayout->EntrySizeBytes = sizeof(uint64_t);
+    pLayout->FeatureFlags |= FILE_SYSTEM_FEATURE_64BIT_OFFSETS;
+    _AssignImageOffsets(pFileSystemBuild);
+
+    return 0;
+}
+
+
+/* Stores a value into an image buffer in the byte order of the target.
+
+   Parameters:
+    pDest is the location in the buffer to receive the value.
+    Value is the value to be stored.
+    Bytes is the width of the field in bytes.
+    BigEndian is non-zero if the target stores the most significant byte
+        first.
+
+   Returns:
+    Pointer to the byte just after the stored field.
+*/
+static unsigned char* _StoreField(unsigned char* pDest, uint64_t Value, unsigned int Bytes, int BigEndian)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < Bytes ; i++)
+    {
+        unsigned int Shift = BigEndian ? (Bytes - 1 - i) * 8 : i * 8;
+
+        pDest[i] = (unsigned char)(Value >> Shift);
+    }
+
+    return pDest + Bytes;
+}
+
+
+/* Reverses the byte order of each element in an array of 32-bit words, 4
+   words at a time with SSE2 or NEON when available. */
+static void _SwapBytes32(uint32_t* pWords, size_t Count)
+{
+    size_t  i = 0;
+
+#if defined(__SSE2__)
+    for ( ; i + 4 <= Count ; i += 4)
+    {
+        __m128i Words = _mm_loadu_si128((const __m128i*)(pWords + i));
+
+        /* Swap the bytes in each 16-bit half and then swap the halves. */
+        Words = _mm_or_si128(_mm_slli_epi16(Words, 8), _mm_srli_epi16(Words, 8));
+        Words = _mm_shufflelo_epi16(Words, _MM_SHUFFLE(2, 3, 0, 1));
+        Words = _mm_shufflehi_epi16(Words, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(pWords + i), Words);
+    }
+#elif defined(__ARM_NEON)
+    for ( ; i + 4 <= Count ; i += 4)
+    {
+        vst1q_u8((uint8_t*)(pWords + i), vrev32q_u8(vld1q_u8((const uint8_t*)(pWords + i))));
+    }
+#endif
+    for ( ; i < Count ; i++)
+    {
+        uint32_t Word = pWords[i];
+
+        pWords[i] = (Word >> 24) | ((Word >> 8) & 0xFF00) | 
+                    ((Word << 8) & 0xFF0000) | (Word << 24);
+    }
+}
+
+
+/* Reverses the byte order of each element in an array of 64-bit words. */
+static void _SwapBytes64(uint64_t* pWords, size_t Count)
+{
+    size_t  i = 0;
+
+#if defined(__SSE2__)
+    for ( ; i + 2 <= Count ; i += 2)
+    {
+        __m128i Words = _mm_loadu_si128((const __m128i*)(pWords + i));
+
+        /* Swap the bytes in each 16-bit quarter and then reverse the
+           quarters. */
+        Words = _mm_or_si128(_mm_slli_epi16(Words, 8), _mm_srli_epi16(Words, 8));
+        Words = _mm_shufflelo_epi16(Words, _MM_SHUFFLE(0, 1, 2, 3));
+        Words = _mm_shufflehi_epi16(Words, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i*)(pWords + i), Words);
+    }
+#elif defined(__ARM_NEON)
+    for ( ; i + 2 <= Count ; i += 2)
+    {
+        vst1q_u8((uint8_t*)(pWords + i), vrev64q_u8(vld1q_u8((const uint8_t*)(pWords + i))));
+    }
+#endif
+    for ( ; i < Count ; i++)
+    {
+        uint64_t Word = pWords[i];
+        uint64_t Swapped = 0;
+        int      j;
+
+        for (j = 0 ; j < 8 ; j++)
+        {
+            Swapped = (Swapped << 8) | (Word & 0xFF);
+            Word >>= 8;
+        }
+        pWords[i] = Swapped;
+    }
+}
+
+
+/* Writes the header, and for versioned images the section table, to the
+   start of the image.  Each field is serialized individually so that the
+   image doesn't depend on the byte order or structure padding of the host.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteImageHeader(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    const SFileSystemLayout*    pLayout = &pFileSystemBuild->Layout;
+    int                         BigEndian = pFileSystemBuild->TargetBigEndian;
+    int                         Result = 1;
+    unsigned char               Header[sizeof(SFileSystemHeaderV2) + sizeof(SFileSystemDigest) +
+                                       sizeof(SFileSystemEncryption) +
+                                       FILE_SYSTEM_MAX_SECTIONS * sizeof(SFileSystemSection)];
+    unsigned char*              pCurr = Header;
+    unsigned int                i;
+
+    if (pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        memcpy(pCurr, FILE_SYSTEM_SIGNATURE, 8);
+        pCurr += 8;
+        pCurr = _StoreField(pCurr, pFileSystemBuild->FileCount, 4, BigEndian);
+        assert ( pCurr - Header == sizeof(SFileSystemHeader) );
+    }
+    else
+    {
+        memcpy(pCurr, FILE_SYSTEM_SIGNATURE_V2, 8);
+        pCurr += 8;
+        pCurr = _StoreField(pCurr, FILE_SYSTEM_FORMAT_VERSION, 2, BigEndian);
+        pCurr = _StoreField(pCurr, 
+                            sizeof(SFileSystemHeaderV2) + 
+                            (pFileSystemBuild->MerkleBlockSize ? sizeof(SFileSystemDigest) : 0) +
+                            (pFileSystemBuild->pKeyFilename ? sizeof(SFileSystemEncryption) : 0), 
+                            2, BigEndian);
+        pCurr = _StoreField(pCurr, pLayout->FeatureFlags, 4, BigEndian);
+        pCurr = _StoreField(pCurr, pFileSystemBuild->FileCount, 4, BigEndian);
+        pCurr = _StoreField(pCurr, pLayout->SectionCount, 4, BigEndian);
+        pCurr = _StoreField(pCurr, pLayout->ImageSize, 8, BigEndian);
+        pCurr = _StoreField(pCurr, pLayout->EntrySize, 2, BigEndian);
+        pCurr = _StoreField(pCurr, pLayout->EntryOffsetBytes, 1, BigEndian);
+        pCurr = _StoreField(pCurr, pLayout->EntrySizeBytes, 1, BigEndian);
+        pCurr = _StoreField(pCurr, 0, 4, BigEndian);
+        assert ( pCurr - Header == sizeof(SFileSystemHeaderV2) );
+        if (pFileSystemBuild->MerkleBlockSize)
+        {
+            /* The root hash is filled in once the whole image has been
+               written and hashed. */
+            pCurr = _StoreField(pCurr, pFileSystemBuild->MerkleBlockSize, 4, BigEndian);
+            pCurr = _StoreField(pCurr, 0, 4, BigEndian);
+            pCurr = _StoreField(pCurr, pLayout->MerkleOffset, 8, BigEndian);
+            memset(pCurr, 0, MERKLE_HASH_SIZE);
+            pCurr += MERKLE_HASH_SIZE;
+        }
+        if (pFileSystemBuild->pKeyFilename)
+        {
+            unsigned char KeyCheck[16];
+
+            memset(KeyCheck, 0, sizeof(KeyCheck));
+            AesEncryptBlocks(&pFileSystemBuild->Aes, KeyCheck, 1);
+            pCurr = _StoreField(pCurr, pFileSystemBuild->Aes.KeyBits, 4, BigEndian);
+            pCurr = _StoreField(pCurr, 0, 4, BigEndian);
+            memcpy(pCurr, pFileSystemBuild->Aes.Nonce, sizeof(pFileSystemBuild->Aes.Nonce));
+            pCurr += sizeof(pFileSystemBuild->Aes.Nonce);
+            memcpy(pCurr, KeyCheck, 8);
+            pCurr += 8;
+        }
+
+        for (i = 0 ; i < pLayout->SectionCount ; i++)
+        {
+            const SFileSystemSection* pSection = &pLayout->Sections[i];
+
+            pCurr = _StoreField(pCurr, pSection->Type, 4, BigEndian);
+            pCurr = _StoreField(pCurr, pSection->Flags, 4, BigEndian);
+            pCurr = _StoreField(pCurr, pSection->Offset, 8, BigEndian);
+            pCurr = _StoreField(pCurr, pSection->Size, 8, BigEndian);
+        }
+    }
+
+    Result = fwrite(Header, pCurr - Header, 1, pFile);
+    if (Result != 1)
+    {
+        fprintf(stderr, "error: Failed to write header to file system image.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Converts the build entries to the on-disk entry encoding selected by the
+   planner and writes them to the image.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteFileEntries(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    int                             Return = 1;
+    int                             Result = 1;
+    const SFileSystemLayout*        pLayout = &pFileSystemBuild->Layout;
+    const SFileSystemBuildEntry*    pEntry = pFileSystemBuild->pFileEntries;
+    int                             BigEndian = pFileSystemBuild->TargetBigEndian;
+    unsigned char*                  pEncoded = NULL;
+    size_t                          EncodedSize = 0;
+    unsigned int                    i;
+
+    EncodedSize = (size_t)pLayout->EntrySize * pFileSystemBuild->FileCount;
+    if (EncodedSize == 0)
+    {
+        return 0;
+    }
+    pEncoded = malloc(EncodedSize);
+    if (!pEncoded)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %lu bytes for file entries.\n", 
+                (unsigned long)EncodedSize);
+        goto Error;
+    }
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        uint64_t FilenameOffset = pLayout->FilenamesOffset + pEntry->FilenameOffset;
+
+        if (pLayout->FeatureFlags & FILE_SYSTEM_FEATURE_COMPACT_ENTRIES)
+        {
+            unsigned char* pEncodedEntry = pEncoded + (size_t)i * pLayout->EntrySize;
+
+            pEncodedEntry = _StoreField(pEncodedEntry, FilenameOffset, 
+                                        pLayout->EntryOffsetBytes, BigEndian);
+            pEncodedEntry = _StoreField(pEncodedEntry, pEntry->FileBinaryOffset, 
+                                        pLayout->EntryOffsetBytes, BigEndian);
+            _StoreField(pEncodedEntry, pEntry->FileBinarySize, 
+                        pLayout->EntrySizeBytes, BigEndian);
+        }
+        else if (pLayout->EntrySize == sizeof(SFileSystemEntry64))
+        {
+            SFileSystemEntry64* pEncodedEntry = (SFileSystemEntry64*)pEncoded + i;
+
+            pEncodedEntry->FilenameOffset = FilenameOffset;
+            pEncodedEntry->FileBinaryOffset = pEntry->FileBinaryOffset;
+            pEncodedEntry->FileBinarySize = pEntry->FileBinarySize;
+        }
+        else
+        {
+            SFileSystemEntry* pEncodedEntry = (SFileSystemEntry*)pEncoded + i;
+
+            pEncodedEntry->FilenameOffset = (unsigned int)FilenameOffset;
+            pEncodedEntry->FileBinaryOffset = (unsigned int)pEntry->FileBinaryOffset;
+            pEncodedEntry->FileBinarySize = (unsigned int)pEntry->FileBinarySize;
+        }
+    }
+
+    /* The fixed width entries were filled in using the host's byte order so
+       swap the whole table at once if the target uses the other order. */
+    if (!(pLayout->FeatureFlags & FILE_SYSTEM_FEATURE_COMPACT_ENTRIES) &&
+        BigEndian != _IsHostBigEndian())
+    {
+        if (pLayout->EntrySize == sizeof(SFileSystemEntry64))
+        {
+            _SwapBytes64((uint64_t*)pEncoded, EncodedSize / sizeof(uint64_t));
+        }
+        else
+        {
+            _SwapBytes32((uint32_t*)pEncoded, EncodedSize / sizeof(uint32_t));
+        }
+    }
+
+    if (pLayout->FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES)
+    {
+        AesCtrXor(&pFileSystemBuild->Aes, FILE_SYSTEM_ENCRYPTION_ENTRIES_INDEX, 0, pEncoded, EncodedSize);
+    }
+    Result = fwrite(pEncoded, EncodedSize, 1, pFile);
+    if (Result != 1)
+    {
+        fprintf(stderr, "error: Failed to write file entries to file system image.\n");
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    free(pEncoded);
+    pEncoded = NULL;
+    return Return;
+}
+
+
+/* Writes the filename filter words to the image in the target byte order.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteNameFilter(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    int         Return = 1;
+    size_t      FilterSize = pFileSystemBuild->NameFilterWordCount * sizeof(uint32_t);
+    uint32_t*   pWords = NULL;
+
+    pWords = malloc(FilterSize);
+    if (!pWords)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %lu bytes for filename filter.\n", 
+                (unsigned long)FilterSize);
+        goto Error;
+    }
+    memcpy(pWords, pFileSystemBuild->pNameFilter, FilterSize);
+    if (pFileSystemBuild->TargetBigEndian != _IsHostBigEndian())
+    {
+        _SwapBytes32(pWords, pFileSystemBuild->NameFilterWordCount);
+    }
+    if (1 != fwrite(pWords, FilterSize, 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to write filename filter to file system image.\n");
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    free(pWords);
+    pWords = NULL;
+    return Return;
+}
+
+
+/* Builds the contents of the FILE_SYSTEM_SECTION_NAME_PREFIXES sidecar: the
+   first PrefixLength bytes of each sorted filename, NULL padded.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build with sorted
+        entries.
+    PrefixLength is the length of each prefix in bytes.
+
+   Returns:
+    Pointer to the prefixes which the caller must free() or NULL if the
+    allocation failed.
+*/
+static unsigned char* _AllocNamePrefixes(const SFileSystemBuild* pFileSystemBuild, unsigned int PrefixLength)
+{
+    const SFileSystemBuildEntry* pEntry = pFileSystemBuild->pFileEntries;
+    unsigned char*               pPrefixes = NULL;
+    size_t                       PrefixesSize;
+    unsigned int                 i;
+
+    /* Always allocate at least one prefix so that an empty image doesn't
+       look like a failed allocation. */
+    PrefixesSize = (size_t)PrefixLength * (pFileSystemBuild->FileCount + 1);
+    pPrefixes = malloc(PrefixesSize);
+    if (!pPrefixes)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %lu bytes for filename prefixes.\n", 
+                (unsigned long)PrefixesSize);
+        return NULL;
+    }
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        strncpy((char*)pPrefixes + (size_t)i * PrefixLength,
+                pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset,
+                PrefixLength);
+    }
+
+    return pPrefixes;
+}
+
+
+/* Writes padding to the image until it reaches the planned offset of the
+   next section or file.
+
+   Parameters:
+    pFile is the image file being written.
+    Offset is the planned offset of the next section or file.
+    Fill is the value of each padding byte.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WritePadding(FILE* pFile, uint64_t Offset, int Fill)
+{
+    long    CurrentOffset = ftell(pFile);
+
+    if (CurrentOffset < 0 || (uint64_t)CurrentOffset > Offset)
+    {
+        fprintf(stderr, "error: Failed to determine current file location.\n");
+        return 1;
+    }
+    while ((uint64_t)CurrentOffset++ < Offset)
+    {
+        if (EOF == fputc(Fill, pFile))
+        {
+            fprintf(stderr, "error: Failed to write padding to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Writes a copy of a region to the image encrypted with the --encrypt key,
+   leaving the original bytes untouched.
+
+   Parameters:
+    pAes is the expanded key and nonce.
+    Index is the counter block index of the region.
+    pData points to the plaintext bytes.
+    Size is the number of bytes.
+    pBuffer is a COPY_BUFFER_SIZE scratch buffer.
+    pCrc32c is set to the CRC32C of the encrypted bytes unless it is NULL.
+    pFile is the image file being written.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteEncrypted(const SAesContext*   pAes, 
+                           uint32_t             Index, 
+                           const unsigned char* pData, 
+                           uint64_t             Size, 
+                           unsigned char*       pBuffer, 
+                           uint32_t*            pCrc32c,
+                           FILE*                pFile)
+{
+    uint64_t Offset = 0;
+
+    if (pCrc32c)
+    {
+        *pCrc32c = 0;
+    }
+    while (Offset < Size)
+    {
+        size_t ChunkSize = Size - Offset < COPY_BUFFER_SIZE ? (size_t)(Size - Offset) : COPY_BUFFER_SIZE;
+
+        memcpy(pBuffer, pData + Offset, ChunkSize);
+        AesCtrXor(pAes, Index, Offset, pBuffer, ChunkSize);
+        if (pCrc32c)
+        {
+            *pCrc32c = Crc32cUpdate(*pCrc32c, pBuffer, ChunkSize);
+        }
+        if (1 != fwrite(pBuffer, ChunkSize, 1, pFile))
+        {
+            fprintf(stderr,
+                    "error: Failed to write %llu bytes to file system image.\n",
+                    (unsigned long long)Size);
+            return 1;
+        }
+        Offset += ChunkSize;
+    }
+
+    return 0;
+}
+
+
+/* Writes the SFileSystemMetadata record of each entry to the image in the
+   target byte order.  The content hashes are only known once the file data
+   has been copied so this is called a second time at the end of the build to
+   fill them in.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, positioned at the metadata
+        section.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteMetadata(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    const SFileSystemBuildEntry* pEntry = pFileSystemBuild->pFileEntries;
+    int                          BigEndian = pFileSystemBuild->TargetBigEndian;
+    unsigned int                 i;
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        unsigned char   Record[sizeof(SFileSystemMetadata)];
+        unsigned char*  pCurr = Record;
+
+        pCurr = _StoreField(pCurr, pEntry->ModificationTime, 8, BigEndian);
+        pCurr = _StoreField(pCurr, pEntry->ContentHash, 8, BigEndian);
+        pCurr = _StoreField(pCurr, pEntry->Mode, 4, BigEndian);
+        pCurr = _StoreField(pCurr, pFileSystemBuild->MimeTypeIds[pEntry->MimeType], 2, BigEndian);
+        _StoreField(pCurr, 0, 2, BigEndian);
+        if (1 != fwrite(Record, sizeof(Record), 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write file metadata to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Writes the table of MIME type strings referenced by the metadata records.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, positioned at the MIME type
+        section.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteMimeTypes(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    const SFileSystemLayout* pLayout = &pFileSystemBuild->Layout;
+    uint64_t                 StringOffset;
+    unsigned int             Id;
+    unsigned int             i;
+
+    /* The ids were handed out in order so the strings can be found by
+       searching for the first g_MimeTypes element with each id. */
+    StringOffset = pLayout->MimeTypesOffset + 
+                   (uint64_t)sizeof(uint32_t) * pFileSystemBuild->MimeTypeCount;
+    for (Id = 0 ; Id < pFileSystemBuild->MimeTypeCount ; Id++)
+    {
+        unsigned char Offset[sizeof(uint32_t)];
+
+        for (i = 0 ; pFileSystemBuild->MimeTypeIds[i] != (int)Id ; i++)
+        {
+        }
+        _StoreField(Offset, StringOffset, sizeof(Offset), pFileSystemBuild->TargetBigEndian);
+        if (1 != fwrite(Offset, sizeof(Offset), 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write MIME types to file system image.\n");
+            return 1;
+        }
+        StringOffset += strlen(g_MimeTypes[i].pMimeType) + 1;
+    }
+    for (Id = 0 ; Id < pFileSystemBuild->MimeTypeCount ; Id++)
+    {
+        const char* pMimeType;
+
+        for (i = 0 ; pFileSystemBuild->MimeTypeIds[i] != (int)Id ; i++)
+        {
+        }
+        pMimeType = g_MimeTypes[i].pMimeType;
+        if (1 != fwrite(pMimeType, strlen(pMimeType) + 1, 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write MIME types to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Writes the SFileSystemVariant record of each precompressed variant to the
+   image in the target byte order.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, positioned at the variants
+        section.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteVariants(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    const SFileSystemBuildVariant* pVariant = pFileSystemBuild->pVariants;
+    int                            BigEndian = pFileSystemBuild->TargetBigEndian;
+    unsigned int                   i;
+
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++, pVariant++)
+    {
+        unsigned char   Record[sizeof(SFileSystemVariant)];
+        unsigned char*  pCurr = Record;
+
+        pCurr = _StoreField(pCurr, pVariant->EntryIndex, 4, BigEndian);
+        pCurr = _StoreField(pCurr, pVariant->Encoding, 2, BigEndian);
+        pCurr = _StoreField(pCurr, 0, 2, BigEndian);
+        pCurr = _StoreField(pCurr, pVariant->Offset, 8, BigEndian);
+        _StoreField(pCurr, pVariant->Size, 8, BigEndian);
+        if (1 != fwrite(Record, sizeof(Record), 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write precompressed variants to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Creates a filename for one of the generated output files by replacing the
+   extension of the output binary filename.
+
+   Parameters:
+    pBinaryFilename is the name of the output binary file.
+    pExtension is the extension, including the leading '.', to be used for the
+        new filename.
+
+   Returns:
+    Pointer to the allocated filename which the caller must free() or NULL if
+    the allocation failed.
+*/
+static char* _AllocOutputFilename(const char* pBinaryFilename, const char* pExtension)
+{
+    const char* pBasename = NULL;
+    const char* pExtensionStart = NULL;
+    size_t      StemLength = 0;
+    char*       pFilename = NULL;
+
+    assert ( pBinaryFilename && pExtension );
+
+    /* Only treat a '.' found in the last path component as an extension. */
+    pBasename = strrchr(pBinaryFilename, '/');
+    pBasename = pBasename ? pBasename + 1 : pBinaryFilename;
+    pExtensionStart = strrchr(pBasename, '.');
+    if (pExtensionStart)
+    {
+        StemLength = pExtensionStart - pBinaryFilename;
+    }
+    else
+    {
+        StemLength = strlen(pBinaryFilename);
+    }
+
+    pFilename = malloc(StemLength + strlen(pExtension) + 1);
+    if (!pFilename)
+    {
+        fprintf(stderr,
+                "error: Failed to allocate filename buffer for %s output.\n",
+                pExtension);
+        return NULL;
+    }
+    memcpy(pFilename, pBinaryFilename, StemLength);
+    strcpy(pFilename + StemLength, pExtension);
+
+    return pFilename;
+}
+
+
+/* Writes the --region table followed by the region of each entry to the
+   image in the target byte order.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, positioned at the regions section.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteRegions(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    int             BigEndian = pFileSystemBuild->TargetBigEndian;
+    unsigned int    i;
+
+    for (i = 0 ; i < pFileSystemBuild->RegionCount ; i++)
+    {
+        const SImageRegion* pRegion = &pFileSystemBuild->Regions[i];
+        unsigned char       Record[sizeof(SFileSystemRegion)];
+        unsigned char*      pCurr = Record;
+
+        pCurr = _StoreField(pCurr, pRegion->Address, 8, BigEndian);
+        pCurr = _StoreField(pCurr, pRegion->Capacity, 8, BigEndian);
+        _StoreField(pCurr, pRegion->Size, 8, BigEndian);
+        if (1 != fwrite(Record, sizeof(Record), 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write FLASH regions to file system image.\n");
+            return 1;
+        }
+    }
+    if (ftell(pFile) != (long)(pFileSystemBuild->ImageFileOffset + pFileSystemBuild->Layout.EntryRegionsOffset))
+    {
+        fprintf(stderr, "error: Failed to write FLASH regions to file system image.\n");
+        return 1;
+    }
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        if (EOF == fputc(pFileSystemBuild->pFileEntries[i].Region, pFile))
+        {
+            fprintf(stderr, "error: Failed to write entry regions to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Opens the binary file which receives the data of a region after the first.
+   It is named after the image with the region name in front of the
+   extension.
+
+   Returns:
+    The opened file or NULL on failure.
+*/
+static FILE* _OpenRegionFile(const SFileSystemBuild* pFileSystemBuild, unsigned int Region)
+{
+    char    Extension[sizeof(pFileSystemBuild->Regions[0].Name) + 8];
+    char*   pFilename;
+    FILE*   pFile = NULL;
+
+    snprintf(Extension, sizeof(Extension), ".%s.bin", pFileSystemBuild->Regions[Region].Name);
+    pFilename = _AllocOutputFilename(pFileSystemBuild->pOutputBinaryFilename, Extension);
+    if (!pFilename)
+    {
+        return NULL;
+    }
+    printf("    Writing %s region to %s.\n", pFileSystemBuild->Regions[Region].Name, pFilename);
+    pFile = fopen(pFilename, "wb");
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to open %s for writing.\n", pFilename);
+    }
+    free(pFilename);
+
+    return pFile;
+}
+
+
+/* Writes the size of the HTTP response header in front of each entry and
+   then each variant to the image in the target byte order.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, positioned at the HTTP headers
+        section.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteHttpHeaderSizes(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    unsigned int    Count = pFileSystemBuild->FileCount + pFileSystemBuild->VariantCount;
+    unsigned int    i;
+
+    for (i = 0 ; i < Count ; i++)
+    {
+        unsigned char   Size[sizeof(uint32_t)];
+        unsigned int    HeaderSize;
+
+        if (i < pFileSystemBuild->FileCount)
+        {
+            HeaderSize = pFileSystemBuild->pFileEntries[i].HttpHeaderSize;
+        }
+        else
+        {
+            HeaderSize = pFileSystemBuild->pVariants[i - pFileSystemBuild->FileCount].HttpHeaderSize;
+        }
+        _StoreField(Size, HeaderSize, sizeof(Size), pFileSystemBuild->TargetBigEndian);
+        if (1 != fwrite(Size, sizeof(Size), 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write HTTP header sizes to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Writes the CRC32C of each entry and then each variant to the image in the
+   target byte order.  The CRCs are only known once the data has been copied
+   so this is called a second time at the end of the build to fill them in.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, positioned at the integrity
+        section.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteIntegrity(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    unsigned int    Count = pFileSystemBuild->FileCount + pFileSystemBuild->VariantCount;
+    unsigned int    i;
+
+    for (i = 0 ; i < Count ; i++)
+    {
+        unsigned char   Field[sizeof(uint32_t)];
+        uint32_t        Crc;
+
+        if (i < pFileSystemBuild->FileCount)
+        {
+            Crc = pFileSystemBuild->pFileEntries[i].Crc32c;
+        }
+        else
+        {
+            Crc = pFileSystemBuild->pVariants[i - pFileSystemBuild->FileCount].Crc32c;
+        }
+        _StoreField(Field, Crc, sizeof(Field), pFileSystemBuild->TargetBigEndian);
+        if (1 != fwrite(Field, sizeof(Field), 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write CRC32C table to file system image.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Writes the HTTP response header of an entry, or of one of its variants,
+   just in front of its data.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pEntry is the entry whose header is to be written.
+    pVariant is the precompressed variant of pEntry or NULL for the original
+        data.
+    pFile is the image file being written, positioned at the header.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteHttpHeader(const SFileSystemBuild*        pFileSystemBuild,
+                            const SFileSystemBuildEntry*   pEntry,
+                            const SFileSystemBuildVariant* pVariant,
+                            FILE*                          pFile)
+{
+    char            Header[HTTP_HEADER_MAX_SIZE];
+    unsigned int    HeaderSize;
+
+    HeaderSize = _RenderEntryHttpHeader(pFileSystemBuild, pEntry, pVariant, Header);
+    if (HeaderSize != (pVariant ? pVariant->HttpHeaderSize : pEntry->HttpHeaderSize) ||
+        1 != fwrite(Header, HeaderSize, 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to write HTTP header to file system image.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Hashes the finished image into the --merkle tree, writes the tree to the
+   end of the image and fills in the root in the header.  The image is
+   mapped so that the blocks can be hashed in parallel straight from the
+   page cache.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the planned file system build.
+    pFile is the image file being written, which must be open for reading
+        as well.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteMerkleTree(const SFileSystemBuild* pFileSystemBuild, FILE* pFile)
+{
+    const SFileSystemLayout*    pLayout = &pFileSystemBuild->Layout;
+    uint64_t                    ImageFileOffset = pFileSystemBuild->ImageFileOffset;
+    void*                       pMapping = MAP_FAILED;
+    unsigned char*              pTree = NULL;
+    uint64_t                    LeafCount;
+    uint64_t                    TreeSize = pLayout->ImageSize - pLayout->MerkleOffset;
+    uint64_t                    StartTime;
+    uint64_t                    ElapsedTime;
+    unsigned int                ThreadCount;
+    int                         Return = 1;
+
+    LeafCount = (pLayout->MerkleOffset + pFileSystemBuild->MerkleBlockSize - 1) / pFileSystemBuild->MerkleBlockSize;
+    pTree = malloc((size_t)TreeSize);
+    if (!pTree)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes for Merkle tree.\n", (unsigned long long)TreeSize);
+        goto Error;
+    }
+    if (fflush(pFile))
+    {
+        fprintf(stderr, "error: Failed to write file system image.\n");
+        goto Error;
+    }
+    /* The mapping starts at the beginning of the file since the image in an
+       --out file needn't start on a page boundary. */
+    pMapping = mmap(NULL, (size_t)(ImageFileOffset + pLayout->MerkleOffset), PROT_READ, MAP_SHARED, fileno(pFile), 0);
+    if (pMapping == MAP_FAILED)
+    {
+        fprintf(stderr, "error: Failed to map file system image for hashing.\n");
+        goto Error;
+    }
+
+    StartTime = _GetTimeInNanoseconds();
+    ThreadCount = _HashMerkleLeaves((const unsigned char*)pMapping + ImageFileOffset, pLayout->MerkleOffset,
+                                    pFileSystemBuild->MerkleBlockSize, pTree);
+    _BuildMerkleLevels(pTree, LeafCount);
+    ElapsedTime = _GetTimeInNanoseconds() - StartTime;
+    printf("    Adding Merkle tree (%llu bytes, %u levels) to file system image.\n",
+           (unsigned long long)TreeSize, pLayout->MerkleLevelCount);
+    printf("    Hashed %llu blocks of %llu bytes (%s) using %u threads in %.2f ms (%.1f MB/s).\n",
+           (unsigned long long)LeafCount,
+           (unsigned long long)pFileSystemBuild->MerkleBlockSize,
+           Sha256Implementation(),
+           ThreadCount,
+           ElapsedTime / 1000000.0,
+           ElapsedTime ? pLayout->MerkleOffset * 1000.0 / ElapsedTime : 0.0);
+
+    if (fseek(pFile, (long)(ImageFileOffset + pLayout->MerkleOffset), SEEK_SET) ||
+        1 != fwrite(pTree, (size_t)TreeSize, 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to write Merkle tree to file system image.\n");
+        goto Error;
+    }
+    if (fseek(pFile, (long)(ImageFileOffset + sizeof(SFileSystemHeaderV2) + offsetof(SFileSystemDigest, RootHash)),
+              SEEK_SET) ||
+        1 != fwrite(pTree + TreeSize - MERKLE_HASH_SIZE, MERKLE_HASH_SIZE, 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to write Merkle root to file system image.\n");
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    if (pMapping != MAP_FAILED)
+    {
+        munmap(pMapping, (size_t)(ImageFileOffset + pLayout->MerkleOffset));
+    }
+    free(pTree);
+    return Return;
+}
+
+
+/* Copies the --firmware to the start of the --out file and fills the gap up
+   to the image with erased bytes, so that the image can then be written in
+   place after it.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    pFile is the --out file, just opened.
+    pBuffer is a COPY_BUFFER_SIZE byte buffer.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteFirmware(const SFileSystemBuild* pFileSystemBuild, FILE* pFile, unsigned char* pBuffer)
+{
+    FILE*       pFirmwareFile = NULL;
+    uint64_t    Copied = 0;
+    size_t      BytesRead;
+    int         Return = 1;
+
+    printf("    Adding firmware %s (%llu bytes) in front of the image.\n",
+           pFileSystemBuild->pFirmwareFilename, (unsigned long long)pFileSystemBuild->FirmwareSize);
+    pFirmwareFile = fopen(pFileSystemBuild->pFirmwareFilename, "rb");
+    if (!pFirmwareFile)
+    {
+        fprintf(stderr, "error: Failed to open %s for read.\n", pFileSystemBuild->pFirmwareFilename);
+        return 1;
+    }
+    while ((BytesRead = fread(pBuffer, 1, COPY_BUFFER_SIZE, pFirmwareFile)) > 0)
+    {
+        if (BytesRead != fwrite(pBuffer, 1, BytesRead, pFile))
+        {
+            fprintf(stderr, "error: Failed to write the contents of %s.\n", pFileSystemBuild->pFirmwareFilename);
+            goto Error;
+        }
+        Copied += BytesRead;
+    }
+    if (ferror(pFirmwareFile) || Copied != pFileSystemBuild->FirmwareSize)
+    {
+        fprintf(stderr, "error: %s changed size while the image was built.\n", pFileSystemBuild->pFirmwareFilename);
+        goto Error;
+    }
+    Return = _WritePadding(pFile, pFileSystemBuild->ImageFileOffset, FLASH_ERASED_BYTE);
+Error:
+    fclose(pFirmwareFile);
+    return Return;
+}
+
+
+/* Creates a simple file system image based on the file entries found in the
+   caller supplied pFileSystemBuild structure.  The layout must already have
+   been planned by _PlanFileSystemImage().
+   
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+        
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CreateFileSystemImage(SFileSystemBuild* pFileSystemBuild)
+{
+    int                     Return = 1;
+    int                     Result = 1;
+    unsigned int            FileCount = 0;
+    FILE*                   pFile = NULL;
+    FILE*                   pDataFile = NULL;
+    uint64_t                ImageFileOffset = pFileSystemBuild->ImageFileOffset;
+    uint64_t                DataFileOffset = 0;
+    FILE*                   pSourceFile = NULL;
+    long                    ImageFileSize = -1;
+    SFileSystemBuildEntry*  pEntry = NULL;
+    SFileSystemLayout*      pLayout = NULL;
+    unsigned char*          pBuffer = NULL;
+    unsigned char*          pPrefixes = NULL;
+    unsigned int            Region = 0;
+    const SAesContext*      pAes = NULL;
+    uint64_t                CopyStartTime = 0;
+    uint64_t                EncryptTime = 0;
+    uint64_t                EncryptedSize = 0;
+    unsigned int            i;
+    
+    assert ( pFileSystemBuild && 
+             pFileSystemBuild->pRootSourceDirectory &&
+             pFileSystemBuild->pOutputBinaryFilename &&
+             pFileSystemBuild->pFilenameBuffer &&
+             pFileSystemBuild->pFileEntries );
+    
+    /* Output information about the image build process to be started */
+    FileCount = pFileSystemBuild->FileCount;
+    pLayout = &pFileSystemBuild->Layout;
+    if (pFileSystemBuild->pKeyFilename)
+    {
+        pAes = &pFileSystemBuild->Aes;
+    }
+    if (ImageFileOffset)
+    {
+        printf("Creating file system image in %s at offset %llu...\n",
+               pFileSystemBuild->pImageFilename, (unsigned long long)ImageFileOffset);
+    }
+    else
+    {
+        printf("Creating file system image in %s...\n",
+               pFileSystemBuild->pImageFilename);
+    }
+           
+    pBuffer = malloc(COPY_BUFFER_SIZE);
+    if (!pBuffer)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %d bytes for read buffer.\n",
+                COPY_BUFFER_SIZE);
+        goto Error;
+    }
+    
+    /* Open the desired file to be populated with the new file system image.
+       It is read back to build the optional Merkle tree.  An --out file gets
+       the firmware first so that the image is written in place after it. */
+    pFile = fopen(pFileSystemBuild->pImageFilename, "w+");
+    if (!pFile)
+    {
+        fprintf(stderr,
+                "Failed to open %s for writing of the file system image.\n",
+                pFileSystemBuild->pImageFilename);
+        goto Error;
+    }
+    if (pFileSystemBuild->pCombinedFilename)
+    {
+        Result = _WriteFirmware(pFileSystemBuild, pFile, pBuffer);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+    
+    /* Write out the file system header */
+    printf("    Adding header (%llu bytes) to file system image.\n", 
+           (unsigned long long)pLayout->HeaderSize);
+    Result = _WriteImageHeader(pFileSystemBuild, pFile);
+    if (Result)
+    {
+        goto Error;
+    }
+    
+    /* Write out the optional filename filter. */
+    if (pFileSystemBuild->pNameFilter)
+    {
+        printf("    Adding filename filter (%lu bytes) to file system image.\n",
+               (unsigned long)(pFileSystemBuild->NameFilterWordCount * sizeof(uint32_t)));
+        Result = _WriteNameFilter(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+    if (ftell(pFile) != (long)(ImageFileOffset + pLayout->EntriesOffset))
+    {
+        fprintf(stderr, "error: Failed to write header to file system image.\n");
+        goto Error;
+    }
+    
+    /* Write out the file entries.  The offsets and sizes are already known
+       from the planned layout. */
+    printf("    Adding file entry descriptors (%llu bytes) to file system image.\n",
+           (unsigned long long)pLayout->EntrySize * pFileSystemBuild->FileCount);
+    Result = _WriteFileEntries(pFileSystemBuild, pFile);
+    if (Result)
+    {
+        goto Error;
+    }
+       
+    /* Write out the optional filename prefix sidecar. */
+    if (pFileSystemBuild->NamePrefixLength)
+    {
+        size_t PrefixesSize = (size_t)pFileSystemBuild->NamePrefixLength * FileCount;
+        
+        printf("    Adding filename prefixes (%lu bytes) to file system image.\n",
+               (unsigned long)PrefixesSize);
+        if (ftell(pFile) != (long)(ImageFileOffset + pLayout->NamePrefixesOffset))
+        {
+            fprintf(stderr, "error: Failed to write file entries to file system image.\n");
+            goto Error;
+        }
+        pPrefixes = _AllocNamePrefixes(pFileSystemBuild, pFileSystemBuild->NamePrefixLength);
+        if (!pPrefixes)
+        {
+            goto Error;
+        }
+        if (PrefixesSize > 0 && 1 != fwrite(pPrefixes, PrefixesSize, 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write filename prefixes to file system image.\n");
+            goto Error;
+        }
+    }
+       
+    /* Write out the optional metadata records and the MIME types they
+       reference.  The records are written again once the content hashes are
+       known. */
+    if (pFileSystemBuild->Metadata)
+    {
+        printf("    Adding file metadata (%llu bytes) to file system image.\n",
+               (unsigned long long)(pLayout->MimeTypesOffset - pLayout->MetadataOffset + 
+                                    pLayout->MimeTypesSize));
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->MetadataOffset, 0);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WriteMetadata(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WriteMimeTypes(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+       
+    /* Write out the optional table of precompressed variants. */
+    if (pFileSystemBuild->VariantCount)
+    {
+        printf("    Adding precompressed variant descriptors (%lu bytes) to file system image.\n",
+               (unsigned long)(pFileSystemBuild->VariantCount * sizeof(SFileSystemVariant)));
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->VariantsOffset, 0);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WriteVariants(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+       
+    /* Write out the optional sizes of the HTTP response headers. */
+    if (pFileSystemBuild->pHttpRulesFilename)
+    {
+        printf("    Adding HTTP header sizes (%lu bytes) to file system image.\n",
+               (unsigned long)((FileCount + pFileSystemBuild->VariantCount) * sizeof(uint32_t)));
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->HttpHeadersOffset, 0);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WriteHttpHeaderSizes(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+       
+    /* Write out the optional CRC32C table.  It is written again once the
+       data has been copied. */
+    if (pFileSystemBuild->Integrity)
+    {
+        printf("    Adding CRC32C table (%lu bytes, %s) to file system image.\n",
+               (unsigned long)((FileCount + pFileSystemBuild->VariantCount) * sizeof(uint32_t)),
+               Crc32cImplementation());
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->IntegrityOffset, 0);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WriteIntegrity(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+       
+    /* Write out the optional FLASH region table. */
+    if (pFileSystemBuild->RegionCount)
+    {
+        printf("    Adding FLASH regions (%llu bytes) to file system image.\n",
+               (unsigned long long)(pLayout->FilenamesOffset - pLayout->RegionsOffset));
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->RegionsOffset, 0);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WriteRegions(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+       
+    /* Write out the filename buffer */
+    printf("    Adding filenames (%u bytes) to file system image.\n",
+           pFileSystemBuild->FilenameBufferSize);
+    if (ftell(pFile) != (long)(ImageFileOffset + pLayout->FilenamesOffset))
+    {
+        fprintf(stderr, "error: Failed to write file entries to file system image.\n");
+        goto Error;
+    }
+    if (pLayout->FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES)
+    {
+        Result = _WriteEncrypted(pAes, FILE_SYSTEM_ENCRYPTION_FILENAMES_INDEX, 
+                                 (const unsigned char*)pFileSystemBuild->pFilenameBuffer,
+                                 pFileSystemBuild->FilenameBufferSize, 
+                                 pBuffer, NULL, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+    else
+    {
+        Result = fwrite(pFileSystemBuild->pFilenameBuffer,
+                        pFileSystemBuild->FilenameBufferSize, 
+                        1, 
+                        pFile);
+        if (Result != 1)
+        {
+            fprintf(stderr, "error: Failed to write filename buffer to file system image.\n");
+            goto Error;
+        }
+    }
+    
+    /* Write out the contents of the files at their planned offsets. */
+    printf("    Adding %u entries to file system image.\n", FileCount);
+    CopyStartTime = _GetTimeInNanoseconds();
+    pDataFile = pFile;
+    DataFileOffset = ImageFileOffset;
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        const SFileSystemLayer* pLayer;
+        char                    FilenameBuffer[1024];
+        char*                   pFilename;
+        uint64_t                BytesLeft;
+        
+        /* Build up path to source file for this entry */
+        pEntry = &pFileSystemBuild->pFileEntries[pFileSystemBuild->pDataOrder ? 
+                                                 pFileSystemBuild->pDataOrder[i] : i];
+        pLayer = _GetSourceLayer(pFileSystemBuild, pEntry);
+        
+        /* Move on to the file of the next region once its data is reached. */
+        if (pEntry->Region != Region)
+        {
+            if (pDataFile != pFile && fclose(pDataFile))
+            {
+                pDataFile = pFile;
+                fprintf(stderr, "error: Failed to write %s region.\n", 
+                        pFileSystemBuild->Regions[Region].Name);
+                goto Error;
+            }
+            Region = pEntry->Region;
+            DataFileOffset = 0;
+            pDataFile = _OpenRegionFile(pFileSystemBuild, Region);
+            if (!pDataFile)
+            {
+                pDataFile = pFile;
+                goto Error;
+            }
+        }
+        pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+        snprintf(FilenameBuffer, sizeof(FilenameBuffer), 
+                 "%s/%s", 
+                 pLayer ? pLayer->pPath : pFileSystemBuild->pRootSourceDirectory, 
+                 pFilename);
+        printf("        %s -> %s (%llu bytes)\n", 
+               FilenameBuffer, 
+               pFilename, 
+               (unsigned long long)pEntry->FileBinarySize);
+        
+        /* Skip over any gap left to keep the file within a FLASH sector. */
+        Result = _WritePadding(pDataFile, DataFileOffset + pEntry->FileBinaryOffset - pEntry->HttpHeaderSize, FLASH_ERASED_BYTE);
+        if (Result)
+        {
+            goto Error;
+        }
+        
+        /* The response header goes in front of the data.  It is written
+           again once the content hash is known. */
+        if (pFileSystemBuild->pHttpRulesFilename)
+        {
+            Result = _WriteHttpHeader(pFileSystemBuild, pEntry, NULL, pDataFile);
+            if (Result)
+            {
+                goto Error;
+            }
+        }
+        
+        /* Make sure that the data is being placed where the entry says it
+           will be found. */
+        if (ftell(pDataFile) != (long)(DataFileOffset + pEntry->FileBinaryOffset))
+        {
+            fprintf(stderr, "error: Failed to determine current file location.\n");
+            goto Error;
+        }
+        
+        /* Data from an existing image is copied as a single extent. */
+        if (pLayer && pLayer->Image.pImage)
+        {
+            if (pAes)
+            {
+                uint64_t StartTime = _GetTimeInNanoseconds();
+
+                Result = _WriteEncrypted(pAes, (uint32_t)(pEntry - pFileSystemBuild->pFileEntries),
+                                         pLayer->Image.pImage + pEntry->SourceOffset, 
+                                         pEntry->FileBinarySize, pBuffer, 
+                                         pFileSystemBuild->Integrity ? &pEntry->Crc32c : NULL, 
+                                         pDataFile);
+                if (Result)
+                {
+                    goto Error;
+                }
+                EncryptTime += _GetTimeInNanoseconds() - StartTime;
+                EncryptedSize += pEntry->FileBinarySize;
+            }
+            else if (pEntry->FileBinarySize > 0 &&
+                     1 != fwrite(pLayer->Image.pImage + pEntry->SourceOffset, (size_t)pEntry->FileBinarySize, 1, pDataFile))
+            {
+                fprintf(stderr,
+                        "error: Failed to write %llu bytes to file system image.\n",
+                        (unsigned long long)pEntry->FileBinarySize);
+                goto Error;
+            }
+            if (pFileSystemBuild->Metadata || pFileSystemBuild->pHttpRulesFilename)
+            {
+                pEntry->ContentHash = FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, 
+                                                           pLayer->Image.pImage + pEntry->SourceOffset, 
+                                                           (size_t)pEntry->FileBinarySize);
+            }
+            if (pFileSystemBuild->Integrity && !pAes)
+            {
+                pEntry->Crc32c = Crc32cUpdate(0, pLayer->Image.pImage + pEntry->SourceOffset, 
+                                               (size_t)pEntry->FileBinarySize);
+            }
+            continue;
+        }
+        
+        /* Open the current source file */
+        pSourceFile = fopen(FilenameBuffer, "r");
+        if (!pSourceFile)
+        {
+            fprintf(stderr, "error: Failed to open %s for read.\n", 
+                    FilenameBuffer);
+            goto Error;
+        }
+        
+        /* Copy the file data in COPY_BUFFER_SIZE chunks. */
+        BytesLeft = pEntry->FileBinarySize;
+        pEntry->ContentHash = FILE_SYSTEM_FNV64_OFFSET_BASIS;
+        pEntry->Crc32c = 0;
+        while (BytesLeft > 0)
+        {
+            size_t ChunkSize = BytesLeft < COPY_BUFFER_SIZE ? (size_t)BytesLeft : COPY_BUFFER_SIZE;
+            
+            Result = fread(pBuffer, ChunkSize, 1, pSourceFile);
+            if (Result != 1)
+            {
+                fprintf(stderr,
+                        "error: Failed to read %llu bytes from %s.\n",
+                        (unsigned long long)pEntry->FileBinarySize,
+                        FilenameBuffer);
+                goto Error;
+            }
+            
+            /* ETags are of the plaintext while the CRC32C is of the bytes
+               stored in FLASH. */
+            if (pFileSystemBuild->Metadata || pFileSystemBuild->pHttpRulesFilename)
+            {
+                pEntry->ContentHash = FsReaderHashContents(pEntry->ContentHash, pBuffer, ChunkSize);
+            }
+            if (pAes)
+            {
+                uint64_t StartTime = _GetTimeInNanoseconds();
+
+                AesCtrXor(pAes, (uint32_t)(pEntry - pFileSystemBuild->pFileEntries),
+                           pEntry->FileBinarySize - BytesLeft, pBuffer, ChunkSize);
+                EncryptTime += _GetTimeInNanoseconds() - StartTime;
+                EncryptedSize += ChunkSize;
+            }
+            if (pFileSystemBuild->Integrity)
+            {
+                pEntry->Crc32c = Crc32cUpdate(pEntry->Crc32c, pBuffer, ChunkSize);
+            }
+            Result = fwrite(pBuffer, ChunkSize, 1, pDataFile);
+            if (Result != 1)
+            {
+                fprintf(stderr,
+                        "error: Failed to write %llu bytes to file system image.\n",
+                        (unsigned long long)pEntry->FileBinarySize);
+                goto Error;
+            }
+            BytesLeft -= ChunkSize;
+        }
+        
+        /* The entry has already been written with the size found during the
+           scan so the file can't be allowed to have grown since. */
+        if (EOF != fgetc(pSourceFile))
+        {
+            fprintf(stderr, 
+                    "error: File contents of %s appear to have changed while creating file system image.\n", 
+                    FilenameBuffer);
+            goto Error;
+        }
+        fclose(pSourceFile);
+        pSourceFile = NULL;
+    }
+    
+    if (pDataFile != pFile)
+    {
+        Result = ftell(pDataFile) != (long)pFileSystemBuild->Regions[Region].Size;
+        if (fclose(pDataFile) || Result)
+        {
+            pDataFile = pFile;
+            fprintf(stderr, "error: Failed to write %s region.\n", pFileSystemBuild->Regions[Region].Name);
+            goto Error;
+        }
+        pDataFile = pFile;
+    }
+    
+    /* Write out the precompressed variants after the original data. */
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+    {
+        SFileSystemBuildVariant* pVariant = &pFileSystemBuild->pVariants[i];
+        
+        Result = _WritePadding(pFile, ImageFileOffset + pVariant->Offset - pVariant->HttpHeaderSize, FLASH_ERASED_BYTE);
+        if (Result)
+        {
+            goto Error;
+        }
+        if (pFileSystemBuild->pHttpRulesFilename)
+        {
+            Result = _WriteHttpHeader(pFileSystemBuild, 
+                                      &pFileSystemBuild->pFileEntries[pVariant->EntryIndex],
+                                      pVariant, pFile);
+            if (Result)
+            {
+                goto Error;
+            }
+        }
+        if (ftell(pFile) != (long)(ImageFileOffset + pVariant->Offset))
+        {
+            fprintf(stderr, "error: Failed to write precompressed variant to file system image.\n");
+            goto Error;
+        }
+        if (pAes)
+        {
+            /* Variants take the counter block indices following the
+               entries. */
+            uint64_t StartTime = _GetTimeInNanoseconds();
+
+            Result = _WriteEncrypted(pAes, FileCount + i, pVariant->pData, pVariant->Size, pBuffer, 
+                                     pFileSystemBuild->Integrity ? &pVariant->Crc32c : NULL, pFile);
+            if (Result)
+            {
+                goto Error;
+            }
+            EncryptTime += _GetTimeInNanoseconds() - StartTime;
+            EncryptedSize += pVariant->Size;
+        }
+        else if (1 != fwrite(pVariant->pData, pVariant->Size, 1, pFile))
+        {
+            fprintf(stderr, "error: Failed to write precompressed variant to file system image.\n");
+            goto Error;
+        }
+        if (pFileSystemBuild->Integrity && !pAes)
+        {
+            pVariant->Crc32c = Crc32cUpdate(0, pVariant->pData, pVariant->Size);
+        }
+    }
+    if (pAes)
+    {
+        uint64_t CopyTime = _GetTimeInNanoseconds() - CopyStartTime;
+
+        printf("    Encrypted %llu bytes with AES-%u-CTR (%s) in %.2f ms (%.0f MB/s); "
+               "data copy took %.2f ms (%.0f MB/s).\n",
+               (unsigned long long)EncryptedSize,
+               pAes->KeyBits,
+               AesImplementation(),
+               EncryptTime / 1e6,
+               EncryptTime ? EncryptedSize * 1e3 / EncryptTime : 0.0,
+               CopyTime / 1e6,
+               CopyTime ? EncryptedSize * 1e3 / CopyTime : 0.0);
+    }
+       
+    /* Leave room for the Merkle tree, which can only be calculated once
+       everything else is final. */
+    if (pFileSystemBuild->MerkleBlockSize)
+    {
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->MerkleOffset, FLASH_ERASED_BYTE);
+        if (Result)
+        {
+            goto Error;
+        }
+        Result = _WritePadding(pFile, ImageFileOffset + pLayout->ImageSize, 0);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+       
+    /* Display the final image file size */
+    ImageFileSize = ftell(pFile) - (long)ImageFileOffset;
+    printf("    Total Image Size: %ld bytes\n", ImageFileSize);
+    if (ImageFileSize != (long)pLayout->ImageSize)
+    {
+        fprintf(stderr, "error: Image size doesn't match planned size of %llu bytes.\n",
+                (unsigned long long)pLayout->ImageSize);
+        goto Error;
+    }
+    
+    /* Now that every file has been hashed, go back and fill in the ETags. */
+    if (pFileSystemBuild->Metadata)
+    {
+        if (fseek(pFile, (long)(ImageFileOffset + pLayout->MetadataOffset), SEEK_SET))
+        {
+            fprintf(stderr, "error: Failed to seek to file metadata in file system image.\n");
+            goto Error;
+        }
+        Result = _WriteMetadata(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+    if (pFileSystemBuild->Integrity)
+    {
+        if (fseek(pFile, (long)(ImageFileOffset + pLayout->IntegrityOffset), SEEK_SET))
+        {
+            fprintf(stderr, "error: Failed to seek to CRC32C table in file system image.\n");
+            goto Error;
+        }
+        Result = _WriteIntegrity(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+    if (pFileSystemBuild->pHttpRulesFilename)
+    {
+        pEntry = pFileSystemBuild->pFileEntries;
+        for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+        {
+            if (fseek(pFile, (long)(ImageFileOffset + pEntry->FileBinaryOffset - pEntry->HttpHeaderSize), SEEK_SET))
+            {
+                fprintf(stderr, "error: Failed to seek to HTTP header in file system image.\n");
+                goto Error;
+            }
+            Result = _WriteHttpHeader(pFileSystemBuild, pEntry, NULL, pFile);
+            if (Result)
+            {
+                goto Error;
+            }
+        }
+    }
+    if (pFileSystemBuild->MerkleBlockSize)
+    {
+        Result = _WriteMerkleTree(pFileSystemBuild, pFile);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+    if (fseek(pFile, 0, SEEK_END))
+    {
+        fprintf(stderr, "error: Failed to seek to end of file system image.\n");
+        goto Error;
+    }
+    
+    Return = 0;
+Error:
+    free(pPrefixes);
+    pPrefixes = NULL;
+    free(pBuffer);
+    pBuffer = NULL;
+    if (pSourceFile)
+    {
+        fclose(pSourceFile);
+        pSourceFile = NULL;
+    }
+    if (pDataFile && pDataFile != pFile)
+    {
+        fclose(pDataFile);
+        pDataFile = NULL;
+    }
+    if (pFile)
+    {
+        if (fclose(pFile))
+        {
+            fprintf(stderr, "error: Failed to write file system image.\n");
+            Return = 1;
+        }
+        pFile = NULL;
+    }
+    return Return;
+}
+
+/* Converts the binary file system image to a header file
+    
+    Parameters:
+     pFileSystemBuild is a pointer to the structure used both for input and
+         output data to/from this procedure.
+         
+    Returns:
+     0 on success and a positive error code otherwise */
+static int _CreateHeaderFile(SFileSystemBuild* pFileSystemBuild)
+{
+    int                 Return = 1;
+    int                 Result = 1;
+    FILE*               pDestFile = NULL;
+    FILE*               pSourceFile = NULL;
+    unsigned char*      pSrcBuffer = NULL;
+    char*               pDestBuffer = NULL;
+    char*               pDdotPos = NULL;
+    char*               pDestFileName = NULL;
+    long                BufLen = 0;
+    long                BinFileSize;
+    long                DestBufferSize;
+
+    const char          HeaderName[] = "#ifndef _FLASH_DRIVE_H_\n#define _FLASH_DRIVE_H_\n";
+    const char          ArrayName[] = "#ifdef __cplusplus\nextern \"C\"\n#endif\nconst uint8_t roFlashDrive[] __attribute__ ((aligned (%u))) __attribute__((section (\"%s\"), used)) = {\n\"";
+    const char          FooterName[] = "\"};\n#endif\n";
+
+    assert ( pFileSystemBuild && 
+              pFileSystemBuild->pOutputBinaryFilename);
+
+    /* Open the binary file to be converted to a header file.  With --out
+       the image follows the firmware in that file. */
+    pSourceFile = fopen(pFileSystemBuild->pImageFilename, "rb");
+    if (!pSourceFile)
+    {
+        fprintf(stderr,
+                "Failed to open %s for writing of the file system image.\n",
+                pFileSystemBuild->pImageFilename);
+        goto Error;
+    }
+    BinFileSize = (long)pFileSystemBuild->Layout.ImageSize;
+
+    /* Seek to the start of the image in the source file. */
+    Result = fseek(pSourceFile, (long)pFileSystemBuild->ImageFileOffset, SEEK_SET);
+    if (Result)
+    {
+        fprintf(stderr,
+                "error: Failed to rewind to file entry location.\n");
+        goto Error;
+    }
+
+    /* Allocate a file buffer to read the binary data. */
+    pSrcBuffer = (unsigned char*)malloc(BinFileSize * sizeof(unsigned char));
+    if (!pSrcBuffer)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %ld bytes for the input buffer.\n", 
+                BinFileSize);
+        goto Error;
+    }
+
+    /*  Allocate the ASCII file buffer to record the converted binary data.
+        - Each data line will be a representation of 16 binary bytes.
+          So, (number of data lines) = ceil(binary file size / 16)
+        - Each binary byte is represented as 4 ASCII bytes :
+          \xXX where XX is the ASCII representation of the binary byte.
+          So, the ASCII data size that represents the binary content is 4 times the binary size.
+          To this value, we need to add (number of data lines - 1) as each ASCII data line,
+          except the last one, is terminated with a '\'.
+          We need to add a second (number of data lines) to cover each line end (LF).
+          
+          ASCII data size = (4 x binary file size) + (2 * number of data lines) - 1
+    */
+    DestBufferSize = (4 * BinFileSize) + (2 * ceil(BinFileSize / 16.0f)) - 1;
+    pDestBuffer = (char*)malloc(DestBufferSize * sizeof(char));
+    if (!pDestBuffer)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %ld bytes for the output buffer.\n", 
+                DestBufferSize);
+        goto Error;
+    }
+
+     /* Read the binary data into the source buffer. */
+    Result = fread(pSrcBuffer, BinFileSize, 1, pSourceFile);
+    if (Result != 1)
+    {
+        fprintf(stderr,
+                "error: Failed to read %ld bytes from %s.\n",
+                BinFileSize,
+                pFileSystemBuild->pImageFilename);
+        goto Error;
+    }
+
+    /* Use the binary filename to create the header filename. */
+    BufLen = strlen(pFileSystemBuild->pOutputBinaryFilename) + 1;
+    pDestFileName = (char*)malloc(BufLen * sizeof(char));
+    if (!pDestFileName)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %ld bytes for filename buffer.\n", 
+                BufLen);
+        goto Error;
+    }
+    memcpy(pDestFileName, pFileSystemBuild->pOutputBinaryFilename, BufLen);
+    pDdotPos = strrchr(pDestFileName,'.');
+    *(pDdotPos+1) = 'h';
+    *(pDdotPos+2) = '\0';
+    printf("\nCreating header file %s from %s...\n", pDestFileName, pFileSystemBuild->pImageFilename);
+    pDestFile = fopen(pDestFileName, "w");
+    if (!pDestFile)
+    {
+        fprintf(stderr,
+                "Failed to open %s for writing of the file system image.\n",
+                pDestFileName);
+        goto Error;
+    }
+
+    printf("Exporting %s to %s...\n", pFileSystemBuild->pImageFilename, pDestFileName);
+
+    /* Write the array declaration to the output file, placed and aligned to
+       suit the --target.  The FLASH size is what FlashFileSystem expects, in
+       KB, for parts other than the LPC1768. */
+    Result = fprintf(pDestFile, "%s", HeaderName);
+    if (Result >= 0 && pFileSystemBuild->HaveTarget)
+    {
+        Result = fprintf(pDestFile, "#define FLASH_DRIVE_FLASH_SIZE_KB %llu\n", 
+                         (unsigned long long)(pFileSystemBuild->Target.FlashSize / 1024));
+    }
+    if (Result >= 0)
+    {
+        Result = fprintf(pDestFile, ArrayName, 
+                         pFileSystemBuild->HaveTarget && pFileSystemBuild->Target.Alignment > 4 ? 
+                            pFileSystemBuild->Target.Alignment : 4,
+                         pFileSystemBuild->HaveTarget ? pFileSystemBuild->Target.SectionName : "FlashDrive");
+    }
+    if (Result < 0)
+    {
+        fprintf(stderr,
+                "error: Failed to write to file %s.\n",
+                 pDestFileName);
+        goto Error;
+    }
+
+    /* Write the binary file content to the output file*/
+    snprintf(pDestBuffer, 1, "%s", "\0");       // Make sure the first char in pDestBuffer is NULL
+    for(long i = 0; i < BinFileSize; i++)
+    {
+        if((i % 16 == 0) && i > 0)
+            snprintf(pDestBuffer + strlen(pDestBuffer), DestBufferSize, "%s", "\\\n");
+        snprintf(pDestBuffer + strlen(pDestBuffer), DestBufferSize, "%s", "\\x");
+        snprintf(pDestBuffer + strlen(pDestBuffer), DestBufferSize, "%02X", pSrcBuffer[i]);
+    }
+
+    /* Write the destination buffer to the output file*/
+    Result = fprintf(pDestFile, "%s", pDestBuffer);
+    if (Result < 0)
+    {
+        fprintf(stderr,
+                "error: Failed to write to file %s.\n",
+                 pDestFileName);
+        goto Error;
+    }
+
+    /* Write array end to the output file*/
+    Result = fprintf(pDestFile, "%s", FooterName);
+    if (Result < 0)
+    {
+        fprintf(stderr,
+                "error: Failed to write to file %s.\n",
+                 pDestFileName);
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    free(pDestFileName);
+    pDestFileName = NULL;
+    if (pSourceFile)
+    {
+        fclose(pSourceFile);
+        pSourceFile = NULL;
+    }
+    if (pDestFile)
+    {
+        fclose(pDestFile);
+        pDestFile = NULL;
+    }
+    return Return;
+}
+
+
+/* Writes a string to a generated source file as a C/C++ string literal,
+   escaping any characters which can't appear in the literal verbatim.
+
+   Parameters:
+    pFile is the source file being generated.
+    pString is the NULL terminated string to be written.
+
+   Returns:
+    Nothing.  Write errors are detected by the caller with ferror().
+*/
+static void _WriteStringLiteral(FILE* pFile, const char* pString)
+{
+    assert ( pFile && pString );
+
+    fputc('"', pFile);
+    for ( ; *pString ; pString++)
+    {
+        unsigned char Char = (unsigned char)*pString;
+
+        if (Char == '"' || Char == '\\')
+        {
+            fprintf(pFile, "\\%c", Char);
+        }
+        else if (Char < 0x20 || Char >= 0x7F || Char == '?')
+        {
+            /* Octal escapes are used since they, unlike \x, have a maximum
+               length and can't swallow the following character.  '?' is
+               escaped to avoid trigraphs. */
+            fprintf(pFile, "\\%03o", Char);
+        }
+        else
+        {
+            fputc(Char, pFile);
+        }
+    }
+    fputc('"', pFile);
+}
+
+
+/* Creates a C++ header file which contains a constexpr index of the files in
+   the image so that literal filenames can be resolved at compile time with
+   fsbld::file<"www/index.html">() rather than with a runtime binary search.
+   The index header only declares roFlashDrive, with the C linkage of its
+   definition in the header created by _CreateHeaderFile(), so that every
+   translation unit which includes it shares the one copy of the image.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CreateIndexHeaderFile(SFileSystemBuild* pFileSystemBuild)
+{
+    int                 Return = 1;
+    FILE*               pDestFile = NULL;
+    char*               pDestFileName = NULL;
+    const char*         pOffsetType = NULL;
+    SFileSystemBuildEntry* pEntry = NULL;
+    SFileSystemLayout*  pLayout = NULL;
+    unsigned int        FileCountOffset = 0;
+    unsigned int        i;
+
+    assert ( pFileSystemBuild &&
+             pFileSystemBuild->pOutputBinaryFilename &&
+             pFileSystemBuild->pFilenameBuffer &&
+             pFileSystemBuild->pFileEntries );
+
+    pDestFileName = _AllocOutputFilename(pFileSystemBuild->pOutputBinaryFilename, ".hpp");
+    if (!pDestFileName)
+    {
+        goto Error;
+    }
+
+    /* Match the field widths and header layout of the image. */
+    pLayout = &pFileSystemBuild->Layout;
+    if (pLayout->EntrySize == sizeof(SFileSystemEntry64))
+    {
+        pOffsetType = "std::uint64_t";
+    }
+    else
+    {
+        pOffsetType = "std::uint32_t";
+    }
+    if (pFileSystemBuild->FormatVersion == FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        FileCountOffset = offsetof(SFileSystemHeader, FileCount);
+    }
+    else
+    {
+        FileCountOffset = offsetof(SFileSystemHeaderV2, FileCount);
+    }
+
+    printf("Creating C++ index header file %s...\n", pDestFileName);
+    pDestFile = fopen(pDestFileName, "w");
+    if (!pDestFile)
+    {
+        fprintf(stderr,
+                "Failed to open %s for writing of the index header.\n",
+                pDestFileName);
+        goto Error;
+    }
+
+    fprintf(pDestFile,
+            "/* Generated by fsbld from %s.  Requires C++20. */\n"
+            "#ifndef _FLASH_DRIVE_INDEX_HPP_\n"
+            "#define _FLASH_DRIVE_INDEX_HPP_\n"
+            "\n"
+            "#include <array>\n"
+            "#include <cstddef>\n"
+            "#include <cstdint>\n"
+            "\n"
+            "/* Defined once, by compiling the .h file generated with this index in\n"
+            "   one translation unit or by the --symbols linker script. */\n"
+            "extern \"C\" const std::uint8_t roFlashDrive[];\n"
+            "\n"
+            "namespace fsbld\n"
+            "{\n"
+            "    /* Size of the image in roFlashDrive. */\n"
+            "    inline constexpr std::size_t g_ImageSize = %lluu;\n"
+            "\n"
+            "    /* Location of a file relative to the start of roFlashDrive. */\n"
+            "    struct SIndexEntry\n"
+            "    {\n"
+            "        const char*     pFilename;\n"
+            "        %s   FileBinaryOffset;\n"
+            "        %s   FileBinarySize;\n"
+            "    };\n"
+            "\n"
+            "    /* Pointer to and size of the file's data in FLASH. */\n"
+            "    struct SFile\n"
+            "    {\n"
+            "        const std::uint8_t* pData;\n"
+            "        std::size_t         Size;\n"
+            "    };\n"
+            "\n"
+            "    /* Sorted in the same case sensitive order as the image entries. */\n"
+            "    inline constexpr std::array<SIndexEntry, %u> g_FileIndex =\n"
+            "    {{\n",
+            pFileSystemBuild->pOutputBinaryFilename,
+            (unsigned long long)pLayout->ImageSize,
+            pOffsetType,
+            pOffsetType,
+            pFileSystemBuild->FileCount);
+
+    pEntry = pFileSystemBuild->pFileEntries;
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++, pEntry++)
+    {
+        const char* pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+
+        fprintf(pDestFile, "        { ");
+        _WriteStringLiteral(pDestFile, pFilename);
+        fprintf(pDestFile, ", %lluu, %lluu },\n",
+                (unsigned long long)pEntry->FileBinaryOffset,
+                (unsigned long long)pEntry->FileBinarySize);
+    }
+
+    fprintf(pDestFile,
+            "    }};\n"
+            "\n"
+            "    namespace detail\n"
+            "    {\n"
+            "        /* Allows a string literal to be used as a template argument. */\n"
+            "        template <std::size_t N>\n"
+            "        struct FixedString\n"
+            "        {\n"
+            "            char Value[N];\n"
+            "\n"
+            "            consteval FixedString(const char (&String)[N])\n"
+            "            {\n"
+            "                for (std::size_t i = 0 ; i < N ; i++)\n"
+            "                    Value[i] = String[i];\n"
+            "            }\n"
+            "        };\n"
+            "\n"
+            "        /* Same ordering as strcmp() used to sort the image. */\n"
+            "        consteval int Compare(const char* p1, const char* p2)\n"
+            "        {\n"
+            "            while (*p1 && *p1 == *p2)\n"
+            "            {\n"
+            "                p1++;\n"
+            "                p2++;\n"
+            "            }\n"
+            "            return (int)(unsigned char)*p1 - (int)(unsigned char)*p2;\n"
+            "        }\n"
+            "\n"
+            "        /* Binary search performed by the compiler.  Failing to find the\n"
+            "           file makes the call a non-constant expression, which is\n"
+            "           reported as a compile error. */\n"
+            "        consteval std::size_t Find(const char* pFilename)\n"
+            "        {\n"
+            "            std::size_t Low = 0;\n"
+            "            std::size_t High = g_FileIndex.size();\n"
+            "\n"
+            "            while (Low < High)\n"
+            "            {\n"
+            "                std::size_t Middle = Low + (High - Low) / 2;\n"
+            "                int         Order = Compare(pFilename, g_FileIndex[Middle].pFilename);\n"
+            "\n"
+            "                if (Order == 0)\n"
+            "                    return Middle;\n"
+            "                else if (Order < 0)\n"
+            "                    High = Middle;\n"
+            "                else\n"
+            "                    Low = Middle + 1;\n"
+            "            }\n"
+            "            throw \"fsbld: file not found in image\";\n"
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    /* Index entry for a file, usable when the image is appended to the\n"
+            "       firmware rather than linked in through roFlashDrive. */\n"
+            "    template <detail::FixedString Filename>\n"
+            "    consteval SIndexEntry entry()\n"
+            "    {\n"
+            "        return g_FileIndex[detail::Find(Filename.Value)];\n"
+            "    }\n"
+            "\n"
+            "    template <detail::FixedString Filename>\n"
+            "    constexpr SFile file()\n"
+            "    {\n"
+            "        constexpr SIndexEntry Entry = entry<Filename>();\n"
+            "        return SFile{ roFlashDrive + Entry.FileBinaryOffset, Entry.FileBinarySize };\n"
+            "    }\n"
+            "\n"
+            "    /* Checks this index against the entry table stored in roFlashDrive\n"
+            "       itself.  Intended for host unit tests and device self tests to\n"
+            "       confirm that the .hpp and .h were generated from the same image. */\n"
+            "    namespace detail\n"
+            "    {\n"
+            "        inline std::uint64_t ReadImageValue(std::size_t Offset, std::size_t Size)\n"
+            "        {\n"
+            "            std::uint64_t Value = 0;\n"
+            "\n"
+            "            for (std::size_t i = 0 ; i < Size ; i++)\n"
+            "                Value = (Value << 8) | roFlashDrive[Offset + %s];\n"
+            "            return Value;\n"
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    inline bool verify_index()\n"
+            "    {\n"
+            "        const std::size_t OffsetBytes = %u;\n"
+            "        const std::size_t SizeBytes = %u;\n"
+            "\n"
+            "        if (detail::ReadImageValue(%u, 4) != g_FileIndex.size())\n"
+            "            return false;\n"
+            "        for (std::size_t i = 0 ; i < g_FileIndex.size() ; i++)\n"
+            "        {\n"
+            "            std::size_t EntryOffset = %llu + i * %u;\n"
+            "            std::size_t FilenameOffset = detail::ReadImageValue(EntryOffset, OffsetBytes);\n"
+            "            const char* pFilename = g_FileIndex[i].pFilename;\n"
+            "\n"
+            "            if (detail::ReadImageValue(EntryOffset + OffsetBytes, OffsetBytes) != g_FileIndex[i].FileBinaryOffset ||\n"
+            "                detail::ReadImageValue(EntryOffset + 2 * OffsetBytes, SizeBytes) != g_FileIndex[i].FileBinarySize)\n"
+            "                return false;\n"
+            "            do\n"
+            "            {\n"
+            "                if (roFlashDrive[FilenameOffset++] != (std::uint8_t)*pFilename)\n"
+            "                    return false;\n"
+            "            } while (*pFilename++);\n"
+            "        }\n"
+            "        return true;\n"
+            "    }\n"
+            "}\n"
+            "\n"
+            "#endif\n",
+            pFileSystemBuild->TargetBigEndian ? "i" : "Size - 1 - i",
+            pLayout->EntryOffsetBytes,
+            pLayout->EntrySizeBytes,
+            FileCountOffset,
+            (unsigned long long)pLayout->EntriesOffset,
+            pLayout->EntrySize);
+
+    if (ferror(pDestFile))
+    {
+        fprintf(stderr,
+                "error: Failed to write to file %s.\n",
+                 pDestFileName);
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    free(pDestFileName);
+    pDestFileName = NULL;
+    if (pDestFile)
+    {
+        if (fclose(pDestFile))
+        {
+            Return = 1;
+        }
+        pDestFile = NULL;
+    }
+    return Return;
+}
+
+
+/* Reads the complete file system image back into memory.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure describing the image.
+
+   Returns:
+    Pointer to the image which the caller must free() or NULL on error.
+*/
+static unsigned char* _LoadFileSystemImage(const SFileSystemBuild* pFileSystemBuild)
+{
+    FILE*           pFile = NULL;
+    unsigned char*  pImage = NULL;
+    size_t          ImageSize = (size_t)pFileSystemBuild->Layout.ImageSize;
+
+    pImage = malloc(ImageSize + 1);
+    if (!pImage)
+    {
+        fprintf(stderr, 
+                "error: Failed to allocate %lu bytes for file system image.\n", 
+                (unsigned long)ImageSize);
+        return NULL;
+    }
+    pFile = fopen(pFileSystemBuild->pImageFilename, "rb");
+    if (!pFile || 
+        fseek(pFile, (long)pFileSystemBuild->ImageFileOffset, SEEK_SET) ||
+        1 != fread(pImage, ImageSize, 1, pFile))
+    {
+        fprintf(stderr, 
+                "error: Failed to read back %s.\n", 
+                pFileSystemBuild->pImageFilename);
+        free(pImage);
+        pImage = NULL;
+    }
+    if (pFile)
+    {
+        fclose(pFile);
+    }
+
+    return pImage;
+}
+
+
+/* Returns a pointer to the filename of an entry by decoding the entry table
+   in the image, the same way that the device does. */
+static const char* _GetImageFilename(const SFileSystemBuild* pFileSystemBuild, 
+                                     const unsigned char*    pImage, 
+                                     unsigned int            Index)
+{
+    const SFileSystemLayout*    pLayout = &pFileSystemBuild->Layout;
+    const unsigned char*        pEntry = pImage + pLayout->EntriesOffset + 
+                                         (size_t)Index * pLayout->EntrySize;
+
+    return (const char*)pImage + FsReaderLoadField(pEntry, 
+                                            pLayout->EntryOffsetBytes, 
+                                            pFileSystemBuild->TargetBigEndian);
+}
+
+
+/* Finds a file in the image with the binary search used by FlashFileSystem,
+   reading the filename for every probe.
+
+   Returns:
+    Index of the matching entry or -1 if it wasn't found.
+*/
+static int _FindImageEntry(const SFileSystemBuild* pFileSystemBuild,
+                           const unsigned char*    pImage,
+                           const char*             pFilename,
+                           unsigned long*          pFilenameReads)
+{
+    unsigned int Low = 0;
+    unsigned int High = pFileSystemBuild->FileCount;
+
+    while (Low < High)
+    {
+        unsigned int Middle = Low + (High - Low) / 2;
+        int          Order;
+
+        (*pFilenameReads)++;
+        Order = strcmp(pFilename, _GetImageFilename(pFileSystemBuild, pImage, Middle));
+        if (Order == 0)
+        {
+            return (int)Middle;
+        }
+        else if (Order < 0)
+        {
+            High = Middle;
+        }
+        else
+        {
+            Low = Middle + 1;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Finds a file in the image with a binary search which first compares
+   against the FILE_SYSTEM_SECTION_NAME_PREFIXES sidecar and only reads the
+   filename when the prefixes match.
+
+   Returns:
+    Index of the matching entry or -1 if it wasn't found.
+*/
+static int _FindImageEntryWithPrefixes(const SFileSystemBuild* pFileSystemBuild,
+                                       const unsigned char*    pImage,
+                                       const unsigned char*    pPrefixes,
+                                       unsigned int            PrefixLength,
+                                       const char*             pFilename,
+                                       unsigned long*          pFilenameReads)
+{
+    unsigned char   Key[16];
+    size_t          FilenameLength = strlen(pFilename);
+    unsigned int    Low = 0;
+    unsigned int    High = pFileSystemBuild->FileCount;
+
+    assert ( PrefixLength <= sizeof(Key) );
+    strncpy((char*)Key, pFilename, PrefixLength);
+
+    while (Low < High)
+    {
+        unsigned int Middle = Low + (High - Low) / 2;
+        int          Order;
+
+        Order = memcmp(Key, pPrefixes + (size_t)Middle * PrefixLength, PrefixLength);
+        if (Order == 0)
+        {
+            /* The NULL terminator was part of the matching prefix. */
+            if (FilenameLength < PrefixLength)
+            {
+                return (int)Middle;
+            }
+            (*pFilenameReads)++;
+            Order = strcmp(pFilename + PrefixLength, 
+                           _GetImageFilename(pFileSystemBuild, pImage, Middle) + PrefixLength);
+            if (Order == 0)
+            {
+                return (int)Middle;
+            }
+        }
+        if (Order < 0)
+        {
+            High = Middle;
+        }
+        else
+        {
+            Low = Middle + 1;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Replays random lookups against the finished image, once with the plain
+   binary search over the entries and once using the filename prefix sidecar,
+   and reports the time and number of filename reads for each.  One in four
+   lookups is for a file which isn't in the image.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure describing the image.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _BenchmarkLookups(const SFileSystemBuild* pFileSystemBuild)
+{
+    int                 Return = 1;
+    unsigned char*      pImage = NULL;
+    unsigned char*      pGeneratedPrefixes = NULL;
+    const unsigned char* pPrefixes = NULL;
+    unsigned int        PrefixLength = 0;
+    char**              ppLookups = NULL;
+    unsigned int        LookupCount = pFileSystemBuild->BenchmarkLookups;
+    unsigned int        FileCount = pFileSystemBuild->FileCount;
+    uint32_t            Random = 0x2545F491;
+    unsigned long       PlainReads = 0;
+    unsigned long       PrefixReads = 0;
+    uint64_t            PlainTime = 0;
+    uint64_t            PrefixTime = 0;
+    uint64_t            StartTime = 0;
+    unsigned int        i;
+
+    if (LookupCount == 0 || FileCount == 0)
+    {
+        return 0;
+    }
+    printf("\nBenchmarking %u random lookups against %s...\n", 
+           LookupCount, 
+           pFileSystemBuild->pImageFilename);
+
+    pImage = _LoadFileSystemImage(pFileSystemBuild);
+    if (!pImage)
+    {
+        goto Error;
+    }
+
+    /* Use the sidecar from the image if it has one, otherwise build one to
+       show what it would save. */
+    PrefixLength = pFileSystemBuild->NamePrefixLength;
+    if (PrefixLength)
+    {
+        pPrefixes = pImage + pFileSystemBuild->Layout.NamePrefixesOffset;
+    }
+    else
+    {
+        PrefixLength = 8;
+        pGeneratedPrefixes = _AllocNamePrefixes(pFileSystemBuild, PrefixLength);
+        if (!pGeneratedPrefixes)
+        {
+            goto Error;
+        }
+        pPrefixes = pGeneratedPrefixes;
+    }
+
+    /* Pick the filenames to be looked up before starting the clock. */
+    ppLookups = calloc(LookupCount, sizeof(*ppLookups));
+    if (!ppLookups)
+    {
+        fprintf(stderr, "error: Failed to allocate %u benchmark lookups.\n", LookupCount);
+        goto Error;
+    }
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        const char* pFilename = _GetImageFilename(pFileSystemBuild, pImage,
+                                                  _NextRandom(&Random) % FileCount);
+        size_t      Length = strlen(pFilename);
+
+        ppLookups[i] = malloc(Length + 2);
+        if (!ppLookups[i])
+        {
+            fprintf(stderr, "error: Failed to allocate benchmark lookup.\n");
+            goto Error;
+        }
+        memcpy(ppLookups[i], pFilename, Length + 1);
+        if (_NextRandom(&Random) % 4 == 0)
+        {
+            /* Turn it into a miss which sorts right next to a real file. */
+            ppLookups[i][Length] = '~';
+            ppLookups[i][Length + 1] = '\0';
+        }
+    }
+
+    StartTime = _GetTimeInNanoseconds();
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        _FindImageEntry(pFileSystemBuild, pImage, ppLookups[i], &PlainReads);
+    }
+    PlainTime = _GetTimeInNanoseconds() - StartTime;
+
+    StartTime = _GetTimeInNanoseconds();
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        _FindImageEntryWithPrefixes(pFileSystemBuild, pImage, pPrefixes, PrefixLength,
+                                    ppLookups[i], &PrefixReads);
+    }
+    PrefixTime = _GetTimeInNanoseconds() - StartTime;
+
+    /* Both searches must agree. */
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        unsigned long Reads = 0;
+
+        if (_FindImageEntry(pFileSystemBuild, pImage, ppLookups[i], &Reads) !=
+            _FindImageEntryWithPrefixes(pFileSystemBuild, pImage, pPrefixes, PrefixLength,
+                                        ppLookups[i], &Reads))
+        {
+            fprintf(stderr, "error: Prefix lookup of %s doesn't match binary search.\n", 
+                    ppLookups[i]);
+            goto Error;
+        }
+    }
+
+    printf("    Binary search over entries:     %8.1f ns/lookup, %5.2f filename reads/lookup\n",
+           (double)PlainTime / LookupCount,
+           (double)PlainReads / LookupCount);
+    printf("    With %2u byte filename prefixes: %8.1f ns/lookup, %5.2f filename reads/lookup%s\n",
+           PrefixLength,
+           (double)PrefixTime / LookupCount,
+           (double)PrefixReads / LookupCount,
+           pGeneratedPrefixes ? " (not in image)" : "");
+
+    Return = 0;
+Error:
+    if (ppLookups)
+    {
+        for (i = 0 ; i < LookupCount ; i++)
+        {
+            free(ppLookups[i]);
+        }
+        free(ppLookups);
+        ppLookups = NULL;
+    }
+    free(pGeneratedPrefixes);
+    pGeneratedPrefixes = NULL;
+    free(pImage);
+    pImage = NULL;
+    return Return;
+}
+
+
+/* Replays random requests against the finished image and times building each
+   response in a buffer standing in for the socket: once by formatting the
+   header at runtime from the entry's metadata followed by a copy of the body,
+   and once with a single copy of the precomputed header and body.  The
+   formatted headers must match those in the image.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure describing the image.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _BenchmarkHttp(const SFileSystemBuild* pFileSystemBuild)
+{
+    int                 Return = 1;
+    unsigned char*      pImage = NULL;
+    unsigned char*      pResponse = NULL;
+    const char**        ppCacheControls = NULL;
+    unsigned char*      pVary = NULL;
+    unsigned int*       pRequests = NULL;
+    unsigned int        RequestCount = pFileSystemBuild->BenchmarkHttpRequests;
+    unsigned int        FileCount = pFileSystemBuild->FileCount;
+    uint32_t            Random = 0x2545F491;
+    uint64_t            MaxResponseSize = 0;
+    uint64_t            ResponseBytes = 0;
+    uint64_t            RuntimeTime = 0;
+    uint64_t            PrecomputedTime = 0;
+    uint64_t            StartTime = 0;
+    unsigned int        i;
+
+    if (RequestCount == 0 || FileCount == 0)
+    {
+        return 0;
+    }
+    printf("\nBenchmarking %u random HTTP responses from %s...\n", 
+           RequestCount, 
+           pFileSystemBuild->pImageFilename);
+
+    pImage = _LoadFileSystemImage(pFileSystemBuild);
+    if (!pImage)
+    {
+        goto Error;
+    }
+
+    /* Firmware formatting its own headers would have its cache policy and
+       which files have variants resolved ahead of time as well, so neither is
+       looked up while the clock is running. */
+    ppCacheControls = calloc(FileCount, sizeof(*ppCacheControls));
+    pVary = calloc(FileCount, sizeof(*pVary));
+    pRequests = calloc(RequestCount, sizeof(*pRequests));
+    if (!ppCacheControls || !pVary || !pRequests)
+    {
+        fprintf(stderr, "error: Failed to allocate %u benchmark requests.\n", RequestCount);
+        goto Error;
+    }
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[i];
+
+        ppCacheControls[i] = _FindCacheControl(pFileSystemBuild,
+                                               pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset);
+        pVary[i] = (unsigned char)_EntryHasVariants(pFileSystemBuild, i);
+        if (pEntry->HttpHeaderSize + pEntry->FileBinarySize > MaxResponseSize)
+        {
+            MaxResponseSize = pEntry->HttpHeaderSize + pEntry->FileBinarySize;
+        }
+    }
+    for (i = 0 ; i < RequestCount ; i++)
+    {
+        pRequests[i] = _NextRandom(&Random) % FileCount;
+        ResponseBytes += pFileSystemBuild->pFileEntries[pRequests[i]].HttpHeaderSize +
+                         pFileSystemBuild->pFileEntries[pRequests[i]].FileBinarySize;
+    }
+    pResponse = malloc((size_t)MaxResponseSize + HTTP_HEADER_MAX_SIZE);
+    if (!pResponse)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes for benchmark responses.\n",
+                (unsigned long long)MaxResponseSize);
+        goto Error;
+    }
+
+    /* Make sure that the headers in the image are what the device would have
+       formatted itself. */
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[i];
+        unsigned int                 HeaderSize;
+
+        HeaderSize = _RenderHttpHeader((char*)pResponse, HTTP_HEADER_MAX_SIZE,
+                                       g_MimeTypes[pEntry->MimeType].pMimeType,
+                                       pEntry->FileBinarySize, pEntry->ContentHash,
+                                       ppCacheControls[i], 0, pVary[i]);
+        if (HeaderSize != pEntry->HttpHeaderSize ||
+            0 != memcmp(pResponse, pImage + pEntry->FileBinaryOffset - HeaderSize, HeaderSize))
+        {
+            fprintf(stderr, "error: HTTP header of %s in image doesn't match runtime formatting.\n",
+                    pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset);
+            goto Error;
+        }
+    }
+
+    StartTime = _GetTimeInNanoseconds();
+    for (i = 0 ; i < RequestCount ; i++)
+    {
+        const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[pRequests[i]];
+        unsigned int                 HeaderSize;
+
+        HeaderSize = _RenderHttpHeader((char*)pResponse, HTTP_HEADER_MAX_SIZE,
+                                       g_MimeTypes[pEntry->MimeType].pMimeType,
+                                       pEntry->FileBinarySize, pEntry->ContentHash,
+                                       ppCacheControls[pRequests[i]], 0, pVary[pRequests[i]]);
+        memcpy(pResponse + HeaderSize, pImage + pEntry->FileBinaryOffset, (size_t)pEntry->FileBinarySize);
+    }
+    RuntimeTime = _GetTimeInNanoseconds() - StartTime;
+
+    StartTime = _GetTimeInNanoseconds();
+    for (i = 0 ; i < RequestCount ; i++)
+    {
+        const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[pRequests[i]];
+
+        memcpy(pResponse, pImage + pEntry->FileBinaryOffset - pEntry->HttpHeaderSize,
+               (size_t)(pEntry->HttpHeaderSize + pEntry->FileBinarySize));
+    }
+    PrecomputedTime = _GetTimeInNanoseconds() - StartTime;
+
+    printf("    Headers formatted at runtime: %8.1f ns/response\n",
+           (double)RuntimeTime / RequestCount);
+    printf("    Precomputed headers:          %8.1f ns/response\n",
+           (double)PrecomputedTime / RequestCount);
+    printf("    Average response size:        %8.1f bytes\n",
+           (double)ResponseBytes / RequestCount);
+
+    Return = 0;
+Error:
+    free(pResponse);
+    pResponse = NULL;
+    free(pRequests);
+    pRequests = NULL;
+    free(ppCacheControls);
+    ppCacheControls = NULL;
+    free(pVary);
+    pVary = NULL;
+    free(pImage);
+    pImage = NULL;
+    return Return;
+}
+
+
+/* Reads an entire binary file, such as an existing image or delta, into
+   memory.
+
+   Parameters:
+    pFilename is the name of the file to be read.
+    pSize is a pointer to be filled in with the size of the file.
+
+   Returns:
+    Pointer to the contents which the caller must free() or NULL on failure.
+*/
+static unsigned char* _LoadBinaryFile(const char* pFilename, uint64_t* pSize)
+{
+    FILE*           pFile = NULL;
+    unsigned char*  pBuffer = NULL;
+    long            FileSize;
+
+    pFile = fopen(pFilename, "rb");
+    if (!pFile || fseek(pFile, 0, SEEK_END) || (FileSize = ftell(pFile)) < 0 || fseek(pFile, 0, SEEK_SET))
+    {
+        fprintf(stderr, "error: Failed to open %s for read.\n", pFilename);
+        goto Error;
+    }
+    pBuffer = malloc(FileSize + 1);
+    if (!pBuffer)
+    {
+        fprintf(stderr, "error: Failed to allocate %ld bytes for %s.\n", FileSize, pFilename);
+        goto Error;
+    }
+    if (FileSize > 0 && 1 != fread(pBuffer, FileSize, 1, pFile))
+    {
+        fprintf(stderr, "error: Failed to read %s.\n", pFilename);
+        free(pBuffer);
+        pBuffer = NULL;
+        goto Error;
+    }
+    *pSize = FileSize;
+
+Error:
+    if (pFile)
+    {
+        fclose(pFile);
+    }
+    return pBuffer;
+}
+
+
+/* Writes a buffer to a new binary file.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _SaveBinaryFile(const char* pFilename, const unsigned char* pData, uint64_t Size)
+{
+    FILE*   pFile = fopen(pFilename, "wb");
+    int     Return = 0;
+
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to open %s for writing.\n", pFilename);
+        return 1;
+    }
+    if (Size > 0 && 1 != fwrite(pData, (size_t)Size, 1, pFile))
+    {
+        Return = 1;
+    }
+    if (fclose(pFile))
+    {
+        Return = 1;
+    }
+    if (Return)
+    {
+        fprintf(stderr, "error: Failed to write %s.\n", pFilename);
+    }
+
+    return Return;
+}
+
+
+/* Checks the entries of an image opened with FsReaderOpenImageUnchecked() so
+   that files can be looked up in it.  Unlike FsReaderOpenImage() an image
+   whose file data is encrypted is accepted since fsbld only copies, diffs
+   or hashes the data.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CheckImageEntries(const SFsReaderImage* pReader, const char* pFilename)
+{
+    int Result;
+
+    if (pReader->FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES)
+    {
+        fprintf(stderr, "error: The entries of %s are encrypted.\n", pFilename);
+        return 1;
+    }
+    /* The data offsets are relative to regions held in other files. */
+    if (pReader->FeatureFlags & FILE_SYSTEM_FEATURE_REGIONS)
+    {
+        fprintf(stderr, "error: The data of %s is split across FLASH regions.\n", pFilename);
+        return 1;
+    }
+    Result = FsReaderCheckEntries(pReader);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", pFilename, FsReaderErrorString(Result));
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Opens an existing image with libfsbld-reader and describes all of its
+   entries.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _LoadImageFile(SImageFile* pImageFile, const char* pFilename)
+{
+    unsigned int    i;
+    int             Result;
+
+    memset(pImageFile, 0, sizeof(*pImageFile));
+    pImageFile->pFilename = pFilename;
+    Result = FsReaderOpenImageUnchecked(&pImageFile->Reader, pFilename);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", pFilename, FsReaderErrorString(Result));
+        return 1;
+    }
+    if (_CheckImageEntries(&pImageFile->Reader, pFilename))
+    {
+        return 1;
+    }
+    pImageFile->pImage = pImageFile->Reader.pImage;
+    pImageFile->ImageSize = pImageFile->Reader.MappingSize;
+
+    pImageFile->FileCount = pImageFile->Reader.FileCount;
+    pImageFile->pEntries = calloc(pImageFile->FileCount + 1, sizeof(*pImageFile->pEntries));
+    if (!pImageFile->pEntries)
+    {
+        fprintf(stderr, "error: Failed to allocate %u image entries.\n", pImageFile->FileCount);
+        return 1;
+    }
+    for (i = 0 ; i < pImageFile->FileCount ; i++)
+    {
+        FsReaderStatIndex(&pImageFile->Reader, i, &pImageFile->pEntries[i]);
+    }
+
+    return 0;
+}
+
+
+/* Frees the entries and closes the image opened by _LoadImageFile(). */
+static void _FreeImageFile(SImageFile* pImageFile)
+{
+    FsReaderCloseImage(&pImageFile->Reader);
+    free(pImageFile->pEntries);
+    pImageFile->pEntries = NULL;
+}
+
+
+/* Fills in the sorted entries of a layer which is an existing image.  The
+   data isn't read, each entry just records where it lies in the image.  The
+   image doesn't record file metadata so the files take the modification
+   time of the image itself.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _LoadImageLayer(SFileSystemLayer* pLayer, unsigned int LayerIndex)
+{
+    struct stat     ImageStat;
+    unsigned int    i;
+
+    if (stat(pLayer->pPath, &ImageStat) || _LoadImageFile(&pLayer->Image, pLayer->pPath))
+    {
+        return 1;
+    }
+    printf("Using the %u files of the %s image...\n", pLayer->Image.FileCount, pLayer->pPath);
+    if (pLayer->Image.Reader.FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED)
+    {
+        fprintf(stderr, "error: %s is encrypted and can't be used as a layer.\n", pLayer->pPath);
+        return 1;
+    }
+    if (pLayer->Image.ImageSize > UINT32_MAX)
+    {
+        fprintf(stderr, "error: %s is too large to be used as a layer.\n", pLayer->pPath);
+        return 1;
+    }
+    pLayer->pFileEntries = calloc(pLayer->Image.FileCount + 1, sizeof(*pLayer->pFileEntries));
+    if (!pLayer->pFileEntries)
+    {
+        fprintf(stderr, "error: Failed to allocate %u file entry descriptors.\n", pLayer->Image.FileCount);
+        return 1;
+    }
+    pLayer->pFilenameBuffer = (const char*)pLayer->Image.pImage;
+    pLayer->FileCount = pLayer->Image.FileCount;
+    for (i = 0 ; i < pLayer->FileCount ; i++)
+    {
+        const SFsReaderStat*    pImageEntry = &pLayer->Image.pEntries[i];
+        SFileSystemBuildEntry*  pEntry = &pLayer->pFileEntries[i];
+
+        pEntry->FilenameOffset = (unsigned int)((const unsigned char*)pImageEntry->pFilename - pLayer->Image.pImage);
+        pEntry->FileBinaryOffset = ~(uint64_t)0;
+        pEntry->FileBinarySize = pImageEntry->Size;
+        pEntry->ModificationTime = ImageStat.st_mtime;
+        pEntry->Mode = 0644;
+        pEntry->MimeType = _FindMimeType(pImageEntry->pFilename);
+        pEntry->Layer = LayerIndex;
+        pEntry->SourceOffset = pImageEntry->Offset;
+    }
+
+    return 0;
+}
+
+
+/* Returns the filename of the next entry to be merged from a layer or NULL
+   once all of its entries have been merged. */
+static const char* _GetLayerHead(const SFileSystemLayer* pLayer)
+{
+    if (pLayer->Position >= pLayer->FileCount)
+    {
+        return NULL;
+    }
+    return pLayer->pFilenameBuffer + pLayer->pFileEntries[pLayer->Position].FilenameOffset;
+}
+
+
+/* Returns non-zero if pPath names a regular file, such as an existing image,
+   rather than a directory. */
+static int _IsRegularFile(const char* pPath)
+{
+    struct stat PathStat;
+
+    return 0 == stat(pPath, &PathStat) && S_ISREG(PathStat.st_mode);
+}
+
+
+/* Creates the list of files to be placed in the image from the root source
+   directory and each --overlay, in that order.  Each layer is either a
+   directory, which is scanned and sorted as for a normal build, or an
+   existing image whose entries are already sorted.  The sorted layers are
+   then combined with a k-way merge.  When several layers contain the same
+   filename the entry from the last of them is used.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the structure used both for input and
+        output data to/from this procedure.
+
+   Returns:
+    0 on success and a positive error code otherwise
+*/
+static int _CreateLayeredFileList(SFileSystemBuild* pFileSystemBuild)
+{
+    const char*     pRootSourceDirectory = pFileSystemBuild->pRootSourceDirectory;
+    uint64_t        TotalFilenameSize = 0;
+    unsigned int    TotalFileCount = 0;
+    unsigned int    Overridden = 0;
+    unsigned int    i;
+
+    pFileSystemBuild->LayerCount = pFileSystemBuild->OverlayCount + 1;
+    pFileSystemBuild->pLayers = calloc(pFileSystemBuild->LayerCount, sizeof(*pFileSystemBuild->pLayers));
+    if (!pFileSystemBuild->pLayers)
+    {
+        fprintf(stderr, "error: Failed to allocate %u layers.\n", pFileSystemBuild->LayerCount);
+        return 1;
+    }
+
+    for (i = 0 ; i < pFileSystemBuild->LayerCount ; i++)
+    {
+        SFileSystemLayer*   pLayer = &pFileSystemBuild->pLayers[i];
+        unsigned int        j;
+
+        pLayer->pPath = i ? pFileSystemBuild->ppOverlays[i - 1] : pRootSourceDirectory;
+        if (_IsRegularFile(pLayer->pPath))
+        {
+            if (_LoadImageLayer(pLayer, i))
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            /* Scan the directory as a normal build would and take over the
+               resulting sorted list. */
+            pFileSystemBuild->pRootSourceDirectory = pLayer->pPath;
+            if (_CreateFileList(pFileSystemBuild))
+            {
+                pFileSystemBuild->pRootSourceDirectory = pRootSourceDirectory;
+                return 1;
+            }
+            pLayer->pFilenameBuffer = pFileSystemBuild->pFilenameBuffer;
+            pLayer->pFileEntries = pFileSystemBuild->pFileEntries;
+            pLayer->FileCount = pFileSystemBuild->FileCount;
+            pFileSystemBuild->pFilenameBuffer = NULL;
+            pFileSystemBuild->pFileEntries = NULL;
+            pFileSystemBuild->FileCount = 0;
+            for (j = 0 ; j < pLayer->FileCount ; j++)
+            {
+                pLayer->pFileEntries[j].Layer = i;
+            }
+        }
+        TotalFileCount += pLayer->FileCount;
+        for (j = 0 ; j < pLayer->FileCount ; j++)
+        {
+            TotalFilenameSize += strlen(pLayer->pFilenameBuffer + pLayer->pFileEntries[j].FilenameOffset) + 1;
+        }
+    }
+    pFileSystemBuild->pRootSourceDirectory = pRootSourceDirectory;
+
+    if (TotalFilenameSize > UINT32_MAX)
+    {
+        fprintf(stderr, "error: Filenames of the merged layers are too large.\n");
+        return 1;
+    }
+    pFileSystemBuild->pFilenameBuffer = malloc((size_t)TotalFilenameSize + 1);
+    pFileSystemBuild->pFileEntries = malloc(((size_t)TotalFileCount + 1) * sizeof(*pFileSystemBuild->pFileEntries));
+    if (!pFileSystemBuild->pFilenameBuffer || !pFileSystemBuild->pFileEntries)
+    {
+        fprintf(stderr, "error: Failed to allocate %u merged file entries.\n", TotalFileCount);
+        return 1;
+    }
+
+    /* Repeatedly take the smallest filename at the head of the layers.  The
+       number of layers is small so a linear scan of the heads beats a heap. */
+    pFileSystemBuild->FileCount = 0;
+    pFileSystemBuild->FilenameBufferSize = 0;
+    for (;;)
+    {
+        const char*             pSmallest = NULL;
+        unsigned int            Winner = 0;
+        SFileSystemBuildEntry*  pEntry;
+        size_t                  Length;
+
+        for (i = 0 ; i < pFileSystemBuild->LayerCount ; i++)
+        {
+            const char* pHead = _GetLayerHead(&pFileSystemBuild->pLayers[i]);
+
+            if (pHead && (!pSmallest || strcmp(pHead, pSmallest) <= 0))
+            {
+                pSmallest = pHead;
+                Winner = i;
+            }
+        }
+        if (!pSmallest)
+        {
+            break;
+        }
+
+        pEntry = &pFileSystemBuild->pFileEntries[pFileSystemBuild->FileCount++];
+        *pEntry = pFileSystemBuild->pLayers[Winner].pFileEntries[pFileSystemBuild->pLayers[Winner].Position];
+        Length = strlen(pSmallest) + 1;
+        memcpy(pFileSystemBuild->pFilenameBuffer + pFileSystemBuild->FilenameBufferSize, pSmallest, Length);
+        pEntry->FilenameOffset = pFileSystemBuild->FilenameBufferSize;
+        pFileSystemBuild->FilenameBufferSize += Length;
+
+        /* Skip past the same filename in every layer. */
+        for (i = 0 ; i < pFileSystemBuild->LayerCount ; i++)
+        {
+            const char* pHead = _GetLayerHead(&pFileSystemBuild->pLayers[i]);
+
+            if (pHead && i != Winner && 0 == strcmp(pHead, pSmallest))
+            {
+                pFileSystemBuild->pLayers[i].Position++;
+                Overridden++;
+            }
+        }
+        pFileSystemBuild->pLayers[Winner].Position++;
+    }
+    printf("Merged %u layers into %u files, %u of which replaced a file from an earlier layer.\n",
+           pFileSystemBuild->LayerCount, pFileSystemBuild->FileCount, Overridden);
+
+    return 0;
+}
+
+
+/* Handles fsbld --diff by creating a delta between two images, checking that
+   it rebuilds the new image and reporting its size and the time taken to
+   build and apply it.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the parsed command line.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _DiffImages(const SFileSystemBuild* pFileSystemBuild)
+{
+    SImageFile      Old;
+    SImageFile      New;
+    unsigned char*  pDelta = NULL;
+    unsigned char*  pRebuilt = NULL;
+    SFsDeltaStats   Stats;
+    uint64_t        DeltaSize = 0;
+    uint64_t        RebuiltSize = 0;
+    uint64_t        StartTime;
+    uint64_t        BuildTime;
+    uint64_t        ApplyTime;
+    int             Result;
+    int             Return = 1;
+
+    memset(&New, 0, sizeof(New));
+    printf("Creating delta from %s to %s in %s...\n",
+           pFileSystemBuild->pParameters[0],
+           pFileSystemBuild->pParameters[1],
+           pFileSystemBuild->pParameters[2]);
+    if (_LoadImageFile(&Old, pFileSystemBuild->pParameters[0]) ||
+        _LoadImageFile(&New, pFileSystemBuild->pParameters[1]))
+    {
+        goto Error;
+    }
+
+    StartTime = _GetTimeInNanoseconds();
+    Result = FsDeltaCreate(&Old.Reader, &New.Reader, &pDelta, &DeltaSize, &Stats);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to create delta: %s.\n", FsDeltaErrorString(Result));
+        goto Error;
+    }
+    BuildTime = _GetTimeInNanoseconds() - StartTime;
+    printf("    %u unchanged, %u changed and %u new files, %lu operations.\n",
+           Stats.Unchanged, Stats.Changed, Stats.Added, (unsigned long)Stats.OpCount);
+
+    StartTime = _GetTimeInNanoseconds();
+    Result = FsDeltaApply(Old.pImage, Old.ImageSize, pDelta, DeltaSize, &pRebuilt, &RebuiltSize);
+    if (Result)
+    {
+        fprintf(stderr, "error: %s.\n", FsDeltaErrorString(Result));
+        goto Error;
+    }
+    ApplyTime = _GetTimeInNanoseconds() - StartTime;
+    if (RebuiltSize != New.ImageSize || 0 != memcmp(pRebuilt, New.pImage, (size_t)RebuiltSize))
+    {
+        fprintf(stderr, "error: Delta doesn't rebuild %s.\n", New.pFilename);
+        goto Error;
+    }
+
+    if (_SaveBinaryFile(pFileSystemBuild->pParameters[2], pDelta, DeltaSize))
+    {
+        goto Error;
+    }
+    printf("    Delta: %llu bytes, %.1f%% of the %llu byte image.\n",
+           (unsigned long long)DeltaSize,
+           New.ImageSize ? 100.0 * DeltaSize / New.ImageSize : 0.0,
+           (unsigned long long)New.ImageSize);
+    printf("    Built in %.3f ms, applied in %.3f ms.\n",
+           BuildTime / 1000000.0,
+           ApplyTime / 1000000.0);
+
+    Return = 0;
+Error:
+    free(pDelta);
+    free(pRebuilt);
+    _FreeImageFile(&Old);
+    _FreeImageFile(&New);
+    return Return;
+}
+
+
+/* Handles fsbld --apply-delta by rebuilding a new image from the previous
+   image and a delta.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the parsed command line.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _ApplyDeltaFile(const SFileSystemBuild* pFileSystemBuild)
+{
+    unsigned char*  pOld = NULL;
+    unsigned char*  pDelta = NULL;
+    unsigned char*  pNew = NULL;
+    uint64_t        OldSize = 0;
+    uint64_t        DeltaSize = 0;
+    uint64_t        NewSize = 0;
+    uint64_t        StartTime;
+    int             Result;
+    int             Return = 1;
+
+    printf("Applying delta %s to %s...\n",
+           pFileSystemBuild->pParameters[1],
+           pFileSystemBuild->pParameters[0]);
+    pOld = _LoadBinaryFile(pFileSystemBuild->pParameters[0], &OldSize);
+    pDelta = pOld ? _LoadBinaryFile(pFileSystemBuild->pParameters[1], &DeltaSize) : NULL;
+    if (!pDelta)
+    {
+        goto Error;
+    }
+    StartTime = _GetTimeInNanoseconds();
+    Result = FsDeltaApply(pOld, OldSize, pDelta, DeltaSize, &pNew, &NewSize);
+    if (Result)
+    {
+        fprintf(stderr, "error: %s.\n", FsDeltaErrorString(Result));
+        goto Error;
+    }
+    printf("    Rebuilt %llu byte image in %.3f ms.\n", 
+           (unsigned long long)NewSize,
+           (_GetTimeInNanoseconds() - StartTime) / 1000000.0);
+    if (_SaveBinaryFile(pFileSystemBuild->pParameters[2], pNew, NewSize))
+    {
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    free(pOld);
+    free(pDelta);
+    free(pNew);
+    return Return;
+}
+
+
+/* Hashes the way up the Merkle tree from one leaf, using the stored sibling
+   hashes, and checks that it arrives at the root.
+
+   Parameters:
+    pTree points to the stored levels of the tree.
+    LeafCount is the number of leaves in the tree.
+    Index is the index of the leaf.
+    pLeaf is the freshly calculated hash of the leaf's block.
+    pRoot is the trusted root hash.
+
+   Returns:
+    Non-zero if the leaf is consistent with the root.
+*/
+static int _CheckMerklePath(const unsigned char* pTree, uint64_t LeafCount, uint64_t Index,
+                            const unsigned char* pLeaf, const unsigned char* pRoot)
+{
+    const unsigned char*    pLevel = pTree;
+    unsigned char           Hash[MERKLE_HASH_SIZE];
+
+    memcpy(Hash, pLeaf, sizeof(Hash));
+    while (LeafCount > 1)
+    {
+        uint64_t Sibling = Index ^ 1;
+
+        if (Sibling < LeafCount)
+        {
+            if (Index & 1)
+            {
+                _HashMerkleNode(pLevel + Sibling * MERKLE_HASH_SIZE, Hash, Hash);
+            }
+            else
+            {
+                _HashMerkleNode(Hash, pLevel + Sibling * MERKLE_HASH_SIZE, Hash);
+            }
+        }
+        pLevel += LeafCount * MERKLE_HASH_SIZE;
+        Index /= 2;
+        LeafCount = (LeafCount + 1) / 2;
+    }
+
+    return 0 == memcmp(Hash, pRoot, sizeof(Hash));
+}
+
+
+/* Checks an image against its --merkle tree for fsbld --verify.  Without a
+   filename every block is hashed and the whole stored tree is compared.
+   With one, only the blocks holding the file's data are hashed and each is
+   checked against the root by walking up the stored tree, as a bootloader
+   would.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the parsed command line.
+
+   Returns:
+    0 if the image verifies and a positive error code otherwise */
+static int _VerifyImage(const SFileSystemBuild* pFileSystemBuild)
+{
+    const char*             pImageFilename = pFileSystemBuild->pParameters[0];
+    const char*             pFilename = pFileSystemBuild->pParameters[1];
+    SFsReaderImage          Reader;
+    SFsReaderSection        Section;
+    const unsigned char*    pImage;
+    const unsigned char*    pRoot;
+    const unsigned char*    pTree = NULL;
+    unsigned char*          pHashes = NULL;
+    unsigned char*          pFirstBlock = NULL;
+    unsigned char           Leaf[MERKLE_HASH_SIZE];
+    uint64_t                BlockSize;
+    uint64_t                CoveredSize;
+    uint64_t                FirstBlockSize;
+    uint64_t                LeafCount;
+    uint64_t                TreeSize = 0;
+    uint64_t                StartTime;
+    uint64_t                ElapsedTime;
+    uint64_t                i;
+    unsigned int            LevelCount;
+    unsigned int            StoredLevelCount = 0;
+    int                     Result;
+    int                     Return = 1;
+
+    /* The entries are only checked when verifying a single file, which lets
+       a whole image with encrypted entries be verified. */
+    Result = FsReaderOpenImageUnchecked(&Reader, pImageFilename);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", pImageFilename, FsReaderErrorString(Result));
+        return 1;
+    }
+    if (pFilename && _CheckImageEntries(&Reader, pImageFilename))
+    {
+        goto Error;
+    }
+    pImage = Reader.pImage;
+    if (Reader.FormatVersion != FILE_SYSTEM_FORMAT_VERSION || !(Reader.FeatureFlags & FILE_SYSTEM_FEATURE_MERKLE) ||
+        Reader.ImageSize < sizeof(SFileSystemHeaderV2) + sizeof(SFileSystemDigest))
+    {
+        fprintf(stderr, "error: %s has no Merkle tree.  Build it with --format v2 --merkle.\n", pImageFilename);
+        goto Error;
+    }
+
+    /* Locate the tree and check that it covers exactly what it should.  The
+       reader has already checked that every section lies within the image. */
+    BlockSize = FsReaderLoadField(pImage + sizeof(SFileSystemHeaderV2), 4, Reader.BigEndian);
+    CoveredSize = FsReaderLoadField(pImage + sizeof(SFileSystemHeaderV2) + offsetof(SFileSystemDigest, CoveredSize), 
+                             8, Reader.BigEndian);
+    pRoot = pImage + sizeof(SFileSystemHeaderV2) + offsetof(SFileSystemDigest, RootHash);
+    for (i = 0 ; i < Reader.SectionCount ; i++)
+    {
+        FsReaderGetSection(&Reader, (uint32_t)i, &Section);
+        if (Section.Type == FILE_SYSTEM_SECTION_MERKLE)
+        {
+            StoredLevelCount = Section.Flags;
+            pTree = pImage + Section.Offset;
+            TreeSize = Section.Size;
+        }
+    }
+    if ((uint64_t)(Reader.pSections - pImage) < sizeof(SFileSystemHeaderV2) + sizeof(SFileSystemDigest) ||
+        BlockSize < MERKLE_MIN_BLOCK_SIZE || (BlockSize & (BlockSize - 1)) ||
+        !pTree || pTree != pImage + CoveredSize)
+    {
+        fprintf(stderr, "error: %s has an invalid Merkle tree.\n", pImageFilename);
+        goto Error;
+    }
+    LeafCount = (CoveredSize + BlockSize - 1) / BlockSize;
+    if (TreeSize != MERKLE_HASH_SIZE * _CountMerkleNodes(LeafCount, &LevelCount) || 
+        LevelCount != StoredLevelCount)
+    {
+        fprintf(stderr, "error: %s has an invalid Merkle tree.\n", pImageFilename);
+        goto Error;
+    }
+
+    /* The root was zero when the first block was hashed. */
+    FirstBlockSize = CoveredSize < BlockSize ? CoveredSize : BlockSize;
+    pFirstBlock = malloc((size_t)FirstBlockSize);
+    if (!pFirstBlock)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes for first block.\n", (unsigned long long)FirstBlockSize);
+        goto Error;
+    }
+    memcpy(pFirstBlock, pImage, (size_t)FirstBlockSize);
+    memset(pFirstBlock + (pRoot - pImage), 0, MERKLE_HASH_SIZE);
+
+    if (!pFilename)
+    {
+        unsigned int ThreadCount;
+
+        printf("Verifying %s...\n", pImageFilename);
+        pHashes = malloc((size_t)TreeSize);
+        if (!pHashes)
+        {
+            fprintf(stderr, "error: Failed to allocate %llu bytes for Merkle tree.\n", (unsigned long long)TreeSize);
+            goto Error;
+        }
+        StartTime = _GetTimeInNanoseconds();
+        ThreadCount = _HashMerkleLeaves(pImage, CoveredSize, BlockSize, pHashes);
+        _HashMerkleLeaf(pFirstBlock, (size_t)FirstBlockSize, pHashes);
+        _BuildMerkleLevels(pHashes, LeafCount);
+        ElapsedTime = _GetTimeInNanoseconds() - StartTime;
+        for (i = 0 ; i < LeafCount ; i++)
+        {
+            if (memcmp(pHashes + i * MERKLE_HASH_SIZE, pTree + i * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE))
+            {
+                fprintf(stderr, "error: Block %llu at offset 0x%llX doesn't match its Merkle tree leaf.\n",
+                        (unsigned long long)i, (unsigned long long)(i * BlockSize));
+                goto Error;
+            }
+        }
+        if (memcmp(pHashes, pTree, (size_t)TreeSize) || 
+            memcmp(pHashes + TreeSize - MERKLE_HASH_SIZE, pRoot, MERKLE_HASH_SIZE))
+        {
+            fprintf(stderr, "error: Merkle tree of %s doesn't match its root.\n", pImageFilename);
+            goto Error;
+        }
+        printf("    Verified %llu blocks of %llu bytes using %u threads in %.2f ms (%.1f MB/s).\n",
+               (unsigned long long)LeafCount,
+               (unsigned long long)BlockSize,
+               ThreadCount,
+               ElapsedTime / 1000000.0,
+               ElapsedTime ? CoveredSize * 1000.0 / ElapsedTime : 0.0);
+    }
+    else
+    {
+        SFsReaderStat       Stat;
+        uint64_t            FirstLeaf;
+        uint64_t            EndLeaf;
+
+        if (FsReaderStat(&Reader, pFilename, &Stat))
+        {
+            fprintf(stderr, "error: %s isn't in %s.\n", pFilename, pImageFilename);
+            goto Error;
+        }
+        printf("Verifying %s in %s...\n", pFilename, pImageFilename);
+        FirstLeaf = Stat.Offset / BlockSize;
+        EndLeaf = (Stat.Offset + Stat.Size + BlockSize - 1) / BlockSize;
+        StartTime = _GetTimeInNanoseconds();
+        for (i = FirstLeaf ; i < EndLeaf ; i++)
+        {
+            uint64_t Size = CoveredSize - i * BlockSize;
+
+            if (i == 0)
+            {
+                _HashMerkleLeaf(pFirstBlock, (size_t)FirstBlockSize, Leaf);
+            }
+            else
+            {
+                _HashMerkleLeaf(pImage + i * BlockSize, (size_t)(Size < BlockSize ? Size : BlockSize), Leaf);
+            }
+            if (!_CheckMerklePath(pTree, LeafCount, i, Leaf, pRoot))
+            {
+                fprintf(stderr, "error: Block %llu at offset 0x%llX of %s doesn't match the Merkle root.\n",
+                        (unsigned long long)i, (unsigned long long)(i * BlockSize), pFilename);
+                goto Error;
+            }
+        }
+        ElapsedTime = _GetTimeInNanoseconds() - StartTime;
+        printf("    Verified %llu of %llu blocks in %.3f ms.\n",
+               (unsigned long long)(EndLeaf - FirstLeaf),
+               (unsigned long long)LeafCount,
+               ElapsedTime / 1000000.0);
+    }
+
+    Return = 0;
+Error:
+    free(pHashes);
+    free(pFirstBlock);
+    FsReaderCloseImage(&Reader);
+    return Return;
+}
+
+
+/* Opens an image with libfsbld-reader for fsbld --benchmark-reader, checks
+   that a lookup of every entry's filename finds that entry and then times
+   random lookups of files which are in the image and of ones which aren't.
+
+   Parameters:
+    pFileSystemBuild holds the image filename and optional lookup count in
+        pParameters.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _BenchmarkReader(const SFileSystemBuild* pFileSystemBuild)
+{
+    const char*         pImageFilename = pFileSystemBuild->pParameters[0];
+    SFsReaderImage      Reader;
+    SFsReaderStat       Entry;
+    SFsReaderDir        Dir;
+    SFsReaderDirEntry   DirEntry;
+    const char**        ppHits = NULL;
+    char**              ppMisses = NULL;
+    unsigned long       LookupCount = 1000000;
+    unsigned int        MissCount = 0;
+    unsigned int        RootCount = 0;
+    uint32_t            Random = 0x2545F491;
+    uint64_t            StartTime;
+    uint64_t            OpenTime;
+    uint64_t            HitTime;
+    uint64_t            MissTime;
+    unsigned long       i;
+    int                 Result;
+    int                 Return = 1;
+
+    if (pFileSystemBuild->pParameters[1])
+    {
+        LookupCount = strtoul(pFileSystemBuild->pParameters[1], NULL, 0);
+    }
+    StartTime = _GetTimeInNanoseconds();
+    Result = FsReaderOpenImage(&Reader, pImageFilename);
+    OpenTime = _GetTimeInNanoseconds() - StartTime;
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", pImageFilename, FsReaderErrorString(Result));
+        return 1;
+    }
+    Result = FsReaderOpenDir(&Reader, "", &Dir);
+    while (0 == Result && 0 == FsReaderReadDir(&Dir, &DirEntry))
+    {
+        RootCount++;
+    }
+    printf("Opened %s (%s, %s endian, %u files, %llu bytes%s%s) in %.3f ms.\n",
+           pImageFilename,
+           Reader.FormatVersion == FILE_SYSTEM_FORMAT_VERSION ? "v2" : "legacy",
+           Reader.BigEndian ? "big" : "little",
+           Reader.FileCount,
+           (unsigned long long)Reader.ImageSize,
+           Reader.pNamePrefixes ? ", filename prefixes" : "",
+           Reader.pNameFilter ? ", filename filter" : "",
+           OpenTime / 1000000.0);
+    printf("    %u files and directories at the root.\n", RootCount);
+    if (Reader.FileCount == 0 || LookupCount == 0)
+    {
+        Return = 0;
+        goto Error;
+    }
+
+    /* Check that the binary search, along with any filename prefixes and
+       filter, finds every file at its own entry. */
+    for (i = 0 ; i < Reader.FileCount ; i++)
+    {
+        SFsReaderStat Stat;
+
+        FsReaderStatIndex(&Reader, (uint32_t)i, &Entry);
+        if (FsReaderStat(&Reader, Entry.pFilename, &Stat) || Stat.Index != i ||
+            Stat.pData != Entry.pData || Stat.Size != Entry.Size)
+        {
+            fprintf(stderr, "error: Reader lookup of %s doesn't match its entry.\n", Entry.pFilename);
+            goto Error;
+        }
+    }
+
+    /* Pick the filenames to be looked up before starting the clock.  Misses
+       sort right next to a real file so they take a full search. */
+    ppHits = calloc(LookupCount, sizeof(*ppHits));
+    MissCount = LookupCount < Reader.FileCount ? (unsigned int)LookupCount : Reader.FileCount;
+    ppMisses = calloc(MissCount, sizeof(*ppMisses));
+    if (!ppHits || !ppMisses)
+    {
+        fprintf(stderr, "error: Failed to allocate %lu benchmark lookups.\n", LookupCount);
+        goto Error;
+    }
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        FsReaderStatIndex(&Reader, _NextRandom(&Random) % Reader.FileCount, &Entry);
+        ppHits[i] = Entry.pFilename;
+    }
+    for (i = 0 ; i < MissCount ; i++)
+    {
+        const char* pFilename;
+        size_t      Length;
+
+        FsReaderStatIndex(&Reader, _NextRandom(&Random) % Reader.FileCount, &Entry);
+        pFilename = Entry.pFilename;
+        Length = strlen(pFilename);
+
+        ppMisses[i] = malloc(Length + 2);
+        if (!ppMisses[i])
+        {
+            fprintf(stderr, "error: Failed to allocate benchmark lookup.\n");
+            goto Error;
+        }
+        memcpy(ppMisses[i], pFilename, Length);
+        ppMisses[i][Length] = '~';
+        ppMisses[i][Length + 1] = '\0';
+    }
+
+    StartTime = _GetTimeInNanoseconds();
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        SFsReaderStat Stat;
+
+        FsReaderStat(&Reader, ppHits[i], &Stat);
+    }
+    HitTime = _GetTimeInNanoseconds() - StartTime;
+    StartTime = _GetTimeInNanoseconds();
+    for (i = 0 ; i < LookupCount ; i++)
+    {
+        SFsReaderStat Stat;
+
+        FsReaderStat(&Reader, ppMisses[i % MissCount], &Stat);
+    }
+    MissTime = _GetTimeInNanoseconds() - StartTime;
+
+    printf("    Found all %u entries by name.\n", Reader.FileCount);
+    printf("    Lookups of files in the image:     %8.1f ns/lookup (%.1f M/s)\n",
+           (double)HitTime / LookupCount,
+           HitTime ? LookupCount * 1000.0 / HitTime : 0.0);
+    printf("    Lookups of files not in the image: %8.1f ns/lookup (%.1f M/s)\n",
+           (double)MissTime / LookupCount,
+           MissTime ? LookupCount * 1000.0 / MissTime : 0.0);
+
+    Return = 0;
+Error:
+    if (ppMisses)
+    {
+        for (i = 0 ; i < MissCount ; i++)
+        {
+            free(ppMisses[i]);
+        }
+        free(ppMisses);
+    }
+    free(ppHits);
+    FsReaderCloseImage(&Reader);
+    return Return;
+}
+
+
+/* Orders the extents found by fsbld --inspect by region and then offset. */
+static int _CompareInspectExtents(const void* pLeft, const void* pRight)
+{
+    const SInspectExtent* pA = (const SInspectExtent*)pLeft;
+    const SInspectExtent* pB = (const SInspectExtent*)pRight;
+
+    if (pA->Region != pB->Region)
+    {
+        return pA->Region < pB->Region ? -1 : 1;
+    }
+    if (pA->Offset != pB->Offset)
+    {
+        return pA->Offset < pB->Offset ? -1 : 1;
+    }
+    return pA->Index < pB->Index ? -1 : (pA->Index > pB->Index);
+}
+
+
+/* Sorts extents, unless they are already in order as the file data written
+   by fsbld is, and counts those which overlap the one before them.
+
+   Returns:
+    The number of overlapping extents.
+*/
+static unsigned int _CheckInspectExtents(SInspectExtent* pExtents, 
+                                         unsigned int    Count, 
+                                         const char*     pWhat,
+                                         const char**    ppFilenames)
+{
+    unsigned int    Overlaps = 0;
+    unsigned int    i;
+
+    for (i = 1 ; i < Count ; i++)
+    {
+        if (_CompareInspectExtents(&pExtents[i - 1], &pExtents[i]) > 0)
+        {
+            qsort(pExtents, Count, sizeof(*pExtents), _CompareInspectExtents);
+            break;
+        }
+    }
+    for (i = 1 ; i < Count ; i++)
+    {
+        const SInspectExtent* pPrev = &pExtents[i - 1];
+
+        if (pPrev->Region == pExtents[i].Region && pExtents[i].Offset < pPrev->Offset + pPrev->Size &&
+            ++Overlaps <= INSPECT_MAX_REPORTED)
+        {
+            fprintf(stderr, "error: The %s of entries %u (%s) and %u (%s) overlap.\n",
+                    pWhat,
+                    pPrev->Index, ppFilenames[pPrev->Index] ? ppFilenames[pPrev->Index] : "?",
+                    pExtents[i].Index, ppFilenames[pExtents[i].Index] ? ppFilenames[pExtents[i].Index] : "?");
+        }
+    }
+
+    return Overlaps;
+}
+
+
+/* Counts the filenames which overlap an earlier one.  The filenames of a
+   legacy image are in the order the files were found rather than sorted so,
+   instead of sorting them, each byte of the filenames is marked in a map of
+   the range they span.
+
+   Returns:
+    The number of overlapping filenames or ~0U if the map can't be allocated.
+*/
+static unsigned int _CheckInspectFilenames(const SInspectExtent* pNames, 
+                                           unsigned int          Count, 
+                                           const char**          ppFilenames)
+{
+    unsigned char*  pMarks;
+    uint64_t        Start = ~(uint64_t)0;
+    uint64_t        End = 0;
+    unsigned int    Overlaps = 0;
+    unsigned int    i;
+
+    for (i = 0 ; i < Count ; i++)
+    {
+        if (pNames[i].Offset < Start)
+        {
+            Start = pNames[i].Offset;
+        }
+        if (pNames[i].Offset + pNames[i].Size > End)
+        {
+            End = pNames[i].Offset + pNames[i].Size;
+        }
+    }
+    if (Count == 0)
+    {
+        return 0;
+    }
+    pMarks = calloc(1, (size_t)(End - Start));
+    if (!pMarks)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes to check the filenames.\n", 
+                (unsigned long long)(End - Start));
+        return ~0U;
+    }
+    for (i = 0 ; i < Count ; i++)
+    {
+        unsigned char*  pMark = pMarks + (pNames[i].Offset - Start);
+        size_t          Size = (size_t)pNames[i].Size;
+
+        if (memchr(pMark, 1, Size) && ++Overlaps <= INSPECT_MAX_REPORTED)
+        {
+            fprintf(stderr, "error: The filename of entry %u (%s) overlaps another filename.\n",
+                    pNames[i].Index, ppFilenames[pNames[i].Index]);
+        }
+        memset(pMark, 1, Size);
+    }
+    free(pMarks);
+
+    return Overlaps;
+}
+
+
+/* Prints the result of one of the fsbld --inspect checks. */
+static void _PrintInspectCheck(const char* pCheck, unsigned int Problems)
+{
+    if (Problems)
+    {
+        printf("        %-36s %u problems\n", pCheck, Problems);
+    }
+    else
+    {
+        printf("        %-36s OK\n", pCheck);
+    }
+}
+
+
+/* Checks an image for fsbld --inspect and reports where its bytes go.  The
+   entries are checked to be sorted, with filenames and data which lie within
+   the image, and the filenames and file data are checked not to overlap.
+   The sizes of the directories, the largest files and the overhead of the
+   header and tables are then listed.  Everything is done in a few passes
+   over the mapped entry table so it only takes milliseconds even for
+   images with 100k files.
+
+   Parameters:
+    pFileSystemBuild holds the image filename in pParameters[0] along with
+        the --depth and --top options.
+
+   Returns:
+    0 on success and a positive error code if the image can't be read or a
+    check fails.
+*/
+static int _InspectImage(const SFileSystemBuild* pFileSystemBuild)
+{
+    const char*             pImageFilename = pFileSystemBuild->pParameters[0];
+    SFsReaderImage          Reader;
+    SFsReaderSection        Section;
+    const unsigned char*    pImage;
+    const unsigned char*    pRegions = NULL;
+    const unsigned char*    pEntryRegions = NULL;
+    const unsigned char*    pHttpHeaders = NULL;
+    const unsigned char*    pVariants = NULL;
+    const char**            ppFilenames = NULL;
+    uint64_t*               pSizes = NULL;
+    SInspectExtent*         pNames = NULL;
+    SInspectExtent*         pData = NULL;
+    SInspectDirectory*      pDirectories = NULL;
+    unsigned int*           pStack = NULL;
+    uint32_t*               pLargest = NULL;
+    unsigned int            DirectoryCount = 0;
+    unsigned int            MaxDirectories = 0;
+    unsigned int            StackDepth = 0;
+    unsigned int            MaxStackDepth = 0;
+    unsigned int            LargestCount = 0;
+    unsigned int            NameCount = 0;
+    unsigned int            DataCount = 0;
+    uint32_t                RegionCount = 1;
+    uint64_t                VariantCount = 0;
+    uint64_t                EntriesOffset;
+    uint64_t                EntriesSize;
+    uint64_t                NamesStart;
+    uint64_t                NamesEnd;
+    uint64_t                NamesSize = 0;
+    uint64_t                OtherTablesSize = 0;
+    uint64_t                MerkleSize = 0;
+    uint64_t                DataSize = 0;
+    uint64_t                OtherRegionsSize = 0;
+    uint64_t                HeadersSize = 0;
+    uint64_t                VariantsSize = 0;
+    uint64_t                PaddingSize;
+    uint64_t                StartTime;
+    uint64_t                ElapsedTime;
+    unsigned int            UnsortedCount = 0;
+    unsigned int            BadNameCount = 0;
+    unsigned int            BadDataCount = 0;
+    unsigned int            NameOverlapCount = 0;
+    unsigned int            DataOverlapCount = 0;
+    const char*             pPrevious = NULL;
+    uint32_t                i;
+    unsigned int            j;
+    int                     Result;
+    int                     Return = 1;
+
+    StartTime = _GetTimeInNanoseconds();
+    Result = FsReaderOpenImageUnchecked(&Reader, pImageFilename);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", pImageFilename, FsReaderErrorString(Result));
+        return 1;
+    }
+    pImage = Reader.pImage;
+    printf("Inspecting %s...\n", pImageFilename);
+    if (Reader.FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES)
+    {
+        fprintf(stderr, "error: The entries of %s are encrypted.\n", pImageFilename);
+        goto Error;
+    }
+
+    /* Find the tables which are needed to place the data. */
+    EntriesOffset = Reader.pEntries - pImage;
+    EntriesSize = (uint64_t)Reader.FileCount * Reader.EntrySize;
+    for (i = 0 ; i < Reader.SectionCount ; i++)
+    {
+        FsReaderGetSection(&Reader, i, &Section);
+        switch (Section.Type)
+        {
+        case FILE_SYSTEM_SECTION_ENTRIES:
+        case FILE_SYSTEM_SECTION_FILENAMES:
+        case FILE_SYSTEM_SECTION_DATA:
+            continue;
+        case FILE_SYSTEM_SECTION_REGIONS:
+            pRegions = pImage + Section.Offset;
+            RegionCount = (uint32_t)(Section.Size / sizeof(SFileSystemRegion));
+            break;
+        case FILE_SYSTEM_SECTION_ENTRY_REGIONS:
+            if (Section.Size >= Reader.FileCount)
+            {
+                pEntryRegions = pImage + Section.Offset;
+            }
+            break;
+        case FILE_SYSTEM_SECTION_VARIANTS:
+            pVariants = pImage + Section.Offset;
+            VariantCount = Section.Size / sizeof(SFileSystemVariant);
+            break;
+        case FILE_SYSTEM_SECTION_HTTP_HEADERS:
+            pHttpHeaders = pImage + Section.Offset;
+            if (Section.Size < 4 * (Reader.FileCount + VariantCount))
+            {
+                pHttpHeaders = NULL;
+            }
+            break;
+        case FILE_SYSTEM_SECTION_MERKLE:
+            MerkleSize = Section.Size;
+            continue;
+        }
+        OtherTablesSize += Section.Size;
+    }
+    if ((Reader.FeatureFlags & FILE_SYSTEM_FEATURE_REGIONS) && (!pRegions || !pEntryRegions || !RegionCount))
+    {
+        fprintf(stderr, "error: %s is missing its FLASH region tables.\n", pImageFilename);
+        goto Error;
+    }
+    if (Reader.pFilenames)
+    {
+        NamesStart = Reader.pFilenames - pImage;
+        NamesEnd = NamesStart + Reader.FilenamesSize;
+        NamesSize = Reader.FilenamesSize;
+    }
+    else
+    {
+        NamesStart = EntriesOffset + EntriesSize;
+        NamesEnd = Reader.ImageSize;
+    }
+
+    ppFilenames = calloc(Reader.FileCount + 1, sizeof(*ppFilenames));
+    pSizes = calloc(Reader.FileCount + 1, sizeof(*pSizes));
+    pNames = calloc(Reader.FileCount + 1, sizeof(*pNames));
+    pData = calloc(Reader.FileCount + 1, sizeof(*pData));
+    pLargest = calloc(pFileSystemBuild->InspectTopCount + 1, sizeof(*pLargest));
+    if (!ppFilenames || !pSizes || !pNames || !pData || !pLargest)
+    {
+        fprintf(stderr, "error: Failed to allocate %u inspected entries.\n", Reader.FileCount);
+        goto Error;
+    }
+
+    /* Decode and check each entry. */
+    for (i = 0 ; i < Reader.FileCount ; i++)
+    {
+        const unsigned char*    pEntry = Reader.pEntries + (uint64_t)i * Reader.EntrySize;
+        uint64_t                NameOffset = FsReaderLoadField(pEntry, Reader.OffsetBytes, Reader.BigEndian);
+        uint64_t                Offset = FsReaderLoadField(pEntry + Reader.OffsetBytes, Reader.OffsetBytes, Reader.BigEndian);
+        uint64_t                Size = FsReaderLoadField(pEntry + 2 * Reader.OffsetBytes, Reader.SizeBytes, Reader.BigEndian);
+        uint32_t                Region = pEntryRegions ? pEntryRegions[i] : 0;
+        uint64_t                Limit = Reader.ImageSize;
+        const unsigned char*    pEnd = NULL;
+
+        if (NameOffset >= NamesStart && NameOffset < NamesEnd)
+        {
+            pEnd = memchr(pImage + NameOffset, '\0', (size_t)(NamesEnd - NameOffset));
+        }
+        if (!pEnd)
+        {
+            if (++BadNameCount <= INSPECT_MAX_REPORTED)
+            {
+                fprintf(stderr, "error: The filename of entry %u isn't a NULL terminated string within the filename table.\n", i);
+            }
+        }
+        else
+        {
+            ppFilenames[i] = (const char*)pImage + NameOffset;
+            pNames[NameCount].Offset = NameOffset;
+            pNames[NameCount].Size = pEnd + 1 - (pImage + NameOffset);
+            pNames[NameCount++].Index = i;
+            if (!Reader.pFilenames)
+            {
+                NamesSize += pEnd + 1 - (pImage + NameOffset);
+            }
+            if (pPrevious && strcmp(pPrevious, ppFilenames[i]) >= 0 && ++UnsortedCount <= INSPECT_MAX_REPORTED)
+            {
+                fprintf(stderr, "error: Entry %u (%s) doesn't sort after %s.\n", i, ppFilenames[i], pPrevious);
+            }
+            pPrevious = ppFilenames[i];
+        }
+
+        /* Data in the other regions lies in their own files. */
+        if (Region >= RegionCount)
+        {
+            Limit = 0;
+        }
+        else if (Region > 0)
+        {
+            Limit = FsReaderLoadField(pRegions + Region * sizeof(SFileSystemRegion) + offsetof(SFileSystemRegion, Size), 
+                               8, Reader.BigEndian);
+        }
+        if (Offset > Limit || Size > Limit - Offset ||
+            (Region == 0 && Size > 0 && 
+             (Offset < Reader.HeaderSize || (Offset < EntriesOffset + EntriesSize && Offset + Size > EntriesOffset))))
+        {
+            if (++BadDataCount <= INSPECT_MAX_REPORTED)
+            {
+                fprintf(stderr, "error: The %llu bytes of data at 0x%llX of entry %u (%s) lie outside of %s.\n",
+                        (unsigned long long)Size, (unsigned long long)Offset, i, 
+                        ppFilenames[i] ? ppFilenames[i] : "?",
+                        Region ? "its region" : "the file data");
+            }
+        }
+        else if (Size > 0)
+        {
+            pData[DataCount].Offset = Offset;
+            pData[DataCount].Size = Size;
+            pData[DataCount].Index = i;
+            pData[DataCount++].Region = Region;
+        }
+        pSizes[i] = Size;
+        if (Region == 0)
+        {
+            DataSize += Size;
+            if (pHttpHeaders)
+            {
+                HeadersSize += FsReaderLoadField(pHttpHeaders + 4 * i, 4, Reader.BigEndian);
+            }
+        }
+        else
+        {
+            OtherRegionsSize += Size;
+        }
+
+        /* Keep the largest files in a min-heap. */
+        if (LargestCount < pFileSystemBuild->InspectTopCount || 
+            (LargestCount > 0 && Size > pSizes[pLargest[0]]))
+        {
+            unsigned int Node = 0;
+
+            if (LargestCount < pFileSystemBuild->InspectTopCount)
+            {
+                Node = LargestCount++;
+                while (Node > 0 && pSizes[pLargest[(Node - 1) / 2]] > Size)
+                {
+                    pLargest[Node] = pLargest[(Node - 1) / 2];
+                    Node = (Node - 1) / 2;
+                }
+            }
+            else
+            {
+                for (;;)
+                {
+                    unsigned int Child = 2 * Node + 1;
+
+                    if (Child >= LargestCount)
+                    {
+                        break;
+                    }
+                    if (Child + 1 < LargestCount && pSizes[pLargest[Child + 1]] < pSizes[pLargest[Child]])
+                    {
+                        Child++;
+                    }
+                    if (pSizes[pLargest[Child]] >= Size)
+                    {
+                        break;
+                    }
+                    pLargest[Node] = pLargest[Child];
+                    Node = Child;
+                }
+            }
+            pLargest[Node] = i;
+        }
+    }
+    for (i = 0 ; pVariants && i < VariantCount ; i++)
+    {
+        const unsigned char* pVariant = pVariants + i * sizeof(SFileSystemVariant);
+
+        VariantsSize += FsReaderLoadField(pVariant + offsetof(SFileSystemVariant, Size), 8, Reader.BigEndian);
+        if (pHttpHeaders)
+        {
+            HeadersSize += FsReaderLoadField(pHttpHeaders + 4 * (Reader.FileCount + i), 4, Reader.BigEndian);
+        }
+    }
+    NameOverlapCount = _CheckInspectFilenames(pNames, NameCount, ppFilenames);
+    if (NameOverlapCount == ~0U)
+    {
+        goto Error;
+    }
+    DataOverlapCount = _CheckInspectExtents(pData, DataCount, "file data", ppFilenames);
+
+    /* Total up the size of each directory.  The entries are sorted so the
+       files of a directory are contiguous and its path stays on the stack
+       until they have all been seen. */
+    for (i = 0 ; i < Reader.FileCount ; i++)
+    {
+        const char* pFilename = ppFilenames[i];
+        const char* pComponent;
+        const char* pSlash;
+
+        if (!pFilename)
+        {
+            continue;
+        }
+        if (DirectoryCount == 0)
+        {
+            MaxDirectories = 64;
+            MaxStackDepth = 16;
+            pDirectories = malloc(MaxDirectories * sizeof(*pDirectories));
+            pStack = malloc(MaxStackDepth * sizeof(*pStack));
+            if (!pDirectories || !pStack)
+            {
+                fprintf(stderr, "error: Failed to allocate directory tree.\n");
+                goto Error;
+            }
+            memset(&pDirectories[0], 0, sizeof(pDirectories[0]));
+            pDirectories[0].pName = "";
+            DirectoryCount = 1;
+            pStack[0] = 0;
+            StackDepth = 1;
+        }
+        while (StackDepth > 1)
+        {
+            const SInspectDirectory* pTop = &pDirectories[pStack[StackDepth - 1]];
+
+            if (0 == strncmp(pFilename, pTop->pName + pTop->NameLength - pTop->PathLength, pTop->PathLength) &&
+                pFilename[pTop->PathLength] == '/')
+            {
+                break;
+            }
+            StackDepth--;
+        }
+        pComponent = pFilename;
+        if (StackDepth > 1)
+        {
+            pComponent += pDirectories[pStack[StackDepth - 1]].PathLength + 1;
+        }
+        while ((pSlash = strchr(pComponent, '/')) != NULL)
+        {
+            SInspectDirectory* pDirectory;
+
+            if (DirectoryCount == MaxDirectories)
+            {
+                SInspectDirectory* pNew = realloc(pDirectories, 2 * MaxDirectories * sizeof(*pDirectories));
+
+                if (!pNew)
+                {
+                    fprintf(stderr, "error: Failed to allocate directory tree.\n");
+                    goto Error;
+                }
+                pDirectories = pNew;
+                MaxDirectories *= 2;
+            }
+            if (StackDepth == MaxStackDepth)
+            {
+                unsigned int* pNew = realloc(pStack, 2 * MaxStackDepth * sizeof(*pStack));
+
+                if (!pNew)
+                {
+                    fprintf(stderr, "error: Failed to allocate directory tree.\n");
+                    goto Error;
+                }
+                pStack = pNew;
+                MaxStackDepth *= 2;
+            }
+            pDirectory = &pDirectories[DirectoryCount];
+            pDirectory->pName = pComponent;
+            pDirectory->NameLength = pSlash - pComponent;
+            pDirectory->PathLength = pSlash - pFilename;
+            pDirectory->Depth = StackDepth;
+            pDirectory->FileCount = 0;
+            pDirectory->Size = 0;
+            pStack[StackDepth++] = DirectoryCount++;
+            pComponent = pSlash + 1;
+        }
+        for (j = 0 ; j < StackDepth ; j++)
+        {
+            pDirectories[pStack[j]].FileCount++;
+            pDirectories[pStack[j]].Size += pSizes[i];
+        }
+    }
+
+    /* Sort the largest files from largest to smallest. */
+    for (i = 1 ; i < LargestCount ; i++)
+    {
+        uint32_t Index = pLargest[i];
+
+        for (j = i ; j > 0 && pSizes[pLargest[j - 1]] < pSizes[Index] ; j--)
+        {
+            pLargest[j] = pLargest[j - 1];
+        }
+        pLargest[j] = Index;
+    }
+    ElapsedTime = _GetTimeInNanoseconds() - StartTime;
+
+    printf("    %s, %s endian, %u files, %llu bytes.\n",
+           Reader.FormatVersion == FILE_SYSTEM_FORMAT_VERSION ? "v2" : "legacy",
+           Reader.BigEndian ? "big" : "little",
+           Reader.FileCount,
+           (unsigned long long)Reader.ImageSize);
+    printf("    Checks:\n");
+    _PrintInspectCheck("Entries sorted:", UnsortedCount);
+    _PrintInspectCheck("Filenames NULL terminated in table:", BadNameCount);
+    _PrintInspectCheck("File data within image:", BadDataCount);
+    _PrintInspectCheck("Filenames don't overlap:", NameOverlapCount);
+    _PrintInspectCheck("File data doesn't overlap:", DataOverlapCount);
+
+    if (DirectoryCount)
+    {
+        printf("    Directories:\n");
+        printf("        %12s %8s  %s\n", "Bytes", "Files", "Path");
+        for (j = 0 ; j < DirectoryCount ; j++)
+        {
+            const SInspectDirectory* pDirectory = &pDirectories[j];
+
+            if (pDirectory->Depth <= pFileSystemBuild->InspectDepth)
+            {
+                printf("        %12llu %8u  %*s%.*s/\n",
+                       (unsigned long long)pDirectory->Size,
+                       pDirectory->FileCount,
+                       2 * pDirectory->Depth, "",
+                       (int)pDirectory->NameLength, pDirectory->pName);
+            }
+        }
+    }
+    if (LargestCount)
+    {
+        printf("    Largest files:\n");
+        for (j = 0 ; j < LargestCount ; j++)
+        {
+            printf("        %12llu  %s\n",
+                   (unsigned long long)pSizes[pLargest[j]],
+                   ppFilenames[pLargest[j]] ? ppFilenames[pLargest[j]] : "?");
+        }
+    }
+
+    PaddingSize = Reader.ImageSize;
+    PaddingSize -= Reader.HeaderSize + EntriesSize + NamesSize + OtherTablesSize + MerkleSize;
+    PaddingSize -= DataSize + HeadersSize + VariantsSize;
+    printf("    Header:            %11llu bytes\n", (unsigned long long)Reader.HeaderSize);
+    printf("    Entries:           %11llu bytes (%u files)\n", (unsigned long long)EntriesSize, Reader.FileCount);
+    printf("    Filenames:         %11llu bytes\n", (unsigned long long)NamesSize);
+    printf("    Other tables:      %11llu bytes\n", (unsigned long long)OtherTablesSize);
+    printf("    File data:         %11llu bytes\n", (unsigned long long)DataSize);
+    if (OtherRegionsSize)
+    {
+        printf("    In other regions:  %11llu bytes\n", (unsigned long long)OtherRegionsSize);
+    }
+    if (HeadersSize)
+    {
+        printf("    HTTP headers:      %11llu bytes\n", (unsigned long long)HeadersSize);
+    }
+    if (VariantsSize)
+    {
+        printf("    Precompressed:     %11llu bytes\n", (unsigned long long)VariantsSize);
+    }
+    if (MerkleSize)
+    {
+        printf("    Merkle tree:       %11llu bytes\n", (unsigned long long)MerkleSize);
+    }
+    printf("    Padding:           %11lld bytes\n", (long long)PaddingSize);
+    printf("    Total:             %11llu bytes, %.1f%% header and tables\n",
+           (unsigned long long)Reader.ImageSize,
+           Reader.ImageSize ? 
+               100.0 * (Reader.HeaderSize + EntriesSize + NamesSize + OtherTablesSize + MerkleSize) / Reader.ImageSize :
+               0.0);
+    printf("Inspected %u entries in %.3f ms.\n", Reader.FileCount, ElapsedTime / 1000000.0);
+
+    Return = UnsortedCount || BadNameCount || BadDataCount || NameOverlapCount || DataOverlapCount;
+    if (Return)
+    {
+        fprintf(stderr, "error: %s failed %u checks.\n",
+                pImageFilename,
+                UnsortedCount + BadNameCount + BadDataCount + NameOverlapCount + DataOverlapCount);
+    }
+Error:
+    free(pLargest);
+    free(pStack);
+    free(pDirectories);
+    free(pData);
+    free(pNames);
+    free(pSizes);
+    free(ppFilenames);
+    FsReaderCloseImage(&Reader);
+    return Return;
+}
+
+
+/* Work shared between the threads which write out the files of an image for
+   fsbld --extract. */
+typedef struct _SExtractWork
+{
+    const SFileSystemBuild* pFileSystemBuild;
+    const SFsReaderImage*   pImage;
+    /* Directory that the files are written into. */
+    int                     OutputDirectory;
+    /* Index of the source file matching each entry of the image, or ~0U if
+       there isn't one, when the files are being compared. */
+    const unsigned int*     pSourceIndices;
+    pthread_mutex_t         Lock;
+    /* Index of the next entry of the image to be written. */
+    uint32_t                NextFile;
+    /* Number of files which couldn't be written or don't match their
+       source. */
+    unsigned int            FailedCount;
+    unsigned int            DifferentCount;
+} SExtractWork;
+
+
+/* Checks that a filename from an image can't write outside of the output
+   directory, so that no component is empty, "." or "..".
+
+   Returns:
+    Non-zero if the filename is safe to extract.
+*/
+static int _IsSafeExtractPath(const char* pFilename)
+{
+    const char* pComponent = pFilename;
+
+    for (;;)
+    {
+        const char* pSlash = strchr(pComponent, '/');
+        size_t      Length = pSlash ? (size_t)(pSlash - pComponent) : strlen(pComponent);
+
+        if (Length == 0 ||
+            (Length == 1 && pComponent[0] == '.') ||
+            (Length == 2 && pComponent[0] == '.' && pComponent[1] == '.'))
+        {
+            return 0;
+        }
+        if (!pSlash)
+        {
+            return 1;
+        }
+        pComponent = pSlash + 1;
+    }
+}
+
+
+/* Writes the data of one file from the mapped image to the output directory
+   with pwrite(), so it goes straight from the mapping to the new file.
+
+   Returns:
+    0 on success and a positive error code otherwise.
+*/
+static int _WriteExtractedFile(int OutputDirectory, const SFsReaderStat* pStat)
+{
+    uint64_t    Written = 0;
+    int         File;
+
+    File = openat(OutputDirectory, pStat->pFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (File < 0)
+    {
+        fprintf(stderr, "error: Failed to create %s: %s.\n", pStat->pFilename, strerror(errno));
+        return 1;
+    }
+    while (Written < pStat->Size)
+    {
+        size_t  Size = pStat->Size - Written > (1 << 30) ? (1 << 30) : (size_t)(pStat->Size - Written);
+        ssize_t Result = pwrite(File, pStat->pData + Written, Size, (off_t)Written);
+
+        if (Result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (Result <= 0)
+        {
+            fprintf(stderr, "error: Failed to write %s: %s.\n", pStat->pFilename, strerror(errno));
+            close(File);
+            return 1;
+        }
+        Written += (uint64_t)Result;
+    }
+    if (close(File))
+    {
+        fprintf(stderr, "error: Failed to write %s: %s.\n", pStat->pFilename, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Compares an extracted file with its source by SHA-256 hash.  The source is
+   hashed as it is read so only a small buffer is needed however large the
+   file is.
+
+   Returns:
+    Non-zero if the file matches its source.
+*/
+static int _IsExtractedFileSame(const SFileSystemBuild*      pFileSystemBuild,
+                                const SFileSystemBuildEntry* pEntry,
+                                const SFsReaderStat*         pStat)
+{
+    SSha256         Sha;
+    unsigned char   ImageHash[MERKLE_HASH_SIZE];
+    unsigned char   SourceHash[MERKLE_HASH_SIZE];
+    unsigned char   Buffer[EXTRACT_READ_SIZE];
+    char            FilenameBuffer[1024];
+    FILE*           pSourceFile;
+    uint64_t        SourceSize = 0;
+    size_t          BytesRead;
+
+    if (pEntry->FileBinarySize != pStat->Size)
+    {
+        return 0;
+    }
+    snprintf(FilenameBuffer, sizeof(FilenameBuffer), 
+             "%s/%s", 
+             pFileSystemBuild->pRootSourceDirectory, 
+             pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset);
+    pSourceFile = fopen(FilenameBuffer, "r");
+    if (!pSourceFile)
+    {
+        fprintf(stderr, "error: Failed to open %s for read.\n", FilenameBuffer);
+        return 0;
+    }
+    Sha256Init(&Sha);
+    while ((BytesRead = fread(Buffer, 1, sizeof(Buffer), pSourceFile)) > 0)
+    {
+        Sha256Update(&Sha, Buffer, BytesRead);
+        SourceSize += BytesRead;
+    }
+    fclose(pSourceFile);
+    Sha256Final(&Sha, SourceHash);
+
+    Sha256Init(&Sha);
+    Sha256Update(&Sha, pStat->pData, (size_t)pStat->Size);
+    Sha256Final(&Sha, ImageHash);
+
+    return SourceSize == pStat->Size && 0 == memcmp(ImageHash, SourceHash, sizeof(ImageHash));
+}
+
+
+/* Thread which repeatedly takes the next file from the shared SExtractWork,
+   writes it out and compares it with its source. */
+static void* _ExtractThread(void* pvWork)
+{
+    SExtractWork*   pWork = (SExtractWork*)pvWork;
+
+    for (;;)
+    {
+        SFsReaderStat   Stat;
+        uint32_t        Index;
+        int             Failed;
+        int             Different = 0;
+
+        pthread_mutex_lock(&pWork->Lock);
+        if (pWork->NextFile >= pWork->pImage->FileCount)
+        {
+            pthread_mutex_unlock(&pWork->Lock);
+            break;
+        }
+        Index = pWork->NextFile++;
+        pthread_mutex_unlock(&pWork->Lock);
+
+        Failed = FsReaderStatIndex(pWork->pImage, Index, &Stat) || 
+                 _WriteExtractedFile(pWork->OutputDirectory, &Stat);
+        if (!Failed && pWork->pSourceIndices && pWork->pSourceIndices[Index] != ~0U)
+        {
+            const SFileSystemBuild* pFileSystemBuild = pWork->pFileSystemBuild;
+
+            Different = !_IsExtractedFileSame(pFileSystemBuild, 
+                                              &pFileSystemBuild->pFileEntries[pWork->pSourceIndices[Index]],
+                                              &Stat);
+            if (Different)
+            {
+                fprintf(stderr, "error: %s differs from %s/%s.\n", 
+                        Stat.pFilename, pFileSystemBuild->pRootSourceDirectory, Stat.pFilename);
+            }
+        }
+        if (Failed || Different)
+        {
+            pthread_mutex_lock(&pWork->Lock);
+            pWork->FailedCount += Failed;
+            pWork->DifferentCount += Different;
+            pthread_mutex_unlock(&pWork->Lock);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Matches the sorted files of the image with the sorted files of the
+   --compare source tree, reporting those which are only in one of them.
+
+   Parameters:
+    pFileSystemBuild holds the source files listed by _CreateFileList().
+    pImage is the image being extracted.
+    pSourceIndices is filled in with the index of the source file matching
+        each entry of the image, or ~0U if there isn't one.
+
+   Returns:
+    The number of files which are only in the image or only in the source.
+*/
+static unsigned int _MatchExtractSources(const SFileSystemBuild* pFileSystemBuild,
+                                         const SFsReaderImage*   pImage,
+                                         unsigned int*           pSourceIndices)
+{
+    unsigned int    Unmatched = 0;
+    unsigned int    Source = 0;
+    uint32_t        i;
+
+    for (i = 0 ; i < pImage->FileCount ; i++)
+    {
+        SFsReaderStat   Stat;
+        int             Compare = 1;
+
+        pSourceIndices[i] = ~0U;
+        FsReaderStatIndex(pImage, i, &Stat);
+        while (Source < pFileSystemBuild->FileCount)
+        {
+            const char* pSourceName = pFileSystemBuild->pFilenameBuffer + 
+                                      pFileSystemBuild->pFileEntries[Source].FilenameOffset;
+
+            Compare = strcmp(pSourceName, Stat.pFilename);
+            if (Compare >= 0)
+            {
+                break;
+            }
+            fprintf(stderr, "error: %s/%s isn't in the image.\n", pFileSystemBuild->pRootSourceDirectory, pSourceName);
+            Unmatched++;
+            Source++;
+        }
+        if (Source < pFileSystemBuild->FileCount && Compare == 0)
+        {
+            pSourceIndices[i] = Source++;
+        }
+        else
+        {
+            fprintf(stderr, "error: %s isn't in %s.\n", Stat.pFilename, pFileSystemBuild->pRootSourceDirectory);
+            Unmatched++;
+        }
+    }
+    for ( ; Source < pFileSystemBuild->FileCount ; Source++)
+    {
+        fprintf(stderr, "error: %s/%s isn't in the image.\n", 
+                pFileSystemBuild->pRootSourceDirectory,
+                pFileSystemBuild->pFilenameBuffer + pFileSystemBuild->pFileEntries[Source].FilenameOffset);
+        Unmatched++;
+    }
+
+    return Unmatched;
+}
+
+
+/* Creates the directories needed by the files of an image.  The filenames are
+   sorted so the files of each directory are contiguous and a directory only
+   needs to be created when the directory of a file differs from that of the
+   file before it, and then only for the components which differ.
+
+   Parameters:
+    OutputDirectory is the directory the files are to be written into.
+    pImage is the image being extracted.
+    pDirectoryCount is filled in with the number of directories created.
+
+   Returns:
+    0 on success and a positive error code otherwise.
+*/
+static int _CreateExtractDirectories(int                   OutputDirectory, 
+                                     const SFsReaderImage* pImage,
+                                     unsigned int*         pDirectoryCount)
+{
+    const char*     pPrevious = "";
+    size_t          PreviousLength = 0;
+    char            DirectoryName[1024];
+    uint32_t        i;
+
+    *pDirectoryCount = 0;
+    for (i = 0 ; i < pImage->FileCount ; i++)
+    {
+        SFsReaderStat   Stat;
+        const char*     pSlash;
+        size_t          Length;
+
+        FsReaderStatIndex(pImage, i, &Stat);
+        if (!_IsSafeExtractPath(Stat.pFilename))
+        {
+            fprintf(stderr, "error: %s would be written outside of the output directory.\n", Stat.pFilename);
+            return 1;
+        }
+        pSlash = strrchr(Stat.pFilename, '/');
+        Length = pSlash ? (size_t)(pSlash - Stat.pFilename) : 0;
+        if (Length == PreviousLength && 0 == memcmp(Stat.pFilename, pPrevious, Length))
+        {
+            continue;
+        }
+        if (Length > sizeof(DirectoryName) - 1)
+        {
+            fprintf(stderr, "error: %s pathname is too long.\n", Stat.pFilename);
+            return 1;
+        }
+
+        /* Create each component past the part shared with the previous
+           file's directory, which already exists. */
+        for (pSlash = strchr(Stat.pFilename, '/') ; 
+             pSlash && (size_t)(pSlash - Stat.pFilename) <= Length ;
+             pSlash = strchr(pSlash + 1, '/'))
+        {
+            size_t ComponentEnd = pSlash - Stat.pFilename;
+
+            if (ComponentEnd <= PreviousLength && 
+                (ComponentEnd == PreviousLength || pPrevious[ComponentEnd] == '/') &&
+                0 == memcmp(Stat.pFilename, pPrevious, ComponentEnd))
+            {
+                continue;
+            }
+            memcpy(DirectoryName, Stat.pFilename, ComponentEnd);
+            DirectoryName[ComponentEnd] = '\0';
+            if (mkdirat(OutputDirectory, DirectoryName, 0777))
+            {
+                if (errno != EEXIST)
+                {
+                    fprintf(stderr, "error: Failed to create directory %s: %s.\n", DirectoryName, strerror(errno));
+                    return 1;
+                }
+            }
+            else
+            {
+                (*pDirectoryCount)++;
+            }
+        }
+        pPrevious = Stat.pFilename;
+        PreviousLength = Length;
+    }
+
+    return 0;
+}
+
+
+/* Extracts the files of an image for fsbld --extract.  The image is mapped,
+   the directories are created once each in sorted order and then the files
+   are written straight from the mapping by a pool of threads, one per
+   processor.  With --compare, each file is also checked against the file of
+   the same name in a source tree by SHA-256 hash and files which are only in
+   the image or only in the source tree are reported.
+
+   Parameters:
+    pFileSystemBuild holds the image filename and output directory in
+        pParameters[0] and pParameters[1] along with the --compare directory.
+
+   Returns:
+    0 on success and a positive error code if the image can't be extracted
+    or doesn't match the source tree.
+*/
+static int _ExtractImage(SFileSystemBuild* pFileSystemBuild)
+{
+    const char*     pImageFilename = pFileSystemBuild->pParameters[0];
+    const char*     pOutputDirectory = pFileSystemBuild->pParameters[1];
+    SFsReaderImage  Image;
+    SExtractWork    Work;
+    pthread_t       Threads[64];
+    unsigned int*   pSourceIndices = NULL;
+    unsigned int    ThreadCount;
+    unsigned int    DirectoryCount = 0;
+    unsigned int    UnmatchedCount = 0;
+    unsigned int    i;
+    uint64_t        TotalSize = 0;
+    uint64_t        StartTime;
+    uint64_t        ElapsedTime;
+    long            ProcessorCount;
+    int             OutputDirectory = -1;
+    int             Result;
+    int             Return = 1;
+
+    Result = FsReaderOpenImage(&Image, pImageFilename);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", pImageFilename, FsReaderErrorString(Result));
+        return 1;
+    }
+    if (pFileSystemBuild->pCompareDirectory)
+    {
+        pFileSystemBuild->pRootSourceDirectory = pFileSystemBuild->pCompareDirectory;
+        if (_CreateFileList(pFileSystemBuild))
+        {
+            goto Error;
+        }
+        pSourceIndices = malloc((Image.FileCount + 1) * sizeof(*pSourceIndices));
+        if (!pSourceIndices)
+        {
+            fprintf(stderr, "error: Failed to allocate %u source indices.\n", Image.FileCount);
+            goto Error;
+        }
+        UnmatchedCount = _MatchExtractSources(pFileSystemBuild, &Image, pSourceIndices);
+    }
+
+    printf("Extracting %s to %s...\n", pImageFilename, pOutputDirectory);
+    StartTime = _GetTimeInNanoseconds();
+    if (mkdir(pOutputDirectory, 0777) && errno != EEXIST)
+    {
+        fprintf(stderr, "error: Failed to create directory %s: %s.\n", pOutputDirectory, strerror(errno));
+        goto Error;
+    }
+    OutputDirectory = open(pOutputDirectory, O_RDONLY | O_DIRECTORY);
+    if (OutputDirectory < 0)
+    {
+        fprintf(stderr, "error: Failed to open directory %s: %s.\n", pOutputDirectory, strerror(errno));
+        goto Error;
+    }
+    if (_CreateExtractDirectories(OutputDirectory, &Image, &DirectoryCount))
+    {
+        goto Error;
+    }
+
+    /* Write the files in parallel. */
+    memset(&Work, 0, sizeof(Work));
+    Work.pFileSystemBuild = pFileSystemBuild;
+    Work.pImage = &Image;
+    Work.OutputDirectory = OutputDirectory;
+    Work.pSourceIndices = pSourceIndices;
+    pthread_mutex_init(&Work.Lock, NULL);
+    ProcessorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    ThreadCount = ProcessorCount > 0 ? (unsigned int)ProcessorCount : 1;
+    if (ThreadCount > sizeof(Threads) / sizeof(Threads[0]))
+    {
+        ThreadCount = sizeof(Threads) / sizeof(Threads[0]);
+    }
+    if (ThreadCount > Image.FileCount)
+    {
+        ThreadCount = Image.FileCount;
+    }
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        if (pthread_create(&Threads[i], NULL, _ExtractThread, &Work))
+        {
+            /* Carry on with the threads which did start, or on this one if
+               none did. */
+            break;
+        }
+    }
+    ThreadCount = i;
+    if (ThreadCount == 0)
+    {
+        _ExtractThread(&Work);
+    }
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        pthread_join(Threads[i], NULL);
+    }
+    pthread_mutex_destroy(&Work.Lock);
+    ElapsedTime = _GetTimeInNanoseconds() - StartTime;
+
+    for (i = 0 ; i < Image.FileCount ; i++)
+    {
+        SFsReaderStat Stat;
+
+        FsReaderStatIndex(&Image, i, &Stat);
+        TotalSize += Stat.Size;
+    }
+    printf("Extracted %u files (%llu bytes) and created %u directories using %u threads in %.2f ms (%.1f MB/s).\n",
+           Image.FileCount - Work.FailedCount,
+           (unsigned long long)TotalSize,
+           DirectoryCount,
+           ThreadCount ? ThreadCount : 1,
+           ElapsedTime / 1000000.0,
+           ElapsedTime ? (TotalSize / 1000000.0) / (ElapsedTime / 1000000000.0) : 0.0);
+    if (Work.FailedCount)
+    {
+        fprintf(stderr, "error: Failed to extract %u files.\n", Work.FailedCount);
+        goto Error;
+    }
+    if (pSourceIndices)
+    {
+        printf("Compared with %s: %u files differ, %u are only in the image or only in the source.\n",
+               pFileSystemBuild->pCompareDirectory, Work.DifferentCount, UnmatchedCount);
+        if (Work.DifferentCount || UnmatchedCount)
+        {
+            goto Error;
+        }
+    }
+
+    Return = 0;
+Error:
+    if (OutputDirectory >= 0)
+    {
+        close(OutputDirectory);
+    }
+    free(pSourceIndices);
+    FsReaderCloseImage(&Image);
+    return Return;
+}
+
+
+/* File to be placed in an image by fsbld --update. */
+typedef struct _SUpdateEntry
+{
+    const char*                  pFilename;
+    /* Where the data currently lives: an entry of the existing image or an
+       entry found in the changes directory. */
+    const SFsReaderStat*         pImageEntry;
+    const SFileSystemBuildEntry* pSourceEntry;
+    /* Location of the data in the updated image. */
+    uint64_t                     FileBinaryOffset;
+    uint64_t                     FileBinarySize;
+} SUpdateEntry;
+
+
+/* Returns non-zero if pFilename matches one of the --remove patterns. */
+static int _IsFileRemoved(const SFileSystemBuild* pFileSystemBuild, const char* pFilename)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < pFileSystemBuild->RemovePatternCount ; i++)
+    {
+        if (0 == fnmatch(pFileSystemBuild->ppRemovePatterns[i], pFilename, 0))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Merges the sorted entries of the existing image with the sorted files found
+   in the changes directory.  A file in the changes directory replaces the
+   existing file of the same name.
+
+   Parameters:
+    pFileSystemBuild is the context which holds the changed files.
+    pImageFile is the existing image.
+    pEntries is an array large enough to hold both lists, which is filled in
+        with the merged list in sorted order.
+    pCounts is filled in with the number of files kept, added, replaced and
+        removed, in that order.
+
+   Returns:
+    The number of elements filled in within pEntries.
+*/
+static unsigned int _MergeUpdateEntries(const SFileSystemBuild* pFileSystemBuild,
+                                        const SImageFile*       pImageFile,
+                                        SUpdateEntry*           pEntries,
+                                        unsigned int            pCounts[4])
+{
+    unsigned int    Count = 0;
+    unsigned int    i = 0;
+    unsigned int    j = 0;
+
+    memset(pCounts, 0, 4 * sizeof(pCounts[0]));
+    while (i < pImageFile->FileCount || j < pFileSystemBuild->FileCount)
+    {
+        const SFsReaderStat*         pImageEntry = i < pImageFile->FileCount ? &pImageFile->pEntries[i] : NULL;
+        const SFileSystemBuildEntry* pSourceEntry = j < pFileSystemBuild->FileCount ? 
+                                                    &pFileSystemBuild->pFileEntries[j] : NULL;
+        SUpdateEntry*                pEntry = &pEntries[Count];
+        int                          Order;
+
+        if (!pImageEntry)
+        {
+            Order = 1;
+        }
+        else if (!pSourceEntry)
+        {
+            Order = -1;
+        }
+        else
+        {
+            Order = strcmp(pImageEntry->pFilename, 
+                           pFileSystemBuild->pFilenameBuffer + pSourceEntry->FilenameOffset);
+        }
+
+        memset(pEntry, 0, sizeof(*pEntry));
+        if (Order < 0)
+        {
+            i++;
+            if (_IsFileRemoved(pFileSystemBuild, pImageEntry->pFilename))
+            {
+                pCounts[3]++;
+                continue;
+            }
+            pCounts[0]++;
+            pEntry->pFilename = pImageEntry->pFilename;
+            pEntry->pImageEntry = pImageEntry;
+            pEntry->FileBinaryOffset = pImageEntry->Offset;
+            pEntry->FileBinarySize = pImageEntry->Size;
+        }
+        else
+        {
+            if (Order == 0)
+            {
+                i++;
+                pCounts[2]++;
+            }
+            else
+            {
+                pCounts[1]++;
+            }
+            j++;
+            pEntry->pFilename = pFileSystemBuild->pFilenameBuffer + pSourceEntry->FilenameOffset;
+            pEntry->pSourceEntry = pSourceEntry;
+            pEntry->FileBinarySize = pSourceEntry->FileBinarySize;
+        }
+        Count++;
+    }
+
+    return Count;
+}
+
+
+/* Writes the data of a file to its location in the updated image, copying it
+   from the existing image or reading it from the changes directory.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteUpdateData(const SFileSystemBuild* pFileSystemBuild,
+                            const SImageFile*       pImageFile,
+                            const SUpdateEntry*     pEntry,
+                            int                     File)
+{
+    const unsigned char*    pData;
+    unsigned char*          pSourceData = NULL;
+    int                     Return = 0;
+
+    if (pEntry->FileBinarySize == 0)
+    {
+        return 0;
+    }
+    if (pEntry->pSourceEntry)
+    {
+        pSourceData = _ReadSourceFile(pFileSystemBuild, pEntry->pSourceEntry);
+        if (!pSourceData)
+        {
+            return 1;
+        }
+        pData = pSourceData;
+    }
+    else
+    {
+        pData = pImageFile->pImage + pEntry->pImageEntry->Offset;
+    }
+    if ((ssize_t)pEntry->FileBinarySize != pwrite(File, pData, (size_t)pEntry->FileBinarySize, 
+                                                  (off_t)pEntry->FileBinaryOffset))
+    {
+        fprintf(stderr, "error: Failed to write %s to the image.\n", pEntry->pFilename);
+        Return = 1;
+    }
+    free(pSourceData);
+
+    return Return;
+}
+
+
+/* Writes the header, entry table and filenames of an updated legacy image.
+
+   Parameters:
+    pImageFile is the existing image which supplies the byte order.
+    pEntries is the merged list of files.
+    Count is the number of elements in pEntries.
+    NamesOffset is the location at which the filenames are to be written.
+    NamesSize is the total size of the filenames including terminators.
+    File is the descriptor to which the tables are written.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _WriteUpdateTables(const SImageFile*     pImageFile,
+                              const SUpdateEntry*   pEntries,
+                              unsigned int          Count,
+                              uint64_t              NamesOffset,
+                              uint64_t              NamesSize,
+                              int                   File)
+{
+    uint64_t        TableSize = sizeof(SFileSystemHeader) + (uint64_t)Count * sizeof(SFileSystemEntry);
+    unsigned char*  pTable = malloc((size_t)TableSize);
+    char*           pNames = malloc((size_t)NamesSize + 1);
+    unsigned char*  pCurr;
+    char*           pName;
+    unsigned int    i;
+    int             Return = 1;
+
+    if (!pTable || !pNames)
+    {
+        fprintf(stderr, "error: Failed to allocate the image tables.\n");
+        goto Error;
+    }
+
+    /* Both tables are built in memory first since they overwrite the old
+       tables which hold the filenames being copied. */
+    memcpy(pTable, FILE_SYSTEM_SIGNATURE, sizeof(((SFileSystemHeader*)0)->FileSystemSignature));
+    pCurr = _StoreField(pTable + 8, Count, 4, pImageFile->Reader.BigEndian);
+    pName = pNames;
+    for (i = 0 ; i < Count ; i++)
+    {
+        size_t Length = strlen(pEntries[i].pFilename) + 1;
+
+        memcpy(pName, pEntries[i].pFilename, Length);
+        pCurr = _StoreField(pCurr, NamesOffset + (pName - pNames), 4, pImageFile->Reader.BigEndian);
+        pCurr = _StoreField(pCurr, pEntries[i].FileBinaryOffset, 4, pImageFile->Reader.BigEndian);
+        pCurr = _StoreField(pCurr, pEntries[i].FileBinarySize, 4, pImageFile->Reader.BigEndian);
+        pName += Length;
+    }
+
+    if ((ssize_t)NamesSize != pwrite(File, pNames, (size_t)NamesSize, (off_t)NamesOffset) ||
+        (ssize_t)TableSize != pwrite(File, pTable, (size_t)TableSize, 0))
+    {
+        fprintf(stderr, "error: Failed to write the image tables.\n");
+        goto Error;
+    }
+
+    Return = 0;
+Error:
+    free(pTable);
+    free(pNames);
+    return Return;
+}
+
+
+/* Handles fsbld --update by merging added, replaced and removed files into an
+   existing legacy image.  The image is mapped rather than rebuilt so only the
+   new data, the entry table and the filenames are written.  The filenames go
+   back between the entries and the data when they fit and are appended
+   otherwise.  Data which the larger entry table would overwrite is moved to
+   the end.  Replaced and removed data is left behind as dead space which
+   --compact reclaims by writing a fresh, tightly packed image and renaming
+   it over the original.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the parsed command line.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _UpdateImage(SFileSystemBuild* pFileSystemBuild)
+{
+    const char*     pImageFilename = pFileSystemBuild->pParameters[0];
+    char*           pTempFilename = NULL;
+    SImageFile      Image;
+    SUpdateEntry*   pEntries = NULL;
+    int             File = -1;
+    int             OutputFile = -1;
+    unsigned int    Counts[4];
+    unsigned int    Count;
+    uint64_t        StartTime = _GetTimeInNanoseconds();
+    uint64_t        TablesEnd;
+    uint64_t        NamesSize = 0;
+    uint64_t        NamesOffset;
+    uint64_t        LiveSize;
+    uint64_t        FirstData;
+    uint64_t        Offset;
+    uint64_t        Written = 0;
+    unsigned int    i;
+    int             Return = 1;
+
+    /* The reader maps the image shared so the data still to be moved can be
+       read through it while the file is written in place. */
+    memset(&Image, 0, sizeof(Image));
+    if (_LoadImageFile(&Image, pImageFilename))
+    {
+        goto Error;
+    }
+    if (Image.Reader.FormatVersion != FILE_SYSTEM_FORMAT_LEGACY)
+    {
+        fprintf(stderr, "error: --update only supports legacy images.  Rebuild v2 images instead.\n");
+        goto Error;
+    }
+    File = open(pImageFilename, O_RDWR);
+    if (File < 0)
+    {
+        fprintf(stderr, "error: Failed to open %s for update.\n", pImageFilename);
+        goto Error;
+    }
+    printf("Updating %s...\n", pImageFilename);
+
+    if (pFileSystemBuild->pParameters[1])
+    {
+        pFileSystemBuild->pRootSourceDirectory = pFileSystemBuild->pParameters[1];
+        if (_CreateFileList(pFileSystemBuild))
+        {
+            goto Error;
+        }
+    }
+    pEntries = malloc(((size_t)Image.FileCount + pFileSystemBuild->FileCount + 1) * sizeof(*pEntries));
+    if (!pEntries)
+    {
+        fprintf(stderr, "error: Failed to allocate the updated entries.\n");
+        goto Error;
+    }
+    Count = _MergeUpdateEntries(pFileSystemBuild, &Image, pEntries, Counts);
+
+    TablesEnd = sizeof(SFileSystemHeader) + (uint64_t)Count * sizeof(SFileSystemEntry);
+    LiveSize = 0;
+    for (i = 0 ; i < Count ; i++)
+    {
+        NamesSize += strlen(pEntries[i].pFilename) + 1;
+        LiveSize += pEntries[i].FileBinarySize;
+    }
+
+    if (pFileSystemBuild->Compact)
+    {
+        /* Lay the image out from scratch into a temporary file. */
+        pTempFilename = _AllocOutputFilename(pImageFilename, ".tmp");
+        if (!pTempFilename)
+        {
+            goto Error;
+        }
+        OutputFile = open(pTempFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (OutputFile < 0)
+        {
+            fprintf(stderr, "error: Failed to open %s for writing.\n", pTempFilename);
+            goto Error;
+        }
+        NamesOffset = TablesEnd;
+        Offset = NamesOffset + NamesSize;
+        for (i = 0 ; i < Count ; i++)
+        {
+            pEntries[i].FileBinaryOffset = Offset;
+            Offset += pEntries[i].FileBinarySize;
+        }
+    }
+    else
+    {
+        /* Existing data stays where it is unless the entry table grows over
+           it, everything new is appended. */
+        OutputFile = File;
+        Offset = Image.ImageSize;
+        FirstData = Image.ImageSize;
+        for (i = 0 ; i < Count ; i++)
+        {
+            SUpdateEntry* pEntry = &pEntries[i];
+
+            if (pEntry->pImageEntry && pEntry->FileBinarySize && pEntry->FileBinaryOffset < TablesEnd)
+            {
+                pEntry->FileBinaryOffset = Offset;
+                Offset += pEntry->FileBinarySize;
+            }
+            else if (pEntry->pImageEntry && pEntry->FileBinarySize && pEntry->FileBinaryOffset < FirstData)
+            {
+                FirstData = pEntry->FileBinaryOffset;
+            }
+        }
+        if (TablesEnd + NamesSize <= FirstData)
+        {
+            NamesOffset = TablesEnd;
+        }
+        else
+        {
+            NamesOffset = Offset;
+            Offset += NamesSize;
+        }
+        for (i = 0 ; i < Count ; i++)
+        {
+            if (pEntries[i].pSourceEntry)
+            {
+                pEntries[i].FileBinaryOffset = Offset;
+                Offset += pEntries[i].FileBinarySize;
+            }
+        }
+    }
+    if (Offset > UINT32_MAX)
+    {
+        fprintf(stderr, "error: Updated image would exceed the 4GB limit of the legacy format.\n");
+        goto Error;
+    }
+
+    /* Move or add the data before the tables are overwritten. */
+    for (i = 0 ; i < Count ; i++)
+    {
+        if (pFileSystemBuild->Compact || 
+            pEntries[i].pSourceEntry || 
+            pEntries[i].FileBinaryOffset != pEntries[i].pImageEntry->Offset)
+        {
+            if (_WriteUpdateData(pFileSystemBuild, &Image, &pEntries[i], OutputFile))
+            {
+                goto Error;
+            }
+            Written += pEntries[i].FileBinarySize;
+        }
+    }
+    if (_WriteUpdateTables(&Image, pEntries, Count, NamesOffset, NamesSize, OutputFile))
+    {
+        goto Error;
+    }
+    Written += TablesEnd + NamesSize;
+    if (pFileSystemBuild->Compact)
+    {
+        if (close(OutputFile) || rename(pTempFilename, pImageFilename))
+        {
+            OutputFile = -1;
+            fprintf(stderr, "error: Failed to replace %s with %s.\n", pImageFilename, pTempFilename);
+            goto Error;
+        }
+        OutputFile = -1;
+    }
+
+    printf("    %u kept, %u added, %u replaced and %u removed files.\n",
+           Counts[0], Counts[1], Counts[2], Counts[3]);
+    printf("    Wrote %llu bytes in %.3f ms.  Image is %llu bytes of which %llu (%.1f%%) are unused.\n",
+           (unsigned long long)Written,
+           (_GetTimeInNanoseconds() - StartTime) / 1000000.0,
+           (unsigned long long)Offset,
+           (unsigned long long)(Offset - TablesEnd - NamesSize - LiveSize),
+           100.0 * (Offset - TablesEnd - NamesSize - LiveSize) / Offset);
+
+    Return = 0;
+Error:
+    if (OutputFile >= 0 && OutputFile != File)
+    {
+        close(OutputFile);
+        unlink(pTempFilename);
+    }
+    if (File >= 0)
+    {
+        close(File);
+    }
+    free(pTempFilename);
+    free(pEntries);
+    _FreeImageFile(&Image);
+    return Return;
+}
+
+
+/* Rule read from the --priorities file. */
+typedef struct _SPriorityRule
+{
+    /* fnmatch() pattern which is compared against the filename. */
+    const char*         pPattern;
+    /* Priority of matching files, lowest dropped first, or -1 for files
+       which must be kept. */
+    int                 Priority;
+} SPriorityRule;
+
+/* Entries and priority of each entry used by _CompareDropOrder(). */
+static const SFileSystemBuildEntry* g_pDropEntries;
+static const int*                   g_pDropPriorities;
+
+/* Orders the optional files in the order they are to be dropped: lowest
+   priority first and then largest first so that as few files as possible are
+   dropped. */
+static int _CompareDropOrder(const void* pv1, const void* pv2)
+{
+    unsigned int Index1 = *(const unsigned int*)pv1;
+    unsigned int Index2 = *(const unsigned int*)pv2;
+    uint64_t     Size1 = g_pDropEntries[Index1].FileBinarySize;
+    uint64_t     Size2 = g_pDropEntries[Index2].FileBinarySize;
+
+    if (g_pDropPriorities[Index1] != g_pDropPriorities[Index2])
+    {
+        return g_pDropPriorities[Index1] < g_pDropPriorities[Index2] ? -1 : 1;
+    }
+    if (Size1 != Size2)
+    {
+        return Size1 > Size2 ? -1 : 1;
+    }
+    return Index1 < Index2 ? -1 : (Index1 > Index2);
+}
+
+
+/* Reads the --priorities file and finds the priority of every file.  Each
+   line is a filename pattern followed by a priority number or "required".
+   The first matching rule wins and files which match no rule are required.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    pPriorities is filled in with the priority of each file or -1 if the file
+        is required.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _LoadFilePriorities(const SFileSystemBuild* pFileSystemBuild, int* pPriorities)
+{
+    char*           pBuffer = NULL;
+    char*           pLine;
+    SPriorityRule*  pRules = NULL;
+    unsigned int    RuleCount = 0;
+    unsigned int    MaxRules = 0;
+    unsigned int    LineNumber = 0;
+    unsigned int    i;
+    unsigned int    j;
+    int             Return = 1;
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        pPriorities[i] = -1;
+    }
+    if (!pFileSystemBuild->pPrioritiesFilename)
+    {
+        return 0;
+    }
+
+    pBuffer = _LoadTextFile(pFileSystemBuild->pPrioritiesFilename, &MaxRules);
+    if (!pBuffer)
+    {
+        return 1;
+    }
+    pRules = calloc(MaxRules, sizeof(*pRules));
+    if (!pRules)
+    {
+        fprintf(stderr, "error: Failed to allocate %u priority rules.\n", MaxRules);
+        goto Error;
+    }
+
+    /* Split each line into its pattern and priority in place. */
+    pLine = pBuffer;
+    while (*pLine)
+    {
+        char*   pNext = pLine + strcspn(pLine, "\n");
+        char*   pValue;
+        char*   pEnd = NULL;
+
+        LineNumber++;
+        if (*pNext)
+        {
+            *pNext++ = '\0';
+        }
+        pLine += strspn(pLine, " \t");
+        if (*pLine && *pLine != '#' && *pLine != '\r')
+        {
+            SPriorityRule* pRule = &pRules[RuleCount++];
+
+            pValue = pLine + strcspn(pLine, " \t");
+            if (*pValue)
+            {
+                *pValue++ = '\0';
+                pValue += strspn(pValue, " \t");
+                pValue[strcspn(pValue, " \t\r")] = '\0';
+            }
+            pRule->pPattern = pLine;
+            if (0 == strcmp(pValue, "required"))
+            {
+                pRule->Priority = -1;
+            }
+            else
+            {
+                pRule->Priority = (int)strtol(pValue, &pEnd, 0);
+                if (pEnd == pValue || *pEnd != '\0' || pRule->Priority < 0)
+                {
+                    fprintf(stderr, "error: %s:%u: Expected a pattern followed by a priority or required.\n",
+                            pFileSystemBuild->pPrioritiesFilename, LineNumber);
+                    goto Error;
+                }
+            }
+        }
+        pLine = pNext;
+    }
+
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        const char* pFilename = pFileSystemBuild->pFilenameBuffer + pFileSystemBuild->pFileEntries[i].FilenameOffset;
+
+        for (j = 0 ; j < RuleCount ; j++)
+        {
+            if (0 == fnmatch(pRules[j].pPattern, pFilename, 0))
+            {
+                pPriorities[i] = pRules[j].Priority;
+                break;
+            }
+        }
+    }
+
+    Return = 0;
+Error:
+    free(pRules);
+    free(pBuffer);
+    return Return;
+}
+
+
+/* Removes the flagged files from the file list, compacting the entries and
+   filenames and remapping the data order.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+    pDrop holds a non-zero flag for each file to be removed.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _DropFiles(SFileSystemBuild* pFileSystemBuild, const unsigned char* pDrop)
+{
+    unsigned int*   pNewIndices = NULL;
+    char*           pNewFilenames = NULL;
+    unsigned int    FilenameSize = 0;
+    unsigned int    Count = 0;
+    unsigned int    i;
+
+    pNewIndices = malloc((pFileSystemBuild->FileCount + 1) * sizeof(*pNewIndices));
+    pNewFilenames = malloc(pFileSystemBuild->FilenameBufferSize + 1);
+    if (!pNewIndices || !pNewFilenames)
     {
-        fprintf(stderr, 
-                "error: Failed to open directory %s\n", 
-                pDirectoryName);
-        goto Error;
+        fprintf(stderr, "error: Failed to allocate the reduced file list.\n");
+        free(pNewIndices);
+        free(pNewFilenames);
+        return 1;
     }
 
-    /* Determine the length of this directory name with trailing slash
-       separator. */
-    DirectoryNameSize = strlen(pDirectoryName);
-    ImageDirectoryNameSize = strlen(pImageDirectoryName);
-    
-    /* Iterate through the files in the directory and fill in the file system
-       entries. */
-    while(NULL != (pDirEntry = readdir(pDir)))
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
     {
-        if (DT_DIR == pDirEntry->d_type)
+        SFileSystemBuildEntry*  pEntry = &pFileSystemBuild->pFileEntries[i];
+        const char*             pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+        size_t                  Length = strlen(pFilename) + 1;
+
+        pNewIndices[i] = Count;
+        if (pDrop[i])
         {
-            /* Skip . and .. directories */
-            if (0 != strcmp(pDirEntry->d_name, ".") &&
-                0 != strcmp(pDirEntry->d_name, ".."))
-            {
-                /* Recurse into subdirectories. */
-                int          Result = 1;
-                char         SubdirectoryName[512];
-                char         ImageSubdirectoryName[512];
-            
-                /* Make sure that the complete pathname for this subdirectory will
-                   fit in the buffers. */
-                if (DirectoryNameSize + 1 + pDirEntry->d_namlen > 
-                    (sizeof(SubdirectoryName) - 1))
-                {
-                    fprintf(stderr,
-                            "error: %s/%s pathname is too long.\n",
-                            pDirectoryName,
-                            pDirEntry->d_name);
-                    goto Error;
-                }
-                if (ImageDirectoryNameSize + pDirEntry->d_namlen + 1 >
-                    sizeof(ImageSubdirectoryName) - 1)
-                {
-                    fprintf(stderr,
-                            "error: %s%s/ pathname is too long.\n",
-                            pImageDirectoryName,
-                            pDirEntry->d_name);
-                    goto Error;
-                }
-            
-                /* Create complete pathnames. */
-                snprintf(SubdirectoryName, sizeof(SubdirectoryName), 
-                         "%s/%s",
-                         pDirectoryName,
-                         pDirEntry->d_name);
-                snprintf(ImageSubdirectoryName, sizeof(ImageSubdirectoryName), 
-                         "%s%s/",
-                         pImageDirectoryName,
-                         pDirEntry->d_name);
-            
-                /* Recurse into this directory and gets its counts. */
-                Result = _PopulateEntriesFromDirectoryTree(pFileSystemBuild,
-                                                           SubdirectoryName,
-                                                           ImageSubdirectoryName);
-                if (Result)
-                {
-                    Return = Result;
-                    goto Error;
-                }
-            }
+            continue;
         }
-        else
+        memcpy(pNewFilenames + FilenameSize, pFilename, Length);
+        pEntry->FilenameOffset = FilenameSize;
+        FilenameSize += Length;
+        pFileSystemBuild->pFileEntries[Count++] = *pEntry;
+    }
+
+    if (pFileSystemBuild->pDataOrder)
+    {
+        unsigned int OrderCount = 0;
+
+        for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
         {
-            unsigned int FilenameLength;
-        
-            /* Make sure that we didn't encounter more files during the second
-               iteration. */
-            if (0 == pFileSystemBuild->FilesLeft--)
+            if (!pDrop[pFileSystemBuild->pDataOrder[i]])
             {
-                fprintf(stderr, 
-                        "error: File contents of %s appear to have changed while creating file system image.\n", 
-                        pFileSystemBuild->pRootSourceDirectory);
-                goto Error;
+                pFileSystemBuild->pDataOrder[OrderCount++] = pNewIndices[pFileSystemBuild->pDataOrder[i]];
             }
-        
-            /* Fill in the directory structure for this file.  Can only default 
-               the binary start offset and size since we don't know the file size
-               yet. */
-            pFileSystemBuild->pCurrEntry->FilenameOffset = pFileSystemBuild->FilenameStartOffset + 
-                                                           pFileSystemBuild->CurrFilenameOffset;
-            pFileSystemBuild->pCurrEntry->FileBinaryOffset = ~0U;
-            pFileSystemBuild->pCurrEntry->FileBinarySize = 0;
+        }
+    }
 
-            /* Make sure that we aren't going to overflow the filename buffer */
-            FilenameLength = ImageDirectoryNameSize + pDirEntry->d_namlen + 1; /* Copy NULL terminator as well. */
-            if ((pFileSystemBuild->CurrFilenameOffset + FilenameLength) > pFileSystemBuild->FilenameBufferSize)
+    free(pFileSystemBuild->pFilenameBuffer);
+    pFileSystemBuild->pFilenameBuffer = pNewFilenames;
+    pFileSystemBuild->FilenameBufferSize = FilenameSize;
+    pFileSystemBuild->FileCount = Count;
+    free(pNewIndices);
+
+    /* The filter only depends on the number of files for its size so it is
+       resized while planning and rebuilt from the remaining names once the
+       files to be dropped are known. */
+    if (pFileSystemBuild->pNameFilter)
+    {
+        pFileSystemBuild->NameFilterWordCount =
+            (unsigned int)(((uint64_t)pFileSystemBuild->NameFilterBitsPerFile * Count + 31) / 32);
+    }
+
+    return 0;
+}
+
+
+/* Prints where the bytes of the planned image go to pStream. */
+static void _PrintImageBreakdown(FILE* pStream, const SFileSystemBuild* pFileSystemBuild)
+{
+    const SFileSystemLayout*    pLayout = &pFileSystemBuild->Layout;
+    uint64_t                    EntriesSize = (uint64_t)pLayout->EntrySize * pFileSystemBuild->FileCount;
+    uint64_t                    DataSize = 0;
+    uint64_t                    HeadersSize = 0;
+    uint64_t                    VariantsSize = 0;
+    uint64_t                    MerkleSize = 0;
+    uint64_t                    PaddingSize;
+    unsigned int                i;
+
+    /* Files placed in other --region banks aren't part of the image. */
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        if (pFileSystemBuild->pFileEntries[i].Region == 0)
+        {
+            DataSize += pFileSystemBuild->pFileEntries[i].FileBinarySize;
+            HeadersSize += pFileSystemBuild->pFileEntries[i].HttpHeaderSize;
+        }
+    }
+    for (i = 0 ; i < pFileSystemBuild->VariantCount ; i++)
+    {
+        VariantsSize += pFileSystemBuild->pVariants[i].Size;
+        HeadersSize += pFileSystemBuild->pVariants[i].HttpHeaderSize;
+    }
+    if (pFileSystemBuild->MerkleBlockSize)
+    {
+        MerkleSize = pLayout->ImageSize - pLayout->MerkleOffset;
+    }
+    PaddingSize = pLayout->ImageSize - pLayout->DataOffset - DataSize - HeadersSize - VariantsSize - MerkleSize;
+
+    fprintf(pStream, "    Header:            %11llu bytes\n", (unsigned long long)pLayout->HeaderSize);
+    fprintf(pStream, "    Entries:           %11llu bytes (%u files)\n",
+            (unsigned long long)EntriesSize, pFileSystemBuild->FileCount);
+    fprintf(pStream, "    Filenames:         %11u bytes\n", pFileSystemBuild->FilenameBufferSize);
+    fprintf(pStream, "    Other tables:      %11llu bytes\n",
+            (unsigned long long)(pLayout->DataOffset - pLayout->HeaderSize - EntriesSize -
+                                 pFileSystemBuild->FilenameBufferSize));
+    fprintf(pStream, "    File data:         %11llu bytes\n", (unsigned long long)DataSize);
+    if (HeadersSize)
+    {
+        fprintf(pStream, "    HTTP headers:      %11llu bytes\n", (unsigned long long)HeadersSize);
+    }
+    if (VariantsSize)
+    {
+        fprintf(pStream, "    Precompressed:     %11llu bytes\n", (unsigned long long)VariantsSize);
+    }
+    if (MerkleSize)
+    {
+        fprintf(pStream, "    Merkle tree:       %11llu bytes\n", (unsigned long long)MerkleSize);
+    }
+    fprintf(pStream, "    Padding:           %11llu bytes\n", (unsigned long long)PaddingSize);
+    fprintf(pStream, "    Total:             %11llu bytes", (unsigned long long)pLayout->ImageSize);
+    if (pFileSystemBuild->Budget)
+    {
+        fprintf(pStream, " of a %llu byte budget", (unsigned long long)pFileSystemBuild->Budget);
+    }
+    fprintf(pStream, "\n");
+}
+
+
+/* Plans the image from the sizes found while scanning and, if it is larger
+   than --budget, drops optional files until it fits.  Files are dropped in
+   order of --priorities, lowest first and largest first within a priority.
+   Enough files to cover the excess, estimated from the bytes each one adds
+   to the image, are dropped at a time and the image replanned until the
+   exact planned size fits.  Only file sizes are used so this runs before any
+   file data is read.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build.
+
+   Returns:
+    0 on success and a positive error code if the required files alone don't
+    fit, after printing a breakdown of the image.
+*/
+static int _FitImageBudget(SFileSystemBuild* pFileSystemBuild)
+{
+    SFileSystemLayout*  pLayout = &pFileSystemBuild->Layout;
+    uint64_t            StartTime = _GetTimeInNanoseconds();
+    int*                pPriorities = NULL;
+    unsigned int*       pOrder = NULL;
+    unsigned int*       pRemap = NULL;
+    unsigned char*      pDrop = NULL;
+    unsigned int        OptionalCount = 0;
+    unsigned int        DroppedCount = 0;
+    uint64_t            DroppedSize = 0;
+    unsigned int        Next = 0;
+    unsigned int        Kept;
+    unsigned int        i;
+    int                 Return = 1;
+
+    if (!pFileSystemBuild->Budget && !pFileSystemBuild->DryRun)
+    {
+        return 0;
+    }
+    if (_PlanFileSystemImage(pFileSystemBuild))
+    {
+        return 1;
+    }
+    if (!pFileSystemBuild->Budget || pLayout->ImageSize <= pFileSystemBuild->Budget)
+    {
+        printf("Planned a %llu byte image in %.3f ms.\n",
+               (unsigned long long)pLayout->ImageSize,
+               (_GetTimeInNanoseconds() - StartTime) / 1000000.0);
+        return 0;
+    }
+
+    pPriorities = malloc((pFileSystemBuild->FileCount + 1) * sizeof(*pPriorities));
+    pOrder = malloc((pFileSystemBuild->FileCount + 1) * sizeof(*pOrder));
+    pRemap = malloc((pFileSystemBuild->FileCount + 1) * sizeof(*pRemap));
+    pDrop = calloc(pFileSystemBuild->FileCount + 1, 1);
+    if (!pPriorities || !pOrder || !pRemap || !pDrop)
+    {
+        fprintf(stderr, "error: Failed to allocate the file priorities.\n");
+        goto Error;
+    }
+    if (_LoadFilePriorities(pFileSystemBuild, pPriorities))
+    {
+        goto Error;
+    }
+    for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+    {
+        if (pPriorities[i] >= 0)
+        {
+            pOrder[OptionalCount++] = i;
+        }
+    }
+    g_pDropEntries = pFileSystemBuild->pFileEntries;
+    g_pDropPriorities = pPriorities;
+    qsort(pOrder, OptionalCount, sizeof(*pOrder), _CompareDropOrder);
+
+    printf("Image would be %llu bytes, %llu over the %llu byte budget.%s\n",
+           (unsigned long long)pLayout->ImageSize,
+           (unsigned long long)(pLayout->ImageSize - pFileSystemBuild->Budget),
+           (unsigned long long)pFileSystemBuild->Budget,
+           OptionalCount ? "  Dropping optional files:" : "");
+    while (pLayout->ImageSize > pFileSystemBuild->Budget && Next < OptionalCount)
+    {
+        uint64_t Excess = pLayout->ImageSize - pFileSystemBuild->Budget;
+        uint64_t Saved = 0;
+
+        /* Each file saves its data, header, entry, filename and per entry
+           records.  Alignment and filter rounding are picked up by the
+           exact replan. */
+        memset(pDrop, 0, pFileSystemBuild->FileCount);
+        while (Saved < Excess && Next < OptionalCount)
+        {
+            const SFileSystemBuildEntry* pEntry = &pFileSystemBuild->pFileEntries[pOrder[Next]];
+            const char*                  pFilename = pFileSystemBuild->pFilenameBuffer + pEntry->FilenameOffset;
+
+            printf("    %s (%llu bytes, priority %d)\n",
+                   pFilename, (unsigned long long)pEntry->FileBinarySize, pPriorities[pOrder[Next]]);
+            pDrop[pOrder[Next++]] = 1;
+            Saved += pEntry->FileBinarySize + pEntry->HttpHeaderSize + pLayout->EntrySize + strlen(pFilename) + 1 +
+                     pFileSystemBuild->NamePrefixLength +
+                     (pFileSystemBuild->Metadata ? sizeof(SFileSystemMetadata) : 0) +
+                     (pFileSystemBuild->pHttpRulesFilename ? sizeof(uint32_t) : 0) +
+                     (pFileSystemBuild->Integrity ? sizeof(uint32_t) : 0);
+            DroppedSize += pEntry->FileBinarySize;
+            DroppedCount++;
+        }
+
+        /* The priorities and remaining indices in pOrder have to follow the
+           compacted entries. */
+        Kept = 0;
+        for (i = 0 ; i < pFileSystemBuild->FileCount ; i++)
+        {
+            pRemap[i] = Kept;
+            if (!pDrop[i])
             {
-                fprintf(stderr, 
-                        "error: File contents of %s appear to have changed while creating file system image.\n", 
-                        pFileSystemBuild->pRootSourceDirectory);
-                goto Error;
+                pPriorities[Kept++] = pPriorities[i];
             }
-        
-            /* Copy the filename into the filename buffer. */
-            memcpy(pFileSystemBuild->pCurrFilename, pImageDirectoryName, ImageDirectoryNameSize);
-            memcpy(pFileSystemBuild->pCurrFilename + ImageDirectoryNameSize, pDirEntry->d_name, pDirEntry->d_namlen + 1);
+        }
+        for (i = Next ; i < OptionalCount ; i++)
+        {
+            pOrder[i] = pRemap[pOrder[i]];
+        }
+        if (_DropFiles(pFileSystemBuild, pDrop) || _PlanFileSystemImage(pFileSystemBuild))
+        {
+            goto Error;
+        }
+    }
 
-            /* Update the pointers */
-            pFileSystemBuild->pCurrFilename += FilenameLength;
-            pFileSystemBuild->CurrFilenameOffset += FilenameLength;
-            pFileSystemBuild->pCurrEntry++;
+    if (pLayout->ImageSize > pFileSystemBuild->Budget)
+    {
+        fprintf(stderr, "error: Image is %llu bytes even after dropping %u optional files.\n",
+                (unsigned long long)pLayout->ImageSize, DroppedCount);
+        _PrintImageBreakdown(stderr, pFileSystemBuild);
+        goto Error;
+    }
+    printf("Dropped %u files (%llu bytes) and planned a %llu byte image in %.3f ms.\n",
+           DroppedCount,
+           (unsigned long long)DroppedSize,
+           (unsigned long long)pLayout->ImageSize,
+           (_GetTimeInNanoseconds() - StartTime) / 1000000.0);
+    if (pFileSystemBuild->pNameFilter)
+    {
+        free(pFileSystemBuild->pNameFilter);
+        pFileSystemBuild->pNameFilter = NULL;
+        if (_CreateNameFilter(pFileSystemBuild))
+        {
+            goto Error;
         }
     }
-    
+
     Return = 0;
 Error:
-    if(pDir)
+    free(pPriorities);
+    free(pOrder);
+    free(pRemap);
+    free(pDrop);
+    return Return;
+}
+
+
+/* Checks the final plan, which includes any precompressed variants, against
+   the --budget.  Without a budget it only warns when the image won't fit in
+   the FILE_SYSTEM_FLASH_SIZE bytes of FLASH on the mbed.
+
+   Returns:
+    0 if the image fits and a positive error code otherwise.
+*/
+static int _CheckImageBudget(const SFileSystemBuild* pFileSystemBuild)
+{
+    const SFileSystemLayout* pLayout = &pFileSystemBuild->Layout;
+
+    if (!pFileSystemBuild->Budget)
+    {
+        if (pLayout->ImageSize > FILE_SYSTEM_FLASH_SIZE && !pFileSystemBuild->RegionCount)
+        {
+            printf("warning: Image is %llu bytes which won't fit in the %u bytes of FLASH.\n",
+                   (unsigned long long)pLayout->ImageSize, (unsigned int)FILE_SYSTEM_FLASH_SIZE);
+        }
+        return 0;
+    }
+    if (pLayout->ImageSize > pFileSystemBuild->Budget)
+    {
+        fprintf(stderr, "error: Image is %llu bytes, over the %llu byte budget.\n",
+                (unsigned long long)pLayout->ImageSize, (unsigned long long)pFileSystemBuild->Budget);
+        _PrintImageBreakdown(stderr, pFileSystemBuild);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Hexadecimal digits of every byte value, filled in by _OpenRecordWriter(),
+   so that each byte of a record is encoded with a single table lookup. */
+static char g_HexPairs[256][2];
+
+/* Writes out the Intel HEX or S-record lines which have been buffered.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _FlushRecordBuffer(SRecordWriter* pWriter)
+{
+    if (pWriter->BufferUsed && pWriter->BufferUsed != fwrite(pWriter->pBuffer, 1, pWriter->BufferUsed, pWriter->pFile))
+    {
+        fprintf(stderr, "error: Failed to write %s.\n", pWriter->pFilename);
+        return 1;
+    }
+    pWriter->BufferUsed = 0;
+
+    return 0;
+}
+
+
+/* Encodes a single record into the output buffer.  The checksum is summed as
+   each byte is encoded.  Lines end with CR LF like those written by objcopy.
+
+   Parameters:
+    pWriter is the record writer.
+    Type is the Intel HEX record type or the S-record type digit.
+    Address is the address field of the record.
+    AddressBytes is the width of the address field.
+    pData points to the data field.
+    Size is the size of the data field.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _EmitRecord(SRecordWriter* pWriter, unsigned int Type, uint64_t Address, unsigned int AddressBytes,
+                       const unsigned char* pData, unsigned int Size)
+{
+    char*           pCurr;
+    unsigned int    Sum = 0;
+    unsigned int    Byte;
+    unsigned int    i;
+
+    if (pWriter->BufferUsed + RECORD_MAX_LINE_SIZE > RECORD_BUFFER_SIZE && _FlushRecordBuffer(pWriter))
+    {
+        return 1;
+    }
+    pCurr = pWriter->pBuffer + pWriter->BufferUsed;
+
+    /* Intel HEX counts the data bytes while S-records count the address,
+       data and checksum bytes. */
+    if (pWriter->Format == RECORD_FORMAT_INTEL_HEX)
+    {
+        *pCurr++ = ':';
+        Byte = Size;
+    }
+    else
+    {
+        *pCurr++ = 'S';
+        *pCurr++ = (char)('0' + Type);
+        Byte = AddressBytes + Size + 1;
+    }
+    memcpy(pCurr, g_HexPairs[Byte], 2);
+    pCurr += 2;
+    Sum += Byte;
+    for (i = AddressBytes ; i-- > 0 ; )
+    {
+        Byte = (Address >> (8 * i)) & 0xFF;
+        memcpy(pCurr, g_HexPairs[Byte], 2);
+        pCurr += 2;
+        Sum += Byte;
+    }
+    if (pWriter->Format == RECORD_FORMAT_INTEL_HEX)
+    {
+        memcpy(pCurr, g_HexPairs[Type], 2);
+        pCurr += 2;
+        Sum += Type;
+    }
+    for (i = 0 ; i < Size ; i++)
+    {
+        memcpy(pCurr, g_HexPairs[pData[i]], 2);
+        pCurr += 2;
+        Sum += pData[i];
+    }
+    Byte = pWriter->Format == RECORD_FORMAT_INTEL_HEX ? (0x100 - (Sum & 0xFF)) & 0xFF : ~Sum & 0xFF;
+    memcpy(pCurr, g_HexPairs[Byte], 2);
+    pCurr += 2;
+    *pCurr++ = '\r';
+    *pCurr++ = '\n';
+
+    pWriter->BufferUsed = pCurr - pWriter->pBuffer;
+    pWriter->RecordCount++;
+
+    return 0;
+}
+
+
+/* Emits the data record for the bytes collected in pWriter->Line, preceded
+   for Intel HEX by an extended linear address record when the upper 16 bits
+   of the address change. */
+static int _FlushRecordLine(SRecordWriter* pWriter)
+{
+    int Result;
+
+    if (pWriter->LineSize == 0)
+    {
+        return 0;
+    }
+    if (pWriter->Format == RECORD_FORMAT_INTEL_HEX)
+    {
+        uint32_t UpperAddress = (uint32_t)(pWriter->LineAddress >> 16);
+
+        if (UpperAddress != pWriter->UpperAddress)
+        {
+            unsigned char Data[2] = { (unsigned char)(UpperAddress >> 8), (unsigned char)UpperAddress };
+
+            if (_EmitRecord(pWriter, INTEL_HEX_EXTENDED_LINEAR_ADDRESS, 0, 2, Data, 2))
+            {
+                return 1;
+            }
+            pWriter->UpperAddress = UpperAddress;
+        }
+        Result = _EmitRecord(pWriter, INTEL_HEX_DATA, pWriter->LineAddress & 0xFFFF, 2, pWriter->Line, pWriter->LineSize);
+    }
+    else
     {
-        closedir(pDir);
-        pDir = NULL;
+        Result = _EmitRecord(pWriter, pWriter->AddressBytes - 1, pWriter->LineAddress, pWriter->AddressBytes,
+                             pWriter->Line, pWriter->LineSize);
+        pWriter->DataRecordCount++;
     }
+    pWriter->LineSize = 0;
 
-    return Return;
+    return Result;
 }
 
 
-/* Creates a list of files to be placed in the file syste image based on the
-   contents of the user supplied root source directory.  Since this function
-   needs to allocate buffers to list out the source files, it needs to know
-   suitable sizes for the allocations before populating them, this function
-   runs two passes through the directory list: first to calculate the required
-   size of the buffers; second fill in the newly allocated buffers.
-   
+/* Creates an Intel HEX or S-record file.  S-records use the narrowest of the
+   S1, S2 or S3 data records which can hold EndAddress.
+
    Parameters:
-    pFileSystemBuild is a pointer to the structure used both for input and
-        output data to/from this procedure.
-        
+    pWriter is the record writer to be initialized.
+    pFilename is the name of the file to be created.
+    Format is RECORD_FORMAT_INTEL_HEX or RECORD_FORMAT_SREC.
+    EndAddress is the address just past the last byte to be written.
+
    Returns:
-    0 on success and a positive error code otherwise 
-*/
-static int _CreateFileList(SFileSystemBuild* pFileSystemBuild)
+    0 on success and a positive error code otherwise */
+static int _OpenRecordWriter(SRecordWriter* pWriter, const char* pFilename, unsigned int Format, uint64_t EndAddress)
 {
-    int                 Return = 1;
-    int                 Result = 1;
-    unsigned int        TotalFilenameSize = 0;
-    unsigned int        TotalFileCount = 0;
-
-    assert ( pFileSystemBuild && pFileSystemBuild->pRootSourceDirectory);
+    static const char   HexDigits[] = "0123456789ABCDEF";
+    const char*         pModuleName = strrchr(pFilename, '/');
+    unsigned int        i;
 
-    /* Display information about the enumeration process to be conducted by
-       this procedure. */
-    printf("Enumerating the contents of the %s directory to be placed in "
-           "the file system image...\n",
-           pFileSystemBuild->pRootSourceDirectory);
-    
-    /* Iterate through the files in the directory and determine size of
-       data to be allocated to track these files. */
-    Result = _CountFilesInDirectoryTree(pFileSystemBuild->pRootSourceDirectory,
-                                        0,
-                                        &TotalFileCount,
-                                        &TotalFilenameSize);
-    if (Result)
+    memset(pWriter, 0, sizeof(*pWriter));
+    pWriter->pFilename = pFilename;
+    pWriter->Format = Format;
+    if (EndAddress > 0x100000000ULL)
     {
-        Return = Result;
-        goto Error;
+        fprintf(stderr, "error: %s can't hold addresses above 4GB.\n", pFilename);
+        return 1;
     }
-    pFileSystemBuild->FileCount = TotalFileCount;
-    pFileSystemBuild->FilenameBufferSize = TotalFilenameSize;
-    
-    /* Allocate the buffers to record the file list information. */
-    pFileSystemBuild->pFilenameBuffer = malloc(TotalFilenameSize);
-    if (!pFileSystemBuild->pFilenameBuffer)
+    for (i = 0 ; i < 256 ; i++)
     {
-        fprintf(stderr, 
-                "error: Failed to allocate %u bytes for filename buffer.\n", 
-                TotalFilenameSize);
-        goto Error;
+        g_HexPairs[i][0] = HexDigits[i >> 4];
+        g_HexPairs[i][1] = HexDigits[i & 0xF];
     }
-    pFileSystemBuild->pFileEntries = malloc(sizeof(pFileSystemBuild->pFileEntries[0]) * 
-                                            TotalFileCount);
-    if (!pFileSystemBuild->pFileEntries)
+    pWriter->AddressBytes = EndAddress <= 0x10000 ? 2 : EndAddress <= 0x1000000 ? 3 : 4;
+    pWriter->pBuffer = malloc(RECORD_BUFFER_SIZE);
+    pWriter->pFile = fopen(pFilename, "wb");
+    if (!pWriter->pBuffer || !pWriter->pFile)
     {
-        fprintf(stderr, 
-                "error: Failed to allocate %u file entry descriptors.\n", 
-                TotalFileCount);
-        goto Error;
+        fprintf(stderr, "error: Failed to open %s for writing.\n", pFilename);
+        return 1;
     }
-    
-    /* Initialize the state used while filling in the file system entries. */
-    pFileSystemBuild->CurrFilenameOffset = 0;
-    pFileSystemBuild->pCurrEntry = pFileSystemBuild->pFileEntries;
-    pFileSystemBuild->pCurrFilename = pFileSystemBuild->pFilenameBuffer;
-    pFileSystemBuild->FilesLeft = TotalFileCount;
 
-    /* Calculate the starting relative offset of the filename buffer in 
-       the final image. */
-    pFileSystemBuild->FilenameStartOffset = sizeof(SFileSystemHeader) + 
-                                    TotalFileCount * sizeof(SFileSystemEntry);
-                                                      
-    /* Iterate through the files in the directory tree again and fill in the
-       structures that were just allocated. */
-    Result = _PopulateEntriesFromDirectoryTree(pFileSystemBuild,
-                                               pFileSystemBuild->pRootSourceDirectory,
-                                               "");
-    if (Result)
+    /* S-record files start with an S0 header naming the module. */
+    pModuleName = pModuleName ? pModuleName + 1 : pFilename;
+    if (Format == RECORD_FORMAT_SREC)
     {
-        Return = Result;
-        goto Error;
-    }
+        unsigned int Length = strlen(pModuleName);
 
-    /* Make sure that we didn't encounter fewer files during the second
-       iteration. */
-    if (0 != pFileSystemBuild->FilesLeft)
-    {
-        fprintf(stderr, 
-                "error: File contents of %s appear to have changed while creating file system image.\n", 
-                pFileSystemBuild->pRootSourceDirectory);
-        goto Error;
+        return _EmitRecord(pWriter, 0, 0, 2, (const unsigned char*)pModuleName, 
+                           Length < RECORD_LINE_SIZE ? Length : RECORD_LINE_SIZE);
     }
-                                                      
-    /* Sort the file entries in case sensitive order. */
-    g_pFLASHBase = pFileSystemBuild->pFilenameBuffer - (sizeof(SFileSystemHeader) + 
-                                                        pFileSystemBuild->FileCount * 
-                                                        sizeof(SFileSystemEntry));
-    qsort(pFileSystemBuild->pFileEntries, 
-          pFileSystemBuild->FileCount,
-          sizeof(pFileSystemBuild->pFileEntries[0]),
-          _CompareFileEntries);
-          
-    Return = 0;
-Error:
 
-    return Return;
+    return 0;
 }
 
 
-/* Frees up memory allocated in the pointers maintained by the SFileSystemBuild
-   structure.
-   
+/* Adds data to the records being written.  Bytes are collected into lines of
+   RECORD_LINE_SIZE, and a new line is started wherever the address jumps, so
+   gaps such as the padding between the firmware and the image are left out.
+   Intel HEX lines never cross a 64KB boundary.
+
    Parameters:
-    pFileSystemBuild is a pointer to the structure to be freed.
-    
+    pWriter is the record writer.
+    Address is the device address of the first byte.
+    pData points to the data.
+    Size is the number of bytes to be written.
+
    Returns:
-    Nothing.
-*/
-static void _FreeFileSystemBuild(SFileSystemBuild* pFileSystemBuild)
+    0 on success and a positive error code otherwise */
+static int _WriteRecords(SRecordWriter* pWriter, uint64_t Address, const unsigned char* pData, size_t Size)
 {
-    /* If the pointer is NULL then there is nothing to do */
-    if (!pFileSystemBuild)
+    if (pWriter->LineSize && Address != pWriter->LineAddress + pWriter->LineSize && _FlushRecordLine(pWriter))
     {
-        return;
+        return 1;
     }
-    
-    if (pFileSystemBuild->pFilenameBuffer)
+    while (Size > 0)
     {
-        free(pFileSystemBuild->pFilenameBuffer);
-        pFileSystemBuild->pFilenameBuffer = NULL;
+        size_t Chunk = RECORD_LINE_SIZE - pWriter->LineSize;
+
+        if (pWriter->LineSize == 0)
+        {
+            pWriter->LineAddress = Address;
+        }
+        if (pWriter->Format == RECORD_FORMAT_INTEL_HEX && Chunk > 0x10000 - (Address & 0xFFFF))
+        {
+            Chunk = 0x10000 - (Address & 0xFFFF);
+        }
+        if (Chunk > Size)
+        {
+            Chunk = Size;
+        }
+        memcpy(pWriter->Line + pWriter->LineSize, pData, Chunk);
+        pWriter->LineSize += Chunk;
+        pWriter->DataSize += Chunk;
+        Address += Chunk;
+        pData += Chunk;
+        Size -= Chunk;
+        if ((pWriter->LineSize == RECORD_LINE_SIZE || 
+             (pWriter->Format == RECORD_FORMAT_INTEL_HEX && (Address & 0xFFFF) == 0)) &&
+            _FlushRecordLine(pWriter))
+        {
+            return 1;
+        }
     }
-    if (pFileSystemBuild->pFileEntries)
+
+    return 0;
+}
+
+
+/* Writes the end of file records and closes the file.  S-record files end
+   with a count of the data records and a termination record matching the
+   data record width.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _CloseRecordWriter(SRecordWriter* pWriter)
+{
+    int Return = 0;
+
+    if (pWriter->pFile)
     {
-        free(pFileSystemBuild->pFileEntries);
-        pFileSystemBuild->pFileEntries = NULL;
+        if (_FlushRecordLine(pWriter))
+        {
+            Return = 1;
+        }
+        else if (pWriter->Format == RECORD_FORMAT_INTEL_HEX)
+        {
+            Return = _EmitRecord(pWriter, INTEL_HEX_END_OF_FILE, 0, 2, NULL, 0);
+        }
+        else if (pWriter->DataRecordCount <= 0xFFFFFF)
+        {
+            Return = _EmitRecord(pWriter, pWriter->DataRecordCount <= 0xFFFF ? 5 : 6, 
+                                 pWriter->DataRecordCount, pWriter->DataRecordCount <= 0xFFFF ? 2 : 3, NULL, 0) ||
+                     _EmitRecord(pWriter, 11 - pWriter->AddressBytes, 0, pWriter->AddressBytes, NULL, 0);
+        }
+        else
+        {
+            Return = _EmitRecord(pWriter, 11 - pWriter->AddressBytes, 0, pWriter->AddressBytes, NULL, 0);
+        }
+        if (!Return)
+        {
+            Return = _FlushRecordBuffer(pWriter);
+        }
+        if (fclose(pWriter->pFile) && !Return)
+        {
+            fprintf(stderr, "error: Failed to write %s.\n", pWriter->pFilename);
+            Return = 1;
+        }
+        pWriter->pFile = NULL;
     }
+    free(pWriter->pBuffer);
+    pWriter->pBuffer = NULL;
+
+    return Return;
 }
 
 
-/* Creates a simple file system image based on the file entries found in the
-   caller supplied pFileSystemBuild structure.
-   
+/* Encodes part of a file into each of the --hex and --srec outputs.
+
    Parameters:
-    pFileSystemBuild is a pointer to the structure used both for input and
-        output data to/from this procedure.
-        
+    pSourceFilename is the name of the file to be encoded.
+    SourceOffset is the offset of the part within the file.
+    ExpectedSize is the size of the part, which runs to the end of the file.
+    Address is the device address at which the part is placed.
+    pWriters are the --hex and --srec writers, those without a file are
+        skipped.
+    pBuffer is a COPY_BUFFER_SIZE byte buffer.
+
    Returns:
     0 on success and a positive error code otherwise */
-static int _CreateFileSystemImage(SFileSystemBuild* pFileSystemBuild)
+static int _ExportFile(const char* pSourceFilename, uint64_t SourceOffset, uint64_t ExpectedSize, uint64_t Address,
+                       SRecordWriter* pWriters, unsigned char* pBuffer)
 {
-    int                 Return = 1;
-    int                 Result = 1;
-    unsigned int        FileCount = 0;
-    FILE*               pFile = NULL;
-    FILE*               pSourceFile = NULL;
-    long                FileEntryPos = -1;
-    long                FilenameBufferPos = -1;
-    long                ImageFileSize = -1;
-    SFileSystemEntry*   pEntry = NULL;
-    unsigned char*      pBuffer = NULL;
-    long                BufferSize = 0;
-    SFileSystemHeader   Header;
-    
-    assert ( pFileSystemBuild && 
-             pFileSystemBuild->pRootSourceDirectory &&
-             pFileSystemBuild->pOutputBinaryFilename &&
-             pFileSystemBuild->pFilenameBuffer &&
-             pFileSystemBuild->pFileEntries );
-    
-    /* Output information about the image build process to be started */
-    FileCount = pFileSystemBuild->FileCount;
-    printf("Creating file system image in %s...\n", 
-           pFileSystemBuild->pOutputBinaryFilename);
-           
-    /* Open the desired file to be populated with the new file system image. */
-    pFile = fopen(pFileSystemBuild->pOutputBinaryFilename, "w");
-    if (!pFile)
+    FILE*           pSourceFile = NULL;
+    uint64_t        Copied = 0;
+    size_t          BytesRead;
+    unsigned int    i;
+    int             Return = 1;
+
+    pSourceFile = fopen(pSourceFilename, "rb");
+    if (!pSourceFile || fseek(pSourceFile, (long)SourceOffset, SEEK_SET))
     {
-        fprintf(stderr,
-                "Failed to open %s for writing of the file system image.\n",
-                pFileSystemBuild->pOutputBinaryFilename);
+        fprintf(stderr, "error: Failed to open %s for read.\n", pSourceFilename);
         goto Error;
     }
-    
-    /* Write out the file system header */
-    printf("    Adding header (%lu bytes) to file system image.\n", sizeof(Header));
-    memcpy(Header.FileSystemSignature, 
-           FILE_SYSTEM_SIGNATURE, 
-           sizeof(Header.FileSystemSignature));
-    Header.FileCount = pFileSystemBuild->FileCount;
-    Result = fwrite(&Header, sizeof(Header), 1, pFile);
-    if (Result != 1)
+    while ((BytesRead = fread(pBuffer, 1, COPY_BUFFER_SIZE, pSourceFile)) > 0)
     {
-        fprintf(stderr, "error: Failed to write header to file system image.\n");
-        goto Error;
+        for (i = 0 ; i < RECORD_FORMAT_COUNT ; i++)
+        {
+            uint64_t StartTime = _GetTimeInNanoseconds();
+
+            if (pWriters[i].pFile && _WriteRecords(&pWriters[i], Address + Copied, pBuffer, BytesRead))
+            {
+                goto Error;
+            }
+            pWriters[i].EncodeTime += _GetTimeInNanoseconds() - StartTime;
+        }
+        Copied += BytesRead;
     }
-    
-    /* Write out the partially completed file entries and seek back and
-       update with completed entries once the file sizes are known. */
-    printf("    Adding file entry descriptors (%lu bytes) to file system image.\n",
-           sizeof(pFileSystemBuild->pFileEntries[0]) * FileCount);
-    FileEntryPos = ftell(pFile);
-    if (FileEntryPos != (long)sizeof(Header))
+    if (ferror(pSourceFile) || Copied != ExpectedSize)
     {
-        fprintf(stderr, "error: Failed to write header to file system image.\n");
+        fprintf(stderr, "error: %s changed size while the image was built.\n", pSourceFilename);
         goto Error;
     }
-    Result = fwrite(pFileSystemBuild->pFileEntries, 
-                    sizeof(pFileSystemBuild->pFileEntries[0]) * FileCount,
-                    1,
-                    pFile);
-    if (Result != 1)
+
+    Return = 0;
+Error:
+    if (pSourceFile)
     {
-        fprintf(stderr, "error: Failed to write file entries to file system image.\n");
-        goto Error;
+        fclose(pSourceFile);
     }
-       
-    /* Write out the filename buffer */
-    printf("    Adding filenames (%u bytes) to file system image.\n",
-           pFileSystemBuild->FilenameBufferSize);
-    FilenameBufferPos = ftell(pFile);
-    if (FilenameBufferPos <= 0)
+    return Return;
+}
+
+
+/* Writes the --symbols linker script which gives the address and size of the
+   image so that firmware built afterwards can refer to it without including
+   the .h file. */
+static int _CreateSymbolFile(const SFileSystemBuild* pFileSystemBuild)
+{
+    FILE*       pFile = NULL;
+    uint64_t    ImageSize = pFileSystemBuild->Layout.ImageSize;
+    int         Return = 0;
+
+    if (!pFileSystemBuild->pSymbolsFilename)
     {
-        fprintf(stderr, "error: Failed to write file entries to file system image.\n");
-        goto Error;
+        return 0;
     }
-    Result = fwrite(pFileSystemBuild->pFilenameBuffer,
-                    pFileSystemBuild->FilenameBufferSize, 
-                    1, 
-                    pFile);
-    if (Result != 1)
+
+    pFile = fopen(pFileSystemBuild->pSymbolsFilename, "w");
+    if (!pFile)
     {
-        fprintf(stderr, "error: Failed to write filename buffer to file system image.\n");
-        goto Error;
+        fprintf(stderr, "error: Failed to open %s for writing.\n", pFileSystemBuild->pSymbolsFilename);
+        return 1;
     }
-    
-    /* Write out the contents of the files while updating the file entries
-       to contain the actual file offset and sizes. */
-    printf("    Adding %u entries to file system image.\n", FileCount);
-    pEntry = pFileSystemBuild->pFileEntries;
-    while (FileCount--)
+    if (0 > fprintf(pFile,
+                    "/* Location of the file system image %s, created by fsbld. */\n"
+                    "roFlashDrive = 0x%08llx;\n"
+                    "roFlashDrive_size = 0x%08llx;\n"
+                    "roFlashDrive_end = 0x%08llx;\n",
+                    pFileSystemBuild->pOutputBinaryFilename,
+                    (unsigned long long)pFileSystemBuild->ImageAddress,
+                    (unsigned long long)ImageSize,
+                    (unsigned long long)(pFileSystemBuild->ImageAddress + ImageSize)))
     {
-        char    FilenameBuffer[1024];
-        char*   pFilename;
-        long    StartPos;
-        long    FileSize;
-        
-        /* Build up path to source file for this entry */
-        pFilename = pFileSystemBuild->pFilenameBuffer + 
-                    (pEntry->FilenameOffset - (unsigned int)FilenameBufferPos);
-        snprintf(FilenameBuffer, sizeof(FilenameBuffer), 
-                 "%s/%s", 
-                 pFileSystemBuild->pRootSourceDirectory, 
-                 pFilename);
-        printf("        %s -> %s ", FilenameBuffer, pFilename);
-        
-        /* Determine the starting location of this file in the image and
-           update file entry with this location. */
-        StartPos = ftell(pFile);
-        if (StartPos < 0)
-        {
-            fprintf(stderr, "\nerror: Failed to determine current file location.\n");
-            goto Error;
-        }
-        pEntry->FileBinaryOffset = StartPos;
-        
-        /* Open the current source file */
-        pSourceFile = fopen(FilenameBuffer, "r");
-        if (!pSourceFile)
+        Return = 1;
+    }
+    if (fclose(pFile))
+    {
+        Return = 1;
+    }
+    if (Return)
+    {
+        fprintf(stderr, "error: Failed to write %s.\n", pFileSystemBuild->pSymbolsFilename);
+        return 1;
+    }
+    printf("Wrote linker symbols to %s.\n", pFileSystemBuild->pSymbolsFilename);
+
+    return 0;
+}
+
+
+/* Writes the --hex and --srec files and reports where the firmware and image
+   ended up.  This runs once the image has been written, since writing it
+   seeks back to fill in hashes, and reads the firmware and the image once
+   each to encode them into all of the record files.  The --out binary needs
+   no copy here since _CreateFileSystemImage() writes the image into it in
+   place, after the firmware and the erased 0xFF bytes which let it be
+   programmed from the firmware base address in one go.  The gap is left out
+   of the records.  Without --firmware the records hold just the image at the
+   --record-base address.
+
+   Parameters:
+    pFileSystemBuild is a pointer to the file system build whose image has
+        been written.
+
+   Returns:
+    0 on success and a positive error code otherwise */
+static int _ExportImage(const SFileSystemBuild* pFileSystemBuild)
+{
+    static const char* const RecordFormatNames[RECORD_FORMAT_COUNT] = { "Intel HEX", "S-record" };
+    const char*     pRecordFilenames[RECORD_FORMAT_COUNT];
+    SRecordWriter   Writers[RECORD_FORMAT_COUNT];
+    unsigned char*  pBuffer = NULL;
+    uint64_t        ImageAddress = pFileSystemBuild->pFirmwareFilename ? pFileSystemBuild->ImageAddress
+                                                                         : pFileSystemBuild->RecordBase;
+    uint64_t        ImageOffset = pFileSystemBuild->ImageAddress - pFileSystemBuild->FirmwareBase;
+    uint64_t        StartAddress = pFileSystemBuild->pFirmwareFilename ? pFileSystemBuild->FirmwareBase : ImageAddress;
+    unsigned int    i;
+    int             Return = 1;
+
+    pRecordFilenames[RECORD_FORMAT_INTEL_HEX] = pFileSystemBuild->pHexFilename;
+    pRecordFilenames[RECORD_FORMAT_SREC] = pFileSystemBuild->pSrecFilename;
+    memset(Writers, 0, sizeof(Writers));
+    if (!pFileSystemBuild->pFirmwareFilename && !pFileSystemBuild->pHexFilename && !pFileSystemBuild->pSrecFilename)
+    {
+        return 0;
+    }
+
+    printf("\nExporting %s%s...\n", 
+           pFileSystemBuild->pFirmwareFilename ? "the firmware and " : "", pFileSystemBuild->pImageFilename);
+    if (pFileSystemBuild->pHexFilename || pFileSystemBuild->pSrecFilename)
+    {
+        pBuffer = malloc(COPY_BUFFER_SIZE);
+        if (!pBuffer)
         {
-            fprintf(stderr, "\nerror: Failed to open %s for read.\n", 
-                    FilenameBuffer);
+            fprintf(stderr, "error: Failed to allocate %u bytes for the copy buffer.\n", COPY_BUFFER_SIZE);
             goto Error;
         }
-        
-        /* Determine the size of the file and update the file entry */
-        Result = fseek(pSourceFile, 0, SEEK_END);
-        if (Result)
+        for (i = 0 ; i < RECORD_FORMAT_COUNT ; i++)
         {
-            fprintf(stderr, "\nerror: Failed to determine file size of %s\n",
-                    FilenameBuffer);
-            goto Error;
+            if (pRecordFilenames[i] && 
+                _OpenRecordWriter(&Writers[i], pRecordFilenames[i], i, 
+                                  ImageAddress + pFileSystemBuild->Layout.ImageSize))
+            {
+                goto Error;
+            }
         }
-        FileSize = ftell(pSourceFile);
-        if (FileSize < 0)
+        if (pFileSystemBuild->pFirmwareFilename &&
+            _ExportFile(pFileSystemBuild->pFirmwareFilename, 0, pFileSystemBuild->FirmwareSize, 
+                        pFileSystemBuild->FirmwareBase, Writers, pBuffer))
         {
-            fprintf(stderr, "\nerror: Failed to determine file size of %s\n",
-                    FilenameBuffer);
             goto Error;
         }
-        Result = fseek(pSourceFile, 0, SEEK_SET);
-        if (Result)
+        if (_ExportFile(pFileSystemBuild->pImageFilename, pFileSystemBuild->ImageFileOffset, 
+                        pFileSystemBuild->Layout.ImageSize, ImageAddress, Writers, pBuffer))
         {
-            fprintf(stderr, "\nerror: Failed to determine file size of %s\n",
-                    FilenameBuffer);
             goto Error;
         }
-        pEntry->FileBinarySize = (unsigned int)FileSize;
-        printf("(%ld bytes)\n", FileSize);
-        
-        /* Just skip ahead if we are placing a zero length file in the image. */
-        if (FileSize > 0)
+        for (i = 0 ; i < RECORD_FORMAT_COUNT ; i++)
         {
-            /* Make sure that the read buffer is large enough for this file. */
-            if (FileSize > BufferSize)
-            {
-                unsigned char* pRealloc;
-            
-                pRealloc = realloc(pBuffer, FileSize);
-                if (!pRealloc)
-                {
-                    fprintf(stderr, 
-                            "error: Failed to allocate %ld bytes for read buffer.\n",
-                            FileSize);
-                    goto Error;
-                }
-                pBuffer = pRealloc;
-                BufferSize = FileSize;
-            }
-        
-            /* Read the data into the buffer. */
-            Result = fread(pBuffer, FileSize, 1, pSourceFile);
-            if (Result != 1)
-            {
-                fprintf(stderr,
-                        "error: Failed to read %ld bytes from %s.\n",
-                        FileSize,
-                        FilenameBuffer);
-                goto Error;
-            }
-        
-            /* Write the file data out to the file system image. */
-            Result = fwrite(pBuffer, FileSize, 1, pFile);
-            if (Result != 1)
+            if (_CloseRecordWriter(&Writers[i]))
             {
-                fprintf(stderr,
-                        "error: Failed to write %ld bytes to file system image.\n",
-                         FileSize);
                 goto Error;
             }
         }
-        
-        pEntry++;
     }
-       
-    /* Display the final image file size */
-    ImageFileSize = ftell(pFile);
-    printf("    Total Image Size: %ld bytes\n", ImageFileSize);
-    
-    /* Seek back to the beginning of the file entries and write out the newly
-       updated ones. */
-    Result = fseek(pFile, FileEntryPos, SEEK_SET);
-    if (Result)
+
+    if (pFileSystemBuild->pFirmwareFilename)
     {
-        fprintf(stderr,
-                "error: Failed to rewind to file entry location.\n");
-        goto Error;
+        printf("    Firmware:          %11llu bytes at 0x%08llx\n", 
+               (unsigned long long)pFileSystemBuild->FirmwareSize, (unsigned long long)pFileSystemBuild->FirmwareBase);
+        printf("    Padding:           %11llu bytes\n", 
+               (unsigned long long)(ImageOffset - pFileSystemBuild->FirmwareSize));
     }
-    Result = fwrite(pFileSystemBuild->pFileEntries, 
-                    sizeof(pFileSystemBuild->pFileEntries[0]) * pFileSystemBuild->FileCount,
-                    1,
-                    pFile);
-    if (Result != 1)
+    printf("    Image:             %11llu bytes at 0x%08llx\n", 
+           (unsigned long long)pFileSystemBuild->Layout.ImageSize, (unsigned long long)ImageAddress);
+    for (i = 0 ; i < RECORD_FORMAT_COUNT ; i++)
     {
-        fprintf(stderr, "error: Failed to write file entries to file system image.\n");
-        goto Error;
+        if (pRecordFilenames[i])
+        {
+            printf("    Wrote %llu %s records from 0x%08llx to %s, encoding at %.1f MB/s.\n",
+                   (unsigned long long)Writers[i].RecordCount,
+                   RecordFormatNames[i],
+                   (unsigned long long)StartAddress,
+                   pRecordFilenames[i],
+                   Writers[i].EncodeTime ? Writers[i].DataSize * 1000.0 / Writers[i].EncodeTime : 0.0);
+        }
     }
-    
-    Return = 0;
+    Return = _CreateSymbolFile(pFileSystemBuild);
 Error:
-    free(pBuffer);
-    pBuffer = NULL;
-    BufferSize = 0;
-    if (pSourceFile)
+    for (i = 0 ; i < RECORD_FORMAT_COUNT ; i++)
     {
-        fclose(pSourceFile);
-        pSourceFile = NULL;
-    }
-    if (pFile)
-    {
-        fclose(pFile);
-        pFile = NULL;
+        _CloseRecordWriter(&Writers[i]);
     }
+    free(pBuffer);
     return Return;
 }
 
-/* Converts the binary file system image to a header file
-    
-    Parameters:
-     pFileSystemBuild is a pointer to the structure used both for input and
-         output data to/from this procedure.
-         
-    Returns:
-     0 on success and a positive error code otherwise */
-static int _CreateHeaderFile(SFileSystemBuild* pFileSystemBuild)
+
+int main(int argc, const char** argv)
 {
     int                 Return = 1;
     int                 Result = 1;
-    FILE*               pDestFile = NULL;
-    FILE*               pSourceFile = NULL;
-    unsigned char*      pSrcBuffer = NULL;
-    char*               pDestBuffer = NULL;
-    char*               pDdotPos = NULL;
-    char*               pDestFileName = NULL;
-    long                BufLen = 0;
-    long                BinFileSize;
-    long                DestBufferSize;
-
-    const char          HeaderName[] = "#ifndef _FLASH_DRIVE_H_\n#define _FLASH_DRIVE_H_\nconst uint8_t roFlashDrive[] __attribute__ ((aligned (4))) __attribute__((section (\"FlashDrive\"), used)) = {\n\"";
-    const char          FooterName[] = "\"};\n#endif\n";
+    SFileSystemBuild    FileSystemBuild;
 
-    assert ( pFileSystemBuild && 
-              pFileSystemBuild->pOutputBinaryFilename);
+    /* Initialize all of the pointers in context to NULL */
+    memset(&FileSystemBuild, 0, sizeof(FileSystemBuild));
 
-    /* Open the binary file to be converted to a header file. */
-    pSourceFile = fopen(pFileSystemBuild->pOutputBinaryFilename, "rb");
-    if (!pSourceFile)
+    /* Display header */
+    printf("Simple FLASH Binary File System Builder\n"
+           "Created by Adam Green in 2011\n\n");
+           
+    Result = _ParseCommandLine(argc, argv, &FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr,
-                "Failed to open %s for writing of the file system image.\n",
-                pFileSystemBuild->pOutputBinaryFilename);
+        _DisplayUsage();
         goto Error;
     }
 
-    /* Determine the size of the binary file */
-    Result = fseek(pSourceFile, 0, SEEK_END);
-    if (Result)
+    if (FileSystemBuild.HaveTarget)
     {
-        fprintf(stderr, "\nerror: Failed to determine file size of %s\n",
-                pFileSystemBuild->pOutputBinaryFilename);
-        goto Error;
+        printf("Target %s: %lluKB of FLASH, %u byte aligned file data, %s endian, section %s.\n",
+               FileSystemBuild.Target.Name,
+               (unsigned long long)(FileSystemBuild.Target.FlashSize / 1024),
+               FileSystemBuild.Target.Alignment,
+               FileSystemBuild.TargetBigEndian ? "big" : "little",
+               FileSystemBuild.Target.SectionName);
     }
-    BinFileSize = ftell(pSourceFile);
 
-    /* Seek back to the beginning of the source file. */
-    Result = fseek(pSourceFile, 0, SEEK_SET);
+    /* Creating and applying deltas and updates work on existing images. */
+    if (FileSystemBuild.Mode == FSBLD_MODE_DIFF)
+    {
+        Return = _DiffImages(&FileSystemBuild);
+        goto Error;
+    }
+    if (FileSystemBuild.Mode == FSBLD_MODE_APPLY_DELTA)
+    {
+        Return = _ApplyDeltaFile(&FileSystemBuild);
+        goto Error;
+    }
+    if (FileSystemBuild.Mode == FSBLD_MODE_UPDATE)
+    {
+        Return = _UpdateImage(&FileSystemBuild);
+        goto Error;
+    }
+    if (FileSystemBuild.Mode == FSBLD_MODE_VERIFY)
+    {
+        Return = _VerifyImage(&FileSystemBuild);
+        goto Error;
+    }
+    if (FileSystemBuild.Mode == FSBLD_MODE_BENCHMARK_READER)
+    {
+        Return = _BenchmarkReader(&FileSystemBuild);
+        goto Error;
+    }
+    if (FileSystemBuild.Mode == FSBLD_MODE_INSPECT)
+    {
+        Return = _InspectImage(&FileSystemBuild);
+        goto Error;
+    }
+    if (FileSystemBuild.Mode == FSBLD_MODE_EXTRACT)
+    {
+        Return = _ExtractImage(&FileSystemBuild);
+        goto Error;
+    }
+    
+    /* Create list of files to be placed in the file system image by walking
+       the source root directory, merging in any overlays. */
+    if (FileSystemBuild.OverlayCount || _IsRegularFile(FileSystemBuild.pRootSourceDirectory))
+    {
+        Result = _CreateLayeredFileList(&FileSystemBuild);
+    }
+    else
+    {
+        Result = _CreateFileList(&FileSystemBuild);
+    }
     if (Result)
     {
-        fprintf(stderr,
-                "error: Failed to rewind to file entry location.\n");
         goto Error;
     }
 
-    /* Allocate a file buffer to read the binary data. */
-    pSrcBuffer = (unsigned char*)malloc(BinFileSize * sizeof(unsigned char));
-    if (!pSrcBuffer)
+    /* Build the optional filename filter now that the entries are sorted. */
+    Result = _CreateNameFilter(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr, 
-                "error: Failed to allocate %ld bytes for the input buffer.\n", 
-                BinFileSize);
         goto Error;
     }
 
-    /*  Allocate the ASCII file buffer to record the converted binary data.
-        - Each data line will be a representation of 16 binary bytes.
-          So, (number of data lines) = ceil(binary file size / 16)
-        - Each binary byte is represented as 4 ASCII bytes :
-          \xXX where XX is the ASCII representation of the binary byte.
-          So, the ASCII data size that represents the binary content is 4 times the binary size.
-          To this value, we need to add (number of data lines - 1) as each ASCII data line,
-          except the last one, is terminated with a '\'.
-          We need to add a second (number of data lines) to cover each line end (LF).
-          
-          ASCII data size = (4 x binary file size) + (2 * number of data lines) - 1
-    */
-    DestBufferSize = (4 * BinFileSize) + (2 * ceil(BinFileSize / 16.0f)) - 1;
-    pDestBuffer = (char*)malloc(DestBufferSize * sizeof(char));
-    if (!pDestBuffer)
+    /* Order the file data to match the optional access profile. */
+    Result = _CreateDataOrder(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr, 
-                "error: Failed to allocate %ld bytes for the output buffer.\n", 
-                DestBufferSize);
         goto Error;
     }
 
-     /* Read the binary data into the source buffer. */
-    Result = fread(pSrcBuffer, BinFileSize, 1, pSourceFile);
-    if (Result != 1)
+    /* Keep the files which are expected to change in sectors of their own. */
+    Result = _GroupVolatileFiles(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr,
-                "error: Failed to read %ld bytes from %s.\n",
-                BinFileSize,
-                pFileSystemBuild->pOutputBinaryFilename);
         goto Error;
     }
 
-    /* Use the binary filename to create the header filename. */
-    BufLen = strlen(pFileSystemBuild->pOutputBinaryFilename) + 1;
-    pDestFileName = (char*)malloc(BufLen * sizeof(char));
-    if (!pDestFileName)
+    /* Read the cache policy for the optional HTTP response headers. */
+    Result = _LoadHttpRules(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr, 
-                "error: Failed to allocate %ld bytes for filename buffer.\n", 
-                BufLen);
         goto Error;
     }
-    memcpy(pDestFileName, pFileSystemBuild->pOutputBinaryFilename, BufLen);
-    pDdotPos = strrchr(pDestFileName,'.');
-    *(pDdotPos+1) = 'h';
-    *(pDdotPos+2) = '\0';
-    printf("\nCreating header file %s from %s...\n", pDestFileName, pFileSystemBuild->pOutputBinaryFilename);
-    pDestFile = fopen(pDestFileName, "w");
-    if (!pDestFile)
+
+    /* Read the key for the optional --encrypt option. */
+    Result = _LoadEncryptionKey(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr,
-                "Failed to open %s for writing of the file system image.\n",
-                pDestFileName);
         goto Error;
     }
 
-    printf("Exporting %s to %s...\n", pFileSystemBuild->pOutputBinaryFilename, pDestFileName);
-
-    /* Write the array declaration to the output file*/
-    Result = fprintf(pDestFile, "%s", HeaderName);
-    if (Result < 0)
+    /* Drop optional files until the image fits its budget using only the
+       sizes found while scanning. */
+    Result = _FitImageBudget(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr,
-                "error: Failed to write to file %s.\n",
-                 pDestFileName);
         goto Error;
     }
 
-    /* Write the binary file content to the output file*/
-    snprintf(pDestBuffer, 1, "%s", "\0");       // Make sure the first char in pDestBuffer is NULL
-    for(long i = 0; i < BinFileSize; i++)
+    /* Compress the variants to be served with a Content-Encoding so that their
+       sizes are known when the image is laid out. */
+    Result = _CreatePrecompressedVariants(&FileSystemBuild);
+    if (Result)
     {
-        if((i % 16 == 0) && i > 0)
-            snprintf(pDestBuffer + strlen(pDestBuffer), DestBufferSize, "%s", "\\\n");
-        snprintf(pDestBuffer + strlen(pDestBuffer), DestBufferSize, "%s", "\\x");
-        snprintf(pDestBuffer + strlen(pDestBuffer), DestBufferSize, "%02X", pSrcBuffer[i]);
+        goto Error;
     }
 
-    /* Write the destination buffer to the output file*/
-    Result = fprintf(pDestFile, "%s", pDestBuffer);
-    if (Result < 0)
+    /* Lay out the image and make sure that it can be encoded before starting
+       to write it. */
+    Result = _PlanFileSystemImage(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr,
-                "error: Failed to write to file %s.\n",
-                 pDestFileName);
         goto Error;
     }
-
-    /* Write array end to the output file*/
-    Result = fprintf(pDestFile, "%s", FooterName);
-    if (Result < 0)
+    Result = _ReportFlashSectors(&FileSystemBuild);
+    if (Result)
     {
-        fprintf(stderr,
-                "error: Failed to write to file %s.\n",
-                 pDestFileName);
         goto Error;
     }
-
-    Return = 0;
-Error:
-    free(pDestFileName);
-    pDestFileName = NULL;
-    if (pSourceFile)
+    Result = _CheckImageBudget(&FileSystemBuild);
+    if (Result)
     {
-        fclose(pSourceFile);
-        pSourceFile = NULL;
+        goto Error;
     }
-    if (pDestFile)
+    if (FileSystemBuild.DryRun)
     {
-        fclose(pDestFile);
-        pDestFile = NULL;
+        printf("\nDry run of %s:\n", FileSystemBuild.pOutputBinaryFilename);
+        _PrintImageBreakdown(stdout, &FileSystemBuild);
+        Return = 0;
+        goto Error;
     }
-    return Return;
-}
 
-int main(int argc, const char** argv)
-{
-    int                 Return = 1;
-    int                 Result = 1;
-    SFileSystemBuild    FileSystemBuild;
+    /* Create the file system image containing the files just enumerated. */
+    Result = _CreateFileSystemImage(&FileSystemBuild);
+    if (Result)
+    {
+        goto Error;
+    }
 
-    /* Initialize all of the pointers in context to NULL */
-    memset(&FileSystemBuild, 0, sizeof(FileSystemBuild));
+    /* Write the HEX and S-record files and report the placement after the
+       firmware if requested. */
+    Result = _ExportImage(&FileSystemBuild);
+    if (Result)
+    {
+        goto Error;
+    }
 
-    /* Display header */
-    printf("Simple FLASH Binary File System Builder\n"
-           "Created by Adam Green in 2011\n\n");
-           
-    Result = _ParseCommandLine(argc, argv, &FileSystemBuild);
+    /* Time lookups against the finished image if requested. */
+    Result = _BenchmarkLookups(&FileSystemBuild);
     if (Result)
     {
-        _DisplayUsage();
         goto Error;
     }
-    
-    /* Create list of files to be placed in the file system image by walking
-       the source root directory. */
-    Result = _CreateFileList(&FileSystemBuild);
+    Result = _BenchmarkHttp(&FileSystemBuild);
     if (Result)
     {
         goto Error;
     }
 
-    /* Create the file system image containing the files just enumerated. */
-    Result = _CreateFileSystemImage(&FileSystemBuild);
-    if (Result)
+    /* Images which need 64-bit offsets are only used on the host and are far
+       too large to be compiled into firmware as a header. */
+    if (FileSystemBuild.Layout.FeatureFlags & FILE_SYSTEM_FEATURE_64BIT_OFFSETS)
     {
+        printf("\nSkipping creation of header files for image larger than 4GB.\n");
+        Return = 0;
         goto Error;
     }
 
@@ -1000,6 +11240,32 @@ int main(int argc, const char** argv)
         goto Error;
     }
 
+    /* The index header gives offsets from the start of roFlashDrive so it
+       can't describe files placed in the other regions. */
+    if (FileSystemBuild.RegionCount > 1)
+    {
+        printf("\nSkipping creation of C++ index header for image split across FLASH regions.\n");
+        Return = 0;
+        goto Error;
+    }
+
+    /* A plaintext index would give away the filenames and offsets which the
+       encrypted tables hide, and verify_index() couldn't match it against
+       the encrypted entries anyway. */
+    if (FileSystemBuild.Layout.FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES)
+    {
+        printf("\nSkipping creation of C++ index header for image with encrypted tables.\n");
+        Return = 0;
+        goto Error;
+    }
+
+    /* Create the C++ index header to go along with it. */
+    Result = _CreateIndexHeaderFile(&FileSystemBuild);
+    if (Result)
+    {
+        goto Error;
+    }
+
     Return = 0;
 Error:
     _FreeFileSystemBuild(&FileSystemBuild);
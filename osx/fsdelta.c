@@ -0,0 +1,726 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Over the air update deltas between two file system images, created by
+   fsbld --diff.  See fsdelta.h for a description of the API and ffsformat.h
+   for the encoding.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ffsformat.h"
+#include "fsreader.h"
+#include "fsdelta.h"
+
+
+/* Content defined chunking parameters.  Boundaries are placed where the low
+   bits of a gear hash are zero so an edit only changes the chunks around it,
+   rather than shifting every chunk boundary which follows. */
+#define DELTA_MIN_CHUNK     64
+#define DELTA_CHUNK_MASK    0x1FF
+#define DELTA_MAX_CHUNK     4096
+
+/* Image being diffed along with all of its entries. */
+typedef struct _SDeltaImage
+{
+    const SFsReaderImage*   pReader;
+    /* Every byte of the image file, including anything after the end of a
+       v2 image, so that a delta rebuilds the file exactly. */
+    const unsigned char*    pImage;
+    uint64_t                ImageSize;
+    SFsReaderStat*          pEntries;
+    uint32_t                FileCount;
+} SDeltaImage;
+
+/* Chunk of the previous image recorded in the delta's chunk index. */
+typedef struct _SDeltaChunk
+{
+    uint64_t            Hash;
+    uint64_t            Offset;
+    size_t              Length;
+} SDeltaChunk;
+
+/* Operation of a delta as it is being built.  Offset is in the previous
+   image for FILE_SYSTEM_DELTA_COPY and in the new image for
+   FILE_SYSTEM_DELTA_ADD. */
+typedef struct _SDeltaOp
+{
+    unsigned int        Type;
+    uint64_t            Offset;
+    uint64_t            Length;
+} SDeltaOp;
+
+/* Context used while building a delta. */
+typedef struct _SDeltaBuild
+{
+    const SDeltaImage*  pOld;
+    const SDeltaImage*  pNew;
+    /* Open addressed hash table of the chunks in the previous image. */
+    SDeltaChunk*        pChunks;
+    size_t              ChunkTableSize;
+    /* Operations which build the new image. */
+    SDeltaOp*           pOps;
+    size_t              OpCount;
+    size_t              OpCapacity;
+} SDeltaBuild;
+
+/* Random values used by the gear hash, one per byte value. */
+static uint64_t g_GearTable[256];
+
+
+/* Fills in g_GearTable with a fixed xorshift sequence so that deltas are
+   reproducible. */
+static void _InitGearTable(void)
+{
+    uint32_t        Random = 0x2545F491;
+    unsigned int    i;
+    unsigned int    j;
+
+    for (i = 0 ; i < sizeof(g_GearTable) / sizeof(g_GearTable[0]) ; i++)
+    {
+        uint64_t Value = 0;
+
+        for (j = 0 ; j < 2 ; j++)
+        {
+            Random ^= Random << 13;
+            Random ^= Random >> 17;
+            Random ^= Random << 5;
+            Value = (Value << 32) | Random;
+        }
+        g_GearTable[i] = Value;
+    }
+}
+
+
+/* Describes every entry of an image for the delta.
+
+   Returns:
+    0 on success and one of the FS_DELTA_ERROR_* codes otherwise */
+static int _LoadDeltaImage(SDeltaImage* pDeltaImage, const SFsReaderImage* pImage)
+{
+    uint32_t i;
+
+    memset(pDeltaImage, 0, sizeof(*pDeltaImage));
+    pDeltaImage->pReader = pImage;
+    pDeltaImage->pImage = pImage->pImage;
+    pDeltaImage->ImageSize = pImage->pMapping ? pImage->MappingSize : pImage->ImageSize;
+    pDeltaImage->FileCount = pImage->FileCount;
+    pDeltaImage->pEntries = calloc((size_t)pImage->FileCount + 1, sizeof(*pDeltaImage->pEntries));
+    if (!pDeltaImage->pEntries)
+    {
+        return FS_DELTA_ERROR_MEMORY;
+    }
+    for (i = 0 ; i < pImage->FileCount ; i++)
+    {
+        FsReaderStatIndex(pImage, i, &pDeltaImage->pEntries[i]);
+    }
+
+    return 0;
+}
+
+
+/* Finds the entry of pFilename in an image.
+
+   Returns:
+    Pointer to the entry or NULL if the image doesn't contain pFilename.
+*/
+static const SFsReaderStat* _FindDeltaEntry(const SDeltaImage* pDeltaImage, const char* pFilename)
+{
+    uint32_t Index;
+
+    if (FsReaderLookup(pDeltaImage->pReader, pFilename, &Index))
+    {
+        return NULL;
+    }
+    return &pDeltaImage->pEntries[Index];
+}
+
+
+/* Sorts image entries by the location of their data. */
+static int _CompareEntryOffsets(const void* pv1, const void* pv2)
+{
+    const SFsReaderStat* pEntry1 = *(const SFsReaderStat* const*)pv1;
+    const SFsReaderStat* pEntry2 = *(const SFsReaderStat* const*)pv2;
+
+    if (pEntry1->Offset != pEntry2->Offset)
+    {
+        return pEntry1->Offset < pEntry2->Offset ? -1 : 1;
+    }
+    return pEntry1 < pEntry2 ? -1 : (pEntry1 > pEntry2);
+}
+
+
+/* Splits an image into segments at the start and end of each file's data so
+   that chunk boundaries line up with file boundaries.  Segments never overlap
+   and cover the whole image.
+
+   Parameters:
+    pDeltaImage is the image.
+    pppSegments is a pointer to be filled in with an array of the segments,
+        which the caller must free().  Each segment points to the entry whose
+        data it holds or NULL for the bytes between files.
+    ppSegmentStarts is a pointer to be filled in with the offset of each
+        segment, which the caller must free().  An extra element holds the
+        size of the image.
+
+   Returns:
+    The number of segments or -1 on failure.
+*/
+static int _SplitImageSegments(const SDeltaImage*     pDeltaImage,
+                               const SFsReaderStat*** pppSegments,
+                               uint64_t**             ppSegmentStarts)
+{
+    const SFsReaderStat** ppSorted = NULL;
+    const SFsReaderStat** ppSegments = NULL;
+    uint64_t*             pStarts = NULL;
+    uint64_t              Offset = 0;
+    unsigned int          Count = 0;
+    unsigned int          i;
+
+    ppSorted = malloc((pDeltaImage->FileCount + 1) * sizeof(*ppSorted));
+    ppSegments = malloc((2 * pDeltaImage->FileCount + 1) * sizeof(*ppSegments));
+    pStarts = malloc((2 * pDeltaImage->FileCount + 2) * sizeof(*pStarts));
+    if (!ppSorted || !ppSegments || !pStarts)
+    {
+        free(ppSorted);
+        free(ppSegments);
+        free(pStarts);
+        return -1;
+    }
+    for (i = 0 ; i < pDeltaImage->FileCount ; i++)
+    {
+        ppSorted[i] = &pDeltaImage->pEntries[i];
+    }
+    qsort(ppSorted, pDeltaImage->FileCount, sizeof(*ppSorted), _CompareEntryOffsets);
+
+    for (i = 0 ; i < pDeltaImage->FileCount ; i++)
+    {
+        const SFsReaderStat* pEntry = ppSorted[i];
+
+        /* Empty files and files which share data with an earlier one don't
+           get segments of their own. */
+        if (pEntry->Size == 0 || pEntry->Offset < Offset)
+        {
+            continue;
+        }
+        if (pEntry->Offset > Offset)
+        {
+            ppSegments[Count] = NULL;
+            pStarts[Count++] = Offset;
+        }
+        ppSegments[Count] = pEntry;
+        pStarts[Count++] = pEntry->Offset;
+        Offset = pEntry->Offset + pEntry->Size;
+    }
+    if (Offset < pDeltaImage->ImageSize)
+    {
+        ppSegments[Count] = NULL;
+        pStarts[Count++] = Offset;
+    }
+    pStarts[Count] = pDeltaImage->ImageSize;
+    free(ppSorted);
+
+    *pppSegments = ppSegments;
+    *ppSegmentStarts = pStarts;
+    return (int)Count;
+}
+
+
+/* Returns the length of the content defined chunk at the start of pData. */
+static size_t _FindChunkLength(const unsigned char* pData, size_t Size)
+{
+    uint64_t    Hash = 0;
+    size_t      i;
+
+    if (Size <= DELTA_MIN_CHUNK)
+    {
+        return Size;
+    }
+    if (Size > DELTA_MAX_CHUNK)
+    {
+        Size = DELTA_MAX_CHUNK;
+    }
+    for (i = 0 ; i < Size ; i++)
+    {
+        /* The shift pushes each byte out of the top of the hash after 64
+           bytes so the boundary only depends on the last 64 bytes. */
+        Hash = (Hash << 1) + g_GearTable[pData[i]];
+        if (i >= DELTA_MIN_CHUNK && ((Hash >> 40) & DELTA_CHUNK_MASK) == 0)
+        {
+            return i + 1;
+        }
+    }
+
+    return Size;
+}
+
+
+/* Appends an operation to the delta, merging it with the previous operation
+   when they are contiguous.
+
+   Returns:
+    0 on success and one of the FS_DELTA_ERROR_* codes otherwise */
+static int _AddDeltaOp(SDeltaBuild* pDelta, unsigned int Type, uint64_t Offset, uint64_t Length)
+{
+    SDeltaOp* pLast = pDelta->OpCount ? &pDelta->pOps[pDelta->OpCount - 1] : NULL;
+
+    if (Length == 0)
+    {
+        return 0;
+    }
+    if (pLast && pLast->Type == Type && pLast->Offset + pLast->Length == Offset)
+    {
+        pLast->Length += Length;
+        return 0;
+    }
+    if (pDelta->OpCount == pDelta->OpCapacity)
+    {
+        size_t      NewCapacity = pDelta->OpCapacity ? 2 * pDelta->OpCapacity : 256;
+        SDeltaOp*   pNewOps = realloc(pDelta->pOps, NewCapacity * sizeof(*pNewOps));
+
+        if (!pNewOps)
+        {
+            return FS_DELTA_ERROR_MEMORY;
+        }
+        pDelta->pOps = pNewOps;
+        pDelta->OpCapacity = NewCapacity;
+    }
+    pDelta->pOps[pDelta->OpCount].Type = Type;
+    pDelta->pOps[pDelta->OpCount].Offset = Offset;
+    pDelta->pOps[pDelta->OpCount].Length = Length;
+    pDelta->OpCount++;
+
+    return 0;
+}
+
+
+/* Indexes the content defined chunks of every segment of the previous image.
+
+   Returns:
+    0 on success and one of the FS_DELTA_ERROR_* codes otherwise */
+static int _IndexDeltaChunks(SDeltaBuild* pDelta)
+{
+    const SDeltaImage*    pOld = pDelta->pOld;
+    const SFsReaderStat** ppSegments = NULL;
+    uint64_t*             pStarts = NULL;
+    uint64_t              Offset;
+    int                   SegmentCount;
+    int                   i;
+
+    /* Size the table for the smallest possible chunks at a load of 50%. */
+    pDelta->ChunkTableSize = 1024;
+    while (pDelta->ChunkTableSize < 2 * (pOld->ImageSize / DELTA_MIN_CHUNK + 2 * pOld->FileCount + 1))
+    {
+        pDelta->ChunkTableSize *= 2;
+    }
+    pDelta->pChunks = calloc(pDelta->ChunkTableSize, sizeof(*pDelta->pChunks));
+    if (!pDelta->pChunks)
+    {
+        return FS_DELTA_ERROR_MEMORY;
+    }
+
+    SegmentCount = _SplitImageSegments(pOld, &ppSegments, &pStarts);
+    if (SegmentCount < 0)
+    {
+        return FS_DELTA_ERROR_MEMORY;
+    }
+    for (i = 0 ; i < SegmentCount ; i++)
+    {
+        for (Offset = pStarts[i] ; Offset < pStarts[i + 1] ; )
+        {
+            size_t      Length = _FindChunkLength(pOld->pImage + Offset, (size_t)(pStarts[i + 1] - Offset));
+            uint64_t    Hash = FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, pOld->pImage + Offset, Length);
+            size_t      Slot = (size_t)Hash & (pDelta->ChunkTableSize - 1);
+
+            /* Keep the first copy of duplicate chunks. */
+            while (pDelta->pChunks[Slot].Length && 
+                   (pDelta->pChunks[Slot].Hash != Hash || pDelta->pChunks[Slot].Length != Length))
+            {
+                Slot = (Slot + 1) & (pDelta->ChunkTableSize - 1);
+            }
+            if (!pDelta->pChunks[Slot].Length)
+            {
+                pDelta->pChunks[Slot].Hash = Hash;
+                pDelta->pChunks[Slot].Offset = Offset;
+                pDelta->pChunks[Slot].Length = Length;
+            }
+            Offset += Length;
+        }
+    }
+    free(ppSegments);
+    free(pStarts);
+
+    return 0;
+}
+
+
+/* Adds the operations which rebuild a segment of the new image from the
+   chunks of the previous image, extending each match as far as the bytes
+   continue to agree.
+
+   Returns:
+    0 on success and one of the FS_DELTA_ERROR_* codes otherwise */
+static int _DiffDeltaSegment(SDeltaBuild* pDelta, uint64_t Start, uint64_t End)
+{
+    const unsigned char*    pOldImage = pDelta->pOld->pImage;
+    const unsigned char*    pNewImage = pDelta->pNew->pImage;
+    uint64_t                OldSize = pDelta->pOld->ImageSize;
+    uint64_t                Offset = Start;
+
+    while (Offset < End)
+    {
+        size_t              Length = _FindChunkLength(pNewImage + Offset, (size_t)(End - Offset));
+        uint64_t            Hash = FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, pNewImage + Offset, Length);
+        size_t              Slot = (size_t)Hash & (pDelta->ChunkTableSize - 1);
+        const SDeltaChunk*  pMatch = NULL;
+
+        while (pDelta->pChunks[Slot].Length)
+        {
+            const SDeltaChunk* pChunk = &pDelta->pChunks[Slot];
+
+            if (pChunk->Hash == Hash && pChunk->Length == Length &&
+                0 == memcmp(pOldImage + pChunk->Offset, pNewImage + Offset, Length))
+            {
+                pMatch = pChunk;
+                break;
+            }
+            Slot = (Slot + 1) & (pDelta->ChunkTableSize - 1);
+        }
+
+        if (pMatch)
+        {
+            uint64_t OldOffset = pMatch->Offset + Length;
+
+            while (Offset + Length < End && OldOffset < OldSize && 
+                   pOldImage[OldOffset] == pNewImage[Offset + Length])
+            {
+                Length++;
+                OldOffset++;
+            }
+            if (_AddDeltaOp(pDelta, FILE_SYSTEM_DELTA_COPY, pMatch->Offset, Length))
+            {
+                return FS_DELTA_ERROR_MEMORY;
+            }
+        }
+        else if (_AddDeltaOp(pDelta, FILE_SYSTEM_DELTA_ADD, Offset, Length))
+        {
+            return FS_DELTA_ERROR_MEMORY;
+        }
+        Offset += Length;
+    }
+
+    return 0;
+}
+
+
+/* Stores a fixed width field of SFileSystemDeltaHeader, which is always
+   least significant byte first.
+
+   Returns:
+    Pointer to the byte after the field.
+*/
+static unsigned char* _StoreHeaderField(unsigned char* pDest, uint64_t Value, unsigned int Bytes)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < Bytes ; i++)
+    {
+        *pDest++ = (unsigned char)(Value >> (8 * i));
+    }
+
+    return pDest;
+}
+
+
+/* Appends an unsigned LEB128 value to a buffer.
+
+   Returns:
+    Pointer to the byte after the value.
+*/
+static unsigned char* _StoreVarint(unsigned char* pDest, uint64_t Value)
+{
+    while (Value >= 0x80)
+    {
+        *pDest++ = (unsigned char)(Value | 0x80);
+        Value >>= 7;
+    }
+    *pDest++ = (unsigned char)Value;
+
+    return pDest;
+}
+
+
+/* Reads an unsigned LEB128 value from a delta.
+
+   Returns:
+    0 on success or 1 if the value runs past pEnd.
+*/
+static int _LoadVarint(const unsigned char** ppCurr, const unsigned char* pEnd, uint64_t* pValue)
+{
+    uint64_t        Value = 0;
+    unsigned int    Shift = 0;
+
+    while (*ppCurr < pEnd && Shift < 64)
+    {
+        unsigned char Byte = *(*ppCurr)++;
+
+        Value |= (uint64_t)(Byte & 0x7F) << Shift;
+        if (!(Byte & 0x80))
+        {
+            *pValue = Value;
+            return 0;
+        }
+        Shift += 7;
+    }
+
+    return 1;
+}
+
+
+int FsDeltaCreate(const SFsReaderImage* pOld,
+                  const SFsReaderImage* pNew,
+                  unsigned char**       ppDelta,
+                  uint64_t*             pDeltaSize,
+                  SFsDeltaStats*        pStats)
+{
+    SDeltaBuild           Delta;
+    SDeltaImage           Old;
+    SDeltaImage           New;
+    const SFsReaderStat** ppSegments = NULL;
+    uint64_t*             pStarts = NULL;
+    unsigned char*        pEncoded = NULL;
+    unsigned char*        pCurr;
+    uint64_t              MaxSize;
+    int                   SegmentCount;
+    int                   Result;
+    int                   i;
+    size_t                j;
+
+    memset(&Delta, 0, sizeof(Delta));
+    memset(&New, 0, sizeof(New));
+    memset(pStats, 0, sizeof(*pStats));
+    Result = _LoadDeltaImage(&Old, pOld);
+    if (!Result)
+    {
+        Result = _LoadDeltaImage(&New, pNew);
+    }
+    if (Result)
+    {
+        goto Error;
+    }
+    if (!g_GearTable[0])
+    {
+        _InitGearTable();
+    }
+    Delta.pOld = &Old;
+    Delta.pNew = &New;
+    Result = _IndexDeltaChunks(&Delta);
+    if (Result)
+    {
+        goto Error;
+    }
+
+    SegmentCount = _SplitImageSegments(&New, &ppSegments, &pStarts);
+    if (SegmentCount < 0)
+    {
+        Result = FS_DELTA_ERROR_MEMORY;
+        goto Error;
+    }
+    for (i = 0 ; i < SegmentCount ; i++)
+    {
+        const SFsReaderStat* pNewEntry = ppSegments[i];
+        const SFsReaderStat* pOldEntry = pNewEntry ? _FindDeltaEntry(&Old, pNewEntry->pFilename) : NULL;
+
+        if (pNewEntry && !pOldEntry)
+        {
+            pStats->Added++;
+        }
+        else if (pOldEntry && 
+                 pOldEntry->Size == pNewEntry->Size &&
+                 0 == memcmp(Old.pImage + pOldEntry->Offset, 
+                             New.pImage + pNewEntry->Offset, 
+                             (size_t)pNewEntry->Size))
+        {
+            pStats->Unchanged++;
+            Result = _AddDeltaOp(&Delta, FILE_SYSTEM_DELTA_COPY, pOldEntry->Offset, pOldEntry->Size);
+            if (Result)
+            {
+                goto Error;
+            }
+            continue;
+        }
+        else if (pOldEntry)
+        {
+            pStats->Changed++;
+        }
+        Result = _DiffDeltaSegment(&Delta, pStarts[i], pStarts[i + 1]);
+        if (Result)
+        {
+            goto Error;
+        }
+    }
+
+    /* Encode the operations.  Each one takes at most 21 bytes plus any new
+       bytes. */
+    MaxSize = sizeof(SFileSystemDeltaHeader) + 1;
+    for (j = 0 ; j < Delta.OpCount ; j++)
+    {
+        MaxSize += 21 + (Delta.pOps[j].Type == FILE_SYSTEM_DELTA_ADD ? Delta.pOps[j].Length : 0);
+    }
+    pEncoded = malloc((size_t)MaxSize);
+    if (!pEncoded)
+    {
+        Result = FS_DELTA_ERROR_MEMORY;
+        goto Error;
+    }
+    memcpy(pEncoded, FILE_SYSTEM_DELTA_SIGNATURE, sizeof(((SFileSystemDeltaHeader*)0)->Signature));
+    pCurr = pEncoded + sizeof(((SFileSystemDeltaHeader*)0)->Signature);
+    pCurr = _StoreHeaderField(pCurr, FILE_SYSTEM_DELTA_VERSION, 4);
+    pCurr = _StoreHeaderField(pCurr, 0, 4);
+    pCurr = _StoreHeaderField(pCurr, Old.ImageSize, 8);
+    pCurr = _StoreHeaderField(pCurr, FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, Old.pImage, 
+                                                          (size_t)Old.ImageSize), 8);
+    pCurr = _StoreHeaderField(pCurr, New.ImageSize, 8);
+    pCurr = _StoreHeaderField(pCurr, FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, New.pImage, 
+                                                          (size_t)New.ImageSize), 8);
+    for (j = 0 ; j < Delta.OpCount ; j++)
+    {
+        const SDeltaOp* pOp = &Delta.pOps[j];
+
+        *pCurr++ = (unsigned char)pOp->Type;
+        if (pOp->Type == FILE_SYSTEM_DELTA_COPY)
+        {
+            pCurr = _StoreVarint(pCurr, pOp->Offset);
+            pCurr = _StoreVarint(pCurr, pOp->Length);
+        }
+        else
+        {
+            pCurr = _StoreVarint(pCurr, pOp->Length);
+            memcpy(pCurr, New.pImage + pOp->Offset, (size_t)pOp->Length);
+            pCurr += pOp->Length;
+        }
+    }
+    *pCurr++ = FILE_SYSTEM_DELTA_END;
+
+    pStats->OpCount = Delta.OpCount;
+    *ppDelta = pEncoded;
+    *pDeltaSize = pCurr - pEncoded;
+    pEncoded = NULL;
+    Result = 0;
+Error:
+    free(pEncoded);
+    free(ppSegments);
+    free(pStarts);
+    free(Delta.pChunks);
+    free(Delta.pOps);
+    free(Old.pEntries);
+    free(New.pEntries);
+    return Result;
+}
+
+
+int FsDeltaApply(const unsigned char* pOld, 
+                 uint64_t             OldSize, 
+                 const unsigned char* pDelta, 
+                 uint64_t             DeltaSize,
+                 unsigned char**      ppNew,
+                 uint64_t*            pNewSize)
+{
+    const unsigned char*    pCurr = pDelta + sizeof(SFileSystemDeltaHeader);
+    const unsigned char*    pEnd = pDelta + DeltaSize;
+    unsigned char*          pNew = NULL;
+    uint64_t                NewSize;
+    uint64_t                Written = 0;
+
+    if (DeltaSize < sizeof(SFileSystemDeltaHeader) ||
+        0 != memcmp(pDelta, FILE_SYSTEM_DELTA_SIGNATURE, sizeof(((SFileSystemDeltaHeader*)0)->Signature)) ||
+        FsReaderLoadField(pDelta + 8, 4, 0) != FILE_SYSTEM_DELTA_VERSION)
+    {
+        return FS_DELTA_ERROR_FORMAT;
+    }
+    if (FsReaderLoadField(pDelta + 16, 8, 0) != OldSize ||
+        FsReaderLoadField(pDelta + 24, 8, 0) != FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, pOld, 
+                                                                     (size_t)OldSize))
+    {
+        return FS_DELTA_ERROR_WRONG_IMAGE;
+    }
+    NewSize = FsReaderLoadField(pDelta + 32, 8, 0);
+    pNew = malloc((size_t)NewSize + 1);
+    if (!pNew)
+    {
+        return FS_DELTA_ERROR_MEMORY;
+    }
+
+    while (pCurr < pEnd && *pCurr != FILE_SYSTEM_DELTA_END)
+    {
+        unsigned int    Type = *pCurr++;
+        uint64_t        Offset = 0;
+        uint64_t        Length = 0;
+
+        if (Type == FILE_SYSTEM_DELTA_COPY)
+        {
+            if (_LoadVarint(&pCurr, pEnd, &Offset) || _LoadVarint(&pCurr, pEnd, &Length) ||
+                Offset > OldSize || Length > OldSize - Offset || Length > NewSize - Written)
+            {
+                break;
+            }
+            memcpy(pNew + Written, pOld + Offset, (size_t)Length);
+        }
+        else if (Type == FILE_SYSTEM_DELTA_ADD)
+        {
+            if (_LoadVarint(&pCurr, pEnd, &Length) ||
+                Length > (uint64_t)(pEnd - pCurr) || Length > NewSize - Written)
+            {
+                break;
+            }
+            memcpy(pNew + Written, pCurr, (size_t)Length);
+            pCurr += Length;
+        }
+        else
+        {
+            break;
+        }
+        Written += Length;
+    }
+    if (pCurr >= pEnd || *pCurr != FILE_SYSTEM_DELTA_END || Written != NewSize ||
+        FsReaderLoadField(pDelta + 40, 8, 0) != FsReaderHashContents(FILE_SYSTEM_FNV64_OFFSET_BASIS, pNew, 
+                                                                     (size_t)NewSize))
+    {
+        free(pNew);
+        return FS_DELTA_ERROR_CORRUPT;
+    }
+
+    *ppNew = pNew;
+    *pNewSize = NewSize;
+    return 0;
+}
+
+
+const char* FsDeltaErrorString(int Error)
+{
+    switch (Error)
+    {
+    case 0:
+        return "Success";
+    case FS_DELTA_ERROR_MEMORY:
+        return "Out of memory";
+    case FS_DELTA_ERROR_FORMAT:
+        return "Not a supported file system image delta";
+    case FS_DELTA_ERROR_WRONG_IMAGE:
+        return "Delta was created from a different image";
+    case FS_DELTA_ERROR_CORRUPT:
+        return "Delta is corrupt";
+    default:
+        return "Unknown error";
+    }
+}
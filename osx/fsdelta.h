@@ -0,0 +1,85 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Over the air update deltas between two file system images, as created by
+   fsbld --diff and applied with fsbld --apply-delta.  Files are matched up
+   by name using the entry tables of the two images and unchanged files
+   become a single copy.  The rest of the new image, including changed files
+   and the tables, is split into content defined chunks which are copied from
+   wherever they occur in the previous image.  The encoding is described with
+   SFileSystemDeltaHeader in ffsformat.h.
+*/
+#ifndef _FSDELTA_H_
+#define _FSDELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fsreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Error codes returned by the FsDelta*() functions.  0 is success. */
+/* Memory for the delta or the rebuilt image couldn't be allocated. */
+#define FS_DELTA_ERROR_MEMORY       1
+/* The delta doesn't start with a supported SFileSystemDeltaHeader. */
+#define FS_DELTA_ERROR_FORMAT       2
+/* The delta was created from an image other than the one given. */
+#define FS_DELTA_ERROR_WRONG_IMAGE  3
+/* The operations of the delta don't rebuild the image it describes. */
+#define FS_DELTA_ERROR_CORRUPT      4
+
+
+/* Counts reported by FsDeltaCreate(). */
+typedef struct _SFsDeltaStats
+{
+    /* Files of the new image which are unchanged, changed or not in the
+       previous image. */
+    unsigned int    Unchanged;
+    unsigned int    Changed;
+    unsigned int    Added;
+    /* Number of operations in the delta. */
+    size_t          OpCount;
+} SFsDeltaStats;
+
+
+/* Creates a delta which rebuilds the whole of the new image file from the
+   previous one.  Both images must have been opened with FsReaderOpenImage(),
+   or with FsReaderOpenImageUnchecked() and checked with
+   FsReaderCheckEntries(), so that their files can be looked up.  *ppDelta is
+   set to the encoded delta, which the caller must free(). */
+int         FsDeltaCreate(const SFsReaderImage* pOld,
+                          const SFsReaderImage* pNew,
+                          unsigned char**       ppDelta,
+                          uint64_t*             pDeltaSize,
+                          SFsDeltaStats*        pStats);
+/* Reference implementation of the delta applier which a device would use to
+   rebuild the new image from the OldSize bytes at pOld that it already has.
+   *ppNew is set to the new image, which the caller must free(). */
+int         FsDeltaApply(const unsigned char* pOld, 
+                         uint64_t             OldSize, 
+                         const unsigned char* pDelta, 
+                         uint64_t             DeltaSize,
+                         unsigned char**      ppNew,
+                         uint64_t*            pNewSize);
+
+/* Returns a description of one of the FS_DELTA_ERROR_* codes. */
+const char* FsDeltaErrorString(int Error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FSDELTA_H_ */
@@ -0,0 +1,747 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host side reader for file system images built by fsbld.  See fsreader.h
+   for a description of the API.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ffsformat.h"
+#include "fsreader.h"
+
+
+/* FormatVersion reported for images with the original SFileSystemHeader. */
+#define FS_READER_FORMAT_LEGACY     1
+
+/* Longest prefix held in a FILE_SYSTEM_SECTION_NAME_PREFIXES sidecar. */
+#define FS_READER_MAX_NAME_PREFIX   16
+
+/* FILE_SYSTEM_FEATURE_* bits which don't stop the files being read. */
+#define FS_READER_KNOWN_FEATURES    (FILE_SYSTEM_FEATURE_64BIT_OFFSETS | \
+                                     FILE_SYSTEM_FEATURE_COMPACT_ENTRIES | \
+                                     FILE_SYSTEM_FEATURE_BIG_ENDIAN | \
+                                     FILE_SYSTEM_FEATURE_MERKLE)
+
+
+uint64_t FsReaderLoadField(const unsigned char* pSrc, unsigned int Bytes, int BigEndian)
+{
+    uint64_t        Value = 0;
+    unsigned int    i;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* The 32-bit little endian fields of the common images are read on
+       every binary search probe so load them directly. */
+    if (Bytes == 4 && !BigEndian)
+    {
+        uint32_t Field;
+
+        memcpy(&Field, pSrc, sizeof(Field));
+        return Field;
+    }
+#endif
+    for (i = 0 ; i < Bytes ; i++)
+    {
+        unsigned int Shift = BigEndian ? (Bytes - 1 - i) * 8 : i * 8;
+
+        Value |= (uint64_t)pSrc[i] << Shift;
+    }
+
+    return Value;
+}
+
+
+/* Returns the filename of an entry. */
+static const char* _GetFilename(const SFsReaderImage* pImage, uint32_t Index)
+{
+    const unsigned char* pEntry = pImage->pEntries + (uint64_t)Index * pImage->EntrySize;
+
+    return (const char*)pImage->pImage + FsReaderLoadField(pEntry, pImage->OffsetBytes, pImage->BigEndian);
+}
+
+
+/* Finds the first entry in [Low, High) whose filename doesn't sort before
+   pFilename. */
+static uint32_t _FindLowerBound(const SFsReaderImage* pImage, uint32_t Low, uint32_t High, const char* pFilename)
+{
+    while (Low < High)
+    {
+        uint32_t Mid = Low + (High - Low) / 2;
+
+        if (strcmp(_GetFilename(pImage, Mid), pFilename) < 0)
+        {
+            Low = Mid + 1;
+        }
+        else
+        {
+            High = Mid;
+        }
+    }
+
+    return Low;
+}
+
+
+/* Finds the first entry in [Low, High) whose filename doesn't start with the
+   Length bytes at pPrefix, given that those before it all do. */
+static uint32_t _FindPrefixEnd(const SFsReaderImage* pImage,
+                               uint32_t              Low,
+                               uint32_t              High,
+                               const char*           pPrefix,
+                               size_t                Length)
+{
+    while (Low < High)
+    {
+        uint32_t Mid = Low + (High - Low) / 2;
+
+        if (0 == strncmp(_GetFilename(pImage, Mid), pPrefix, Length))
+        {
+            Low = Mid + 1;
+        }
+        else
+        {
+            High = Mid;
+        }
+    }
+
+    return Low;
+}
+
+
+uint64_t FsReaderHashContents(uint64_t Hash, const unsigned char* pData, size_t Size)
+{
+    while (Size--)
+    {
+        Hash ^= *pData++;
+        Hash *= FILE_SYSTEM_FNV64_PRIME;
+    }
+
+    return Hash;
+}
+
+
+uint32_t FsReaderHashFilename(const char* pFilename)
+{
+    uint32_t Hash = FILE_SYSTEM_FNV_OFFSET_BASIS;
+
+    while (*pFilename)
+    {
+        Hash ^= (unsigned char)*pFilename++;
+        Hash *= FILE_SYSTEM_FNV_PRIME;
+    }
+
+    return Hash;
+}
+
+
+uint32_t FsReaderGetFilterBits(uint32_t Hash, unsigned int HashCount)
+{
+    uint32_t        Mix = Hash;
+    uint32_t        Bits = 0;
+    unsigned int    i;
+
+    Mix ^= Mix >> 16;
+    Mix *= FILE_SYSTEM_FILTER_MIX1;
+    Mix ^= Mix >> 13;
+    Mix *= FILE_SYSTEM_FILTER_MIX2;
+    Mix ^= Mix >> 16;
+    for (i = 0 ; i < HashCount ; i++)
+    {
+        Bits |= (uint32_t)1 << ((Mix >> (5 * i)) & 31);
+    }
+
+    return Bits;
+}
+
+
+int FsReaderTestNameFilter(const unsigned char* pFilter,
+                           uint32_t             WordCount,
+                           unsigned int         HashCount,
+                           int                  BigEndian,
+                           const char*          pFilename)
+{
+    uint32_t Hash = FsReaderHashFilename(pFilename);
+    uint32_t Bits = FsReaderGetFilterBits(Hash, HashCount);
+    uint32_t Word = (uint32_t)FsReaderLoadField(pFilter + 4 * (Hash % WordCount), 4, BigEndian);
+
+    return (Word & Bits) == Bits;
+}
+
+
+/* Fills in the fields of an image which is in memory from its header and
+   checks that its tables lie within it.
+
+   Returns:
+    0 on success and one of the FS_READER_ERROR_* codes otherwise */
+static int _ParseHeader(SFsReaderImage* pImage)
+{
+    const unsigned char*    p = pImage->pImage;
+    uint64_t                ImageSize = pImage->ImageSize;
+    uint64_t                EntriesOffset = 0;
+    uint32_t                i;
+
+    if (ImageSize >= sizeof(SFileSystemHeader) &&
+        0 == memcmp(p, FILE_SYSTEM_SIGNATURE, sizeof(((SFileSystemHeader*)0)->FileSystemSignature)))
+    {
+        /* The legacy header has no byte order marker so pick the one which
+           gives an entry table that fits in the image. */
+        pImage->FileCount = (uint32_t)FsReaderLoadField(p + 8, 4, 0);
+        if (sizeof(SFileSystemHeader) + (uint64_t)pImage->FileCount * sizeof(SFileSystemEntry) > ImageSize)
+        {
+            pImage->BigEndian = 1;
+            pImage->FileCount = (uint32_t)FsReaderLoadField(p + 8, 4, 1);
+        }
+        pImage->FormatVersion = FS_READER_FORMAT_LEGACY;
+        pImage->EntrySize = sizeof(SFileSystemEntry);
+        pImage->OffsetBytes = sizeof(uint32_t);
+        pImage->SizeBytes = sizeof(uint32_t);
+        pImage->HeaderSize = sizeof(SFileSystemHeader);
+        EntriesOffset = sizeof(SFileSystemHeader);
+    }
+    else if (ImageSize >= sizeof(SFileSystemHeaderV2) &&
+             0 == memcmp(p, FILE_SYSTEM_SIGNATURE_V2, sizeof(((SFileSystemHeaderV2*)0)->FileSystemSignature)))
+    {
+        uint64_t HeaderSize;
+        uint32_t SectionCount;
+        uint64_t StoredImageSize;
+
+        pImage->BigEndian = FsReaderLoadField(p + 8, 2, 0) != FILE_SYSTEM_FORMAT_VERSION;
+        if (FsReaderLoadField(p + 8, 2, pImage->BigEndian) != FILE_SYSTEM_FORMAT_VERSION)
+        {
+            return FS_READER_ERROR_FORMAT;
+        }
+        pImage->FormatVersion = FILE_SYSTEM_FORMAT_VERSION;
+        HeaderSize = FsReaderLoadField(p + 10, 2, pImage->BigEndian);
+        pImage->FeatureFlags = (uint32_t)FsReaderLoadField(p + 12, 4, pImage->BigEndian);
+        pImage->FileCount = (uint32_t)FsReaderLoadField(p + 16, 4, pImage->BigEndian);
+        SectionCount = (uint32_t)FsReaderLoadField(p + 20, 4, pImage->BigEndian);
+        StoredImageSize = FsReaderLoadField(p + 24, 8, pImage->BigEndian);
+        pImage->EntrySize = (unsigned int)FsReaderLoadField(p + 32, 2, pImage->BigEndian);
+        pImage->OffsetBytes = p[34];
+        pImage->SizeBytes = p[35];
+        if (HeaderSize < sizeof(SFileSystemHeaderV2) ||
+            !(pImage->FeatureFlags & FILE_SYSTEM_FEATURE_BIG_ENDIAN) != !pImage->BigEndian ||
+            pImage->OffsetBytes < 2 || pImage->OffsetBytes > 8 ||
+            pImage->SizeBytes < 2 || pImage->SizeBytes > 8 ||
+            pImage->EntrySize < 2 * pImage->OffsetBytes + pImage->SizeBytes)
+        {
+            return FS_READER_ERROR_FORMAT;
+        }
+
+        /* Anything after the image, such as padding up to the end of a FLASH
+           bank, isn't part of it. */
+        if (StoredImageSize > ImageSize ||
+            HeaderSize + (uint64_t)SectionCount * sizeof(SFileSystemSection) > StoredImageSize)
+        {
+            return FS_READER_ERROR_CORRUPT;
+        }
+        pImage->ImageSize = ImageSize = StoredImageSize;
+        pImage->HeaderSize = HeaderSize + (uint64_t)SectionCount * sizeof(SFileSystemSection);
+        pImage->pSections = p + HeaderSize;
+        pImage->SectionCount = SectionCount;
+
+        for (i = 0 ; i < SectionCount ; i++)
+        {
+            const unsigned char* pSection = p + HeaderSize + (uint64_t)i * sizeof(SFileSystemSection);
+            uint32_t             Type = (uint32_t)FsReaderLoadField(pSection, 4, pImage->BigEndian);
+            uint32_t             Flags = (uint32_t)FsReaderLoadField(pSection + 4, 4, pImage->BigEndian);
+            uint64_t             Offset = FsReaderLoadField(pSection + 8, 8, pImage->BigEndian);
+            uint64_t             Size = FsReaderLoadField(pSection + 16, 8, pImage->BigEndian);
+
+            if (Offset > ImageSize || Size > ImageSize - Offset)
+            {
+                return FS_READER_ERROR_CORRUPT;
+            }
+            switch (Type)
+            {
+            case FILE_SYSTEM_SECTION_ENTRIES:
+                EntriesOffset = Offset;
+                break;
+            case FILE_SYSTEM_SECTION_FILENAMES:
+                pImage->pFilenames = p + Offset;
+                pImage->FilenamesSize = Size;
+                break;
+            case FILE_SYSTEM_SECTION_NAME_PREFIXES:
+                if (Flags == 0 || Flags > FS_READER_MAX_NAME_PREFIX ||
+                    Size < (uint64_t)Flags * pImage->FileCount)
+                {
+                    return FS_READER_ERROR_CORRUPT;
+                }
+                pImage->pNamePrefixes = p + Offset;
+                pImage->NamePrefixLength = Flags;
+                break;
+            case FILE_SYSTEM_SECTION_NAME_FILTER:
+                if (Flags == 0 || Flags > 6 || Size < 4 || Size / 4 > UINT32_MAX)
+                {
+                    return FS_READER_ERROR_CORRUPT;
+                }
+                pImage->pNameFilter = p + Offset;
+                pImage->NameFilterWordCount = (uint32_t)(Size / 4);
+                pImage->NameFilterHashCount = Flags;
+                break;
+            }
+        }
+
+        /* The filename table must end with a terminator so that no compare
+           can run past it. */
+        if (EntriesOffset == 0 || pImage->FilenamesSize == 0 || 
+            (!(pImage->FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES) &&
+             pImage->pFilenames[pImage->FilenamesSize - 1] != '\0'))
+        {
+            return FS_READER_ERROR_CORRUPT;
+        }
+    }
+    else
+    {
+        return FS_READER_ERROR_FORMAT;
+    }
+
+    if (EntriesOffset > ImageSize ||
+        (uint64_t)pImage->FileCount * pImage->EntrySize > ImageSize - EntriesOffset)
+    {
+        return FS_READER_ERROR_CORRUPT;
+    }
+    pImage->pEntries = p + EntriesOffset;
+
+    return 0;
+}
+
+
+/* Checks that the reader understands all of the features of a parsed image
+   and that every entry lies within it.
+
+   Returns:
+    0 on success and one of the FS_READER_ERROR_* codes otherwise */
+static int _CheckImage(const SFsReaderImage* pImage)
+{
+    if (pImage->FeatureFlags & ~FS_READER_KNOWN_FEATURES)
+    {
+        return FS_READER_ERROR_UNSUPPORTED;
+    }
+
+    return FsReaderCheckEntries(pImage);
+}
+
+
+int FsReaderCheckEntries(const SFsReaderImage* pImage)
+{
+    const unsigned char*    p = pImage->pImage;
+    uint64_t                ImageSize = pImage->ImageSize;
+    uint64_t                FilenamesOffset = pImage->pFilenames ? (uint64_t)(pImage->pFilenames - p) : 0;
+    uint32_t                i;
+
+    for (i = 0 ; i < pImage->FileCount ; i++)
+    {
+        const unsigned char* pEntry = pImage->pEntries + (uint64_t)i * pImage->EntrySize;
+        uint64_t             FilenameOffset = FsReaderLoadField(pEntry, pImage->OffsetBytes, pImage->BigEndian);
+        uint64_t             DataOffset = FsReaderLoadField(pEntry + pImage->OffsetBytes, pImage->OffsetBytes, pImage->BigEndian);
+        uint64_t             DataSize = FsReaderLoadField(pEntry + 2 * pImage->OffsetBytes, pImage->SizeBytes, pImage->BigEndian);
+        int                  ValidName;
+
+        if (pImage->pFilenames)
+        {
+            ValidName = FilenameOffset >= FilenamesOffset && 
+                        FilenameOffset < FilenamesOffset + pImage->FilenamesSize;
+        }
+        else
+        {
+            ValidName = FilenameOffset < ImageSize &&
+                        memchr(p + FilenameOffset, '\0', (size_t)(ImageSize - FilenameOffset));
+        }
+        if (!ValidName || DataOffset > ImageSize || DataSize > ImageSize - DataOffset)
+        {
+            return FS_READER_ERROR_CORRUPT;
+        }
+    }
+
+    return 0;
+}
+
+
+int FsReaderOpenImageMemory(SFsReaderImage* pImage, const void* pData, uint64_t Size)
+{
+    int Result;
+
+    memset(pImage, 0, sizeof(*pImage));
+    pImage->pImage = pData;
+    pImage->ImageSize = Size;
+    Result = _ParseHeader(pImage);
+    if (Result)
+    {
+        return Result;
+    }
+
+    return _CheckImage(pImage);
+}
+
+
+/* Maps an image file and parses it, checking its entries unless Unchecked
+   is non-zero.
+
+   Returns:
+    0 on success and one of the FS_READER_ERROR_* codes otherwise */
+static int _MapImage(SFsReaderImage* pImage, const char* pFilename, int Unchecked)
+{
+    struct stat     Stat;
+    void*           pMapping;
+    int             File;
+    int             Result;
+
+    memset(pImage, 0, sizeof(*pImage));
+    File = open(pFilename, O_RDONLY);
+    if (File < 0)
+    {
+        return FS_READER_ERROR_IO;
+    }
+    if (fstat(File, &Stat))
+    {
+        close(File);
+        return FS_READER_ERROR_IO;
+    }
+    if (Stat.st_size == 0)
+    {
+        close(File);
+        return FS_READER_ERROR_FORMAT;
+    }
+    pMapping = mmap(NULL, (size_t)Stat.st_size, PROT_READ, MAP_SHARED, File, 0);
+    close(File);
+    if (pMapping == MAP_FAILED)
+    {
+        return FS_READER_ERROR_IO;
+    }
+
+    pImage->pImage = pMapping;
+    pImage->ImageSize = (uint64_t)Stat.st_size;
+    Result = _ParseHeader(pImage);
+    if (!Result && !Unchecked)
+    {
+        Result = _CheckImage(pImage);
+    }
+    if (Result)
+    {
+        munmap(pMapping, (size_t)Stat.st_size);
+        memset(pImage, 0, sizeof(*pImage));
+        return Result;
+    }
+    pImage->pMapping = pMapping;
+    pImage->MappingSize = (uint64_t)Stat.st_size;
+
+    /* Lookups touch a few scattered pages so don't read ahead, unlike tools
+       which walk the whole entry table. */
+    if (!Unchecked)
+    {
+        madvise(pMapping, (size_t)Stat.st_size, MADV_RANDOM);
+    }
+
+    return 0;
+}
+
+
+int FsReaderOpenImage(SFsReaderImage* pImage, const char* pFilename)
+{
+    return _MapImage(pImage, pFilename, 0);
+}
+
+
+int FsReaderOpenImageUnchecked(SFsReaderImage* pImage, const char* pFilename)
+{
+    return _MapImage(pImage, pFilename, 1);
+}
+
+
+void FsReaderCloseImage(SFsReaderImage* pImage)
+{
+    if (pImage->pMapping)
+    {
+        munmap(pImage->pMapping, (size_t)pImage->MappingSize);
+    }
+    memset(pImage, 0, sizeof(*pImage));
+}
+
+
+int FsReaderGetSection(const SFsReaderImage* pImage, uint32_t Index, SFsReaderSection* pSection)
+{
+    const unsigned char* pEntry;
+
+    if (Index >= pImage->SectionCount)
+    {
+        return FS_READER_ERROR_INVALID;
+    }
+    pEntry = pImage->pSections + (uint64_t)Index * sizeof(SFileSystemSection);
+    pSection->Type = (uint32_t)FsReaderLoadField(pEntry, 4, pImage->BigEndian);
+    pSection->Flags = (uint32_t)FsReaderLoadField(pEntry + 4, 4, pImage->BigEndian);
+    pSection->Offset = FsReaderLoadField(pEntry + 8, 8, pImage->BigEndian);
+    pSection->Size = FsReaderLoadField(pEntry + 16, 8, pImage->BigEndian);
+
+    return 0;
+}
+
+
+int FsReaderLookup(const SFsReaderImage* pImage, const char* pFilename, uint32_t* pIndex)
+{
+    unsigned char   Key[FS_READER_MAX_NAME_PREFIX];
+    size_t          KeyLength = 0;
+    uint32_t        Low = 0;
+    uint32_t        High = pImage->FileCount;
+
+    if (pImage->pNameFilter && 
+        !FsReaderTestNameFilter(pImage->pNameFilter, pImage->NameFilterWordCount, pImage->NameFilterHashCount,
+                                pImage->BigEndian, pFilename))
+    {
+        return FS_READER_ERROR_NOT_FOUND;
+    }
+
+    /* Pad the key to the prefix length so that it can be compared against
+       the prefix sidecar with memcmp() like the device does. */
+    if (pImage->pNamePrefixes)
+    {
+        KeyLength = strlen(pFilename);
+        memset(Key, 0, sizeof(Key));
+        memcpy(Key, pFilename, KeyLength < pImage->NamePrefixLength ? KeyLength : pImage->NamePrefixLength);
+    }
+
+    while (Low < High)
+    {
+        uint32_t    Mid = Low + (High - Low) / 2;
+        int         Compare;
+
+        if (pImage->pNamePrefixes)
+        {
+            Compare = memcmp(Key, pImage->pNamePrefixes + (uint64_t)Mid * pImage->NamePrefixLength,
+                             pImage->NamePrefixLength);
+            if (Compare == 0 && KeyLength >= pImage->NamePrefixLength)
+            {
+                Compare = strcmp(pFilename, _GetFilename(pImage, Mid));
+            }
+        }
+        else
+        {
+            Compare = strcmp(pFilename, _GetFilename(pImage, Mid));
+        }
+        if (Compare == 0)
+        {
+            *pIndex = Mid;
+            return 0;
+        }
+        if (Compare < 0)
+        {
+            High = Mid;
+        }
+        else
+        {
+            Low = Mid + 1;
+        }
+    }
+
+    return FS_READER_ERROR_NOT_FOUND;
+}
+
+
+int FsReaderStatIndex(const SFsReaderImage* pImage, uint32_t Index, SFsReaderStat* pStat)
+{
+    const unsigned char* pEntry;
+
+    if (Index >= pImage->FileCount)
+    {
+        return FS_READER_ERROR_INVALID;
+    }
+    pEntry = pImage->pEntries + (uint64_t)Index * pImage->EntrySize;
+    pStat->Index = Index;
+    pStat->pFilename = (const char*)pImage->pImage + FsReaderLoadField(pEntry, pImage->OffsetBytes, pImage->BigEndian);
+    pStat->Offset = FsReaderLoadField(pEntry + pImage->OffsetBytes, pImage->OffsetBytes, pImage->BigEndian);
+    pStat->Size = FsReaderLoadField(pEntry + 2 * pImage->OffsetBytes, pImage->SizeBytes, pImage->BigEndian);
+    pStat->pData = pImage->pImage + pStat->Offset;
+
+    return 0;
+}
+
+
+int FsReaderStat(const SFsReaderImage* pImage, const char* pFilename, SFsReaderStat* pStat)
+{
+    uint32_t    Index;
+    int         Result;
+
+    Result = FsReaderLookup(pImage, pFilename, &Index);
+    if (Result)
+    {
+        return Result;
+    }
+
+    return FsReaderStatIndex(pImage, Index, pStat);
+}
+
+
+int FsReaderOpen(const SFsReaderImage* pImage, const char* pFilename, SFsReaderFile* pFile)
+{
+    SFsReaderStat   Stat;
+    int             Result;
+
+    Result = FsReaderStat(pImage, pFilename, &Stat);
+    if (Result)
+    {
+        return Result;
+    }
+    pFile->pData = Stat.pData;
+    pFile->Size = Stat.Size;
+    pFile->Position = 0;
+
+    return 0;
+}
+
+
+size_t FsReaderRead(SFsReaderFile* pFile, void* pBuffer, size_t Size)
+{
+    uint64_t BytesLeft = pFile->Size - pFile->Position;
+
+    if (Size > BytesLeft)
+    {
+        Size = (size_t)BytesLeft;
+    }
+    memcpy(pBuffer, pFile->pData + pFile->Position, Size);
+    pFile->Position += Size;
+
+    return Size;
+}
+
+
+int FsReaderSeek(SFsReaderFile* pFile, int64_t Offset, int Whence)
+{
+    int64_t Base;
+
+    switch (Whence)
+    {
+    case SEEK_SET:
+        Base = 0;
+        break;
+    case SEEK_CUR:
+        Base = (int64_t)pFile->Position;
+        break;
+    case SEEK_END:
+        Base = (int64_t)pFile->Size;
+        break;
+    default:
+        return FS_READER_ERROR_INVALID;
+    }
+    if ((Offset < 0 && -Offset > Base) ||
+        (Offset > 0 && (uint64_t)Offset > pFile->Size - (uint64_t)Base))
+    {
+        return FS_READER_ERROR_INVALID;
+    }
+    pFile->Position = (uint64_t)(Base + Offset);
+
+    return 0;
+}
+
+
+const void* FsReaderPeek(const SFsReaderFile* pFile, uint64_t* pSize)
+{
+    *pSize = pFile->Size - pFile->Position;
+
+    return pFile->pData + pFile->Position;
+}
+
+
+int FsReaderOpenDir(const SFsReaderImage* pImage, const char* pPath, SFsReaderDir* pDir)
+{
+    size_t Length;
+
+    while (*pPath == '/')
+    {
+        pPath++;
+    }
+    Length = strlen(pPath);
+    while (Length > 0 && pPath[Length - 1] == '/')
+    {
+        Length--;
+    }
+    if (Length + 2 > sizeof(pDir->Path))
+    {
+        return FS_READER_ERROR_INVALID;
+    }
+
+    /* The files of a directory are the contiguous run of entries which
+       start with its path and a '/'. */
+    pDir->pImage = pImage;
+    memcpy(pDir->Path, pPath, Length);
+    if (Length > 0)
+    {
+        pDir->Path[Length++] = '/';
+    }
+    pDir->Path[Length] = '\0';
+    pDir->PathLength = Length;
+    pDir->Index = _FindLowerBound(pImage, 0, pImage->FileCount, pDir->Path);
+    pDir->End = _FindPrefixEnd(pImage, pDir->Index, pImage->FileCount, pDir->Path, Length);
+    if (pDir->Index == pDir->End && Length > 0)
+    {
+        return FS_READER_ERROR_NOT_FOUND;
+    }
+
+    return 0;
+}
+
+
+int FsReaderReadDir(SFsReaderDir* pDir, SFsReaderDirEntry* pEntry)
+{
+    const char* pSlash;
+
+    if (pDir->Index >= pDir->End)
+    {
+        return FS_READER_ERROR_NOT_FOUND;
+    }
+    FsReaderStatIndex(pDir->pImage, pDir->Index, &pEntry->Stat);
+    pEntry->pName = pEntry->Stat.pFilename + pDir->PathLength;
+    pSlash = strchr(pEntry->pName, '/');
+    if (!pSlash)
+    {
+        pEntry->NameLength = strlen(pEntry->pName);
+        pEntry->IsDirectory = 0;
+        pDir->Index++;
+        return 0;
+    }
+
+    /* Skip over everything within the subdirectory. */
+    pEntry->NameLength = pSlash - pEntry->pName;
+    pEntry->IsDirectory = 1;
+    pDir->Index = _FindPrefixEnd(pDir->pImage, pDir->Index + 1, pDir->End,
+                                 pEntry->Stat.pFilename, pSlash + 1 - pEntry->Stat.pFilename);
+
+    return 0;
+}
+
+
+const char* FsReaderErrorString(int Error)
+{
+    switch (Error)
+    {
+    case 0:
+        return "Success";
+    case FS_READER_ERROR_IO:
+        return "Failed to open or map the image";
+    case FS_READER_ERROR_FORMAT:
+        return "Not a file system image";
+    case FS_READER_ERROR_UNSUPPORTED:
+        return "Image uses features which can't be read on the host";
+    case FS_READER_ERROR_CORRUPT:
+        return "Image has tables or entries outside of it";
+    case FS_READER_ERROR_NOT_FOUND:
+        return "No such file or directory";
+    case FS_READER_ERROR_INVALID:
+        return "Invalid argument";
+    default:
+        return "Unknown error";
+    }
+}
@@ -0,0 +1,237 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host side reader for file system images built by fsbld (libfsbld-reader).
+   An image is mapped into memory and files are found with the same binary
+   search over the sorted entry table that the FlashFileSystem runtime uses
+   on the device, so images can be examined and debugged without flashing a
+   board.  The data and filename pointers returned point straight into the
+   mapping and are valid until the image is closed.
+
+   Legacy images and v2 images, in either byte order and with any entry
+   encoding, are supported.  Images whose data is spread across FLASH
+   regions or encrypted are refused since their file data can't be read
+   from the image alone.
+*/
+#ifndef _FSREADER_H_
+#define _FSREADER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Error codes returned by the FsReader*() functions.  0 is success. */
+/* The image couldn't be opened or mapped.  errno holds the reason. */
+#define FS_READER_ERROR_IO          1
+/* The image doesn't start with a valid legacy or v2 header. */
+#define FS_READER_ERROR_FORMAT      2
+/* The image uses FILE_SYSTEM_FEATURE_* bits which this reader can't read. */
+#define FS_READER_ERROR_UNSUPPORTED 3
+/* An entry or table of the image lies outside of it. */
+#define FS_READER_ERROR_CORRUPT     4
+/* The requested file or directory isn't in the image. */
+#define FS_READER_ERROR_NOT_FOUND   5
+/* An invalid argument, such as a seek before the start of a file. */
+#define FS_READER_ERROR_INVALID     6
+
+/* Longest path accepted by FsReaderOpenDir(). */
+#define FS_READER_MAX_PATH          1024
+
+
+/* An image opened with FsReaderOpenImage() or FsReaderOpenImageMemory().
+   The fields are filled in from the validated header and shouldn't be
+   modified. */
+typedef struct _SFsReaderImage
+{
+    /* Start and size of the image in memory. */
+    const unsigned char*    pImage;
+    uint64_t                ImageSize;
+    /* Sorted entry table and the layout of each entry in it. */
+    const unsigned char*    pEntries;
+    uint32_t                FileCount;
+    unsigned int            EntrySize;
+    unsigned int            OffsetBytes;
+    unsigned int            SizeBytes;
+    /* 1 for a legacy image or FILE_SYSTEM_FORMAT_VERSION, the
+       FILE_SYSTEM_FEATURE_* bits of a v2 image and its byte order. */
+    unsigned int            FormatVersion;
+    uint32_t                FeatureFlags;
+    int                     BigEndian;
+    /* Size of the header, including any extensions and the section table,
+       which is the start of the first table. */
+    uint64_t                HeaderSize;
+    /* Section table of a v2 image. */
+    const unsigned char*    pSections;
+    uint32_t                SectionCount;
+    /* Filename table of a v2 image.  A legacy image has no table, its
+       filenames lie between the entries and the file data. */
+    const unsigned char*    pFilenames;
+    uint64_t                FilenamesSize;
+    /* Optional FILE_SYSTEM_SECTION_NAME_PREFIXES sidecar and the length of
+       each prefix. */
+    const unsigned char*    pNamePrefixes;
+    unsigned int            NamePrefixLength;
+    /* Optional FILE_SYSTEM_SECTION_NAME_FILTER words, the number of them and
+       the number of bits set per filename. */
+    const unsigned char*    pNameFilter;
+    uint32_t                NameFilterWordCount;
+    unsigned int            NameFilterHashCount;
+    /* Mapping made by FsReaderOpenImage() and its size, or NULL if the
+       image is in memory owned by the caller. */
+    void*                   pMapping;
+    uint64_t                MappingSize;
+} SFsReaderImage;
+
+/* Description of a file returned by FsReaderStat(). */
+typedef struct _SFsReaderStat
+{
+    /* Index of the file's entry in the sorted entry table. */
+    uint32_t                Index;
+    /* NULL terminated filename within the image's filename table. */
+    const char*             pFilename;
+    /* File data within the image and its size. */
+    const unsigned char*    pData;
+    uint64_t                Size;
+    /* Offset of the data from the start of the image. */
+    uint64_t                Offset;
+} SFsReaderStat;
+
+/* Section of a v2 image returned by FsReaderGetSection(). */
+typedef struct _SFsReaderSection
+{
+    /* One of the FILE_SYSTEM_SECTION_* values and its flags. */
+    uint32_t                Type;
+    uint32_t                Flags;
+    uint64_t                Offset;
+    uint64_t                Size;
+} SFsReaderSection;
+
+/* File opened with FsReaderOpen(). */
+typedef struct _SFsReaderFile
+{
+    const unsigned char*    pData;
+    uint64_t                Size;
+    uint64_t                Position;
+} SFsReaderFile;
+
+/* Directory opened with FsReaderOpenDir().  Directories aren't stored in an
+   image, they are implied by the '/' separated filenames. */
+typedef struct _SFsReaderDir
+{
+    const SFsReaderImage*   pImage;
+    /* Range of entries, [Index, End), whose filenames start with Path. */
+    uint32_t                Index;
+    uint32_t                End;
+    size_t                  PathLength;
+    char                    Path[FS_READER_MAX_PATH];
+} SFsReaderDir;
+
+/* Item returned by FsReaderReadDir(). */
+typedef struct _SFsReaderDirEntry
+{
+    /* Name of the file or subdirectory within the directory.  It points
+       into the image's filename table and is NameLength bytes long.  It is
+       only NULL terminated for files. */
+    const char*             pName;
+    size_t                  NameLength;
+    /* Non-zero for a subdirectory, in which case Stat describes its first
+       file. */
+    int                     IsDirectory;
+    SFsReaderStat           Stat;
+} SFsReaderDirEntry;
+
+
+/* Maps the image file pFilename and validates its header and entries. */
+int         FsReaderOpenImage(SFsReaderImage* pImage, const char* pFilename);
+/* Validates an image which is already in memory, such as one embedded in a
+   program with the .h file created by fsbld. */
+int         FsReaderOpenImageMemory(SFsReaderImage* pImage, const void* pData, uint64_t Size);
+/* Maps an image and reads its header and section table like
+   FsReaderOpenImage() but neither checks the entries nor refuses
+   FILE_SYSTEM_FEATURE_* bits it can't read.  It is meant for tools, such as
+   fsbld --inspect, which check and report on every entry themselves.  Don't
+   look up files in an image opened this way. */
+int         FsReaderOpenImageUnchecked(SFsReaderImage* pImage, const char* pFilename);
+/* Checks that every entry of an image opened with
+   FsReaderOpenImageUnchecked() lies within it, as FsReaderOpenImage() does,
+   but without refusing its FILE_SYSTEM_FEATURE_* bits.  Files can then be
+   looked up in it.  Tools which can handle encrypted file data use this,
+   but it can't check images with encrypted tables or split into regions. */
+int         FsReaderCheckEntries(const SFsReaderImage* pImage);
+/* Unmaps an image opened with FsReaderOpenImage().  Pointers into the image
+   are no longer valid afterwards. */
+void        FsReaderCloseImage(SFsReaderImage* pImage);
+
+/* Decodes entry Index of the section table of a v2 image. */
+int         FsReaderGetSection(const SFsReaderImage* pImage, uint32_t Index, SFsReaderSection* pSection);
+
+/* Finds pFilename, which must match a stored filename exactly, with a binary
+   search of the entry table and sets *pIndex to its entry index. */
+int         FsReaderLookup(const SFsReaderImage* pImage, const char* pFilename, uint32_t* pIndex);
+/* Describes the file with the given entry index. */
+int         FsReaderStatIndex(const SFsReaderImage* pImage, uint32_t Index, SFsReaderStat* pStat);
+/* Looks up pFilename and describes it. */
+int         FsReaderStat(const SFsReaderImage* pImage, const char* pFilename, SFsReaderStat* pStat);
+
+/* Opens pFilename for reading from its start. */
+int         FsReaderOpen(const SFsReaderImage* pImage, const char* pFilename, SFsReaderFile* pFile);
+/* Copies up to Size bytes from the current position into pBuffer and
+   returns the number copied, which is 0 at the end of the file. */
+size_t      FsReaderRead(SFsReaderFile* pFile, void* pBuffer, size_t Size);
+/* Moves the current position like lseek(), with SEEK_SET, SEEK_CUR or
+   SEEK_END.  The position may not be moved past the end of the file. */
+int         FsReaderSeek(SFsReaderFile* pFile, int64_t Offset, int Whence);
+/* Returns a pointer to the data at the current position and sets *pSize to
+   the number of bytes left, without copying. */
+const void* FsReaderPeek(const SFsReaderFile* pFile, uint64_t* pSize);
+
+/* Opens a directory, given without a trailing '/', for listing.  "" and "/"
+   are the root. */
+int         FsReaderOpenDir(const SFsReaderImage* pImage, const char* pPath, SFsReaderDir* pDir);
+/* Fills in the next file or subdirectory, in sorted order.  Returns
+   FS_READER_ERROR_NOT_FOUND once there are no more. */
+int         FsReaderReadDir(SFsReaderDir* pDir, SFsReaderDirEntry* pEntry);
+
+/* Returns a description of one of the FS_READER_ERROR_* codes. */
+const char* FsReaderErrorString(int Error);
+
+/* Helpers for the encoding of images, shared with fsbld so that it builds
+   images with exactly the code that reads them back. */
+/* Reads an unsigned field of Bytes bytes stored in the given byte order. */
+uint64_t    FsReaderLoadField(const unsigned char* pSrc, unsigned int Bytes, int BigEndian);
+/* Updates a 64-bit FNV-1a hash, as used for content hashes and deltas, with
+   the next Size bytes at pData. */
+uint64_t    FsReaderHashContents(uint64_t Hash, const unsigned char* pData, size_t Size);
+/* Hashes a filename with 32-bit FNV-1a as described for
+   FILE_SYSTEM_SECTION_NAME_FILTER. */
+uint32_t    FsReaderHashFilename(const char* pFilename);
+/* Returns the bits within a filter word to be set for a filename hash. */
+uint32_t    FsReaderGetFilterBits(uint32_t Hash, unsigned int HashCount);
+/* Tests a filename against the WordCount filter words at pFilter, stored in
+   the given byte order.  Returns 0 if the filename definitely isn't in the
+   image and non-zero if it might be. */
+int         FsReaderTestNameFilter(const unsigned char* pFilter,
+                                   uint32_t             WordCount,
+                                   unsigned int         HashCount,
+                                   int                  BigEndian,
+                                   const char*          pFilename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FSREADER_H_ */
@@ -0,0 +1,309 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* SHA-256 used by fsbld --merkle and --extract --compare.  See sha256.h for
+   a description of the API.
+*/
+#include <string.h>
+#include "sha256.h"
+
+/* On x86 the SHA-NI code is compiled with a target attribute and chosen at
+   run time with __builtin_cpu_supports(), so fsbld needs no special flags to
+   use the instructions. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_SHA_NI   1
+#include <immintrin.h>
+#endif
+
+
+static const uint32_t g_Sha256K[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+
+#if defined(SHA256_SHA_NI)
+/* Runs the SHA-256 compression function over whole 64 byte blocks with the
+   SHA-NI instructions.
+
+   Parameters:
+    pState is the hash state to be updated.
+    pData points to the blocks.
+    BlockCount is the number of blocks.
+
+   Returns:
+    Nothing.
+*/
+__attribute__((target("sha,sse4.1")))
+static void _Sha256BlocksShaNi(uint32_t* pState, const unsigned char* pData, size_t BlockCount)
+{
+    const __m128i   ByteSwap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    __m128i         State0;
+    __m128i         State1;
+    __m128i         Temp;
+
+    /* The instructions want the state as ABEF and CDGH. */
+    Temp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&pState[0]), 0xB1);
+    State1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&pState[4]), 0x1B);
+    State0 = _mm_alignr_epi8(Temp, State1, 8);
+    State1 = _mm_blend_epi16(State1, Temp, 0xF0);
+    /* The 16 groups of 4 rounds are written out so that the message words
+       stay in registers, each group scheduling the words of a later one. */
+#define SHA256_LOAD(Words, Index) \
+    Words = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 16 * (Index))), ByteSwap)
+#define SHA256_SCHEDULE(Words0, Words1, Words2, Words3) \
+    Words0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(Words0, Words1), \
+                                                _mm_alignr_epi8(Words3, Words2, 4)), \
+                                  Words3)
+#define SHA256_ROUNDS(Words, Index) \
+    Message = _mm_add_epi32(Words, _mm_loadu_si128((const __m128i*)&g_Sha256K[4 * (Index)])); \
+    State1 = _mm_sha256rnds2_epu32(State1, State0, Message); \
+    State0 = _mm_sha256rnds2_epu32(State0, State1, _mm_shuffle_epi32(Message, 0x0E))
+    for ( ; BlockCount > 0 ; BlockCount--, pData += 64)
+    {
+        __m128i Saved0 = State0;
+        __m128i Saved1 = State1;
+        __m128i Words0;
+        __m128i Words1;
+        __m128i Words2;
+        __m128i Words3;
+        __m128i Message;
+
+        SHA256_LOAD(Words0, 0);
+        SHA256_ROUNDS(Words0, 0);
+        SHA256_LOAD(Words1, 1);
+        SHA256_ROUNDS(Words1, 1);
+        SHA256_LOAD(Words2, 2);
+        SHA256_ROUNDS(Words2, 2);
+        SHA256_LOAD(Words3, 3);
+        SHA256_ROUNDS(Words3, 3);
+        SHA256_SCHEDULE(Words0, Words1, Words2, Words3);
+        SHA256_ROUNDS(Words0, 4);
+        SHA256_SCHEDULE(Words1, Words2, Words3, Words0);
+        SHA256_ROUNDS(Words1, 5);
+        SHA256_SCHEDULE(Words2, Words3, Words0, Words1);
+        SHA256_ROUNDS(Words2, 6);
+        SHA256_SCHEDULE(Words3, Words0, Words1, Words2);
+        SHA256_ROUNDS(Words3, 7);
+        SHA256_SCHEDULE(Words0, Words1, Words2, Words3);
+        SHA256_ROUNDS(Words0, 8);
+        SHA256_SCHEDULE(Words1, Words2, Words3, Words0);
+        SHA256_ROUNDS(Words1, 9);
+        SHA256_SCHEDULE(Words2, Words3, Words0, Words1);
+        SHA256_ROUNDS(Words2, 10);
+        SHA256_SCHEDULE(Words3, Words0, Words1, Words2);
+        SHA256_ROUNDS(Words3, 11);
+        SHA256_SCHEDULE(Words0, Words1, Words2, Words3);
+        SHA256_ROUNDS(Words0, 12);
+        SHA256_SCHEDULE(Words1, Words2, Words3, Words0);
+        SHA256_ROUNDS(Words1, 13);
+        SHA256_SCHEDULE(Words2, Words3, Words0, Words1);
+        SHA256_ROUNDS(Words2, 14);
+        SHA256_SCHEDULE(Words3, Words0, Words1, Words2);
+        SHA256_ROUNDS(Words3, 15);
+        State0 = _mm_add_epi32(State0, Saved0);
+        State1 = _mm_add_epi32(State1, Saved1);
+    }
+#undef SHA256_LOAD
+#undef SHA256_SCHEDULE
+#undef SHA256_ROUNDS
+    Temp = _mm_shuffle_epi32(State0, 0x1B);
+    State1 = _mm_shuffle_epi32(State1, 0xB1);
+    _mm_storeu_si128((__m128i*)&pState[0], _mm_blend_epi16(Temp, State1, 0xF0));
+    _mm_storeu_si128((__m128i*)&pState[4], _mm_alignr_epi8(State1, Temp, 8));
+}
+
+static int _HasShaNi(void)
+{
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+
+/* Runs the SHA-256 compression function over whole 64 byte blocks in
+   portable code.
+
+   Parameters:
+    pState is the hash state to be updated.
+    pData points to the blocks.
+    BlockCount is the number of blocks.
+
+   Returns:
+    Nothing.
+*/
+static void _Sha256BlocksPortable(uint32_t* pState, const unsigned char* pData, size_t BlockCount)
+{
+#define SHA256_ROTATE(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+    for ( ; BlockCount > 0 ; BlockCount--, pData += 64)
+    {
+        uint32_t        W[64];
+        uint32_t        A = pState[0];
+        uint32_t        B = pState[1];
+        uint32_t        C = pState[2];
+        uint32_t        D = pState[3];
+        uint32_t        E = pState[4];
+        uint32_t        F = pState[5];
+        uint32_t        G = pState[6];
+        uint32_t        H = pState[7];
+        unsigned int    i;
+
+        for (i = 0 ; i < 16 ; i++)
+        {
+            W[i] = (uint32_t)pData[4 * i] << 24 | (uint32_t)pData[4 * i + 1] << 16 |
+                   (uint32_t)pData[4 * i + 2] << 8 | pData[4 * i + 3];
+        }
+        for ( ; i < 64 ; i++)
+        {
+            uint32_t S0 = SHA256_ROTATE(W[i - 15], 7) ^ SHA256_ROTATE(W[i - 15], 18) ^ (W[i - 15] >> 3);
+            uint32_t S1 = SHA256_ROTATE(W[i - 2], 17) ^ SHA256_ROTATE(W[i - 2], 19) ^ (W[i - 2] >> 10);
+
+            W[i] = W[i - 16] + S0 + W[i - 7] + S1;
+        }
+        for (i = 0 ; i < 64 ; i++)
+        {
+            uint32_t T1 = H + (SHA256_ROTATE(E, 6) ^ SHA256_ROTATE(E, 11) ^ SHA256_ROTATE(E, 25)) +
+                          ((E & F) ^ (~E & G)) + g_Sha256K[i] + W[i];
+            uint32_t T2 = (SHA256_ROTATE(A, 2) ^ SHA256_ROTATE(A, 13) ^ SHA256_ROTATE(A, 22)) +
+                          ((A & B) ^ (A & C) ^ (B & C));
+
+            H = G;
+            G = F;
+            F = E;
+            E = D + T1;
+            D = C;
+            C = B;
+            B = A;
+            A = T1 + T2;
+        }
+        pState[0] += A;
+        pState[1] += B;
+        pState[2] += C;
+        pState[3] += D;
+        pState[4] += E;
+        pState[5] += F;
+        pState[6] += G;
+        pState[7] += H;
+    }
+#undef SHA256_ROTATE
+}
+
+
+/* Runs the SHA-256 compression function over whole 64 byte blocks, with
+   the SHA-NI instructions when the processor has them.
+
+   Parameters:
+    pState is the hash state to be updated.
+    pData points to the blocks.
+    BlockCount is the number of blocks.
+
+   Returns:
+    Nothing.
+*/
+static void _Sha256Blocks(uint32_t* pState, const unsigned char* pData, size_t BlockCount)
+{
+#if defined(SHA256_SHA_NI)
+    if (_HasShaNi())
+    {
+        _Sha256BlocksShaNi(pState, pData, BlockCount);
+        return;
+    }
+#endif
+    _Sha256BlocksPortable(pState, pData, BlockCount);
+}
+
+
+void Sha256Init(SSha256* pSha)
+{
+    static const uint32_t InitialState[8] =
+    {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+
+    memcpy(pSha->State, InitialState, sizeof(pSha->State));
+    pSha->Length = 0;
+}
+
+
+void Sha256Update(SSha256* pSha, const void* pvData, size_t Size)
+{
+    const unsigned char*    pData = (const unsigned char*)pvData;
+    unsigned int            Used = (unsigned int)(pSha->Length & 63);
+
+    pSha->Length += Size;
+    if (Used)
+    {
+        size_t Fill = Size < 64 - Used ? Size : 64 - Used;
+
+        memcpy(pSha->Buffer + Used, pData, Fill);
+        pData += Fill;
+        Size -= Fill;
+        if (Used + Fill < 64)
+        {
+            return;
+        }
+        _Sha256Blocks(pSha->State, pSha->Buffer, 1);
+    }
+    if (Size >= 64)
+    {
+        _Sha256Blocks(pSha->State, pData, Size / 64);
+        pData += Size & ~(size_t)63;
+        Size &= 63;
+    }
+    memcpy(pSha->Buffer, pData, Size);
+}
+
+
+void Sha256Final(SSha256* pSha, unsigned char* pDigest)
+{
+    unsigned int    Used = (unsigned int)(pSha->Length & 63);
+    uint64_t        BitLength = pSha->Length * 8;
+    unsigned int    i;
+
+    pSha->Buffer[Used++] = 0x80;
+    if (Used > 56)
+    {
+        memset(pSha->Buffer + Used, 0, 64 - Used);
+        _Sha256Blocks(pSha->State, pSha->Buffer, 1);
+        Used = 0;
+    }
+    memset(pSha->Buffer + Used, 0, 56 - Used);
+    for (i = 0 ; i < 8 ; i++)
+    {
+        pSha->Buffer[56 + i] = (unsigned char)(BitLength >> (56 - 8 * i));
+    }
+    _Sha256Blocks(pSha->State, pSha->Buffer, 1);
+    for (i = 0 ; i < 32 ; i++)
+    {
+        pDigest[i] = (unsigned char)(pSha->State[i / 4] >> (24 - 8 * (i & 3)));
+    }
+}
+
+
+const char* Sha256Implementation(void)
+{
+#if defined(SHA256_SHA_NI)
+    if (_HasShaNi())
+    {
+        return "SHA-NI";
+    }
+#endif
+    return "portable";
+}
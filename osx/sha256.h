@@ -0,0 +1,56 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* SHA-256 (FIPS 180-4), used for the Merkle tree of fsbld --merkle and to
+   compare extracted files with their sources.  The SHA-NI instructions are
+   used when the processor has them and portable code otherwise.
+*/
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of a SHA-256 digest in bytes. */
+#define SHA256_DIGEST_SIZE  32
+
+/* Running hash, started with Sha256Init(). */
+typedef struct _SSha256
+{
+    uint32_t            State[8];
+    /* Number of bytes hashed so far. */
+    uint64_t            Length;
+    /* Bytes which don't yet fill a 64 byte block. */
+    unsigned char       Buffer[64];
+} SSha256;
+
+/* Starts a new hash. */
+void    Sha256Init(SSha256* pSha);
+/* Adds Size bytes at pvData to the hash. */
+void    Sha256Update(SSha256* pSha, const void* pvData, size_t Size);
+/* Pads the hash and writes the SHA256_DIGEST_SIZE byte digest to pDigest.
+   The hash must be started again with Sha256Init() before it is reused. */
+void    Sha256Final(SSha256* pSha, unsigned char* pDigest);
+/* Returns "SHA-NI" or "portable", whichever is used on this processor. */
+const char* Sha256Implementation(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SHA256_H_ */
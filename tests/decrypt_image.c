@@ -0,0 +1,187 @@
+/* Writes a plaintext copy of an image built by fsbld --encrypt, using the
+   key and the nonce from its SFileSystemEncryption, so that reader_test can
+   check that the files read back with the contents they were built from.
+
+   Usage: decrypt_image Image KeyFile OutputImage
+*/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ffsformat.h"
+#include "fsreader.h"
+#include "aesctr.h"
+
+
+/* Reads a 128 or 256-bit key stored as hex digits, with any whitespace
+   between them, into pKey and returns its size in bits or 0 on error. */
+static unsigned int _LoadKey(const char* pFilename, unsigned char* pKey)
+{
+    FILE*           pFile = NULL;
+    unsigned int    Digits = 0;
+    int             Char;
+
+    pFile = fopen(pFilename, "r");
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to open key file %s.\n", pFilename);
+        return 0;
+    }
+    while ((Char = fgetc(pFile)) != EOF)
+    {
+        int Value;
+
+        if (isspace(Char))
+        {
+            continue;
+        }
+        if (!isxdigit(Char) || Digits >= 64)
+        {
+            Digits = 0;
+            break;
+        }
+        Value = isdigit(Char) ? Char - '0' : tolower(Char) - 'a' + 10;
+        pKey[Digits / 2] = (unsigned char)((Digits & 1) ? (pKey[Digits / 2] << 4) | Value : Value);
+        Digits++;
+    }
+    fclose(pFile);
+    if (Digits != 32 && Digits != 64)
+    {
+        fprintf(stderr, "error: %s should hold a 128 or 256-bit key as hex digits.\n", pFilename);
+        return 0;
+    }
+
+    return Digits * 4;
+}
+
+/* Stores the low Bytes bytes of Value at pDest in the image's byte order. */
+static void _StoreField(unsigned char* pDest, uint64_t Value, unsigned int Bytes, int BigEndian)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < Bytes ; i++)
+    {
+        pDest[BigEndian ? Bytes - 1 - i : i] = (unsigned char)(Value >> (8 * i));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    SFsReaderImage          Image;
+    SFsReaderImage          Plain;
+    SFsReaderSection        Section;
+    SAesContext             Aes;
+    const unsigned char*    pEncryption;
+    unsigned char*          pCopy = NULL;
+    unsigned char           Key[32];
+    unsigned char           KeyCheck[16];
+    unsigned int            KeyBits;
+    FILE*                   pFile = NULL;
+    uint32_t                i;
+    int                     Result;
+    int                     ExitCode = 1;
+
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: decrypt_image Image KeyFile OutputImage\n");
+        return 1;
+    }
+    KeyBits = _LoadKey(argv[2], Key);
+    if (!KeyBits)
+    {
+        return 1;
+    }
+    Result = FsReaderOpenImageUnchecked(&Image, argv[1]);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", argv[1], FsReaderErrorString(Result));
+        return 1;
+    }
+    memset(&Plain, 0, sizeof(Plain));
+    if (!(Image.FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED))
+    {
+        fprintf(stderr, "error: %s isn't encrypted.\n", argv[1]);
+        goto Error;
+    }
+    /* Precompressed variants are encrypted too but reader_test has no way
+       of checking them. */
+    for (i = 0 ; i < Image.SectionCount ; i++)
+    {
+        if (0 == FsReaderGetSection(&Image, i, &Section) && Section.Type == FILE_SYSTEM_SECTION_VARIANTS)
+        {
+            fprintf(stderr, "error: %s has precompressed variants.\n", argv[1]);
+            goto Error;
+        }
+    }
+
+    /* SFileSystemEncryption follows the header and any SFileSystemDigest.
+       Its KeyCheck catches being given the wrong key. */
+    pEncryption = Image.pImage + sizeof(SFileSystemHeaderV2) +
+                  ((Image.FeatureFlags & FILE_SYSTEM_FEATURE_MERKLE) ? sizeof(SFileSystemDigest) : 0);
+    if (FsReaderLoadField(pEncryption, 4, Image.BigEndian) != KeyBits)
+    {
+        fprintf(stderr, "error: %s was encrypted with a %u-bit key, not a %u-bit one.\n", argv[1],
+                (unsigned int)FsReaderLoadField(pEncryption, 4, Image.BigEndian), KeyBits);
+        goto Error;
+    }
+    AesExpandKey(&Aes, Key, KeyBits);
+    memcpy(Aes.Nonce, pEncryption + 8, sizeof(Aes.Nonce));
+    memset(KeyCheck, 0, sizeof(KeyCheck));
+    AesEncryptBlocks(&Aes, KeyCheck, 1);
+    if (memcmp(KeyCheck, pEncryption + 16, 8))
+    {
+        fprintf(stderr, "error: %s was encrypted with a different key.\n", argv[1]);
+        goto Error;
+    }
+
+    pCopy = malloc((size_t)Image.ImageSize);
+    if (!pCopy)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes.\n", (unsigned long long)Image.ImageSize);
+        goto Error;
+    }
+    memcpy(pCopy, Image.pImage, (size_t)Image.ImageSize);
+    if (Image.FeatureFlags & FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES)
+    {
+        AesCtrXor(&Aes, FILE_SYSTEM_ENCRYPTION_ENTRIES_INDEX, 0, pCopy + (Image.pEntries - Image.pImage),
+                  (size_t)Image.FileCount * Image.EntrySize);
+        AesCtrXor(&Aes, FILE_SYSTEM_ENCRYPTION_FILENAMES_INDEX, 0, pCopy + (Image.pFilenames - Image.pImage),
+                  (size_t)Image.FilenamesSize);
+    }
+    /* With the encryption flags cleared the copy is an ordinary image whose
+       entries can be checked and looked up before its data is decrypted. */
+    _StoreField(pCopy + 12,
+                Image.FeatureFlags & ~(FILE_SYSTEM_FEATURE_ENCRYPTED | FILE_SYSTEM_FEATURE_ENCRYPTED_TABLES),
+                4, Image.BigEndian);
+    Result = FsReaderOpenImageMemory(&Plain, pCopy, Image.ImageSize);
+    if (Result)
+    {
+        fprintf(stderr, "error: Decrypted %s is invalid: %s.\n", argv[1], FsReaderErrorString(Result));
+        goto Error;
+    }
+    for (i = 0 ; i < Plain.FileCount ; i++)
+    {
+        SFsReaderStat Stat;
+
+        FsReaderStatIndex(&Plain, i, &Stat);
+        AesCtrXor(&Aes, i, 0, pCopy + Stat.Offset, (size_t)Stat.Size);
+    }
+
+    pFile = fopen(argv[3], "wb");
+    if (!pFile || Image.ImageSize != fwrite(pCopy, 1, (size_t)Image.ImageSize, pFile))
+    {
+        fprintf(stderr, "error: Failed to write %s.\n", argv[3]);
+        goto Error;
+    }
+    ExitCode = 0;
+
+Error:
+    if (pFile)
+    {
+        fclose(pFile);
+    }
+    FsReaderCloseImage(&Plain);
+    free(pCopy);
+    FsReaderCloseImage(&Image);
+    return ExitCode;
+}
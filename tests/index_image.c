@@ -0,0 +1,7 @@
+/* Defines roFlashDrive by compiling the .h file generated by fsbld in a C
+   translation unit, the way firmware written in C links the image.
+
+   FSBLD_IMAGE_HEADER names the .h to compile.
+*/
+#include <stdint.h>
+#include FSBLD_IMAGE_HEADER
@@ -0,0 +1,8 @@
+/* Defines roFlashDrive by compiling the .h file generated by fsbld in a C++
+   translation unit.  The .h gives the definition C linkage so that it is the
+   same roFlashDrive which the index header declares.
+
+   FSBLD_IMAGE_HEADER names the .h to compile.
+*/
+#include <cstdint>
+#include FSBLD_IMAGE_HEADER
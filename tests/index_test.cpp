@@ -0,0 +1,72 @@
+/* Checks that the C++20 index header generated by fsbld for the files in
+   tests/fixture resolves files at compile time to the same place as the
+   entry table of the roFlashDrive image it was generated with.
+
+   FSBLD_INDEX_HEADER names the .hpp to test so that the same checks can be
+   compiled against images of each layout.  The image itself is linked in
+   from index_image.c or index_image.cpp and index_test_unit.cpp includes the
+   index header in a second translation unit.
+*/
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include FSBLD_INDEX_HEADER
+
+
+/* The sizes of the fixture files. */
+static_assert(fsbld::entry<"docs/readme.txt">().FileBinarySize == 12);
+static_assert(fsbld::entry<"www/app.js">().FileBinarySize == 9);
+static_assert(fsbld::entry<"www/index.html">().FileBinarySize == 16);
+static_assert(fsbld::entry<"www/style.css">().FileBinarySize == 7);
+
+/* Without an access profile or alignment the data is packed in the sorted
+   order of the filenames. */
+static_assert(fsbld::g_FileIndex.size() == 4);
+static_assert(fsbld::entry<"www/app.js">().FileBinaryOffset ==
+              fsbld::entry<"docs/readme.txt">().FileBinaryOffset + 12);
+static_assert(fsbld::entry<"www/index.html">().FileBinaryOffset ==
+              fsbld::entry<"www/app.js">().FileBinaryOffset + 9);
+static_assert(fsbld::entry<"www/style.css">().FileBinaryOffset ==
+              fsbld::entry<"www/index.html">().FileBinaryOffset + 16);
+static_assert(fsbld::entry<"www/style.css">().FileBinaryOffset + 7 <= fsbld::g_ImageSize);
+
+
+/* Implemented in index_test_unit.cpp. */
+const std::uint8_t* SecondUnitFile(void);
+
+
+/* Checks that file<>() points at the expected contents. */
+static int _CheckContents(const char* pFilename, const fsbld::SFile& File, const char* pExpected)
+{
+    size_t ExpectedSize = strlen(pExpected);
+
+    if (File.Size != ExpectedSize || memcmp(File.pData, pExpected, ExpectedSize))
+    {
+        fprintf(stderr, "error: %s doesn't have the expected contents.\n", pFilename);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(void)
+{
+    int Failures = 0;
+
+    if (!fsbld::verify_index())
+    {
+        fprintf(stderr, "error: verify_index() failed for %s.\n", FSBLD_INDEX_HEADER);
+        Failures++;
+    }
+    Failures += _CheckContents("docs/readme.txt", fsbld::file<"docs/readme.txt">(), "hello world\n");
+    Failures += _CheckContents("www/app.js", fsbld::file<"www/app.js">(), "var a=1;\n");
+    Failures += _CheckContents("www/index.html", fsbld::file<"www/index.html">(), "<html>hi</html>\n");
+    Failures += _CheckContents("www/style.css", fsbld::file<"www/style.css">(), "body{}\n");
+    if (SecondUnitFile() != fsbld::file<"www/app.js">().pData)
+    {
+        fprintf(stderr, "error: Each translation unit has its own copy of roFlashDrive.\n");
+        Failures++;
+    }
+
+    return Failures ? 1 : 0;
+}
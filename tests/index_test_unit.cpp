@@ -0,0 +1,11 @@
+/* A second translation unit which includes the C++20 index header so that
+   index_test.cpp can check that both see the same copy of roFlashDrive.
+*/
+#include <cstdint>
+#include FSBLD_INDEX_HEADER
+
+
+const std::uint8_t* SecondUnitFile(void)
+{
+    return fsbld::file<"www/app.js">().pData;
+}
@@ -0,0 +1,194 @@
+/* Checks that an image built by fsbld from tests/fixture reads back through
+   libfsbld-reader with the expected format and byte order and with every
+   file holding the same bytes as its source.
+
+   Usage: reader_test Image FixtureDirectory legacy|v2 little|big
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ffsformat.h"
+#include "fsreader.h"
+
+
+/* Reads the whole of pFilename into a buffer which the caller must free(). */
+static unsigned char* _LoadSourceFile(const char* pFilename, size_t* pSize)
+{
+    FILE*           pFile = NULL;
+    unsigned char*  pData = NULL;
+    long            Size = 0;
+
+    pFile = fopen(pFilename, "rb");
+    if (!pFile)
+    {
+        return NULL;
+    }
+    if (0 == fseek(pFile, 0, SEEK_END) && (Size = ftell(pFile)) >= 0 && 0 == fseek(pFile, 0, SEEK_SET))
+    {
+        /* Allocate at least one byte so that empty files aren't an error. */
+        pData = malloc(Size + 1);
+        if (pData && (size_t)Size != fread(pData, 1, Size, pFile))
+        {
+            free(pData);
+            pData = NULL;
+        }
+    }
+    fclose(pFile);
+    *pSize = (size_t)Size;
+
+    return pData;
+}
+
+
+/* Checks one source file against the file of the same name in the image. */
+static unsigned int _CheckFile(const SFsReaderImage* pImage, const char* pSourceName, const char* pImageName)
+{
+    SFsReaderStat   Stat;
+    SFsReaderFile   File;
+    unsigned char*  pSource = NULL;
+    unsigned char*  pRead = NULL;
+    size_t          SourceSize = 0;
+    unsigned int    Failures = 0;
+    int             Result;
+
+    pSource = _LoadSourceFile(pSourceName, &SourceSize);
+    if (!pSource)
+    {
+        fprintf(stderr, "error: Failed to read %s.\n", pSourceName);
+        return 1;
+    }
+
+    /* Look the file up, then read it through an open file as well to check
+       both ways of getting at the data. */
+    Result = FsReaderStat(pImage, pImageName, &Stat);
+    if (Result)
+    {
+        fprintf(stderr, "error: %s: %s.\n", pImageName, FsReaderErrorString(Result));
+        Failures++;
+        goto Done;
+    }
+    if (strcmp(Stat.pFilename, pImageName) ||
+        Stat.Size != SourceSize ||
+        memcmp(Stat.pData, pSource, SourceSize))
+    {
+        fprintf(stderr, "error: %s doesn't match %s.\n", pImageName, pSourceName);
+        Failures++;
+    }
+
+    pRead = malloc(SourceSize + 1);
+    Result = FsReaderOpen(pImage, pImageName, &File);
+    if (!pRead || Result ||
+        SourceSize != FsReaderRead(&File, pRead, SourceSize + 1) ||
+        memcmp(pRead, pSource, SourceSize))
+    {
+        fprintf(stderr, "error: Reading %s didn't return the contents of %s.\n", pImageName, pSourceName);
+        Failures++;
+    }
+
+Done:
+    free(pRead);
+    free(pSource);
+    return Failures;
+}
+
+
+/* Checks every file below pDirectoryName, counting them in *pFileCount.
+   ImageNameOffset is the length of the fixture directory name, plus its
+   '/', which isn't part of the names in the image. */
+static unsigned int _CheckDirectory(const SFsReaderImage* pImage,
+                                    const char*           pDirectoryName,
+                                    size_t                ImageNameOffset,
+                                    unsigned int*         pFileCount)
+{
+    DIR*            pDir = NULL;
+    struct dirent*  pDirEntry = NULL;
+    unsigned int    Failures = 0;
+
+    pDir = opendir(pDirectoryName);
+    if (!pDir)
+    {
+        fprintf(stderr, "error: Failed to open directory %s.\n", pDirectoryName);
+        return 1;
+    }
+
+    while ((pDirEntry = readdir(pDir)) != NULL)
+    {
+        char        Pathname[1024];
+        struct stat Stat;
+
+        if (0 == strcmp(pDirEntry->d_name, ".") || 0 == strcmp(pDirEntry->d_name, ".."))
+        {
+            continue;
+        }
+        snprintf(Pathname, sizeof(Pathname), "%s/%s", pDirectoryName, pDirEntry->d_name);
+        if (stat(Pathname, &Stat))
+        {
+            fprintf(stderr, "error: Failed to stat %s.\n", Pathname);
+            Failures++;
+        }
+        else if (S_ISDIR(Stat.st_mode))
+        {
+            Failures += _CheckDirectory(pImage, Pathname, ImageNameOffset, pFileCount);
+        }
+        else
+        {
+            Failures += _CheckFile(pImage, Pathname, Pathname + ImageNameOffset);
+            (*pFileCount)++;
+        }
+    }
+    closedir(pDir);
+
+    return Failures;
+}
+
+
+int main(int argc, char** argv)
+{
+    SFsReaderImage  Image;
+    SFsReaderStat   Stat;
+    unsigned int    ExpectedVersion;
+    int             ExpectBigEndian;
+    unsigned int    FileCount = 0;
+    unsigned int    Failures = 0;
+    int             Result;
+
+    if (argc != 5)
+    {
+        fprintf(stderr, "Usage: reader_test Image FixtureDirectory legacy|v2 little|big\n");
+        return 1;
+    }
+    ExpectedVersion = 0 == strcmp(argv[3], "v2") ? FILE_SYSTEM_FORMAT_VERSION : 1;
+    ExpectBigEndian = 0 == strcmp(argv[4], "big");
+
+    Result = FsReaderOpenImage(&Image, argv[1]);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", argv[1], FsReaderErrorString(Result));
+        return 1;
+    }
+
+    if (Image.FormatVersion != ExpectedVersion || Image.BigEndian != ExpectBigEndian)
+    {
+        fprintf(stderr, "error: %s was read as format %u %s endian, expected %s %s endian.\n",
+                argv[1], Image.FormatVersion, Image.BigEndian ? "big" : "little", argv[3], argv[4]);
+        Failures++;
+    }
+
+    Failures += _CheckDirectory(&Image, argv[2], strlen(argv[2]) + 1, &FileCount);
+    if (FileCount != Image.FileCount)
+    {
+        fprintf(stderr, "error: %s holds %u files rather than %u.\n", argv[1], Image.FileCount, FileCount);
+        Failures++;
+    }
+    if (FS_READER_ERROR_NOT_FOUND != FsReaderStat(&Image, "www/missing.html", &Stat))
+    {
+        fprintf(stderr, "error: Found a file which isn't in %s.\n", argv[1]);
+        Failures++;
+    }
+
+    FsReaderCloseImage(&Image);
+
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+/* Writes a copy of an image with the first byte of one file's data flipped,
+   so that the tests can check that --verify notices.
+
+   Usage: tamper_image Image Filename OutputImage
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fsreader.h"
+
+
+int main(int argc, char** argv)
+{
+    SFsReaderImage  Image;
+    SFsReaderStat   Stat;
+    unsigned char*  pCopy = NULL;
+    FILE*           pFile = NULL;
+    int             Result;
+    int             ExitCode = 1;
+
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: tamper_image Image Filename OutputImage\n");
+        return 1;
+    }
+    Result = FsReaderOpenImage(&Image, argv[1]);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", argv[1], FsReaderErrorString(Result));
+        return 1;
+    }
+    Result = FsReaderStat(&Image, argv[2], &Stat);
+    if (Result || Stat.Size == 0)
+    {
+        fprintf(stderr, "error: %s: %s.\n", argv[2], Result ? FsReaderErrorString(Result) : "File is empty");
+        goto Error;
+    }
+
+    pCopy = malloc((size_t)Image.ImageSize);
+    if (!pCopy)
+    {
+        fprintf(stderr, "error: Failed to allocate %llu bytes.\n", (unsigned long long)Image.ImageSize);
+        goto Error;
+    }
+    memcpy(pCopy, Image.pImage, (size_t)Image.ImageSize);
+    pCopy[Stat.Offset] ^= 0xFF;
+
+    pFile = fopen(argv[3], "wb");
+    if (!pFile || Image.ImageSize != fwrite(pCopy, 1, (size_t)Image.ImageSize, pFile))
+    {
+        fprintf(stderr, "error: Failed to write %s.\n", argv[3]);
+        goto Error;
+    }
+    ExitCode = 0;
+
+Error:
+    if (pFile)
+    {
+        fclose(pFile);
+    }
+    free(pCopy);
+    FsReaderCloseImage(&Image);
+    return ExitCode;
+}